@@ -0,0 +1,78 @@
+/*
+ * Counts heap allocations by replacing the malloc family of the benchmark
+ * process. The executable's definitions take precedence over the C library
+ * for every shared object, so the calls made inside libmqtt are counted as
+ * well. The real work is forwarded to glibc's internal entry points.
+ * While allocations are forbidden they fail with NULL and are counted.
+ */
+#include "bench_util.h"
+
+#include <stddef.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static __thread uint64_t bench_alloc_count;
+static __thread uint64_t bench_alloc_bytes;
+static __thread int bench_alloc_forbidden;
+static __thread uint64_t bench_alloc_refused;
+
+void *malloc(size_t size)
+{
+    if(bench_alloc_forbidden) {
+        ++bench_alloc_refused;
+        return NULL;
+    }
+    ++bench_alloc_count;
+    bench_alloc_bytes += size;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    if(bench_alloc_forbidden) {
+        ++bench_alloc_refused;
+        return NULL;
+    }
+    ++bench_alloc_count;
+    bench_alloc_bytes += count * size;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if(bench_alloc_forbidden) {
+        ++bench_alloc_refused;
+        return NULL;
+    }
+    ++bench_alloc_count;
+    bench_alloc_bytes += size;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+uint64_t Bench_AllocCount(void)
+{
+    return bench_alloc_count;
+}
+
+uint64_t Bench_AllocBytes(void)
+{
+    return bench_alloc_bytes;
+}
+
+void Bench_ForbidAlloc(int forbid)
+{
+    bench_alloc_forbidden = forbid;
+}
+
+uint64_t Bench_RefusedAllocs(void)
+{
+    return bench_alloc_refused;
+}
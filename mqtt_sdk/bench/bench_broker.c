@@ -0,0 +1,611 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // accept4
+#endif
+
+#include "bench_broker.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_BROKER_RECV_SIZE 65536
+// packets parsed from one connection before the others get their turn
+#define BENCH_BROKER_MAX_READS 16
+
+struct BenchBrokerSub {
+    char *filter;
+    enum MqttQosLevel qos;
+};
+
+struct BenchBrokerConn {
+    struct BenchBrokerConn *prev;
+    struct BenchBrokerConn *next;
+    struct BenchBrokerConn *next_dirty;
+    struct BenchBroker *broker;
+    int fd;
+    int dirty;
+    int read_blocked;
+    int closing;
+    char *client_id;
+    uint16_t next_pkt_id;
+    struct MqttContext ctx[1];
+
+    struct BenchBrokerSub *subs;
+    uint32_t sub_count;
+    uint32_t sub_cap;
+
+    char *out;
+    uint32_t out_len;
+    uint32_t out_cap;
+};
+
+static int BenchBroker_Queue(struct BenchBrokerConn *conn, const char *data, uint32_t size)
+{
+    if(conn->out_len + size > conn->out_cap) {
+        uint32_t cap = conn->out_cap ? conn->out_cap * 2 : 1024;
+        char *tmp;
+
+        while(cap < conn->out_len + size) {
+            cap *= 2;
+        }
+
+        tmp = (char*)realloc(conn->out, cap);
+        if(!tmp) {
+            return -1;
+        }
+        conn->out = tmp;
+        conn->out_cap = cap;
+    }
+
+    memcpy(conn->out + conn->out_len, data, size);
+    conn->out_len += size;
+    return 0;
+}
+
+static int BenchBroker_Read(void *arg, void *buf, uint32_t count)
+{
+    struct BenchBrokerConn *conn = (struct BenchBrokerConn*)arg;
+    ssize_t bytes = recv(conn->fd, buf, count, 0);
+
+    if((bytes < 0) && ((EAGAIN == errno) || (EWOULDBLOCK == errno))) {
+        conn->read_blocked = 1;
+    }
+
+    return (int)bytes;
+}
+
+// responses and forwarded messages are collected and sent once the current batch is done
+static int BenchBroker_Writev(void *arg, const struct iovec *iov, int iovcnt)
+{
+    struct BenchBrokerConn *conn = (struct BenchBrokerConn*)arg;
+    int i, bytes = 0;
+
+    for(i = 0; i < iovcnt; ++i) {
+        if(BenchBroker_Queue(conn, (const char*)iov[i].iov_base, (uint32_t)iov[i].iov_len) < 0) {
+            return -1;
+        }
+        bytes += (int)iov[i].iov_len;
+    }
+
+    if(!conn->dirty) {
+        conn->dirty = 1;
+        conn->next_dirty = conn->broker->dirty;
+        conn->broker->dirty = conn;
+    }
+
+    return bytes;
+}
+
+// MQTT topic filter matching with the '+' and '#' wildcards
+static int BenchBroker_TopicMatch(const char *filter, const char *topic)
+{
+    // wildcards at the first level do not match system topics such as $creq
+    if(('$' == *topic) && (('#' == *filter) || ('+' == *filter))) {
+        return 0;
+    }
+
+    while(*filter) {
+        if('#' == *filter) {
+            return 1;
+        }
+
+        if('+' == *filter) {
+            while(*topic && ('/' != *topic)) {
+                ++topic;
+            }
+            ++filter;
+            continue;
+        }
+
+        if(*filter != *topic) {
+            // "a/#" also matches "a"
+            return ('\0' == *topic) && (0 == strcmp(filter, "/#"));
+        }
+
+        ++filter;
+        ++topic;
+    }
+
+    return '\0' == *topic;
+}
+
+static int BenchBroker_SendPublish(struct BenchBrokerConn *conn, const char *topic,
+                                   const char *payload, uint32_t size, enum MqttQosLevel qos)
+{
+    struct MqttBuffer buf[1];
+    int err;
+
+    if(0 == ++conn->next_pkt_id) {
+        conn->next_pkt_id = 1;
+    }
+
+    MqttBuffer_Init(buf);
+    err = Mqtt_PackPublishPkt(buf, conn->next_pkt_id, topic, payload, size, qos, 0, 0);
+    if((MQTTERR_NOERROR == err) &&
+       (Mqtt_SendPkt(conn->ctx, buf, 0) != (int)buf->buffered_bytes)) {
+        err = MQTTERR_IO;
+    }
+    MqttBuffer_Destroy(buf);
+
+    return err;
+}
+
+static void BenchBroker_Route(struct BenchBroker *broker, const char *topic,
+                              const char *payload, uint32_t size, enum MqttQosLevel qos)
+{
+    struct BenchBrokerConn *conn;
+    uint32_t i;
+
+    for(conn = broker->conns; conn; conn = conn->next) {
+        for(i = 0; i < conn->sub_count; ++i) {
+            if(BenchBroker_TopicMatch(conn->subs[i].filter, topic)) {
+                const enum MqttQosLevel granted = qos < conn->subs[i].qos ? qos : conn->subs[i].qos;
+                if(MQTTERR_NOERROR == BenchBroker_SendPublish(conn, topic, payload, size, granted)) {
+                    ++broker->delivered;
+                }
+                break;
+            }
+        }
+    }
+}
+
+static int BenchBroker_HandleConnect(void *arg, const char *id, uint16_t keep_alive,
+                                     int clean_session, const char *will_topic,
+                                     const char *will_msg, uint16_t msg_len,
+                                     enum MqttQosLevel will_qos, int will_retain,
+                                     const char *user, const char *password, uint16_t pswd_len)
+{
+    struct BenchBrokerConn *conn = (struct BenchBrokerConn*)arg;
+    (void)keep_alive; (void)clean_session; (void)will_topic; (void)will_msg; (void)msg_len;
+    (void)will_qos; (void)will_retain; (void)user; (void)password; (void)pswd_len;
+
+    free(conn->client_id);
+    conn->client_id = strdup(id);
+    ++conn->broker->connects;
+    return MQTT_CONNACK_ACCEPTED;
+}
+
+static int BenchBroker_HandlePublish(void *arg, uint16_t pkt_id, const char *topic,
+                                     const char *payload, uint32_t payloadsize,
+                                     int dup, enum MqttQosLevel qos)
+{
+    struct BenchBrokerConn *conn = (struct BenchBrokerConn*)arg;
+    struct BenchBroker *broker = conn->broker;
+    (void)pkt_id; (void)dup;
+
+    ++broker->publishes;
+    if(broker->handle_publish) {
+        broker->handle_publish(broker->handle_publish_arg, conn->client_id, topic,
+                               payload, payloadsize, qos);
+    }
+
+    BenchBroker_Route(broker, topic, payload, payloadsize, qos);
+    return 0;
+}
+
+static int BenchBroker_HandleCmd(void *arg, uint16_t pkt_id, const char *cmdid,
+                                 int64_t timestamp, const char *desc, const char *cmdarg,
+                                 uint32_t cmdarg_len, int dup, enum MqttQosLevel qos)
+{
+    (void)arg; (void)pkt_id; (void)cmdid; (void)timestamp; (void)desc;
+    (void)cmdarg; (void)cmdarg_len; (void)dup; (void)qos;
+    return 0; // commands only flow from the broker to the devices
+}
+
+static int BenchBroker_HandleSubscribe(void *arg, uint16_t pkt_id, const char *topic,
+                                       enum MqttQosLevel qos)
+{
+    struct BenchBrokerConn *conn = (struct BenchBrokerConn*)arg;
+    uint32_t i;
+    (void)pkt_id;
+
+    for(i = 0; i < conn->sub_count; ++i) {
+        if(0 == strcmp(conn->subs[i].filter, topic)) {
+            conn->subs[i].qos = qos;
+            return qos;
+        }
+    }
+
+    if(conn->sub_count == conn->sub_cap) {
+        const uint32_t cap = conn->sub_cap ? conn->sub_cap * 2 : 4;
+        struct BenchBrokerSub *subs = (struct BenchBrokerSub*)realloc(conn->subs, cap * sizeof(*subs));
+        if(!subs) {
+            return MQTT_SUBACK_FAILUER;
+        }
+        conn->subs = subs;
+        conn->sub_cap = cap;
+    }
+
+    conn->subs[conn->sub_count].filter = strdup(topic);
+    if(!conn->subs[conn->sub_count].filter) {
+        return MQTT_SUBACK_FAILUER;
+    }
+    conn->subs[conn->sub_count].qos = qos;
+    ++conn->sub_count;
+
+    return qos;
+}
+
+static int BenchBroker_HandleUnsubscribe(void *arg, uint16_t pkt_id, const char *topic)
+{
+    struct BenchBrokerConn *conn = (struct BenchBrokerConn*)arg;
+    uint32_t i;
+    (void)pkt_id;
+
+    for(i = 0; i < conn->sub_count; ++i) {
+        if(0 == strcmp(conn->subs[i].filter, topic)) {
+            free(conn->subs[i].filter);
+            conn->subs[i] = conn->subs[--conn->sub_count];
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static int BenchBroker_HandleAck(void *arg, uint16_t pkt_id)
+{
+    (void)arg; (void)pkt_id;
+    return 0;
+}
+
+static int BenchBroker_HandlePingReq(void *arg)
+{
+    (void)arg;
+    return 0;
+}
+
+static int BenchBroker_HandleDisconnect(void *arg)
+{
+    ((struct BenchBrokerConn*)arg)->closing = 1;
+    return 0;
+}
+
+static void BenchBroker_Close(struct BenchBroker *broker, struct BenchBrokerConn *conn)
+{
+    uint32_t i;
+
+    if(conn->prev) {
+        conn->prev->next = conn->next;
+    }
+    else {
+        broker->conns = conn->next;
+    }
+    if(conn->next) {
+        conn->next->prev = conn->prev;
+    }
+
+    if(conn->dirty) {
+        struct BenchBrokerConn **link = &broker->dirty;
+        while(*link != conn) {
+            link = &(*link)->next_dirty;
+        }
+        *link = conn->next_dirty;
+    }
+
+    epoll_ctl(broker->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    Mqtt_DestroyContext(conn->ctx);
+    for(i = 0; i < conn->sub_count; ++i) {
+        free(conn->subs[i].filter);
+    }
+    free(conn->subs);
+    free(conn->client_id);
+    free(conn->out);
+    free(conn);
+}
+
+static int BenchBroker_Flush(struct BenchBroker *broker, struct BenchBrokerConn *conn)
+{
+    struct epoll_event evt;
+    ssize_t bytes;
+
+    if(0 == conn->out_len) {
+        return 0;
+    }
+
+    bytes = send(conn->fd, conn->out, conn->out_len, MSG_NOSIGNAL);
+    if(bytes < 0) {
+        if((EAGAIN != errno) && (EWOULDBLOCK != errno)) {
+            return -1;
+        }
+        bytes = 0;
+    }
+
+    memmove(conn->out, conn->out + bytes, conn->out_len - bytes);
+    conn->out_len -= (uint32_t)bytes;
+
+    evt.events = conn->out_len ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    evt.data.ptr = conn;
+    epoll_ctl(broker->epfd, EPOLL_CTL_MOD, conn->fd, &evt);
+    return 0;
+}
+
+// a failed connection is only shut down here, the broker thread closes it on its next event
+static void BenchBroker_FlushDirty(struct BenchBroker *broker)
+{
+    while(broker->dirty) {
+        struct BenchBrokerConn *conn = broker->dirty;
+        broker->dirty = conn->next_dirty;
+        conn->dirty = 0;
+
+        if(BenchBroker_Flush(broker, conn) < 0) {
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+    }
+}
+
+static int BenchBroker_Input(struct BenchBrokerConn *conn)
+{
+    int i, err;
+
+    for(i = 0; (i < BENCH_BROKER_MAX_READS) && !conn->closing; ++i) {
+        conn->read_blocked = 0;
+        err = Mqtt_RecvPkt(conn->ctx);
+        if(MQTTERR_NOERROR == err) {
+            continue;
+        }
+
+        return ((MQTTERR_IO == err) && conn->read_blocked) ? 0 : -1;
+    }
+
+    return conn->closing ? -1 : 0;
+}
+
+static int BenchBroker_Add(struct BenchBroker *broker, int fd)
+{
+    struct BenchBrokerConn *conn;
+    struct MqttContext *ctx;
+    struct epoll_event evt;
+
+    conn = (struct BenchBrokerConn*)calloc(1, sizeof(*conn));
+    if(!conn) {
+        close(fd);
+        return -1;
+    }
+
+    if(MQTTERR_NOERROR != Mqtt_InitContext(conn->ctx, BENCH_BROKER_RECV_SIZE)) {
+        free(conn);
+        close(fd);
+        return -1;
+    }
+
+    conn->broker = broker;
+    conn->fd = fd;
+
+    ctx = conn->ctx;
+    ctx->read_func_arg = conn;
+    ctx->read_func = BenchBroker_Read;
+    ctx->writev_func_arg = conn;
+    ctx->writev_func = BenchBroker_Writev;
+    ctx->handle_connect_arg = conn;
+    ctx->handle_connect = BenchBroker_HandleConnect;
+    ctx->handle_publish_arg = conn;
+    ctx->handle_publish = BenchBroker_HandlePublish;
+    ctx->handle_cmd_arg = conn;
+    ctx->handle_cmd = BenchBroker_HandleCmd;
+    ctx->handle_pub_ack_arg = conn;
+    ctx->handle_pub_ack = BenchBroker_HandleAck;
+    ctx->handle_pub_rec_arg = conn;
+    ctx->handle_pub_rec = BenchBroker_HandleAck;
+    ctx->handle_pub_rel_arg = conn;
+    ctx->handle_pub_rel = BenchBroker_HandleAck;
+    ctx->handle_pub_comp_arg = conn;
+    ctx->handle_pub_comp = BenchBroker_HandleAck;
+    ctx->handle_subscribe_arg = conn;
+    ctx->handle_subscribe = BenchBroker_HandleSubscribe;
+    ctx->handle_unsubscribe_arg = conn;
+    ctx->handle_unsubscribe = BenchBroker_HandleUnsubscribe;
+    ctx->handle_ping_req_arg = conn;
+    ctx->handle_ping_req = BenchBroker_HandlePingReq;
+    ctx->handle_disconnect_arg = conn;
+    ctx->handle_disconnect = BenchBroker_HandleDisconnect;
+
+    evt.events = EPOLLIN;
+    evt.data.ptr = conn;
+    if(epoll_ctl(broker->epfd, EPOLL_CTL_ADD, fd, &evt) < 0) {
+        Mqtt_DestroyContext(conn->ctx);
+        free(conn);
+        close(fd);
+        return -1;
+    }
+
+    conn->next = broker->conns;
+    if(conn->next) {
+        conn->next->prev = conn;
+    }
+    broker->conns = conn;
+    return 0;
+}
+
+static void BenchBroker_Accept(struct BenchBroker *broker)
+{
+    while(1) {
+        int on = 1;
+        int fd = accept4(broker->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) {
+            return;
+        }
+
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        BenchBroker_Add(broker, fd);
+    }
+}
+
+static void *BenchBroker_Thread(void *arg)
+{
+    struct BenchBroker *broker = (struct BenchBroker*)arg;
+    struct epoll_event events[256];
+
+    while(broker->running) {
+        int i, count = epoll_wait(broker->epfd, events, 256, -1);
+
+        pthread_mutex_lock(&broker->lock);
+        for(i = 0; i < count; ++i) {
+            struct BenchBrokerConn *conn = (struct BenchBrokerConn*)events[i].data.ptr;
+
+            if(conn == (void*)broker) {
+                BenchBroker_Accept(broker);
+                continue;
+            }
+
+            if(!conn) {
+                continue; // woken up to stop
+            }
+
+            if(((events[i].events & EPOLLOUT) && (BenchBroker_Flush(broker, conn) < 0)) ||
+               ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+                (BenchBroker_Input(conn) < 0))) {
+                BenchBroker_Close(broker, conn);
+            }
+        }
+        BenchBroker_FlushDirty(broker);
+        pthread_mutex_unlock(&broker->lock);
+    }
+
+    return NULL;
+}
+
+int BenchBroker_Start(struct BenchBroker *broker, unsigned short port)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    struct epoll_event evt;
+    int on = 1;
+
+    memset(broker, 0, sizeof(*broker));
+
+    broker->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(broker->listen_fd < 0) {
+        return -1;
+    }
+    setsockopt(broker->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if((bind(broker->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) ||
+       (listen(broker->listen_fd, SOMAXCONN) < 0) ||
+       (getsockname(broker->listen_fd, (struct sockaddr*)&addr, &addr_len) < 0)) {
+        close(broker->listen_fd);
+        return -1;
+    }
+    broker->port = ntohs(addr.sin_port);
+
+    broker->epfd = epoll_create1(EPOLL_CLOEXEC);
+    broker->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_mutex_init(&broker->lock, NULL);
+
+    evt.events = EPOLLIN;
+    evt.data.ptr = broker;
+    epoll_ctl(broker->epfd, EPOLL_CTL_ADD, broker->listen_fd, &evt);
+    evt.data.ptr = NULL;
+    epoll_ctl(broker->epfd, EPOLL_CTL_ADD, broker->wakefd, &evt);
+
+    broker->running = 1;
+    if(0 != pthread_create(&broker->thread, NULL, BenchBroker_Thread, broker)) {
+        close(broker->listen_fd);
+        close(broker->epfd);
+        close(broker->wakefd);
+        pthread_mutex_destroy(&broker->lock);
+        return -1;
+    }
+
+    return 0;
+}
+
+int BenchBroker_Attach(struct BenchBroker *broker, int fd)
+{
+    int err;
+
+    if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&broker->lock);
+    err = BenchBroker_Add(broker, fd);
+    pthread_mutex_unlock(&broker->lock);
+
+    return err;
+}
+
+int BenchBroker_SendCmd(struct BenchBroker *broker, const char *client_id, const char *cmdid,
+                        const char *payload, uint32_t size, enum MqttQosLevel qos)
+{
+    struct BenchBrokerConn *conn;
+    char topic[256];
+    int sent = 0;
+
+    if(snprintf(topic, sizeof(topic), "$creq/%s", cmdid) >= (int)sizeof(topic)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&broker->lock);
+    for(conn = broker->conns; conn; conn = conn->next) {
+        if(!conn->client_id || (client_id && strcmp(client_id, conn->client_id))) {
+            continue;
+        }
+
+        if(MQTTERR_NOERROR == BenchBroker_SendPublish(conn, topic, payload, size, qos)) {
+            ++broker->commands;
+            ++sent;
+        }
+    }
+    BenchBroker_FlushDirty(broker);
+    pthread_mutex_unlock(&broker->lock);
+
+    return sent;
+}
+
+void BenchBroker_Stop(struct BenchBroker *broker)
+{
+    const uint64_t one = 1;
+
+    broker->running = 0;
+    if(write(broker->wakefd, &one, sizeof(one)) < 0) {
+        // the broker thread is already awake
+    }
+    pthread_join(broker->thread, NULL);
+
+    while(broker->conns) {
+        BenchBroker_Close(broker, broker->conns);
+    }
+
+    close(broker->listen_fd);
+    close(broker->epfd);
+    close(broker->wakefd);
+    pthread_mutex_destroy(&broker->lock);
+}
@@ -0,0 +1,71 @@
+#ifndef ONENET_BENCH_BROKER_H
+#define ONENET_BENCH_BROKER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "mqtt/mqtt.h"
+
+struct BenchBrokerConn;
+
+/**
+ * 用于压力测试的本地MQTT服务器替身，在独立线程中运行，用SDK自身的解析和打包
+ * 函数处理CONNECT、PUBLISH(QoS0/1/2)、SUBSCRIBE、UNSUBSCRIBE、PINGREQ和
+ * DISCONNECT，把PUBLISH转发给订阅了匹配topic的连接，并可向设备下发$creq命令
+ */
+struct BenchBroker {
+    int listen_fd;
+    int epfd;
+    int wakefd;
+    unsigned short port;      /**< 实际监听的端口 */
+    volatile int running;
+    pthread_t thread;
+    pthread_mutex_t lock;     /* 保护连接列表，下发命令的线程与服务器线程共用 */
+    struct BenchBrokerConn *conns;
+    struct BenchBrokerConn *dirty;
+
+    uint64_t connects;        /**< 收到的CONNECT个数 */
+    uint64_t publishes;       /**< 收到的PUBLISH个数 */
+    uint64_t delivered;       /**< 转发给订阅者的PUBLISH个数 */
+    uint64_t commands;        /**< 下发的$creq命令个数 */
+
+    void *handle_publish_arg; /**< 收到PUBLISH时回调函数的关联参数 */
+    void (*handle_publish)(void *arg, const char *client_id, const char *topic,
+                           const char *payload, uint32_t size, enum MqttQosLevel qos);
+        /**< 收到PUBLISH时的回调函数，在服务器线程中调用，可为NULL，
+             在BenchBroker_Start之后、第一个连接建立之前设置 */
+};
+
+/**
+ * 在127.0.0.1上启动服务器替身
+ * @param broker 服务器替身
+ * @param port 监听端口，为0时由系统分配
+ * @return 成功返回0
+ */
+int BenchBroker_Start(struct BenchBroker *broker, unsigned short port);
+/**
+ * 把已连接的套接字(如socketpair的一端)交给服务器替身处理
+ * @param broker 服务器替身
+ * @param fd 已连接的套接字，之后由服务器替身负责关闭
+ * @return 成功返回0
+ */
+int BenchBroker_Attach(struct BenchBroker *broker, int fd);
+/**
+ * 向设备下发命令，即发布到"$creq/cmdid"
+ * @param broker 服务器替身
+ * @param client_id 接收命令的设备的客户端ID，为NULL时发给所有已连接的设备
+ * @param cmdid 命令ID
+ * @param payload 命令内容
+ * @param size 命令内容的字节数
+ * @param qos QoS等级
+ * @return 收到命令的设备个数，失败返回-1
+ * @remark 可在任意线程调用
+ */
+int BenchBroker_SendCmd(struct BenchBroker *broker, const char *client_id, const char *cmdid,
+                        const char *payload, uint32_t size, enum MqttQosLevel qos);
+/**
+ * 停止服务器替身并关闭所有连接
+ * @param broker 服务器替身
+ */
+void BenchBroker_Stop(struct BenchBroker *broker);
+
+#endif // ONENET_BENCH_BROKER_H
@@ -0,0 +1,255 @@
+/*
+ * Payload compression benchmark: typical kTypeFullJson datapoint documents
+ * and a binary waveform are published to a user topic plain and through
+ * MqttCompression_PackPublishPkt, then received through Mqtt_RecvPkt with
+ * an in-memory read_func and checked against the original. Reports the
+ * compression ratio and the packing and receiving cost of both paths. One
+ * JSON line is printed per payload.
+ */
+#include "mqtt/mqtt.h"
+#include "mqtt/mqtt_compress.h"
+#include "bench_util.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct BenchCompressStream {
+    char *data;
+    uint32_t size;
+    uint32_t capacity;
+    uint32_t pos;
+    const char *expected;
+    uint32_t expected_size;
+    uint32_t received;
+    uint32_t mismatches;
+};
+
+static const char *bench_compress_streams[] = {
+    "temperature", "humidity", "pressure", "voltage"
+};
+
+// a kTypeFullJson document close to what the devices upload, about bytes long
+static uint32_t BenchCompress_GenJson(char *out, uint32_t bytes)
+{
+    uint32_t len, i = 0, s, first;
+
+    len = (uint32_t)sprintf(out, "{\"datastreams\":[");
+    for(s = 0; s < 4; ++s) {
+        len += (uint32_t)sprintf(out + len, "%s{\"id\":\"%s\",\"datapoints\":[",
+                                 s ? "," : "", bench_compress_streams[s]);
+        first = i;
+        do {
+            len += (uint32_t)sprintf(out + len, "%s{\"at\":\"2017-07-14 02:%02u:%02u\",\"value\":%.2f}",
+                                     i > first ? "," : "", i / 60 % 60, i % 60,
+                                     20.0 + (i * 7 % 500) / 100.0 + s * 10);
+            ++i;
+        } while(len < bytes * (s + 1) / 4);
+        len += (uint32_t)sprintf(out + len, "]}");
+    }
+    len += (uint32_t)sprintf(out + len, "]}");
+    return len;
+}
+
+// 16-bit samples of a noisy triangle wave standing in for a vibration signal
+static uint32_t BenchCompress_GenBinary(char *out, uint32_t bytes)
+{
+    uint32_t i, seed = 1;
+    int16_t v;
+
+    for(i = 0; i + 2 <= bytes; i += 2) {
+        seed = seed * 1103515245 + 12345;
+        v = (int16_t)((i % 800 < 400 ? i % 800 : 800 - i % 800) * 5 + (int)((seed >> 16) % 16));
+        out[i] = (char)(v >> 8);
+        out[i + 1] = (char)v;
+    }
+    return i;
+}
+
+static int BenchCompress_Append(struct BenchCompressStream *stream, struct MqttBuffer *buf)
+{
+    struct MqttExtent *ext;
+    char *data;
+
+    if(stream->size + buf->buffered_bytes > stream->capacity) {
+        stream->capacity = (stream->size + buf->buffered_bytes) * 2;
+        data = (char*)realloc(stream->data, stream->capacity);
+        if(!data) {
+            return MQTTERR_OUTOFMEMORY;
+        }
+        stream->data = data;
+    }
+
+    for(ext = buf->first_ext; ext; ext = ext->next) {
+        memcpy(stream->data + stream->size, ext->payload, ext->len);
+        stream->size += ext->len;
+    }
+    return MQTTERR_NOERROR;
+}
+
+static int BenchCompress_Read(void *arg, void *buf, uint32_t count)
+{
+    struct BenchCompressStream *stream = (struct BenchCompressStream*)arg;
+    uint32_t n = stream->size - stream->pos;
+
+    n = n < count ? n : count;
+    memcpy(buf, stream->data + stream->pos, n);
+    stream->pos += n;
+    return (int)n;
+}
+
+static int BenchCompress_HandlePublish(void *arg, uint16_t pkt_id, const char *topic,
+                                       const char *payload, uint32_t payloadsize,
+                                       int dup, enum MqttQosLevel qos)
+{
+    struct BenchCompressStream *stream = (struct BenchCompressStream*)arg;
+
+    (void)pkt_id; (void)topic; (void)dup; (void)qos;
+    ++stream->received;
+    if((payloadsize != stream->expected_size) ||
+       (0 != memcmp(payload, stream->expected, payloadsize))) {
+        ++stream->mismatches;
+    }
+    return 0;
+}
+
+// packs count copies of payload into stream, returns the packing time
+static int64_t BenchCompress_Pack(struct MqttCompression *comp, struct BenchCompressStream *stream,
+                                  const char *payload, uint32_t size, uint32_t count)
+{
+    struct MqttBuffer buf[1];
+    int64_t start, elapsed = 0;
+    uint32_t i;
+    int err = MQTTERR_NOERROR;
+
+    MqttBuffer_Init(buf);
+    for(i = 0; (i < count) && (MQTTERR_NOERROR == err); ++i) {
+        start = Bench_NowNs();
+        if(comp) {
+            err = MqttCompression_PackPublishPkt(comp, buf, 1, "factory/line3/vibration/upload",
+                                                 payload, size, MQTT_QOS_LEVEL0, 0);
+        }
+        else {
+            err = Mqtt_PackPublishPkt(buf, 1, "factory/line3/vibration/upload",
+                                      payload, size, MQTT_QOS_LEVEL0, 0, 1);
+        }
+        elapsed += Bench_NowNs() - start;
+        if(MQTTERR_NOERROR == err) {
+            err = BenchCompress_Append(stream, buf);
+        }
+        MqttBuffer_Reset(buf);
+    }
+    MqttBuffer_Destroy(buf);
+
+    return MQTTERR_NOERROR == err ? elapsed : -1;
+}
+
+static int64_t BenchCompress_Recv(struct MqttCompression *comp, struct BenchCompressStream *stream)
+{
+    struct MqttContext ctx[1];
+    int64_t start, elapsed;
+    int err = MQTTERR_NOERROR;
+
+    if(MQTTERR_NOERROR != Mqtt_InitContext(ctx, 1024 * 1024)) {
+        return -1;
+    }
+    ctx->read_func = BenchCompress_Read;
+    ctx->read_func_arg = stream;
+    ctx->handle_publish = BenchCompress_HandlePublish;
+    ctx->handle_publish_arg = stream;
+    ctx->compression = comp;
+
+    start = Bench_NowNs();
+    while((stream->pos < stream->size) && (err >= 0)) {
+        err = Mqtt_RecvPkt(ctx);
+    }
+    elapsed = Bench_NowNs() - start;
+
+    Mqtt_DestroyContext(ctx);
+    return err >= 0 ? elapsed : -1;
+}
+
+static int BenchCompress_Run(const char *name, const char *payload, uint32_t size,
+                             uint32_t count, uint32_t threshold)
+{
+    struct BenchCompressStream plain, packed;
+    struct MqttCompression comp;
+    int64_t plain_pack, comp_pack, plain_recv, comp_recv;
+    int failed;
+
+    memset(&plain, 0, sizeof(plain));
+    memset(&packed, 0, sizeof(packed));
+    plain.expected = packed.expected = payload;
+    plain.expected_size = packed.expected_size = size;
+    if(MQTTERR_NOERROR != MqttCompression_Init(&comp, threshold)) {
+        return -1;
+    }
+
+    plain_pack = BenchCompress_Pack(NULL, &plain, payload, size, count);
+    comp_pack = BenchCompress_Pack(&comp, &packed, payload, size, count);
+    plain_recv = BenchCompress_Recv(NULL, &plain);
+    comp_recv = BenchCompress_Recv(&comp, &packed);
+
+    failed = (plain_pack < 0) || (comp_pack < 0) || (plain_recv < 0) || (comp_recv < 0) ||
+        (packed.received != count) || (packed.mismatches != 0);
+    if(failed) {
+        fprintf(stderr, "%s: failed, %u of %u received, %u mismatches.\n",
+                name, packed.received, count, packed.mismatches);
+    }
+    else {
+        printf("{\"bench\":\"compress\",\"payload\":\"%s\",\"payload_bytes\":%u,\"pkts\":%u,"
+               "\"wire_bytes_plain\":%.1f,\"wire_bytes_compressed\":%.1f,\"ratio\":%.2f,"
+               "\"pack_ns_plain\":%.1f,\"pack_ns_compressed\":%.1f,\"compress_mb_s\":%.1f,"
+               "\"recv_ns_plain\":%.1f,\"recv_ns_compressed\":%.1f,\"decompress_mb_s\":%.1f}\n",
+               name, size, count, (double)plain.size / count, (double)packed.size / count,
+               comp.bytes_out ? (double)comp.bytes_in / comp.bytes_out : 1.0,
+               (double)plain_pack / count, (double)comp_pack / count,
+               comp_pack > plain_pack ? (double)size * count * 1000 / (comp_pack - plain_pack) : 0,
+               (double)plain_recv / count, (double)comp_recv / count,
+               comp.decoded_pkts && (comp_recv > plain_recv) ? (double)size * count * 1000 / (comp_recv - plain_recv) : 0);
+        fflush(stdout);
+    }
+
+    MqttCompression_Destroy(&comp);
+    free(plain.data);
+    free(packed.data);
+    return failed ? -1 : 0;
+}
+
+static void BenchCompress_Usage(const char *name)
+{
+    printf("usage: %s [options]\n", name);
+    printf("  -n pkts            packets per payload (default 20000)\n");
+    printf("  -t threshold       compression threshold in bytes (default 256)\n");
+}
+
+int main(int argc, char **argv)
+{
+    static const uint32_t json_sizes[] = {256, 1024, 4096, 16384};
+    static char payload[32768];
+    char name[32];
+    uint32_t count = 20000, threshold = 256, size, i;
+    int failed = 0, opt;
+
+    while((opt = getopt(argc, argv, "hn:t:")) != -1) {
+        switch(opt) {
+        case 'n': count = (uint32_t)atol(optarg); break;
+        case 't': threshold = (uint32_t)atoi(optarg); break;
+        default:
+            BenchCompress_Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    for(i = 0; i < sizeof(json_sizes) / sizeof(json_sizes[0]); ++i) {
+        size = BenchCompress_GenJson(payload, json_sizes[i]);
+        sprintf(name, "json_%u", json_sizes[i]);
+        failed |= BenchCompress_Run(name, payload, size, count, threshold) < 0;
+    }
+
+    size = BenchCompress_GenBinary(payload, 4096);
+    failed |= BenchCompress_Run("binary_4096", payload, size, count, threshold) < 0;
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,279 @@
+/*
+ * CONNECT cache benchmark: a reconnect storm over many device identities
+ * (client id, product id and an access token as password) in random order.
+ * Each reconnect either packs the CONNECT with Mqtt_PackConnectPkt and sends
+ * it with Mqtt_SendPkt, sends the cached bytes with MqttConnectCache_Send, or
+ * puts a reference into a buffer with MqttConnectCache_Append and sends that.
+ * The cache is saved to a file and loaded back, and every cached packet is
+ * compared with a freshly packed one. Reports the cost, allocations and
+ * iovecs per reconnect, the cache footprint and the persistence cost. One
+ * JSON line per method, one for persistence.
+ */
+#include "mqtt/mqtt.h"
+#include "mqtt/mqtt_connect_cache.h"
+#include "bench_util.h"
+
+#include <sys/uio.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum BenchCcMethod {
+    BENCH_CC_PACK,
+    BENCH_CC_SEND,
+    BENCH_CC_APPEND
+};
+
+static const char *bench_cc_methods[] = {"pack", "cache_send", "cache_append"};
+
+struct BenchCcWriter {
+    uint64_t calls;
+    uint64_t iovecs;
+    uint64_t bytes;
+};
+
+static int BenchCc_Writev(void *arg, const struct iovec *iov, int iovcnt)
+{
+    struct BenchCcWriter *writer = (struct BenchCcWriter*)arg;
+    int i, bytes = 0;
+
+    for(i = 0; i < iovcnt; ++i) {
+        bytes += (int)iov[i].iov_len;
+    }
+    ++writer->calls;
+    writer->iovecs += (uint32_t)iovcnt;
+    writer->bytes += (uint32_t)bytes;
+    return bytes;
+}
+
+// a OneNET style access token, about 130 bytes that differ per device
+static void BenchCc_GenToken(char *out, uint32_t device)
+{
+    sprintf(out, "version=2018-10-31&res=products%%2F418620%%2Fdevices%%2Fdev%08u"
+            "&et=1924876800&method=sha1&sign=%08x%08x%%2B%08x%%3D",
+            device, device * 2654435761u, device ^ 0x5bd1e995u, device * 40503u);
+}
+
+static int BenchCc_PackConnect(struct MqttBuffer *buf, uint32_t device)
+{
+    char id[16], token[192];
+
+    sprintf(id, "dev%08u", device);
+    BenchCc_GenToken(token, device);
+    return Mqtt_PackConnectPkt(buf, 120, id, 0, NULL, NULL, 0, MQTT_QOS_LEVEL0, 0,
+                               "418620", token, (uint16_t)strlen(token));
+}
+
+// compares every cached packet with a freshly packed one, returns the mismatches
+static int BenchCc_Verify(const struct MqttConnectCache *cache, uint32_t count)
+{
+    struct MqttBuffer buf[1];
+    const struct MqttExtent *ext;
+    const char *data;
+    uint32_t i, size, offset;
+    int mismatches = 0;
+
+    MqttBuffer_Init(buf);
+    for(i = 0; i < count; ++i) {
+        MqttBuffer_Reset(buf);
+        if((MQTTERR_NOERROR != BenchCc_PackConnect(buf, i)) ||
+           (MQTTERR_NOERROR != MqttConnectCache_Get(cache, i, &data, &size)) ||
+           (size != buf->buffered_bytes)) {
+            ++mismatches;
+            continue;
+        }
+
+        offset = 0;
+        for(ext = buf->first_ext; ext; ext = ext->next) {
+            if(0 != memcmp(data + offset, ext->payload, ext->len)) {
+                ++mismatches;
+                break;
+            }
+            offset += ext->len;
+        }
+    }
+    MqttBuffer_Destroy(buf);
+
+    return mismatches;
+}
+
+static int BenchCc_Run(enum BenchCcMethod method, const struct MqttConnectCache *cache,
+                       const uint32_t *order, uint32_t count, uint32_t rounds)
+{
+    struct BenchCcWriter writer;
+    struct MqttContext ctx[1];
+    struct MqttBuffer buf[1];
+    int64_t start, elapsed;
+    uint64_t allocs;
+    uint32_t r, i;
+    int err = MQTTERR_NOERROR;
+
+    if(MQTTERR_NOERROR != Mqtt_InitContext(ctx, 1024)) {
+        return -1;
+    }
+    memset(&writer, 0, sizeof(writer));
+    ctx->writev_func = BenchCc_Writev;
+    ctx->writev_func_arg = &writer;
+    MqttBuffer_Init(buf);
+
+    allocs = Bench_AllocCount();
+    start = Bench_NowNs();
+    for(r = 0; r < rounds; ++r) {
+        for(i = 0; (i < count) && (err >= 0); ++i) {
+            switch(method) {
+            case BENCH_CC_PACK:
+                MqttBuffer_Reset(buf);
+                err = BenchCc_PackConnect(buf, order[i]);
+                if(MQTTERR_NOERROR == err) {
+                    err = Mqtt_SendPkt(ctx, buf, 0);
+                }
+                break;
+
+            case BENCH_CC_SEND:
+                err = MqttConnectCache_Send(cache, order[i], ctx);
+                break;
+
+            default:
+                MqttBuffer_Reset(buf);
+                err = MqttConnectCache_Append(cache, order[i], buf);
+                if(MQTTERR_NOERROR == err) {
+                    err = Mqtt_SendPkt(ctx, buf, 0);
+                }
+                break;
+            }
+        }
+    }
+    elapsed = Bench_NowNs() - start;
+    allocs = Bench_AllocCount() - allocs;
+
+    MqttBuffer_Destroy(buf);
+    Mqtt_DestroyContext(ctx);
+
+    if(err < 0) {
+        fprintf(stderr, "%s: failed, error %d.\n", bench_cc_methods[method], err);
+        return -1;
+    }
+
+    printf("{\"bench\":\"connect_cache\",\"method\":\"%s\",\"devices\":%u,\"reconnects\":%llu,"
+           "\"ns_per_reconnect\":%.1f,\"allocs_per_reconnect\":%.2f,"
+           "\"writev_per_reconnect\":%.2f,\"iovecs_per_writev\":%.2f,\"bytes_per_connect\":%.1f}\n",
+           bench_cc_methods[method], count, (unsigned long long)writer.calls,
+           (double)elapsed / ((uint64_t)count * rounds),
+           (double)allocs / ((uint64_t)count * rounds),
+           (double)writer.calls / ((uint64_t)count * rounds),
+           (double)writer.iovecs / writer.calls, (double)writer.bytes / writer.calls);
+    fflush(stdout);
+    return 0;
+}
+
+static void BenchCc_Usage(const char *name)
+{
+    printf("usage: %s [options]\n", name);
+    printf("  -n devices         device identities (default 100000)\n");
+    printf("  -r rounds          reconnects of every device per method (default 5)\n");
+    printf("  -f path            file the cache is saved to and loaded from\n");
+    printf("                     (default mqtt_connect_cache.bin, removed afterwards)\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct MqttConnectCache cache, loaded;
+    struct MqttBuffer buf[1];
+    const char *path = "mqtt_connect_cache.bin";
+    uint32_t count = 100000, rounds = 5, i, j, index, tmp, seed = 1;
+    uint32_t *order;
+    int64_t start, build_ns, save_ns, load_ns;
+    int failed = 0, opt, err = MQTTERR_NOERROR, mismatches;
+
+    while((opt = getopt(argc, argv, "hn:r:f:")) != -1) {
+        switch(opt) {
+        case 'n': count = (uint32_t)atol(optarg); break;
+        case 'r': rounds = (uint32_t)atol(optarg); break;
+        case 'f': path = optarg; break;
+        default:
+            BenchCc_Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if((0 == count) || (0 == rounds)) {
+        BenchCc_Usage(argv[0]);
+        return 1;
+    }
+
+    // a storm reaches the devices in no particular order
+    order = (uint32_t*)malloc(count * sizeof(uint32_t));
+    if(!order) {
+        return 1;
+    }
+    for(i = 0; i < count; ++i) {
+        order[i] = i;
+    }
+    for(i = count - 1; i > 0; --i) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        j = seed % (i + 1);
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    MqttConnectCache_Init(&cache);
+    MqttConnectCache_Init(&loaded);
+    MqttBuffer_Init(buf);
+    start = Bench_NowNs();
+    for(i = 0; (i < count) && (MQTTERR_NOERROR == err); ++i) {
+        MqttBuffer_Reset(buf);
+        err = BenchCc_PackConnect(buf, i);
+        if(MQTTERR_NOERROR == err) {
+            err = MqttConnectCache_Put(&cache, buf, &index);
+        }
+    }
+    build_ns = Bench_NowNs() - start;
+    MqttBuffer_Destroy(buf);
+
+    if((MQTTERR_NOERROR != err) || (0 != BenchCc_Verify(&cache, count))) {
+        fprintf(stderr, "building the cache failed, error %d.\n", err);
+        failed = 1;
+    }
+
+    for(i = BENCH_CC_PACK; !failed && (i <= BENCH_CC_APPEND); ++i) {
+        failed |= BenchCc_Run((enum BenchCcMethod)i, &cache, order, count, rounds) < 0;
+    }
+
+    if(!failed) {
+        start = Bench_NowNs();
+        err = MqttConnectCache_Save(&cache, path);
+        save_ns = Bench_NowNs() - start;
+        start = Bench_NowNs();
+        if(MQTTERR_NOERROR == err) {
+            err = MqttConnectCache_Load(&loaded, path);
+        }
+        load_ns = Bench_NowNs() - start;
+        unlink(path);
+
+        mismatches = MQTTERR_NOERROR == err ? BenchCc_Verify(&loaded, count) : -1;
+        if((0 != mismatches) || (loaded.count != count)) {
+            fprintf(stderr, "persistence failed, error %d, %d mismatches.\n", err, mismatches);
+            failed = 1;
+        }
+        else {
+            printf("{\"bench\":\"connect_cache\",\"method\":\"persist\",\"devices\":%u,"
+                   "\"build_ns_per_device\":%.1f,\"cache_bytes\":%llu,\"memory_bytes\":%llu,"
+                   "\"memory_per_device\":%.1f,\"save_ms\":%.2f,\"load_ms\":%.2f,"
+                   "\"load_ns_per_device\":%.1f}\n",
+                   count, (double)build_ns / count, (unsigned long long)cache.bytes,
+                   (unsigned long long)cache.memory, (double)cache.memory / count,
+                   save_ns / 1e6, load_ns / 1e6, (double)load_ns / count);
+            fflush(stdout);
+        }
+    }
+
+    MqttConnectCache_Destroy(&cache);
+    MqttConnectCache_Destroy(&loaded);
+    free(order);
+    return failed ? 1 : 0;
+}
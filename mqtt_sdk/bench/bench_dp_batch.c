@@ -0,0 +1,187 @@
+/*
+ * Datapoint batching benchmark: the same telemetry, several streams
+ * reporting one double each round, is sent one $dp packet per point
+ * through the Mqtt_AppendDP* builder and through a MqttDpAggregator with
+ * a range of byte budgets. The writev_func only counts, so the numbers
+ * are the SDK's cost per point plus the syscalls and wire bytes a socket
+ * transport would see. One JSON line is printed per mode.
+ */
+#include "mqtt/mqtt.h"
+#include "mqtt/mqtt_dp_aggregator.h"
+#include "bench_util.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct BenchDpSink {
+    uint64_t writev_calls;
+    uint64_t bytes;
+    uint64_t pkts;
+};
+
+static const char *bench_dp_streams[] = {
+    "temperature", "humidity", "pressure", "voltage",
+    "current", "rpm", "vibration_x", "vibration_y"
+};
+
+#define BENCH_DP_STREAMS (sizeof(bench_dp_streams) / sizeof(bench_dp_streams[0]))
+
+static int BenchDp_Writev(void *arg, const struct iovec *iov, int iovcnt)
+{
+    struct BenchDpSink *sink = (struct BenchDpSink*)arg;
+    int i, bytes = 0;
+
+    ++sink->writev_calls;
+    for(i = 0; i < iovcnt; ++i) {
+        bytes += (int)iov[i].iov_len;
+    }
+
+    sink->bytes += (uint64_t)bytes;
+    return bytes;
+}
+
+static int BenchDp_Send(void *arg, uint16_t pkt_id, struct MqttBuffer *buf)
+{
+    struct MqttContext *ctx = (struct MqttContext*)arg;
+
+    (void)pkt_id;
+    ++((struct BenchDpSink*)ctx->writev_func_arg)->pkts;
+    return Mqtt_SendPkt(ctx, buf, 0) == (int)buf->buffered_bytes ? 0 : MQTTERR_IO;
+}
+
+static int BenchDp_PerPoint(struct MqttContext *ctx, uint64_t points, int64_t ts0)
+{
+    struct MqttBuffer buf[1];
+    uint64_t i;
+    int err = MQTTERR_NOERROR;
+
+    MqttBuffer_Init(buf);
+    for(i = 0; (i < points) && (MQTTERR_NOERROR == err); ++i) {
+        err = Mqtt_PackDataPointStart(buf, 1, MQTT_QOS_LEVEL0, 0, 1);
+        if(MQTTERR_NOERROR == err) {
+            err = Mqtt_AppendDPDouble(buf, bench_dp_streams[i % BENCH_DP_STREAMS],
+                                      ts0 + (int64_t)(i / BENCH_DP_STREAMS), 20.0 + i % 100);
+        }
+        if(MQTTERR_NOERROR == err) {
+            err = Mqtt_PackDataPointFinish(buf);
+        }
+        if(MQTTERR_NOERROR == err) {
+            err = BenchDp_Send(ctx, 0, buf);
+        }
+        MqttBuffer_Reset(buf);
+    }
+    MqttBuffer_Destroy(buf);
+
+    return err;
+}
+
+static int BenchDp_Aggregated(struct MqttContext *ctx, struct MqttDpAggregator *agg,
+                              uint64_t points, int64_t ts0)
+{
+    uint64_t i;
+    int err = MQTTERR_NOERROR;
+
+    // one round of all streams per millisecond, the deadline never hits
+    for(i = 0; (i < points) && (MQTTERR_NOERROR == err); ++i) {
+        err = MqttDpAggregator_AddDouble(agg, bench_dp_streams[i % BENCH_DP_STREAMS],
+                                         ts0 + (int64_t)(i / BENCH_DP_STREAMS),
+                                         20.0 + i % 100, (int64_t)(i / BENCH_DP_STREAMS));
+    }
+
+    if(MQTTERR_NOERROR == err) {
+        err = MqttDpAggregator_Flush(agg, 0, 1);
+    }
+
+    return err;
+}
+
+static int BenchDp_Run(uint32_t max_bytes, uint64_t points)
+{
+    struct BenchDpSink sink;
+    struct MqttContext ctx[1];
+    struct MqttDpAggregator agg;
+    const int64_t ts0 = 1500000000000LL;
+    uint64_t allocs;
+    int64_t start, elapsed;
+    int err;
+
+    memset(&sink, 0, sizeof(sink));
+    if(MQTTERR_NOERROR != Mqtt_InitContext(ctx, 1024)) {
+        return -1;
+    }
+    ctx->writev_func = BenchDp_Writev;
+    ctx->writev_func_arg = &sink;
+
+    MqttDpAggregator_Init(&agg, max_bytes, 1000);
+    agg.flush_func = BenchDp_Send;
+    agg.flush_func_arg = ctx;
+
+    allocs = Bench_AllocCount();
+    start = Bench_NowNs();
+    if(max_bytes) {
+        err = BenchDp_Aggregated(ctx, &agg, points, ts0);
+    }
+    else {
+        err = BenchDp_PerPoint(ctx, points, ts0);
+    }
+    elapsed = Bench_NowNs() - start;
+    allocs = Bench_AllocCount() - allocs;
+
+    if(MQTTERR_NOERROR == err) {
+        printf("{\"bench\":\"dp_batch\",\"mode\":\"%s\",\"max_bytes\":%u,\"points\":%lu,"
+               "\"pkts\":%lu,\"points_per_pkt\":%.1f,\"ns_per_point\":%.1f,"
+               "\"wire_bytes_per_point\":%.1f,\"writev_per_point\":%.4f,"
+               "\"allocs_per_point\":%.4f,\"size_flushes\":%lu}\n",
+               max_bytes ? "aggregated" : "per_point", max_bytes, (unsigned long)points,
+               (unsigned long)sink.pkts, (double)points / sink.pkts, (double)elapsed / points,
+               (double)sink.bytes / points, (double)sink.writev_calls / points,
+               (double)allocs / points, (unsigned long)agg.size_flushes);
+        fflush(stdout);
+    }
+    else {
+        fprintf(stderr, "max_bytes %u: failed with %d.\n", max_bytes, err);
+    }
+
+    MqttDpAggregator_Destroy(&agg);
+    Mqtt_DestroyContext(ctx);
+    return MQTTERR_NOERROR == err ? 0 : -1;
+}
+
+static void BenchDp_Usage(const char *name)
+{
+    printf("usage: %s [options]\n", name);
+    printf("  -n points          points per mode (default 1000000)\n");
+    printf("  -b bytes           only run the aggregator with this byte budget\n");
+}
+
+int main(int argc, char **argv)
+{
+    static const uint32_t budgets[] = {0, 512, 1460, 4096, 16384, 65536};
+    uint64_t points = 1000000;
+    uint32_t max_bytes = 0, i;
+    int failed = 0, opt;
+
+    while((opt = getopt(argc, argv, "hn:b:")) != -1) {
+        switch(opt) {
+        case 'n': points = (uint64_t)atol(optarg); break;
+        case 'b': max_bytes = (uint32_t)atoi(optarg); break;
+        default:
+            BenchDp_Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if(max_bytes) {
+        return BenchDp_Run(max_bytes, points) < 0;
+    }
+
+    for(i = 0; i < sizeof(budgets) / sizeof(budgets[0]); ++i) {
+        if(BenchDp_Run(budgets[i], points) < 0) {
+            failed = 1;
+        }
+    }
+
+    return failed;
+}
@@ -0,0 +1,377 @@
+/*
+ * Columnar datapoint benchmark: a bulk upload of float and string samples,
+ * rate samples per second with second resolution timestamps, packed one
+ * $dp packet per sample through Mqtt_PackDataPointByString and a batch at a
+ * time through Mqtt_PackDataPointFloats (one packet per second) and
+ * Mqtt_PackDataPointStrings (one packet per sample). Only packing is timed,
+ * the buffer is reset after each batch. Before timing, every float packet of
+ * the first batch and of a fixed set with more than 500 samples in a second
+ * is walked: packet id, one type and time, then stream, count and values in
+ * groups of at most 500. Every string packet is compared byte by byte with
+ * the Mqtt_PackDataPointByString packet of its sample. One JSON line is
+ * printed per mode.
+ */
+#include <time.h>
+#include "mqtt/mqtt.h"
+#include "mqtt/mqtt_v5.h"
+#include "bench_util.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct BenchColumnarData {
+    uint32_t count;
+    int64_t *ts;
+    float *floats;
+    const char **strings;
+    uint32_t *sizes;
+};
+
+static const char *bench_columnar_states[] = {
+    "idle", "running", "overheat", "maintenance"
+};
+
+// the per-point path takes the stream, count and value already in wire order, low byte first
+static void BenchColumnar_WriteFloat(char *out, float value)
+{
+    uint32_t v;
+
+    memcpy(&v, &value, 4);
+    out[0] = (char)v;
+    out[1] = (char)(v >> 8);
+    out[2] = (char)(v >> 16);
+    out[3] = (char)(v >> 24);
+}
+
+static int BenchColumnar_PerPointFloats(struct MqttBuffer *buf, const struct BenchColumnarData *data,
+                                        uint32_t batch, uint64_t *bytes)
+{
+    char payload[8] = {0, 1, 0, 1};
+    uint32_t i;
+    int err = MQTTERR_NOERROR;
+
+    (void)batch;
+    for(i = 0; (i < data->count) && (MQTTERR_NOERROR == err); ++i) {
+        BenchColumnar_WriteFloat(payload + 4, data->floats[i]);
+        err = Mqtt_PackDataPointByString(buf, 1, data->ts[i], PAYLOADWITHTIME(kTypeFloat),
+                                         payload, sizeof(payload), MQTT_QOS_LEVEL0, 0, 1);
+        *bytes += buf->buffered_bytes;
+        MqttBuffer_Reset(buf);
+    }
+
+    return err;
+}
+
+// copies all packets of buf into one block, returns it or NULL
+static char *BenchColumnar_Flatten(const struct MqttBuffer *buf)
+{
+    const struct MqttExtent *ext;
+    char *out = (char*)malloc(buf->buffered_bytes + 1);
+    uint32_t size = 0;
+
+    for(ext = buf->first_ext; out && ext; ext = ext->next) {
+        memcpy(out + size, ext->payload, ext->len);
+        size += ext->len;
+    }
+    return out;
+}
+
+// checks the head of the QoS1 $dp packet at *pos, moves *pos to its payload and returns its size
+static int BenchColumnar_Payload(const char *data, uint32_t size, uint32_t *pos, uint16_t pkt_id)
+{
+    uint32_t remaining_len;
+    const char *p = data + *pos;
+    int bytes;
+
+    if((*pos + 2 > size) || (0x32 != (uint8_t)p[0])) {
+        return -1;
+    }
+    bytes = MqttV5_ReadVarInt(p + 1, size - *pos - 1, &remaining_len);
+    if((bytes <= 0) || (*pos + 1 + (uint32_t)bytes + remaining_len > size) || (remaining_len < 7)) {
+        return -1;
+    }
+
+    // the two byte length and "$dp", then the packet id
+    p += 1 + bytes;
+    if(memcmp(p, "\0\3$dp", 5) || ((uint8_t)p[5] != (pkt_id >> 8)) ||
+       ((uint8_t)p[6] != (pkt_id & 0xFF))) {
+        return -1;
+    }
+    *pos += 1 + (uint32_t)bytes + 7;
+    return (int)remaining_len - 7;
+}
+
+/*
+ * Packs the samples at QoS1 and walks the packets: one per run of samples in
+ * the same second (all samples when ts is NULL), ids counting up from 0xFFFE
+ * past 0, each payload one type and time followed by stream, count and the
+ * low byte first values, at most 500 per group.
+ */
+static int BenchColumnar_VerifyFloats(const char *name, const int64_t *ts, const float *floats,
+                                      uint32_t count)
+{
+    struct MqttBuffer buf[1];
+    struct tm t;
+    time_t tt;
+    char *packets = NULL, expected[10];
+    uint32_t pos = 0, i = 0, end, j, n, pkt_count = 0, packed = 0;
+    uint16_t pkt_id = 0xFFFE;
+    int payload_size = 0, err, ok = 1;
+
+    MqttBuffer_Init(buf);
+    err = Mqtt_PackDataPointFloats(buf, pkt_id, 1, ts, floats, count, MQTT_QOS_LEVEL1, 0, &pkt_count);
+    if(MQTTERR_NOERROR == err) {
+        packets = BenchColumnar_Flatten(buf);
+    }
+    ok = (NULL != packets);
+
+    while(ok && (i < count)) {
+        for(end = i + 1; (end < count) && (!ts || (ts[end] == ts[i])); ++end) {
+        }
+
+        payload_size = BenchColumnar_Payload(packets, buf->buffered_bytes, &pos, pkt_id);
+        n = (end - i + 499) / 500;
+        ok = (payload_size == (int)(1 + (ts ? 6 : 0) + n * 4 + (end - i) * 4));
+        if(ok && ts) {
+            tt = (time_t)ts[i];
+            gmtime_r(&tt, &t);
+            expected[0] = (char)PAYLOADWITHTIME(kTypeFloat);
+            expected[1] = (char)(t.tm_year % 100);
+            expected[2] = (char)(t.tm_mon + 1);
+            expected[3] = (char)t.tm_mday;
+            expected[4] = (char)t.tm_hour;
+            expected[5] = (char)t.tm_min;
+            expected[6] = (char)t.tm_sec;
+            ok = !memcmp(packets + pos, expected, 7);
+            pos += 7;
+        }
+        else if(ok) {
+            ok = (kTypeFloat == packets[pos++]);
+        }
+
+        for(; ok && (i < end); i += n) {
+            n = end - i < 500 ? end - i : 500;
+            expected[0] = 0;
+            expected[1] = 1;
+            expected[2] = (char)(n >> 8);
+            expected[3] = (char)n;
+            ok = !memcmp(packets + pos, expected, 4);
+            pos += 4;
+            for(j = 0; ok && (j < n); ++j, pos += 4) {
+                BenchColumnar_WriteFloat(expected, floats[i + j]);
+                ok = !memcmp(packets + pos, expected, 4);
+            }
+        }
+
+        ++packed;
+        pkt_id = (0xFFFF == pkt_id) ? 1 : pkt_id + 1;
+    }
+    ok = ok && (pos == buf->buffered_bytes) && (packed == pkt_count);
+    MqttBuffer_Destroy(buf);
+    free(packets);
+
+    if(!ok) {
+        fprintf(stderr, "float_columnar: %s: packet %u (sample %u, byte %u) does not match the "
+                "type 7 layout, error %d.\n", name, packed, i, pos, err);
+        return -1;
+    }
+    return 0;
+}
+
+// compares every string packet with the Mqtt_PackDataPointByString packet of its sample
+static int BenchColumnar_VerifyStrings(const struct BenchColumnarData *data, uint32_t batch)
+{
+    struct MqttBuffer buf[1], point[1];
+    const uint32_t n = data->count < batch ? data->count : batch;
+    char *packets = NULL, *expected;
+    uint32_t pos = 0, i = 0, pkt_count = 0;
+    uint16_t pkt_id = 0xFFFE;
+    int err, ok;
+
+    MqttBuffer_Init(buf);
+    MqttBuffer_Init(point);
+    err = Mqtt_PackDataPointStrings(buf, pkt_id, data->ts, data->strings, data->sizes, n,
+                                    MQTT_QOS_LEVEL1, 0, &pkt_count);
+    if(MQTTERR_NOERROR == err) {
+        packets = BenchColumnar_Flatten(buf);
+    }
+    ok = (NULL != packets) && (pkt_count == n);
+
+    for(; ok && (i < n); ++i) {
+        MqttBuffer_Reset(point);
+        err = Mqtt_PackDataPointByString(point, pkt_id, data->ts[i],
+                                         PAYLOADWITHTIME(kTypeStringWithTime), data->strings[i],
+                                         data->sizes[i], MQTT_QOS_LEVEL1, 0, 1);
+        expected = MQTTERR_NOERROR == err ? BenchColumnar_Flatten(point) : NULL;
+        ok = expected && (pos + point->buffered_bytes <= buf->buffered_bytes) &&
+            !memcmp(packets + pos, expected, point->buffered_bytes);
+        pos += point->buffered_bytes;
+        free(expected);
+        pkt_id = (0xFFFF == pkt_id) ? 1 : pkt_id + 1;
+    }
+    ok = ok && (pos == buf->buffered_bytes);
+    MqttBuffer_Destroy(point);
+    MqttBuffer_Destroy(buf);
+    free(packets);
+
+    if(!ok) {
+        fprintf(stderr, "string_columnar: packet %u differs from the per-point packet, error %d.\n",
+                i, err);
+        return -1;
+    }
+    return 0;
+}
+
+static int BenchColumnar_Floats(struct MqttBuffer *buf, const struct BenchColumnarData *data,
+                                uint32_t batch, uint64_t *bytes)
+{
+    uint32_t i, n;
+    int err = MQTTERR_NOERROR;
+
+    for(i = 0; (i < data->count) && (MQTTERR_NOERROR == err); i += n) {
+        n = data->count - i < batch ? data->count - i : batch;
+        err = Mqtt_PackDataPointFloats(buf, 1, 1, data->ts + i, data->floats + i, n,
+                                       MQTT_QOS_LEVEL0, 0, NULL);
+        *bytes += buf->buffered_bytes;
+        MqttBuffer_Reset(buf);
+    }
+
+    return err;
+}
+
+static int BenchColumnar_PerPointStrings(struct MqttBuffer *buf, const struct BenchColumnarData *data,
+                                         uint32_t batch, uint64_t *bytes)
+{
+    uint32_t i;
+    int err = MQTTERR_NOERROR;
+
+    (void)batch;
+    for(i = 0; (i < data->count) && (MQTTERR_NOERROR == err); ++i) {
+        err = Mqtt_PackDataPointByString(buf, 1, data->ts[i], PAYLOADWITHTIME(kTypeStringWithTime),
+                                         data->strings[i], data->sizes[i], MQTT_QOS_LEVEL0, 0, 1);
+        *bytes += buf->buffered_bytes;
+        MqttBuffer_Reset(buf);
+    }
+
+    return err;
+}
+
+static int BenchColumnar_Strings(struct MqttBuffer *buf, const struct BenchColumnarData *data,
+                                 uint32_t batch, uint64_t *bytes)
+{
+    uint32_t i, n;
+    int err = MQTTERR_NOERROR;
+
+    for(i = 0; (i < data->count) && (MQTTERR_NOERROR == err); i += n) {
+        n = data->count - i < batch ? data->count - i : batch;
+        err = Mqtt_PackDataPointStrings(buf, 1, data->ts + i, data->strings + i, data->sizes + i,
+                                        n, MQTT_QOS_LEVEL0, 0, NULL);
+        *bytes += buf->buffered_bytes;
+        MqttBuffer_Reset(buf);
+    }
+
+    return err;
+}
+
+static int BenchColumnar_Run(const char *mode, const struct BenchColumnarData *data, uint32_t batch,
+                             int (*pack)(struct MqttBuffer*, const struct BenchColumnarData*,
+                                         uint32_t, uint64_t*))
+{
+    struct MqttBuffer buf[1];
+    uint64_t bytes = 0;
+    int64_t start, elapsed;
+    int err;
+
+    MqttBuffer_Init(buf);
+    start = Bench_NowNs();
+    err = pack(buf, data, batch, &bytes);
+    elapsed = Bench_NowNs() - start;
+    MqttBuffer_Destroy(buf);
+
+    if(MQTTERR_NOERROR != err) {
+        fprintf(stderr, "%s: failed with %d.\n", mode, err);
+        return -1;
+    }
+
+    printf("{\"bench\":\"dp_columnar\",\"mode\":\"%s\",\"points\":%u,\"batch\":%u,"
+           "\"ns_per_point\":%.1f,\"bytes_per_point\":%.2f}\n",
+           mode, data->count, batch, (double)elapsed / data->count,
+           (double)bytes / data->count);
+    fflush(stdout);
+    return 0;
+}
+
+static void BenchColumnar_Usage(const char *name)
+{
+    printf("usage: %s [options]\n", name);
+    printf("  -n points          samples per mode (default 1000000)\n");
+    printf("  -r rate            samples per second (default 100)\n");
+    printf("  -b batch           samples per columnar call (default 1000)\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct BenchColumnarData data;
+    const int64_t ts0 = 1500000000;
+    int64_t dense_ts[1202];
+    float dense[1202];
+    uint32_t points = 1000000, rate = 100, batch = 1000, i;
+    int failed = 0, opt;
+
+    while((opt = getopt(argc, argv, "hn:r:b:")) != -1) {
+        switch(opt) {
+        case 'n': points = (uint32_t)atol(optarg); break;
+        case 'r': rate = (uint32_t)atoi(optarg); break;
+        case 'b': batch = (uint32_t)atoi(optarg); break;
+        default:
+            BenchColumnar_Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if((0 == points) || (0 == rate) || (0 == batch)) {
+        BenchColumnar_Usage(argv[0]);
+        return 1;
+    }
+
+    data.count = points;
+    data.ts = (int64_t*)malloc(points * sizeof(int64_t));
+    data.floats = (float*)malloc(points * sizeof(float));
+    data.strings = (const char**)malloc(points * sizeof(const char*));
+    data.sizes = (uint32_t*)malloc(points * sizeof(uint32_t));
+    if(!data.ts || !data.floats || !data.strings || !data.sizes) {
+        fprintf(stderr, "out of memory.\n");
+        return 1;
+    }
+
+    for(i = 0; i < points; ++i) {
+        data.ts[i] = ts0 + i / rate;
+        data.floats[i] = 20.0f + (float)(i % 1000) / 100.0f;
+        data.strings[i] = bench_columnar_states[i / 97 % 4];
+        data.sizes[i] = (uint32_t)strlen(data.strings[i]);
+    }
+
+    // 1201 samples in one second are three groups, then a packet of its own for the next second
+    for(i = 0; i < 1202; ++i) {
+        dense_ts[i] = ts0 + (i > 1200);
+        dense[i] = -1.5f * (float)i;
+    }
+
+    failed |= BenchColumnar_VerifyFloats("first batch", data.ts, data.floats,
+                                         points < batch ? points : batch) < 0;
+    failed |= BenchColumnar_VerifyFloats("1201 in a second", dense_ts, dense, 1202) < 0;
+    failed |= BenchColumnar_VerifyFloats("no time", NULL, dense, 1202) < 0;
+    failed |= BenchColumnar_VerifyStrings(&data, batch) < 0;
+    failed |= BenchColumnar_Run("float_per_point", &data, 1, BenchColumnar_PerPointFloats);
+    failed |= BenchColumnar_Run("float_columnar", &data, batch, BenchColumnar_Floats);
+    failed |= BenchColumnar_Run("string_per_point", &data, 1, BenchColumnar_PerPointStrings);
+    failed |= BenchColumnar_Run("string_columnar", &data, batch, BenchColumnar_Strings);
+
+    free(data.ts);
+    free(data.floats);
+    free(data.strings);
+    free(data.sizes);
+    return failed ? 1 : 0;
+}
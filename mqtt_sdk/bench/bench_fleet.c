@@ -0,0 +1,750 @@
+/*
+ * Device fleet load generator: thousands of simulated devices run on a
+ * MqttShardedEngine and publish data points of the OneNET save-data types
+ * at a fixed per-device rate with a configurable QoS mix. Every packet is
+ * built with the SDK packers, so the cost of packing and sending is
+ * measured together with the broker round trip. Without -H the local
+ * stand-in broker is started and injects $creq commands, which the devices
+ * answer at the configured response rate. Latency percentiles are printed
+ * per message class as JSON lines.
+ */
+#include "mqtt/mqtt_shard.h"
+#include "bench_broker.h"
+#include "bench_util.h"
+
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_FLEET_TYPES 7
+#define BENCH_FLEET_CMD_DELIVERY (BENCH_FLEET_TYPES * 3)
+#define BENCH_FLEET_CMD_RESPONSE (BENCH_FLEET_CMD_DELIVERY + 1)
+#define BENCH_FLEET_CLASSES (BENCH_FLEET_CMD_RESPONSE + 1)
+#define BENCH_FLEET_SLOTS 256
+#define BENCH_FLEET_SLOT_RESPONSE 0xFF
+#define BENCH_FLEET_MAX_SAMPLES (1u << 22)
+
+struct BenchFleetSeries {
+    int64_t *values;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+struct BenchFleetClass {
+    uint64_t sent;
+    uint64_t completed;
+    struct BenchFleetSeries latency; /* 发送到确认(或送达)的纳秒数 */
+    struct BenchFleetSeries cost;    /* 打包并交给引擎发送的纳秒数 */
+};
+
+/* 每个分片线程(以及服务器替身线程)各自一份，不需要加锁 */
+struct BenchFleetStats {
+    struct BenchFleetClass classes[BENCH_FLEET_CLASSES];
+    uint64_t throttled;
+    uint64_t errors;
+};
+
+struct BenchFleetConfig {
+    uint32_t types[BENCH_FLEET_TYPES];
+    uint32_t type_count;
+    uint32_t qos_weights[3];
+    uint32_t qos_total;
+    double rate;
+    uint32_t interval_ms;
+    uint32_t window;
+    uint32_t payload_size;
+    uint32_t response_rate;
+    enum MqttQosLevel cmd_qos;
+    char *binary;
+    volatile int stopping;
+
+    uint64_t connected;
+    uint64_t failed;
+};
+
+struct BenchFleetDevice {
+    struct BenchFleetConfig *cfg;
+    struct BenchFleetStats *stats;
+    struct MqttConnection *conn;
+    struct MqttTimer timer;
+    uint32_t rng;
+    uint32_t next_slot;
+    uint32_t inflight;
+    int64_t sent_at[BENCH_FLEET_SLOTS];
+    uint8_t sent_class[BENCH_FLEET_SLOTS];
+    char id[24];
+};
+
+struct BenchFleetSlice {
+    struct BenchFleetDevice *devices;
+    uint32_t first;
+    uint32_t step;
+    uint32_t count;
+};
+
+static void BenchFleet_AddSample(struct BenchFleetSeries *series, int64_t value)
+{
+    if(series->count == series->capacity) {
+        uint32_t capacity = series->capacity ? series->capacity * 2 : 1024;
+        int64_t *values;
+
+        if(capacity > BENCH_FLEET_MAX_SAMPLES) {
+            return;
+        }
+
+        values = (int64_t*)realloc(series->values, capacity * sizeof(int64_t));
+        if(!values) {
+            return;
+        }
+        series->values = values;
+        series->capacity = capacity;
+    }
+
+    series->values[series->count++] = value;
+}
+
+static void BenchFleet_MergeSeries(struct BenchFleetSeries *dst, struct BenchFleetSeries *src)
+{
+    uint32_t i;
+
+    for(i = 0; i < src->count; ++i) {
+        BenchFleet_AddSample(dst, src->values[i]);
+    }
+
+    free(src->values);
+    memset(src, 0, sizeof(*src));
+}
+
+static void BenchFleet_MergeStats(struct BenchFleetStats *dst, struct BenchFleetStats *src)
+{
+    uint32_t i;
+
+    for(i = 0; i < BENCH_FLEET_CLASSES; ++i) {
+        dst->classes[i].sent += src->classes[i].sent;
+        dst->classes[i].completed += src->classes[i].completed;
+        BenchFleet_MergeSeries(&dst->classes[i].latency, &src->classes[i].latency);
+        BenchFleet_MergeSeries(&dst->classes[i].cost, &src->classes[i].cost);
+    }
+
+    dst->throttled += src->throttled;
+    dst->errors += src->errors;
+}
+
+static uint32_t BenchFleet_Random(struct BenchFleetDevice *dev)
+{
+    // xorshift32, the state is never zero
+    dev->rng ^= dev->rng << 13;
+    dev->rng ^= dev->rng >> 17;
+    dev->rng ^= dev->rng << 5;
+    return dev->rng;
+}
+
+static enum MqttQosLevel BenchFleet_PickQos(struct BenchFleetDevice *dev)
+{
+    const struct BenchFleetConfig *cfg = dev->cfg;
+    uint32_t pick = BenchFleet_Random(dev) % cfg->qos_total;
+
+    if(pick < cfg->qos_weights[0]) {
+        return MQTT_QOS_LEVEL0;
+    }
+    return pick < cfg->qos_weights[0] + cfg->qos_weights[1] ? MQTT_QOS_LEVEL1 : MQTT_QOS_LEVEL2;
+}
+
+// returns the packet id of a free in-flight slot, 0 when the window is full
+static uint16_t BenchFleet_AllocSlot(struct BenchFleetDevice *dev, uint8_t class_id)
+{
+    uint32_t i, slot;
+
+    if(dev->inflight >= dev->cfg->window) {
+        return 0;
+    }
+
+    for(i = 0; i < BENCH_FLEET_SLOTS; ++i) {
+        slot = (dev->next_slot + i) % BENCH_FLEET_SLOTS;
+        if(0 == dev->sent_at[slot]) {
+            dev->next_slot = slot + 1;
+            dev->sent_at[slot] = Bench_NowNs();
+            dev->sent_class[slot] = class_id;
+            ++dev->inflight;
+            return (uint16_t)(slot + 1);
+        }
+    }
+
+    return 0;
+}
+
+static int BenchFleet_Pack(struct BenchFleetDevice *dev, struct MqttBuffer *buf,
+                           uint32_t type, uint16_t pkt_id, enum MqttQosLevel qos)
+{
+    static const char full_json[] =
+        "{\"datastreams\":[{\"id\":\"temperature\",\"datapoints\":"
+        "[{\"at\":\"2016-12-22 22:22:22\",\"value\":36.5}]}]}";
+    static const char simple_json[] = "{\"temperature\":22.5,\"humidity\":61}";
+    static const char simple_json_time[] =
+        "{\"temperature\":{\"2015-03-22 22:31:12\":22.5},\"humidity\":61}";
+    static const char string[] = ",;temperature,2015-03-22 22:31:12,22.5;102;pm2.5,89;10";
+    char floats[12];
+    const float values[2] = {34.0f, -20.3f};
+
+    switch(type) {
+    case kTypeFullJson:
+        return Mqtt_PackDataPointByString(buf, pkt_id, 0, kTypeFullJson, full_json,
+                                          sizeof(full_json) - 1, qos, 0, 1);
+
+    case kTypeBin:
+        return Mqtt_PackDataPointByBinary(buf, pkt_id, "image", "fleet", 0, dev->cfg->binary,
+                                          dev->cfg->payload_size, qos, 0, 0);
+
+    case kTypeSimpleJsonWithoutTime:
+        return Mqtt_PackDataPointByString(buf, pkt_id, 0, kTypeSimpleJsonWithoutTime,
+                                          simple_json, sizeof(simple_json) - 1, qos, 0, 1);
+
+    case kTypeSimpleJsonWithTime:
+        return Mqtt_PackDataPointByString(buf, pkt_id, 0, kTypeSimpleJsonWithTime,
+                                          simple_json_time, sizeof(simple_json_time) - 1,
+                                          qos, 0, 1);
+
+    case kTypeString:
+        return Mqtt_PackDataPointByString(buf, pkt_id, 0, kTypeString, string,
+                                          sizeof(string) - 1, qos, 0, 1);
+
+    case kTypeStringWithTime:
+        return Mqtt_PackDataPointByString(buf, pkt_id, 0, PAYLOADWITHTIME(kTypeStringWithTime),
+                                          string, sizeof(string) - 1, qos, 0, 1);
+
+    default:
+        // data stream 0 with two float values, as in the sample
+        floats[0] = 0;
+        floats[1] = 0;
+        floats[2] = 0;
+        floats[3] = 2;
+        memcpy(floats + 4, values, sizeof(values));
+        return Mqtt_PackDataPointByString(buf, pkt_id, 0, PAYLOADWITHTIME(kTypeFloat),
+                                          floats, sizeof(floats), qos, 0, 1);
+    }
+}
+
+static void BenchFleet_Publish(struct BenchFleetDevice *dev)
+{
+    struct BenchFleetConfig *cfg = dev->cfg;
+    const uint32_t type = cfg->types[BenchFleet_Random(dev) % cfg->type_count];
+    const enum MqttQosLevel qos = BenchFleet_PickQos(dev);
+    const uint8_t class_id = (uint8_t)((type - 1) * 3 + qos);
+    struct BenchFleetClass *cls = dev->stats->classes + class_id;
+    struct MqttBuffer buf[1];
+    uint16_t pkt_id = 1;
+    int64_t start;
+    int err;
+
+    if(MQTT_QOS_LEVEL0 != qos) {
+        pkt_id = BenchFleet_AllocSlot(dev, class_id);
+        if(0 == pkt_id) {
+            ++dev->stats->throttled;
+            return;
+        }
+    }
+
+    start = Bench_NowNs();
+    MqttBuffer_Init(buf);
+    err = BenchFleet_Pack(dev, buf, type, pkt_id, qos);
+    if(MQTTERR_NOERROR == err) {
+        err = MqttEngine_SendPkt(dev->conn, buf);
+    }
+    MqttBuffer_Destroy(buf);
+    BenchFleet_AddSample(&cls->cost, Bench_NowNs() - start);
+
+    ++cls->sent;
+    if(MQTT_QOS_LEVEL0 == qos) {
+        ++cls->completed;
+    }
+    else {
+        // the ack latency starts when packing starts, like a real device would see it
+        dev->sent_at[pkt_id - 1] = start;
+    }
+
+    if(MQTTERR_NOERROR != err) {
+        ++dev->stats->errors;
+        MqttEngine_CloseConnection(dev->conn, err);
+    }
+}
+
+static void BenchFleet_HandleTimer(void *arg, struct MqttTimer *timer)
+{
+    struct BenchFleetDevice *dev = (struct BenchFleetDevice*)arg;
+    struct MqttEngine *engine;
+
+    if(dev->cfg->stopping || !dev->conn) {
+        return;
+    }
+
+    engine = dev->conn->engine;
+    BenchFleet_Publish(dev);
+    MqttTimer_Start(engine->timers, timer, timer->expire + dev->cfg->interval_ms);
+}
+
+static int BenchFleet_Complete(struct BenchFleetDevice *dev, uint16_t pkt_id)
+{
+    const uint32_t slot = (uint32_t)pkt_id - 1;
+    struct BenchFleetClass *cls;
+
+    if((0 == pkt_id) || (slot >= BENCH_FLEET_SLOTS) || (0 == dev->sent_at[slot])) {
+        return 0;
+    }
+
+    if(BENCH_FLEET_SLOT_RESPONSE != dev->sent_class[slot]) {
+        cls = dev->stats->classes + dev->sent_class[slot];
+        BenchFleet_AddSample(&cls->latency, Bench_NowNs() - dev->sent_at[slot]);
+        ++cls->completed;
+    }
+
+    dev->sent_at[slot] = 0;
+    --dev->inflight;
+    return 0;
+}
+
+static int BenchFleet_HandleConnAck(void *arg, char flags, char ret_code)
+{
+    struct BenchFleetDevice *dev = (struct BenchFleetDevice*)arg;
+    (void)flags;
+
+    __atomic_add_fetch(MQTT_CONNACK_ACCEPTED == ret_code ? &dev->cfg->connected :
+                       &dev->cfg->failed, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int BenchFleet_HandlePubAck(void *arg, uint16_t pkt_id)
+{
+    return BenchFleet_Complete((struct BenchFleetDevice*)arg, pkt_id);
+}
+
+static int BenchFleet_HandlePubRec(void *arg, uint16_t pkt_id)
+{
+    // the SDK answers with PUBREL, the message completes on PUBCOMP
+    (void)arg;
+    (void)pkt_id;
+    return 0;
+}
+
+static int BenchFleet_HandlePubRel(void *arg, uint16_t pkt_id)
+{
+    (void)arg;
+    (void)pkt_id;
+    return 0;
+}
+
+static int BenchFleet_HandlePubComp(void *arg, uint16_t pkt_id)
+{
+    return BenchFleet_Complete((struct BenchFleetDevice*)arg, pkt_id);
+}
+
+static int BenchFleet_HandlePublish(void *arg, uint16_t pkt_id, const char *topic,
+                                    const char *payload, uint32_t payloadsize,
+                                    int dup, enum MqttQosLevel qos)
+{
+    (void)arg; (void)pkt_id; (void)topic; (void)payload; (void)payloadsize; (void)dup; (void)qos;
+    return 0;
+}
+
+static int BenchFleet_HandleCmd(void *arg, uint16_t pkt_id, const char *cmdid,
+                                int64_t timestamp, const char *desc, const char *cmdarg,
+                                uint32_t cmdarg_len, int dup, enum MqttQosLevel qos)
+{
+    struct BenchFleetDevice *dev = (struct BenchFleetDevice*)arg;
+    struct BenchFleetClass *cls = dev->stats->classes + BENCH_FLEET_CMD_DELIVERY;
+    struct MqttBuffer buf[1];
+    long long issued;
+    uint16_t resp_id = 1;
+    int64_t start;
+    int err;
+    (void)pkt_id; (void)timestamp; (void)desc; (void)cmdarg; (void)cmdarg_len; (void)dup;
+
+    // commands injected by this program carry the time they were issued
+    if(1 == sscanf(cmdid, "fleet-%lld", &issued)) {
+        BenchFleet_AddSample(&cls->latency, Bench_NowNs() - (int64_t)issued);
+    }
+    ++cls->completed;
+
+    if(BenchFleet_Random(dev) % 100 >= dev->cfg->response_rate) {
+        return 0;
+    }
+
+    // Mqtt_PackCmdRetPkt sends QoS2 responses at QoS0
+    cls = dev->stats->classes + BENCH_FLEET_CMD_RESPONSE;
+    if(MQTT_QOS_LEVEL1 == qos) {
+        resp_id = BenchFleet_AllocSlot(dev, BENCH_FLEET_SLOT_RESPONSE);
+        if(0 == resp_id) {
+            ++dev->stats->throttled;
+            return 0;
+        }
+    }
+
+    start = Bench_NowNs();
+    MqttBuffer_Init(buf);
+    err = Mqtt_PackCmdRetPkt(buf, resp_id, cmdid, "ok", 2, qos, 1);
+    if(MQTTERR_NOERROR == err) {
+        err = MqttEngine_SendPkt(dev->conn, buf);
+    }
+    MqttBuffer_Destroy(buf);
+    BenchFleet_AddSample(&cls->cost, Bench_NowNs() - start);
+    ++cls->sent;
+
+    if(MQTTERR_NOERROR != err) {
+        ++dev->stats->errors;
+    }
+    return err;
+}
+
+static void BenchFleet_HandleClose(void *arg, struct MqttConnection *conn, int err)
+{
+    struct BenchFleetDevice *dev = (struct BenchFleetDevice*)arg;
+
+    MqttTimer_Stop(conn->engine->timers, &dev->timer);
+    dev->conn = NULL;
+    if(!dev->cfg->stopping) {
+        fprintf(stderr, "Device %s closed early, errcode is %d.\n", dev->id, err);
+        ++dev->stats->errors;
+    }
+}
+
+// runs on the broker thread, answers to injected commands are timed here
+static void BenchFleet_HandleBrokerPublish(void *arg, const char *client_id, const char *topic,
+                                           const char *payload, uint32_t size,
+                                           enum MqttQosLevel qos)
+{
+    struct BenchFleetClass *cls = ((struct BenchFleetStats*)arg)->classes + BENCH_FLEET_CMD_RESPONSE;
+    long long issued;
+    (void)client_id; (void)payload; (void)size; (void)qos;
+
+    if(1 == sscanf(topic, "$crsp/fleet-%lld", &issued)) {
+        BenchFleet_AddSample(&cls->latency, Bench_NowNs() - (int64_t)issued);
+        ++cls->completed;
+    }
+}
+
+// runs on the shard thread, spreads the first publish of each device over one interval
+static void BenchFleet_Start(void *arg, struct MqttEngine *engine)
+{
+    struct BenchFleetSlice *slice = (struct BenchFleetSlice*)arg;
+    uint32_t i;
+
+    for(i = slice->first; i < slice->count; i += slice->step) {
+        struct BenchFleetDevice *dev = slice->devices + i;
+
+        if(dev->conn && (dev->cfg->rate > 0)) {
+            MqttTimer_Start(engine->timers, &dev->timer,
+                            engine->now + BenchFleet_Random(dev) % dev->cfg->interval_ms);
+        }
+    }
+}
+
+static int BenchFleet_WaitConnected(struct BenchFleetConfig *cfg, uint64_t target,
+                                    int64_t timeout_ns)
+{
+    const int64_t deadline = Bench_NowNs() + timeout_ns;
+    struct timespec pause = {0, 200000};
+
+    while(__atomic_load_n(&cfg->connected, __ATOMIC_RELAXED) +
+          __atomic_load_n(&cfg->failed, __ATOMIC_RELAXED) < target) {
+        if(Bench_NowNs() > deadline) {
+            return -1;
+        }
+        nanosleep(&pause, NULL);
+    }
+
+    return 0;
+}
+
+static void BenchFleet_Report(struct BenchFleetClass *cls, const char *name, int type, int qos)
+{
+    char prefix[96];
+
+    if((0 == cls->sent) && (0 == cls->completed)) {
+        return;
+    }
+
+    if(type > 0) {
+        snprintf(prefix, sizeof(prefix), "\"class\":\"%s\",\"type\":%d,\"qos\":%d", name, type, qos);
+    }
+    else {
+        snprintf(prefix, sizeof(prefix), "\"class\":\"%s\"", name);
+    }
+
+    Bench_SortSamples(cls->latency.values, cls->latency.count);
+    Bench_SortSamples(cls->cost.values, cls->cost.count);
+    printf("{\"bench\":\"fleet\",%s,\"sent\":%lu,\"completed\":%lu,\"samples\":%u,"
+           "\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,"
+           "\"sdk_p50_ns\":%ld,\"sdk_p99_ns\":%ld}\n",
+           prefix, (unsigned long)cls->sent, (unsigned long)cls->completed, cls->latency.count,
+           Bench_Percentile(cls->latency.values, cls->latency.count, 50) / 1e3,
+           Bench_Percentile(cls->latency.values, cls->latency.count, 90) / 1e3,
+           Bench_Percentile(cls->latency.values, cls->latency.count, 99) / 1e3,
+           Bench_Percentile(cls->latency.values, cls->latency.count, 99.9) / 1e3,
+           Bench_Percentile(cls->latency.values, cls->latency.count, 100) / 1e3,
+           (long)Bench_Percentile(cls->cost.values, cls->cost.count, 50),
+           (long)Bench_Percentile(cls->cost.values, cls->cost.count, 99));
+}
+
+static uint32_t BenchFleet_ParseList(const char *str, uint32_t *values, uint32_t max)
+{
+    uint32_t count = 0;
+    char *end;
+
+    while(*str && (count < max)) {
+        values[count++] = (uint32_t)strtoul(str, &end, 10);
+        if(end == str) {
+            return 0;
+        }
+        str = (',' == *end) ? end + 1 : end;
+    }
+
+    return count;
+}
+
+static void BenchFleet_Usage(const char *name)
+{
+    printf("usage: %s [options]\n", name);
+    printf("  -H host            broker address (default: start the local stand-in broker)\n");
+    printf("  -P port            broker port (default 1883)\n");
+    printf("  -c devices         simulated devices (default 1000)\n");
+    printf("  -r rate            publishes per second per device (default 1)\n");
+    printf("  -d seconds         duration of the run (default 10)\n");
+    printf("  -y types           save-data types 1-7 to publish, such as 1,3,5 (default all)\n");
+    printf("  -q weights         weights of QoS 0,1,2 (default 40,40,20)\n");
+    printf("  -w window          unacknowledged publishes per device (default 16)\n");
+    printf("  -s bytes           payload size of type 2 (default 256)\n");
+    printf("  -C rate            commands per second over the fleet, local broker only (default 100)\n");
+    printf("  -R percent         commands answered with Mqtt_PackCmdRetPkt (default 100)\n");
+    printf("  -k qos             QoS of the commands (default 1)\n");
+    printf("  -t shards          shard threads (default 1)\n");
+}
+
+int main(int argc, char **argv)
+{
+    static const char *qos_names[3] = {"publish_qos0", "publish_qos1", "publish_qos2"};
+    struct BenchBroker broker[1];
+    struct MqttShardedEngine se[1];
+    struct BenchFleetConfig cfg;
+    struct BenchFleetDevice *devices;
+    struct BenchFleetSlice *slices;
+    struct BenchFleetStats *stats, total, broker_stats;
+    struct MqttBuffer buf[1];
+    const char *host = NULL;
+    unsigned short port = 1883;
+    uint32_t dev_count = 1000, shards = 1, duration = 10, cmd_rate = 100, fd_limit, i;
+    uint64_t commands = 0, published = 0;
+    struct timespec pause = {0, 1000000};
+    int64_t start, now, elapsed;
+    int err, opt;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.type_count = BenchFleet_ParseList("1,2,3,4,5,6,7", cfg.types, BENCH_FLEET_TYPES);
+    BenchFleet_ParseList("40,40,20", cfg.qos_weights, 3);
+    cfg.rate = 1;
+    cfg.window = 16;
+    cfg.payload_size = 256;
+    cfg.response_rate = 100;
+    cfg.cmd_qos = MQTT_QOS_LEVEL1;
+
+    while((opt = getopt(argc, argv, "hH:P:c:r:d:y:q:w:s:C:R:k:t:")) != -1) {
+        switch(opt) {
+        case 'H': host = optarg; break;
+        case 'P': port = (unsigned short)atoi(optarg); break;
+        case 'c': dev_count = (uint32_t)atoi(optarg); break;
+        case 'r': cfg.rate = atof(optarg); break;
+        case 'd': duration = (uint32_t)atoi(optarg); break;
+        case 'y': cfg.type_count = BenchFleet_ParseList(optarg, cfg.types, BENCH_FLEET_TYPES); break;
+        case 'q': memset(cfg.qos_weights, 0, sizeof(cfg.qos_weights));
+                  BenchFleet_ParseList(optarg, cfg.qos_weights, 3); break;
+        case 'w': cfg.window = (uint32_t)atoi(optarg); break;
+        case 's': cfg.payload_size = (uint32_t)atoi(optarg); break;
+        case 'C': cmd_rate = (uint32_t)atoi(optarg); break;
+        case 'R': cfg.response_rate = (uint32_t)atoi(optarg); break;
+        case 'k': cfg.cmd_qos = (enum MqttQosLevel)(atoi(optarg) % 3); break;
+        case 't': shards = (uint32_t)atoi(optarg); break;
+        default:
+            BenchFleet_Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    for(i = 0; i < cfg.type_count; ++i) {
+        if((cfg.types[i] < kTypeFullJson) || (cfg.types[i] > kTypeFloat)) {
+            cfg.type_count = 0;
+        }
+    }
+    cfg.qos_total = cfg.qos_weights[0] + cfg.qos_weights[1] + cfg.qos_weights[2];
+    if((0 == cfg.type_count) || (0 == cfg.qos_total) || (0 == dev_count) || (0 == shards)) {
+        BenchFleet_Usage(argv[0]);
+        return 1;
+    }
+
+    if(cfg.window > BENCH_FLEET_SLOTS) {
+        cfg.window = BENCH_FLEET_SLOTS;
+    }
+    cfg.interval_ms = cfg.rate > 0 ? (uint32_t)(1000 / cfg.rate) : 1000;
+    if(0 == cfg.interval_ms) {
+        cfg.interval_ms = 1;
+    }
+
+    // with the local broker every device needs a descriptor on both sides
+    fd_limit = Bench_RaiseFdLimit();
+    if((host ? 1 : 2) * dev_count + 64 > fd_limit) {
+        dev_count = (fd_limit - 64) / (host ? 1 : 2);
+        fprintf(stderr, "The descriptor limit is %u, using %u devices.\n", fd_limit, dev_count);
+    }
+
+    cfg.binary = (char*)malloc(cfg.payload_size + 1);
+    devices = (struct BenchFleetDevice*)calloc(dev_count, sizeof(*devices));
+    slices = (struct BenchFleetSlice*)calloc(shards, sizeof(*slices));
+    stats = (struct BenchFleetStats*)calloc(shards, sizeof(*stats));
+    if(!cfg.binary || !devices || !slices || !stats) {
+        fprintf(stderr, "Failed to allocate the devices.\n");
+        return 1;
+    }
+    memset(cfg.binary, 0x5A, cfg.payload_size);
+    memset(&broker_stats, 0, sizeof(broker_stats));
+    memset(&total, 0, sizeof(total));
+
+    if(!host) {
+        if(BenchBroker_Start(broker, 0) < 0) {
+            fprintf(stderr, "Failed to start the stand-in broker.\n");
+            return 1;
+        }
+        broker->handle_publish_arg = &broker_stats;
+        broker->handle_publish = BenchFleet_HandleBrokerPublish;
+        port = broker->port;
+    }
+
+    err = MqttShardedEngine_Init(se, shards, dev_count / shards + 1, 0);
+    if(MQTTERR_NOERROR != err) {
+        fprintf(stderr, "Failed to init the sharded engine, errcode is %d.\n", err);
+        return 1;
+    }
+
+    MqttBuffer_Init(buf);
+    for(i = 0; i < dev_count; ++i) {
+        struct BenchFleetDevice *dev = devices + i;
+        struct MqttShard *shard = MqttShardedEngine_GetShard(se, i);
+        struct MqttContext *ctx;
+
+        dev->cfg = &cfg;
+        dev->stats = stats + shard->index;
+        dev->rng = 2654435761u * (i + 1);
+        snprintf(dev->id, sizeof(dev->id), "fleet%u", i);
+        MqttTimer_Init(&dev->timer, BenchFleet_HandleTimer, dev);
+
+        err = MqttEngine_Connect(shard->engine, host ? host : "127.0.0.1", port, 4096, &dev->conn);
+        if(MQTTERR_NOERROR != err) {
+            fprintf(stderr, "Failed to connect device %u, errcode is %d.\n", i, err);
+            ++cfg.failed;
+            continue;
+        }
+
+        ctx = dev->conn->ctx;
+        ctx->handle_conn_ack_arg = dev;
+        ctx->handle_conn_ack = BenchFleet_HandleConnAck;
+        ctx->handle_pub_ack_arg = dev;
+        ctx->handle_pub_ack = BenchFleet_HandlePubAck;
+        ctx->handle_pub_rec_arg = dev;
+        ctx->handle_pub_rec = BenchFleet_HandlePubRec;
+        ctx->handle_pub_rel_arg = dev;
+        ctx->handle_pub_rel = BenchFleet_HandlePubRel;
+        ctx->handle_pub_comp_arg = dev;
+        ctx->handle_pub_comp = BenchFleet_HandlePubComp;
+        ctx->handle_publish_arg = dev;
+        ctx->handle_publish = BenchFleet_HandlePublish;
+        ctx->handle_cmd_arg = dev;
+        ctx->handle_cmd = BenchFleet_HandleCmd;
+        dev->conn->handle_close_arg = dev;
+        dev->conn->handle_close = BenchFleet_HandleClose;
+
+        err = Mqtt_PackConnectPkt(buf, 0, dev->id, 1, NULL, NULL, 0, MQTT_QOS_LEVEL0, 0,
+                                  "fleet", "fleet", 5);
+        if(MQTTERR_NOERROR == err) {
+            err = MqttEngine_SendPkt(dev->conn, buf);
+        }
+        MqttBuffer_Reset(buf);
+    }
+    MqttBuffer_Destroy(buf);
+
+    MqttShardedEngine_Start(se);
+    if(BenchFleet_WaitConnected(&cfg, dev_count, 60000000000LL) < 0) {
+        fprintf(stderr, "Timed out waiting for CONNACK (%lu of %u).\n",
+                (unsigned long)cfg.connected, dev_count);
+    }
+
+    for(i = 0; i < shards; ++i) {
+        slices[i].devices = devices;
+        slices[i].first = i;
+        slices[i].step = shards;
+        slices[i].count = dev_count;
+        MqttShard_Post(se->shards + i, BenchFleet_Start, slices + i);
+    }
+
+    // commands go to random devices at the requested fleet-wide rate
+    start = Bench_NowNs();
+    now = start;
+    while(now - start < (int64_t)duration * 1000000000LL) {
+        const uint64_t due = host ? 0 : (uint64_t)((now - start) / 1e9 * cmd_rate);
+
+        while(commands < due) {
+            char cmdid[48];
+
+            snprintf(cmdid, sizeof(cmdid), "fleet-%lld", (long long)Bench_NowNs());
+            if(BenchBroker_SendCmd(broker, devices[rand() % dev_count].id, cmdid,
+                                   "{\"interval\":60}", 15, cfg.cmd_qos) > 0) {
+                ++broker_stats.classes[BENCH_FLEET_CMD_DELIVERY].sent;
+            }
+            ++commands;
+        }
+
+        nanosleep(&pause, NULL);
+        now = Bench_NowNs();
+    }
+    elapsed = now - start;
+
+    // let the last acknowledgements and responses arrive
+    cfg.stopping = 1;
+    pause.tv_nsec = 500000000;
+    nanosleep(&pause, NULL);
+
+    MqttShardedEngine_Destroy(se);
+    if(!host) {
+        BenchBroker_Stop(broker);
+    }
+
+    for(i = 0; i < shards; ++i) {
+        BenchFleet_MergeStats(&total, stats + i);
+    }
+    BenchFleet_MergeStats(&total, &broker_stats);
+
+    for(i = 0; i < BENCH_FLEET_TYPES * 3; ++i) {
+        BenchFleet_Report(total.classes + i, qos_names[i % 3], (int)(i / 3 + 1), (int)(i % 3));
+        published += total.classes[i].sent;
+    }
+    BenchFleet_Report(total.classes + BENCH_FLEET_CMD_DELIVERY, "command_delivery", 0, 0);
+    BenchFleet_Report(total.classes + BENCH_FLEET_CMD_RESPONSE, "command_response", 0, 0);
+
+    printf("{\"bench\":\"fleet\",\"class\":\"total\",\"broker\":\"%s\",\"devices\":%u,"
+           "\"connected\":%lu,\"failed\":%lu,\"shards\":%u,\"duration_s\":%.3f,"
+           "\"published\":%lu,\"msgs_per_sec\":%.0f,\"throttled\":%lu,\"errors\":%lu,"
+           "\"commands\":%lu}\n",
+           host ? host : "local", dev_count, (unsigned long)cfg.connected,
+           (unsigned long)cfg.failed, shards, elapsed / 1e9, (unsigned long)published,
+           published / (elapsed / 1e9), (unsigned long)total.throttled,
+           (unsigned long)total.errors, (unsigned long)commands);
+    fflush(stdout);
+
+    for(i = 0; i < BENCH_FLEET_CLASSES; ++i) {
+        free(total.classes[i].latency.values);
+        free(total.classes[i].cost.values);
+    }
+    free(cfg.binary);
+    free(devices);
+    free(slices);
+    free(stats);
+    return 0;
+}
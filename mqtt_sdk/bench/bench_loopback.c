@@ -0,0 +1,452 @@
+/*
+ * End-to-end benchmark against the in-process stand-in broker: a publisher
+ * and a subscriber built on the plain SDK context talk to the broker over
+ * TCP loopback or a socketpair. The publish test measures throughput and
+ * publish-to-delivery latency, the command test measures the round trip of
+ * $creq commands answered with Mqtt_PackCmdRetPkt.
+ */
+#include "mqtt/mqtt.h"
+#include "bench_broker.h"
+#include "bench_util.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct BenchLoopClient {
+    int fd;
+    struct MqttContext ctx[1];
+    const char *id;
+    int connected;
+    int subscribed;
+    uint64_t acked;
+
+    int64_t *latencies;       /* 订阅者记录的发布到收到的延迟(纳秒) */
+    uint32_t received;
+
+    char cmdid[64];           /* 设备收到的最近一个命令 */
+    uint64_t commands;
+};
+
+struct BenchLoopCmd {
+    volatile uint64_t responses;
+    volatile int64_t last_response;
+};
+
+static int BenchLoop_Read(void *arg, void *buf, uint32_t count)
+{
+    return (int)recv(((struct BenchLoopClient*)arg)->fd, buf, count, 0);
+}
+
+static int BenchLoop_Writev(void *arg, const struct iovec *iov, int iovcnt)
+{
+    return (int)writev(((struct BenchLoopClient*)arg)->fd, iov, iovcnt);
+}
+
+static int BenchLoop_HandleConnAck(void *arg, char flags, char ret_code)
+{
+    (void)flags;
+    ((struct BenchLoopClient*)arg)->connected = (MQTT_CONNACK_ACCEPTED == ret_code) ? 1 : -1;
+    return 0;
+}
+
+static int BenchLoop_HandleSubAck(void *arg, uint16_t pkt_id, const char *codes, uint32_t count)
+{
+    (void)pkt_id;
+    ((struct BenchLoopClient*)arg)->subscribed =
+        ((1 == count) && !(codes[0] & 0x80)) ? 1 : -1;
+    return 0;
+}
+
+static int BenchLoop_HandlePublish(void *arg, uint16_t pkt_id, const char *topic,
+                                   const char *payload, uint32_t payloadsize,
+                                   int dup, enum MqttQosLevel qos)
+{
+    struct BenchLoopClient *client = (struct BenchLoopClient*)arg;
+    int64_t sent;
+    (void)pkt_id; (void)topic; (void)dup; (void)qos;
+
+    if(payloadsize >= sizeof(sent)) {
+        memcpy(&sent, payload, sizeof(sent));
+        client->latencies[client->received] = Bench_NowNs() - sent;
+    }
+    ++client->received;
+    return 0;
+}
+
+static int BenchLoop_HandleAck(void *arg, uint16_t pkt_id)
+{
+    (void)pkt_id;
+    ++((struct BenchLoopClient*)arg)->acked;
+    return 0;
+}
+
+static int BenchLoop_HandleCmd(void *arg, uint16_t pkt_id, const char *cmdid,
+                               int64_t timestamp, const char *desc, const char *cmdarg,
+                               uint32_t cmdarg_len, int dup, enum MqttQosLevel qos)
+{
+    struct BenchLoopClient *client = (struct BenchLoopClient*)arg;
+    (void)pkt_id; (void)timestamp; (void)desc; (void)cmdarg; (void)cmdarg_len; (void)dup; (void)qos;
+
+    snprintf(client->cmdid, sizeof(client->cmdid), "%s", cmdid);
+    ++client->commands;
+    return 0;
+}
+
+static void BenchLoop_HandleBrokerPublish(void *arg, const char *client_id, const char *topic,
+                                          const char *payload, uint32_t size,
+                                          enum MqttQosLevel qos)
+{
+    struct BenchLoopCmd *cmd = (struct BenchLoopCmd*)arg;
+    (void)client_id; (void)payload; (void)size; (void)qos;
+
+    if(0 == strncmp(topic, "$crsp/", 6)) {
+        __atomic_store_n(&cmd->last_response, Bench_NowNs(), __ATOMIC_RELAXED);
+        __atomic_add_fetch(&cmd->responses, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static int BenchLoop_Open(struct BenchBroker *broker, int socketpair_mode)
+{
+    struct sockaddr_in addr;
+    int fds[2], on = 1;
+
+    if(socketpair_mode) {
+        if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+            return -1;
+        }
+        if(BenchBroker_Attach(broker, fds[1]) < 0) {
+            close(fds[0]);
+            return -1;
+        }
+        return fds[0];
+    }
+
+    fds[0] = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fds[0] < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(broker->port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fds[0], (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fds[0]);
+        return -1;
+    }
+
+    setsockopt(fds[0], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fds[0];
+}
+
+// feeds every client whose socket is readable to Mqtt_RecvPkt once
+static int BenchLoop_Poll(struct BenchLoopClient **clients, int count, int timeout_ms)
+{
+    struct pollfd pfds[2];
+    int i, ready;
+
+    for(i = 0; i < count; ++i) {
+        pfds[i].fd = clients[i]->fd;
+        pfds[i].events = POLLIN;
+    }
+
+    ready = poll(pfds, count, timeout_ms);
+    for(i = 0; (ready > 0) && (i < count); ++i) {
+        if(pfds[i].revents && (MQTTERR_NOERROR != Mqtt_RecvPkt(clients[i]->ctx))) {
+            return -1;
+        }
+    }
+
+    return ready < 0 ? -1 : 0;
+}
+
+static int BenchLoop_Send(struct BenchLoopClient *client, struct MqttBuffer *buf, int err)
+{
+    if((MQTTERR_NOERROR == err) &&
+       (Mqtt_SendPkt(client->ctx, buf, 0) != (int)buf->buffered_bytes)) {
+        err = MQTTERR_IO;
+    }
+
+    MqttBuffer_Reset(buf);
+    return err;
+}
+
+static int BenchLoop_Setup(struct BenchBroker *broker, struct BenchLoopClient *client,
+                           const char *id, int socketpair_mode, uint32_t messages)
+{
+    struct MqttBuffer buf[1];
+    struct MqttContext *ctx = client->ctx;
+    int err;
+
+    memset(client, 0, sizeof(*client));
+    client->id = id;
+    client->fd = BenchLoop_Open(broker, socketpair_mode);
+    if(client->fd < 0) {
+        return -1;
+    }
+
+    if(MQTTERR_NOERROR != Mqtt_InitContext(ctx, 1 << 16)) {
+        close(client->fd);
+        return -1;
+    }
+
+    client->latencies = (int64_t*)calloc(messages + 1, sizeof(int64_t));
+
+    ctx->read_func_arg = client;
+    ctx->read_func = BenchLoop_Read;
+    ctx->writev_func_arg = client;
+    ctx->writev_func = BenchLoop_Writev;
+    ctx->handle_conn_ack_arg = client;
+    ctx->handle_conn_ack = BenchLoop_HandleConnAck;
+    ctx->handle_sub_ack_arg = client;
+    ctx->handle_sub_ack = BenchLoop_HandleSubAck;
+    ctx->handle_publish_arg = client;
+    ctx->handle_publish = BenchLoop_HandlePublish;
+    ctx->handle_cmd_arg = client;
+    ctx->handle_cmd = BenchLoop_HandleCmd;
+    ctx->handle_pub_ack_arg = client;
+    ctx->handle_pub_ack = BenchLoop_HandleAck;
+    ctx->handle_pub_rec_arg = client;
+    ctx->handle_pub_rec = BenchLoop_HandleAck;
+    ctx->handle_pub_rel_arg = client;
+    ctx->handle_pub_rel = BenchLoop_HandleAck;
+    ctx->handle_pub_comp_arg = client;
+    ctx->handle_pub_comp = BenchLoop_HandleAck;
+
+    MqttBuffer_Init(buf);
+    err = Mqtt_PackConnectPkt(buf, 0, id, 1, NULL, NULL, 0, MQTT_QOS_LEVEL0, 0,
+                              "bench", "bench", 5);
+    err = BenchLoop_Send(client, buf, err);
+    MqttBuffer_Destroy(buf);
+
+    while((MQTTERR_NOERROR == err) && (0 == client->connected)) {
+        if(BenchLoop_Poll(&client, 1, 1000) < 0) {
+            return -1;
+        }
+    }
+
+    return ((MQTTERR_NOERROR == err) && (1 == client->connected)) ? 0 : -1;
+}
+
+static void BenchLoop_Teardown(struct BenchLoopClient *client)
+{
+    Mqtt_DestroyContext(client->ctx);
+    close(client->fd);
+    free(client->latencies);
+}
+
+static int BenchLoop_PublishTest(struct BenchLoopClient *pub, struct BenchLoopClient *sub,
+                                 const char *transport, uint32_t messages, uint32_t window,
+                                 uint32_t payload_bytes, enum MqttQosLevel qos)
+{
+    struct MqttBuffer buf[1];
+    const char *topics[1] = {"bench/e2e/#"};
+    char *payload;
+    uint32_t sent = 0;
+    int64_t start, elapsed, now;
+    int err;
+
+    MqttBuffer_Init(buf);
+    err = Mqtt_PackSubscribePkt(buf, 1, qos, topics, 1);
+    err = BenchLoop_Send(sub, buf, err);
+    while((MQTTERR_NOERROR == err) && (0 == sub->subscribed)) {
+        if(BenchLoop_Poll(&sub, 1, 1000) < 0) {
+            err = MQTTERR_IO;
+        }
+    }
+    if((MQTTERR_NOERROR != err) || (1 != sub->subscribed)) {
+        MqttBuffer_Destroy(buf);
+        return -1;
+    }
+
+    payload = (char*)calloc(1, payload_bytes);
+    start = Bench_NowNs();
+    while(sub->received < messages) {
+        struct BenchLoopClient *both[2];
+
+        while((sent < messages) && (sent - sub->received < window)) {
+            now = Bench_NowNs();
+            memcpy(payload, &now, sizeof(now));
+            err = Mqtt_PackPublishPkt(buf, (uint16_t)(sent % 65535 + 1), "bench/e2e/telemetry",
+                                      payload, payload_bytes, qos, 0, 0);
+            if(MQTTERR_NOERROR != BenchLoop_Send(pub, buf, err)) {
+                break;
+            }
+            ++sent;
+        }
+
+        both[0] = pub;
+        both[1] = sub;
+        if(BenchLoop_Poll(both, 2, 1000) < 0) {
+            break;
+        }
+    }
+    elapsed = Bench_NowNs() - start;
+    MqttBuffer_Destroy(buf);
+    free(payload);
+
+    Bench_SortSamples(sub->latencies, sub->received);
+    printf("{\"bench\":\"loopback\",\"transport\":\"%s\",\"test\":\"publish\",\"qos\":%d,"
+           "\"payload_bytes\":%u,\"window\":%u,\"messages\":%u,\"msgs_per_sec\":%.0f,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+           transport, qos, payload_bytes, window, sub->received,
+           sub->received * 1e9 / elapsed,
+           Bench_Percentile(sub->latencies, sub->received, 50) / 1e3,
+           Bench_Percentile(sub->latencies, sub->received, 99) / 1e3,
+           Bench_Percentile(sub->latencies, sub->received, 99.9) / 1e3,
+           Bench_Percentile(sub->latencies, sub->received, 100) / 1e3);
+    fflush(stdout);
+
+    return sub->received == messages ? 0 : -1;
+}
+
+static int BenchLoop_CommandTest(struct BenchBroker *broker, struct BenchLoopClient *device,
+                                 struct BenchLoopCmd *cmd, const char *transport,
+                                 uint32_t commands, enum MqttQosLevel qos)
+{
+    struct MqttBuffer buf[1];
+    int64_t *rtts = (int64_t*)calloc(commands + 1, sizeof(int64_t));
+    char cmdid[64];
+    uint32_t i;
+    int err = MQTTERR_NOERROR;
+
+    MqttBuffer_Init(buf);
+    for(i = 0; (i < commands) && (MQTTERR_NOERROR == err); ++i) {
+        const uint64_t expected = device->commands + 1;
+        const uint64_t responses = cmd->responses;
+        const int64_t start = Bench_NowNs();
+
+        snprintf(cmdid, sizeof(cmdid), "6e3b1c2a-%08u", i);
+        if(1 != BenchBroker_SendCmd(broker, device->id, cmdid, "reboot", 6, qos)) {
+            err = MQTTERR_IO;
+            break;
+        }
+
+        while(device->commands < expected) {
+            if(BenchLoop_Poll(&device, 1, 1000) < 0) {
+                err = MQTTERR_IO;
+                break;
+            }
+        }
+        if(MQTTERR_NOERROR != err) {
+            break;
+        }
+
+        err = Mqtt_PackCmdRetPkt(buf, (uint16_t)(i % 65535 + 1), device->cmdid, "ok", 2, qos, 0);
+        err = BenchLoop_Send(device, buf, err);
+
+        // the answer is seen by the broker thread
+        while((MQTTERR_NOERROR == err) &&
+              (__atomic_load_n(&cmd->responses, __ATOMIC_ACQUIRE) == responses)) {
+            if((MQTT_QOS_LEVEL0 != qos) && (BenchLoop_Poll(&device, 1, 0) < 0)) {
+                err = MQTTERR_IO;
+            }
+        }
+        rtts[i] = cmd->last_response - start;
+    }
+    MqttBuffer_Destroy(buf);
+
+    Bench_SortSamples(rtts, i);
+    printf("{\"bench\":\"loopback\",\"transport\":\"%s\",\"test\":\"command\",\"qos\":%d,"
+           "\"commands\":%u,\"rtt_p50_us\":%.1f,\"rtt_p99_us\":%.1f,\"rtt_max_us\":%.1f}\n",
+           transport, qos, i, Bench_Percentile(rtts, i, 50) / 1e3,
+           Bench_Percentile(rtts, i, 99) / 1e3, Bench_Percentile(rtts, i, 100) / 1e3);
+    fflush(stdout);
+
+    free(rtts);
+    return MQTTERR_NOERROR == err ? 0 : -1;
+}
+
+static void BenchLoop_Usage(const char *name)
+{
+    printf("usage: %s [options]\n", name);
+    printf("  -m messages        messages of the publish test (default 200000)\n");
+    printf("  -w window          published but not yet delivered messages (default 64)\n");
+    printf("  -s bytes           payload size, at least 8 (default 64)\n");
+    printf("  -q qos             0, 1 or 2 (default 1)\n");
+    printf("  -c commands        commands of the command test (default 10000)\n");
+    printf("  -x                 connect over a socketpair instead of TCP loopback\n");
+    printf("  -l port            only run the broker on the port until stdin is closed\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct BenchBroker broker[1];
+    struct BenchLoopClient pub, sub;
+    struct BenchLoopCmd cmd;
+    uint32_t messages = 200000, window = 64, payload_bytes = 64, commands = 10000;
+    enum MqttQosLevel qos = MQTT_QOS_LEVEL1;
+    const char *transport;
+    int socketpair_mode = 0, listen_port = -1, failed = 0;
+    int opt;
+
+    while((opt = getopt(argc, argv, "hm:w:s:q:c:xl:")) != -1) {
+        switch(opt) {
+        case 'm': messages = (uint32_t)atoi(optarg); break;
+        case 'w': window = (uint32_t)atoi(optarg); break;
+        case 's': payload_bytes = (uint32_t)atoi(optarg); break;
+        case 'q': qos = (enum MqttQosLevel)(atoi(optarg) % 3); break;
+        case 'c': commands = (uint32_t)atoi(optarg); break;
+        case 'x': socketpair_mode = 1; break;
+        case 'l': listen_port = atoi(optarg); break;
+        default:
+            BenchLoop_Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if(payload_bytes < sizeof(int64_t)) {
+        payload_bytes = sizeof(int64_t);
+    }
+
+    if(BenchBroker_Start(broker, listen_port > 0 ? (unsigned short)listen_port : 0) < 0) {
+        fprintf(stderr, "Failed to start the stand-in broker.\n");
+        return 1;
+    }
+
+    if(listen_port >= 0) {
+        printf("{\"bench\":\"loopback\",\"listen\":%u}\n", broker->port);
+        fflush(stdout);
+        while(EOF != getchar()) {
+        }
+        BenchBroker_Stop(broker);
+        return 0;
+    }
+
+    memset(&cmd, 0, sizeof(cmd));
+    broker->handle_publish_arg = &cmd;
+    broker->handle_publish = BenchLoop_HandleBrokerPublish;
+
+    transport = socketpair_mode ? "socketpair" : "tcp";
+    if((BenchLoop_Setup(broker, &pub, "benchpub", socketpair_mode, 0) < 0) ||
+       (BenchLoop_Setup(broker, &sub, "benchsub", socketpair_mode, messages) < 0)) {
+        fprintf(stderr, "Failed to connect to the stand-in broker.\n");
+        BenchBroker_Stop(broker);
+        return 1;
+    }
+
+    if(BenchLoop_PublishTest(&pub, &sub, transport, messages, window, payload_bytes, qos) < 0) {
+        fprintf(stderr, "The publish test did not complete.\n");
+        failed = 1;
+    }
+
+    if(BenchLoop_CommandTest(broker, &pub, &cmd, transport, commands, qos) < 0) {
+        fprintf(stderr, "The command test did not complete.\n");
+        failed = 1;
+    }
+
+    BenchLoop_Teardown(&pub);
+    BenchLoop_Teardown(&sub);
+    BenchBroker_Stop(broker);
+    return failed;
+}
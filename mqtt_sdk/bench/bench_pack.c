@@ -0,0 +1,492 @@
+/*
+ * Microbenchmark of the packet builders: every case packs into a
+ * MqttBuffer and resets it, repeated until the time budget is used up.
+ * One JSON line is printed per case with the cost of a single operation
+ * and the heap allocations it made, counted by bench_alloc.c.
+ * With -a every case is packed once and the MqttBuffer statistics of
+ * the packet are printed instead, to tune the chunk size per workload.
+ * With -z every case is packed into a fixed storage buffer while the heap
+ * is forbidden, once with enough storage and once with one byte too few.
+ */
+#include "mqtt/mqtt.h"
+#include "bench_util.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum BenchPackKind {
+    BENCH_PACK_PINGREQ,
+    BENCH_PACK_DISCONNECT,
+    BENCH_PACK_CONNACK,
+    BENCH_PACK_SUBACK,
+    BENCH_PACK_UNSUBACK,
+    BENCH_PACK_PINGRESP,
+    BENCH_PACK_UNSUBSCRIBE,
+    BENCH_PACK_CMDRET,
+    BENCH_PACK_CONNECT,
+    BENCH_PACK_PUBLISH,
+    BENCH_PACK_PUBLISH_SHARED,
+    BENCH_PACK_SUBSCRIBE,
+    BENCH_PACK_DP_NULL,
+    BENCH_PACK_DP_INT,
+    BENCH_PACK_DP_DOUBLE,
+    BENCH_PACK_DP_STRING,
+    BENCH_PACK_DP_OBJECT,
+    BENCH_PACK_DP_SUBVALUE_INT,
+    BENCH_PACK_DP_SUBVALUE_DOUBLE,
+    BENCH_PACK_DP_SUBVALUE_STRING,
+    BENCH_PACK_DP_SUBOBJECT,
+    BENCH_PACK_DP_BY_STRING,
+    BENCH_PACK_DP_BY_BINARY
+};
+
+struct BenchPackCase {
+    const char *func;
+    enum BenchPackKind kind;
+    uint32_t payload_bytes;
+    int own;     /* publish: own, subscribe: topics, by string: type */
+};
+
+// the append cases add this many items to one data point packet per iteration
+#define BENCH_PACK_DP_ITEMS 32
+
+// the payload of the shared publish cases, created once per case by main
+static struct MqttSharedPayload *bench_pack_shared;
+
+static const char *bench_pack_topics[] = {
+    "device/1/cmd", "device/1/cfg", "device/1/ota", "device/1/log",
+    "fleet/cmd", "fleet/cfg", "fleet/ota", "fleet/alarm"
+};
+
+static int BenchPack_AppendDP(struct MqttBuffer *buf, enum BenchPackKind kind, uint32_t i)
+{
+    switch(kind) {
+    case BENCH_PACK_DP_NULL:
+        return Mqtt_AppendDPNull(buf, "switch");
+    case BENCH_PACK_DP_INT:
+        return Mqtt_AppendDPInt(buf, "temperature", 0, (int)i);
+    case BENCH_PACK_DP_DOUBLE:
+        return Mqtt_AppendDPDouble(buf, "humidity", 0, i * 0.25);
+    case BENCH_PACK_DP_STRING:
+        return Mqtt_AppendDPString(buf, "status", 0, "running normally");
+    case BENCH_PACK_DP_OBJECT:
+        if(MQTTERR_NOERROR != Mqtt_AppendDPStartObject(buf, "location", 0)) {
+            return MQTTERR_INTERNAL;
+        }
+        return Mqtt_AppendDPFinishObject(buf);
+    case BENCH_PACK_DP_SUBVALUE_INT:
+        return Mqtt_AppendDPSubvalueInt(buf, "speed", (int)i);
+    case BENCH_PACK_DP_SUBVALUE_DOUBLE:
+        return Mqtt_AppendDPSubvalueDouble(buf, "lon", i * 0.25);
+    case BENCH_PACK_DP_SUBVALUE_STRING:
+        return Mqtt_AppendDPSubvalueString(buf, "city", "hangzhou");
+    case BENCH_PACK_DP_SUBOBJECT:
+        if(MQTTERR_NOERROR != Mqtt_AppendDPStartSubobject(buf, "gps")) {
+            return MQTTERR_INTERNAL;
+        }
+        return Mqtt_AppendDPFinishSubobject(buf);
+    default:
+        return MQTTERR_INVALID_PARAMETER;
+    }
+}
+
+// one data point packet holding BENCH_PACK_DP_ITEMS items of the measured kind
+static int BenchPack_DataPoints(struct MqttBuffer *buf, enum BenchPackKind kind)
+{
+    const int in_object = (kind >= BENCH_PACK_DP_SUBVALUE_INT) && (kind <= BENCH_PACK_DP_SUBOBJECT);
+    uint32_t i;
+    int err;
+
+    err = Mqtt_PackDataPointStart(buf, 1, MQTT_QOS_LEVEL1, 0, 1);
+    if(in_object && (MQTTERR_NOERROR == err)) {
+        err = Mqtt_AppendDPStartObject(buf, "vehicle", 0);
+    }
+
+    for(i = 0; (i < BENCH_PACK_DP_ITEMS) && (MQTTERR_NOERROR == err); ++i) {
+        err = BenchPack_AppendDP(buf, kind, i);
+    }
+
+    if(in_object && (MQTTERR_NOERROR == err)) {
+        err = Mqtt_AppendDPFinishObject(buf);
+    }
+
+    return MQTTERR_NOERROR == err ? Mqtt_PackDataPointFinish(buf) : err;
+}
+
+static int BenchPack_Once(const struct BenchPackCase *bc, struct MqttBuffer *buf,
+                          const char *payload)
+{
+    switch(bc->kind) {
+    case BENCH_PACK_PINGREQ:
+        return Mqtt_PackPingReqPkt(buf);
+    case BENCH_PACK_DISCONNECT:
+        return Mqtt_PackDisconnectPkt(buf);
+    case BENCH_PACK_CONNACK:
+        return Mqtt_PackConnAckPkt(buf, 0, 0);
+    case BENCH_PACK_SUBACK:
+        return Mqtt_PackSubAckPkt(buf, 1, "\x01\x01\x00\x02", 4);
+    case BENCH_PACK_UNSUBACK:
+        return Mqtt_PackUnsubAckPkt(buf, 1);
+    case BENCH_PACK_PINGRESP:
+        return Mqtt_PackPingRespPkt(buf);
+    case BENCH_PACK_UNSUBSCRIBE:
+        return Mqtt_PackUnsubscribePkt(buf, 1, bench_pack_topics, bc->own);
+    case BENCH_PACK_CMDRET:
+        return Mqtt_PackCmdRetPkt(buf, 1, "0f9c2ea6-6f3c-4a5b-9d2e-4c1b7a3e8d01", payload,
+                                  bc->payload_bytes, MQTT_QOS_LEVEL1, 1);
+    case BENCH_PACK_CONNECT:
+        return Mqtt_PackConnectPkt(buf, 120, "benchdevice0001", 1, "device/0001/will",
+                                   "offline", 7, MQTT_QOS_LEVEL1, 0, "bench-product",
+                                   "bench-password", 14);
+    case BENCH_PACK_PUBLISH:
+        return Mqtt_PackPublishPkt(buf, 1, "device/0001/telemetry", payload,
+                                   bc->payload_bytes, MQTT_QOS_LEVEL1, 0, bc->own);
+    case BENCH_PACK_PUBLISH_SHARED:
+        return Mqtt_PackPublishSharedPkt(buf, 1, "device/0001/telemetry", bench_pack_shared,
+                                         MQTT_QOS_LEVEL1, 0);
+    case BENCH_PACK_SUBSCRIBE:
+        return Mqtt_PackSubscribePkt(buf, 1, MQTT_QOS_LEVEL1, bench_pack_topics, bc->own);
+    case BENCH_PACK_DP_BY_STRING:
+        return Mqtt_PackDataPointByString(buf, 1, 0, bc->own, payload, bc->payload_bytes,
+                                          MQTT_QOS_LEVEL1, 0, 1);
+    case BENCH_PACK_DP_BY_BINARY:
+        return Mqtt_PackDataPointByBinary(buf, 1, "image", "camera snapshot", 0, payload,
+                                          bc->payload_bytes, MQTT_QOS_LEVEL1, 0, 1);
+    default:
+        return BenchPack_DataPoints(buf, bc->kind);
+    }
+}
+
+static const char *BenchPack_Variant(const struct BenchPackCase *bc, char *variant_buf,
+                                     size_t size)
+{
+    if(bc->kind >= BENCH_PACK_DP_NULL && bc->kind <= BENCH_PACK_DP_SUBOBJECT) {
+        snprintf(variant_buf, size, "items=%d", BENCH_PACK_DP_ITEMS);
+        return variant_buf;
+    }
+    else if(BENCH_PACK_PUBLISH == bc->kind) {
+        return bc->own ? "own=1" : "own=0";
+    }
+    else if((BENCH_PACK_SUBSCRIBE == bc->kind) || (BENCH_PACK_UNSUBSCRIBE == bc->kind)) {
+        snprintf(variant_buf, size, "topics=%d", bc->own);
+        return variant_buf;
+    }
+    else if(BENCH_PACK_DP_BY_STRING == bc->kind) {
+        snprintf(variant_buf, size, "type=%d", bc->own);
+        return variant_buf;
+    }
+
+    return "";
+}
+
+// packs the case into fixed storage with the heap forbidden, then again with too little storage
+static int BenchPack_HeapFree(const struct BenchPackCase *bc, const char *payload,
+                              char *storage, uint32_t storage_size)
+{
+    struct MqttBuffer buf[1];
+    uint64_t refused;
+    uint32_t used;
+    int err, short_err;
+    char variant_buf[32];
+
+    // libc initializes some state lazily (time zones, locales), let that happen first
+    MqttBuffer_Init(buf);
+    BenchPack_Once(bc, buf, payload);
+    MqttBuffer_Destroy(buf);
+
+    refused = Bench_RefusedAllocs();
+    Bench_ForbidAlloc(1);
+    MqttBuffer_InitFixed(buf, storage, storage_size);
+    err = BenchPack_Once(bc, buf, payload);
+    used = (uint32_t)(buf->first_available - storage);
+    MqttBuffer_Destroy(buf);
+
+    MqttBuffer_InitFixed(buf, storage, used - 1);
+    short_err = BenchPack_Once(bc, buf, payload);
+    MqttBuffer_Destroy(buf);
+    Bench_ForbidAlloc(0);
+    refused = Bench_RefusedAllocs() - refused;
+
+    printf("{\"bench\":\"pack_heap_free\",\"func\":\"%s\",\"variant\":\"%s\","
+           "\"payload_bytes\":%u,\"storage_used\":%u,\"err\":%d,\"short_storage_err\":%d,"
+           "\"refused_allocs\":%lu}\n",
+           bc->func, BenchPack_Variant(bc, variant_buf, sizeof(variant_buf)), bc->payload_bytes,
+           used, err, short_err, (unsigned long)refused);
+    fflush(stdout);
+
+    if((MQTTERR_NOERROR != err) || (MQTTERR_OUTOFMEMORY != short_err) || refused) {
+        fprintf(stderr, "%s is not heap free.\n", bc->func);
+        return -1;
+    }
+
+    return 0;
+}
+
+// packs the case once and prints how well the chunks of the buffer were used
+static int BenchPack_Report(const struct BenchPackCase *bc, const char *payload,
+                            const struct MqttBufferPolicy *policy)
+{
+    struct MqttBuffer buf[1];
+    struct MqttBufferStats stats, global;
+    uint32_t packet_bytes;
+    char variant_buf[32];
+
+    MqttBuffer_Init(buf);
+    MqttBuffer_SetPolicy(buf, policy);
+    MqttBuffer_ResetGlobalStats();
+    if(MQTTERR_NOERROR != BenchPack_Once(bc, buf, payload)) {
+        fprintf(stderr, "%s failed with payload of %u bytes.\n", bc->func, bc->payload_bytes);
+        MqttBuffer_Destroy(buf);
+        return -1;
+    }
+
+    MqttBuffer_GetStats(buf, &stats);
+    packet_bytes = buf->buffered_bytes;
+    MqttBuffer_Destroy(buf);
+    // the peak includes the temporary buffers some packers use internally
+    MqttBuffer_GetGlobalStats(&global);
+
+    printf("{\"bench\":\"pack_alloc\",\"func\":\"%s\",\"variant\":\"%s\",\"payload_bytes\":%u,"
+           "\"packet_bytes\":%u,\"requested_bytes\":%lu,\"extents\":%lu,"
+           "\"allocated_bytes\":%lu,\"chunks\":%lu,\"fragmentation\":%.3f,"
+           "\"peak_bytes\":%lu}\n",
+           bc->func, BenchPack_Variant(bc, variant_buf, sizeof(variant_buf)),
+           bc->payload_bytes, packet_bytes, (unsigned long)stats.requested_bytes,
+           (unsigned long)stats.extents, (unsigned long)stats.allocated_bytes,
+           (unsigned long)stats.chunks, stats.fragmentation, (unsigned long)global.peak_bytes);
+    fflush(stdout);
+    return 0;
+}
+
+static int BenchPack_Run(const struct BenchPackCase *bc, const char *payload,
+                         const struct MqttBufferPolicy *policy, int64_t budget_ns)
+{
+    struct MqttBuffer buf[1];
+    uint64_t iterations = 0, batch = 1, allocs, alloc_bytes, ops, i;
+    int64_t start, elapsed;
+    char variant_buf[32];
+
+    MqttBuffer_Init(buf);
+    MqttBuffer_SetPolicy(buf, policy);
+
+    // warm up the allocator and the caches, and make sure the case is valid at all
+    if(MQTTERR_NOERROR != BenchPack_Once(bc, buf, payload)) {
+        fprintf(stderr, "%s failed with payload of %u bytes.\n", bc->func, bc->payload_bytes);
+        MqttBuffer_Destroy(buf);
+        return -1;
+    }
+    MqttBuffer_Reset(buf);
+
+    allocs = Bench_AllocCount();
+    alloc_bytes = Bench_AllocBytes();
+    start = Bench_NowNs();
+    do {
+        for(i = 0; i < batch; ++i) {
+            BenchPack_Once(bc, buf, payload);
+            MqttBuffer_Reset(buf);
+        }
+        iterations += batch;
+        batch *= 2;
+        elapsed = Bench_NowNs() - start;
+    } while(elapsed < budget_ns);
+    allocs = Bench_AllocCount() - allocs;
+    alloc_bytes = Bench_AllocBytes() - alloc_bytes;
+
+    MqttBuffer_Destroy(buf);
+
+    ops = iterations;
+    if(bc->kind >= BENCH_PACK_DP_NULL && bc->kind <= BENCH_PACK_DP_SUBOBJECT) {
+        ops *= BENCH_PACK_DP_ITEMS;
+    }
+
+    printf("{\"bench\":\"pack\",\"func\":\"%s\",\"variant\":\"%s\",\"payload_bytes\":%u,"
+           "\"iterations\":%lu,\"ns_per_op\":%.1f,\"allocs_per_op\":%.3f,"
+           "\"alloc_bytes_per_op\":%.1f}\n",
+           bc->func, BenchPack_Variant(bc, variant_buf, sizeof(variant_buf)), bc->payload_bytes, (unsigned long)iterations,
+           (double)elapsed / ops, (double)allocs / ops, (double)alloc_bytes / ops);
+    fflush(stdout);
+    return 0;
+}
+
+static void BenchPack_Usage(const char *name)
+{
+    printf("usage: %s [options]\n", name);
+    printf("  -t ms              time budget per case (default 200)\n");
+    printf("  -s bytes           largest payload size (default 1048576)\n");
+    printf("  -f name            only run the cases whose function name contains name\n");
+    printf("  -a                 pack every case once and report the MqttBuffer statistics\n");
+    printf("  -i bytes           minimum size of the first heap chunk (default 1024)\n");
+    printf("  -g factor          growth factor of the following chunks (default 1)\n");
+    printf("  -M bytes           upper limit of the chunk growth (default unlimited)\n");
+    printf("  -k bytes           stack buffer used before the heap (default none)\n");
+    printf("  -z                 check that every case packs into fixed storage without the heap\n");
+}
+
+int main(int argc, char **argv)
+{
+    static const uint32_t payload_sizes[] = {0, 16, 256, 4096, 65536, 1048576};
+    static const uint32_t binary_sizes[] = {16, 4096, 65536, 1048576};
+    static const char json[] = "{\"temperature\":25,\"humidity\":40.5,\"status\":\"ok\"}";
+    struct BenchPackCase cases[64];
+    uint32_t count = 0, max_payload = 1048576, i;
+    int64_t budget_ms = 200;
+    const char *filter = NULL;
+    struct MqttBufferStats global;
+    struct MqttBufferPolicy policy;
+    char stack_buffer[65536];
+    char *payload, *storage = NULL;
+    uint32_t storage_size = 0;
+    int report = 0;
+    int heap_free = 0;
+    int failed = 0;
+    int opt;
+
+    memset(&policy, 0, sizeof(policy));
+    while((opt = getopt(argc, argv, "ht:s:f:ai:g:M:k:z")) != -1) {
+        switch(opt) {
+        case 't': budget_ms = atoi(optarg); break;
+        case 's': max_payload = (uint32_t)atoi(optarg); break;
+        case 'f': filter = optarg; break;
+        case 'a': report = 1; break;
+        case 'z': heap_free = 1; break;
+        case 'i': policy.initial_size = (uint32_t)atoi(optarg); break;
+        case 'g': policy.growth_factor = (uint32_t)atoi(optarg); break;
+        case 'M': policy.max_chunk_size = (uint32_t)atoi(optarg); break;
+        case 'k':
+            policy.initial_buffer = stack_buffer;
+            policy.initial_buffer_size = (uint32_t)atoi(optarg);
+            if(policy.initial_buffer_size > sizeof(stack_buffer)) {
+                policy.initial_buffer_size = sizeof(stack_buffer);
+            }
+            break;
+        default:
+            BenchPack_Usage(argv[0]);
+            return 1;
+        }
+    }
+
+#define BENCH_PACK_CASE(f, k, bytes, o) do { \
+        cases[count].func = f; \
+        cases[count].kind = k; \
+        cases[count].payload_bytes = bytes; \
+        cases[count].own = o; \
+        ++count; \
+    } while(0)
+
+    BENCH_PACK_CASE("Mqtt_PackPingReqPkt", BENCH_PACK_PINGREQ, 0, 0);
+    BENCH_PACK_CASE("Mqtt_PackDisconnectPkt", BENCH_PACK_DISCONNECT, 0, 0);
+    BENCH_PACK_CASE("Mqtt_PackConnAckPkt", BENCH_PACK_CONNACK, 0, 0);
+    BENCH_PACK_CASE("Mqtt_PackSubAckPkt", BENCH_PACK_SUBACK, 0, 0);
+    BENCH_PACK_CASE("Mqtt_PackUnsubAckPkt", BENCH_PACK_UNSUBACK, 0, 0);
+    BENCH_PACK_CASE("Mqtt_PackPingRespPkt", BENCH_PACK_PINGRESP, 0, 0);
+    BENCH_PACK_CASE("Mqtt_PackUnsubscribePkt", BENCH_PACK_UNSUBSCRIBE, 0, 8);
+    BENCH_PACK_CASE("Mqtt_PackCmdRetPkt", BENCH_PACK_CMDRET, 64, 0);
+    BENCH_PACK_CASE("Mqtt_PackConnectPkt", BENCH_PACK_CONNECT, 0, 0);
+    for(i = 0; i < sizeof(payload_sizes) / sizeof(payload_sizes[0]); ++i) {
+        if(payload_sizes[i] <= max_payload) {
+            BENCH_PACK_CASE("Mqtt_PackPublishPkt", BENCH_PACK_PUBLISH, payload_sizes[i], 0);
+            BENCH_PACK_CASE("Mqtt_PackPublishPkt", BENCH_PACK_PUBLISH, payload_sizes[i], 1);
+            BENCH_PACK_CASE("Mqtt_PackPublishSharedPkt", BENCH_PACK_PUBLISH_SHARED,
+                            payload_sizes[i], 0);
+        }
+    }
+    BENCH_PACK_CASE("Mqtt_PackSubscribePkt", BENCH_PACK_SUBSCRIBE, 0, 1);
+    BENCH_PACK_CASE("Mqtt_PackSubscribePkt", BENCH_PACK_SUBSCRIBE, 0, 8);
+    BENCH_PACK_CASE("Mqtt_AppendDPNull", BENCH_PACK_DP_NULL, 0, 0);
+    BENCH_PACK_CASE("Mqtt_AppendDPInt", BENCH_PACK_DP_INT, 0, 0);
+    BENCH_PACK_CASE("Mqtt_AppendDPDouble", BENCH_PACK_DP_DOUBLE, 0, 0);
+    BENCH_PACK_CASE("Mqtt_AppendDPString", BENCH_PACK_DP_STRING, 0, 0);
+    BENCH_PACK_CASE("Mqtt_AppendDPStartObject", BENCH_PACK_DP_OBJECT, 0, 0);
+    BENCH_PACK_CASE("Mqtt_AppendDPSubvalueInt", BENCH_PACK_DP_SUBVALUE_INT, 0, 0);
+    BENCH_PACK_CASE("Mqtt_AppendDPSubvalueDouble", BENCH_PACK_DP_SUBVALUE_DOUBLE, 0, 0);
+    BENCH_PACK_CASE("Mqtt_AppendDPSubvalueString", BENCH_PACK_DP_SUBVALUE_STRING, 0, 0);
+    BENCH_PACK_CASE("Mqtt_AppendDPStartSubobject", BENCH_PACK_DP_SUBOBJECT, 0, 0);
+    BENCH_PACK_CASE("Mqtt_PackDataPointByString", BENCH_PACK_DP_BY_STRING,
+                    sizeof(json) - 1, kTypeFullJson);
+    BENCH_PACK_CASE("Mqtt_PackDataPointByString", BENCH_PACK_DP_BY_STRING,
+                    sizeof(json) - 1, kTypeSimpleJsonWithoutTime);
+    BENCH_PACK_CASE("Mqtt_PackDataPointByString", BENCH_PACK_DP_BY_STRING,
+                    sizeof(json) - 1, kTypeString);
+    for(i = 0; i < sizeof(binary_sizes) / sizeof(binary_sizes[0]); ++i) {
+        if(binary_sizes[i] <= max_payload) {
+            BENCH_PACK_CASE("Mqtt_PackDataPointByBinary", BENCH_PACK_DP_BY_BINARY,
+                            binary_sizes[i], 0);
+        }
+    }
+
+#undef BENCH_PACK_CASE
+
+    payload = (char*)malloc(max_payload > sizeof(json) ? max_payload : sizeof(json));
+    if(!payload) {
+        return 1;
+    }
+
+    if(heap_free) {
+        // the largest packets copy the payload once, the rest is headers
+        storage_size = max_payload + 65536;
+        storage = (char*)malloc(storage_size);
+        if(!storage) {
+            free(payload);
+            return 1;
+        }
+    }
+
+    for(i = 0; i < count; ++i) {
+        if(filter && !strstr(cases[i].func, filter)) {
+            continue;
+        }
+
+        if(BENCH_PACK_DP_BY_STRING == cases[i].kind) {
+            memcpy(payload, json, sizeof(json));
+        }
+        else {
+            memset(payload, 'x', cases[i].payload_bytes);
+        }
+
+        if(BENCH_PACK_PUBLISH_SHARED == cases[i].kind) {
+            bench_pack_shared = MqttSharedPayload_Create(payload, cases[i].payload_bytes);
+            if(!bench_pack_shared) {
+                failed = 1;
+                continue;
+            }
+        }
+
+        if(heap_free) {
+            if(BenchPack_HeapFree(cases + i, payload, storage, storage_size) < 0) {
+                failed = 1;
+            }
+        }
+        else if(report) {
+            if(BenchPack_Report(cases + i, payload, &policy) < 0) {
+                failed = 1;
+            }
+        }
+        else if(BenchPack_Run(cases + i, payload, &policy, budget_ms * 1000000) < 0) {
+            failed = 1;
+        }
+
+        if(bench_pack_shared) {
+            MqttSharedPayload_Release(bench_pack_shared);
+            bench_pack_shared = NULL;
+        }
+    }
+
+    // every buffer has been destroyed by now, anything still live is a leak
+    MqttBuffer_GetGlobalStats(&global);
+    if(report) {
+        printf("{\"bench\":\"pack_alloc\",\"func\":\"total\",\"live_bytes\":%lu,"
+               "\"live_chunks\":%lu}\n",
+               (unsigned long)global.live_bytes, (unsigned long)global.live_chunks);
+    }
+    if(global.live_chunks) {
+        fprintf(stderr, "%lu MqttBuffer chunks were not released.\n",
+                (unsigned long)global.live_chunks);
+        failed = 1;
+    }
+
+    free(storage);
+    free(payload);
+    return failed;
+}
@@ -0,0 +1,754 @@
+/*
+ * Fleet recovery benchmark: a fleet of devices is connected, the broker goes
+ * away and every device reconnects at the same moment. The network and the
+ * broker are simulated on a virtual clock (one-way latency, a TCP handshake
+ * before the CONNECT, a token bucket admitting connects and refusing the rest
+ * with "server unavailable"), every packet is packed and parsed by real SDK
+ * client and server contexts. Three strategies are compared:
+ *   legacy     fixed 1 s retry, CONNECT / CONNACK / SUBSCRIBE / SUBACK /
+ *              publishes one after the other, clean session
+ *   pipelined  MqttReconnect with clean session: jittered backoff, CONNECT,
+ *              batched SUBSCRIBE and queued publishes in one flush
+ *   resume     MqttReconnect without clean session: the broker keeps the
+ *              session, the CONNACK carries session present and nothing is
+ *              resubscribed
+ * A device has recovered when its subscriptions are acknowledged and its
+ * queued QoS1 publishes are acknowledged. Reports the virtual recovery time
+ * percentiles, connect attempts, flushes and bytes per device and the real
+ * packing cost per attempt. One JSON line per strategy.
+ */
+#include "mqtt/mqtt.h"
+#include "mqtt/mqtt_reconnect.h"
+#include "mqtt/mqtt_send_queue.h"
+#include "bench_util.h"
+
+#include <sys/uio.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_RC_MAX_TOPICS 64
+#define BENCH_RC_MAX_QUEUED 64
+#define BENCH_RC_LEGACY_RETRY_US 1000000
+
+enum BenchRcMode {
+    BENCH_RC_LEGACY,
+    BENCH_RC_PIPELINED,
+    BENCH_RC_RESUME
+};
+
+static const char *bench_rc_modes[] = {"legacy", "pipelined", "resume"};
+
+enum BenchRcEventKind {
+    BENCH_RC_ATTEMPT, /* the device starts a TCP connection */
+    BENCH_RC_OPEN,    /* the TCP handshake finished */
+    BENCH_RC_UP,      /* bytes reach the broker */
+    BENCH_RC_DOWN     /* bytes reach the device */
+};
+
+struct BenchRcEvent {
+    int64_t at;
+    uint32_t device;
+    uint32_t seq;      /* connection the event belongs to, stale ones are dropped */
+    uint32_t limit;    /* channel offset delivered by the event */
+    uint32_t kind;
+};
+
+struct BenchRcChannel {
+    char *data;
+    uint32_t size;
+    uint32_t capacity;
+    uint32_t pos;
+    uint32_t limit;
+};
+
+struct BenchRc;
+
+struct BenchRcDevice {
+    struct BenchRc *bench;
+    uint32_t index;
+    uint32_t seq;
+    struct MqttContext client[1];
+    struct MqttContext server[1];
+    struct BenchRcChannel up;
+    struct BenchRcChannel down;
+    struct MqttSendQueue queue;
+    struct MqttReconnect rc;
+    struct MqttBuffer pubs[BENCH_RC_MAX_QUEUED]; /* the queued publishes of the legacy strategy */
+
+    int refused;          /* the broker refused the current connection */
+    int accepted;
+    int session;          /* the broker keeps a session for the device */
+    uint32_t subacks_pending;
+    uint32_t pubacks_pending;
+    int recovered;
+    int64_t recovered_at;
+};
+
+struct BenchRc {
+    enum BenchRcMode mode;
+    uint32_t device_count;
+    uint32_t topic_count;
+    uint32_t queued;
+    int64_t latency_us;
+    double rate;          /* connects admitted per second */
+    double burst;
+    double tokens;
+    int64_t refilled_at;
+
+    const char *topics[BENCH_RC_MAX_TOPICS];
+    char topic_storage[BENCH_RC_MAX_TOPICS][64];
+    struct BenchRcDevice *devices;
+
+    struct BenchRcEvent *heap;
+    uint32_t heap_size;
+    uint32_t heap_capacity;
+    int64_t now;          /* virtual time in microseconds */
+
+    int64_t outage_at;
+    uint32_t recovered;
+    uint64_t attempts;
+    uint64_t refused;
+    uint64_t flushes;
+    uint64_t up_bytes;
+    int64_t pack_ns;
+    int failed;
+};
+
+static int BenchRc_Push(struct BenchRc *bench, int64_t at, uint32_t device, uint32_t kind,
+                        uint32_t limit)
+{
+    struct BenchRcEvent *heap, ev;
+    uint32_t i, parent;
+
+    if(bench->heap_size == bench->heap_capacity) {
+        const uint32_t capacity = bench->heap_capacity ? bench->heap_capacity * 2 : 1024;
+        heap = (struct BenchRcEvent*)realloc(bench->heap, capacity * sizeof(*heap));
+        if(!heap) {
+            bench->failed = 1;
+            return -1;
+        }
+        bench->heap = heap;
+        bench->heap_capacity = capacity;
+    }
+
+    ev.at = at;
+    ev.device = device;
+    ev.seq = bench->devices[device].seq;
+    ev.limit = limit;
+    ev.kind = kind;
+
+    for(i = bench->heap_size++; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if(bench->heap[parent].at <= at) {
+            break;
+        }
+        bench->heap[i] = bench->heap[parent];
+    }
+    bench->heap[i] = ev;
+    return 0;
+}
+
+static struct BenchRcEvent BenchRc_Pop(struct BenchRc *bench)
+{
+    const struct BenchRcEvent top = bench->heap[0];
+    const struct BenchRcEvent last = bench->heap[--bench->heap_size];
+    uint32_t i = 0, child;
+
+    while((child = 2 * i + 1) < bench->heap_size) {
+        if((child + 1 < bench->heap_size) && (bench->heap[child + 1].at < bench->heap[child].at)) {
+            ++child;
+        }
+        if(last.at <= bench->heap[child].at) {
+            break;
+        }
+        bench->heap[i] = bench->heap[child];
+        i = child;
+    }
+    if(bench->heap_size) {
+        bench->heap[i] = last;
+    }
+    return top;
+}
+
+static int BenchRc_Write(struct BenchRcChannel *channel, const struct iovec *iov, int iovcnt)
+{
+    int i, bytes = 0;
+    char *data;
+
+    for(i = 0; i < iovcnt; ++i) {
+        if(channel->size + iov[i].iov_len > channel->capacity) {
+            channel->capacity = (channel->size + (uint32_t)iov[i].iov_len) * 2;
+            data = (char*)realloc(channel->data, channel->capacity);
+            if(!data) {
+                return -1;
+            }
+            channel->data = data;
+        }
+        memcpy(channel->data + channel->size, iov[i].iov_base, iov[i].iov_len);
+        channel->size += (uint32_t)iov[i].iov_len;
+        bytes += (int)iov[i].iov_len;
+    }
+    return bytes;
+}
+
+static int BenchRc_Read(struct BenchRcChannel *channel, void *buf, uint32_t count)
+{
+    uint32_t n = channel->limit - channel->pos;
+
+    n = n < count ? n : count;
+    memcpy(buf, channel->data + channel->pos, n);
+    channel->pos += n;
+    return (int)n;
+}
+
+static int BenchRc_ClientWritev(void *arg, const struct iovec *iov, int iovcnt)
+{
+    struct BenchRcDevice *dev = (struct BenchRcDevice*)arg;
+    const int bytes = BenchRc_Write(&dev->up, iov, iovcnt);
+
+    if(bytes > 0) {
+        ++dev->bench->flushes;
+        dev->bench->up_bytes += (uint32_t)bytes;
+        BenchRc_Push(dev->bench, dev->bench->now + dev->bench->latency_us, dev->index,
+                     BENCH_RC_UP, dev->up.size);
+    }
+    return bytes;
+}
+
+static int BenchRc_ClientRead(void *arg, void *buf, uint32_t count)
+{
+    return BenchRc_Read(&((struct BenchRcDevice*)arg)->down, buf, count);
+}
+
+static int BenchRc_ServerWritev(void *arg, const struct iovec *iov, int iovcnt)
+{
+    struct BenchRcDevice *dev = (struct BenchRcDevice*)arg;
+    int i, bytes = 0;
+
+    // a refused connection is closed after the CONNACK, whatever followed it is lost
+    if(dev->refused && dev->down.size) {
+        for(i = 0; i < iovcnt; ++i) {
+            bytes += (int)iov[i].iov_len;
+        }
+        return bytes;
+    }
+    return BenchRc_Write(&dev->down, iov, iovcnt);
+}
+
+static int BenchRc_ServerRead(void *arg, void *buf, uint32_t count)
+{
+    return BenchRc_Read(&((struct BenchRcDevice*)arg)->up, buf, count);
+}
+
+static int BenchRc_HandleConnect(void *arg, const char *id, uint16_t keep_alive,
+                                 int clean_session, const char *will_topic,
+                                 const char *will_msg, uint16_t msg_len,
+                                 enum MqttQosLevel will_qos, int will_retain,
+                                 const char *user, const char *password, uint16_t pswd_len)
+{
+    struct BenchRcDevice *dev = (struct BenchRcDevice*)arg;
+    struct BenchRc *bench = dev->bench;
+    int present;
+    (void)id; (void)keep_alive; (void)will_topic; (void)will_msg; (void)msg_len;
+    (void)will_qos; (void)will_retain; (void)user; (void)password; (void)pswd_len;
+
+    bench->tokens += (double)(bench->now - bench->refilled_at) * bench->rate / 1e6;
+    bench->tokens = bench->tokens > bench->burst ? bench->burst : bench->tokens;
+    bench->refilled_at = bench->now;
+    if(bench->tokens < 1.0) {
+        dev->refused = 1;
+        return MQTT_CONNACK_SERVER_UNAVAILABLE;
+    }
+    bench->tokens -= 1.0;
+
+    present = !clean_session && dev->session;
+    dev->session = !clean_session;
+    return present ? MQTT_CONNACK_ACCEPTED | (MQTT_CONNACK_SP << 8) : MQTT_CONNACK_ACCEPTED;
+}
+
+static int BenchRc_HandleSubscribe(void *arg, uint16_t pkt_id, const char *topic,
+                                   enum MqttQosLevel qos)
+{
+    (void)arg; (void)pkt_id; (void)topic;
+    return qos;
+}
+
+static int BenchRc_HandlePublish(void *arg, uint16_t pkt_id, const char *topic,
+                                 const char *payload, uint32_t payloadsize,
+                                 int dup, enum MqttQosLevel qos)
+{
+    (void)arg; (void)pkt_id; (void)topic; (void)payload; (void)payloadsize; (void)dup; (void)qos;
+    return 0;
+}
+
+static void BenchRc_CheckRecovered(struct BenchRcDevice *dev)
+{
+    struct BenchRc *bench = dev->bench;
+
+    if(!dev->recovered && dev->accepted && !dev->subacks_pending && !dev->pubacks_pending) {
+        dev->recovered = 1;
+        dev->recovered_at = bench->now;
+        ++bench->recovered;
+    }
+}
+
+static void BenchRc_Flush(struct BenchRcDevice *dev)
+{
+    if(MQTTERR_NOERROR != MqttSendQueue_Flush(&dev->queue, dev->client, dev->bench->now / 1000, 1)) {
+        dev->bench->failed = 1;
+    }
+}
+
+static int BenchRc_HandleConnAck(void *arg, char flags, char ret_code)
+{
+    struct BenchRcDevice *dev = (struct BenchRcDevice*)arg;
+    struct BenchRc *bench = dev->bench;
+    const int64_t start = Bench_NowNs();
+    uint32_t i;
+
+    if(BENCH_RC_LEGACY == bench->mode) {
+        if(MQTT_CONNACK_ACCEPTED != ret_code) {
+            return 0;
+        }
+        dev->accepted = 1;
+        dev->subacks_pending = 1;
+        MqttBuffer_Reset(dev->pubs + BENCH_RC_MAX_QUEUED - 1);
+        if(MQTTERR_NOERROR != Mqtt_PackSubscribePkt(dev->pubs + BENCH_RC_MAX_QUEUED - 1, 1,
+                                                    MQTT_QOS_LEVEL1, bench->topics,
+                                                    (int)bench->topic_count)) {
+            bench->failed = 1;
+            return 0;
+        }
+        bench->pack_ns += Bench_NowNs() - start;
+        Mqtt_SendPkt(dev->client, dev->pubs + BENCH_RC_MAX_QUEUED - 1, 0);
+        return 0;
+    }
+
+    i = (uint32_t)dev->rc.resubscribes;
+    if(MQTTERR_NOERROR != MqttReconnect_HandleConnAck(&dev->rc, flags, ret_code, &dev->queue,
+                                                      bench->now / 1000)) {
+        bench->failed = 1;
+        return 0;
+    }
+    bench->pack_ns += Bench_NowNs() - start;
+
+    if(MQTT_CONNACK_ACCEPTED != ret_code) {
+        return 0;
+    }
+
+    dev->accepted = 1;
+    if(dev->rc.resubscribes != i) {
+        // the session was lost after all, the subscriptions follow now
+        dev->subacks_pending = 1;
+        BenchRc_Flush(dev);
+    }
+    BenchRc_CheckRecovered(dev);
+    return 0;
+}
+
+static int BenchRc_HandleSubAck(void *arg, uint16_t pkt_id, const char *codes, uint32_t count)
+{
+    struct BenchRcDevice *dev = (struct BenchRcDevice*)arg;
+    uint32_t i;
+    (void)pkt_id; (void)codes;
+
+    if(dev->subacks_pending) {
+        --dev->subacks_pending;
+    }
+
+    if(BENCH_RC_LEGACY == dev->bench->mode) {
+        for(i = 0; i < dev->bench->queued; ++i) {
+            Mqtt_SendPkt(dev->client, dev->pubs + i, 0);
+        }
+    }
+
+    if(count != dev->bench->topic_count) {
+        dev->bench->failed = 1;
+    }
+    BenchRc_CheckRecovered(dev);
+    return 0;
+}
+
+static int BenchRc_HandlePubAck(void *arg, uint16_t pkt_id)
+{
+    struct BenchRcDevice *dev = (struct BenchRcDevice*)arg;
+    (void)pkt_id;
+
+    if(dev->pubacks_pending) {
+        --dev->pubacks_pending;
+    }
+    BenchRc_CheckRecovered(dev);
+    return 0;
+}
+
+static int BenchRc_PackConnect(void *arg, struct MqttBuffer *buf)
+{
+    struct BenchRcDevice *dev = (struct BenchRcDevice*)arg;
+    char id[16];
+
+    sprintf(id, "dev%08u", dev->index);
+    return Mqtt_PackConnectPkt(buf, 120, id, dev->rc.clean_session, NULL, NULL, 0,
+                               MQTT_QOS_LEVEL0, 0, "fleet", "token", 5);
+}
+
+static int BenchRc_PackPublish(struct BenchRc *bench, struct MqttBuffer *buf, uint32_t device,
+                               uint32_t index)
+{
+    char payload[64];
+
+    sprintf(payload, "{\"device\":%u,\"reading\":%u,\"value\":%u.%02u}",
+            device, index, 20 + index % 10, device % 100);
+    (void)bench;
+    return Mqtt_PackPublishPkt(buf, (uint16_t)(index + 1), "fleet/telemetry", payload,
+                               (uint32_t)strlen(payload), MQTT_QOS_LEVEL1, 0, 1);
+}
+
+// a new connection: the channels start empty and the old contexts lose their partial input
+static void BenchRc_Open(struct BenchRcDevice *dev)
+{
+    struct BenchRc *bench = dev->bench;
+    const int64_t start = Bench_NowNs();
+
+    ++bench->attempts;
+    dev->up.size = dev->up.pos = dev->up.limit = 0;
+    dev->down.size = dev->down.pos = dev->down.limit = 0;
+    dev->client->pos = dev->client->bgn;
+    dev->server->pos = dev->server->bgn;
+    dev->refused = 0;
+    dev->accepted = 0;
+    dev->subacks_pending = 0;
+    dev->pubacks_pending = bench->queued;
+
+    if(BENCH_RC_LEGACY == bench->mode) {
+        struct MqttBuffer *connect = dev->pubs + BENCH_RC_MAX_QUEUED - 1;
+        MqttBuffer_Reset(connect);
+        dev->rc.clean_session = 1;
+        if(BenchRc_PackConnect(dev, connect) < 0) {
+            bench->failed = 1;
+            return;
+        }
+        bench->pack_ns += Bench_NowNs() - start;
+        Mqtt_SendPkt(dev->client, connect, 0);
+        return;
+    }
+
+    if(MQTTERR_NOERROR != MqttReconnect_Begin(&dev->rc, &dev->queue, bench->now / 1000)) {
+        bench->failed = 1;
+        return;
+    }
+    bench->pack_ns += Bench_NowNs() - start;
+    dev->subacks_pending = dev->rc.subscribes_sent;
+    if(dev->rc.queued_pkts != dev->rc.replaying) {
+        bench->failed = 1;
+    }
+    dev->pubacks_pending = dev->rc.replaying;
+    BenchRc_Flush(dev);
+}
+
+static void BenchRc_Deliver(struct BenchRcDevice *dev, struct MqttContext *ctx,
+                            struct BenchRcChannel *channel, uint32_t limit)
+{
+    int err = MQTTERR_NOERROR;
+
+    channel->limit = limit;
+    while((channel->pos < channel->limit) && (err >= 0)) {
+        err = Mqtt_RecvPkt(ctx);
+    }
+    if(err < 0) {
+        dev->bench->failed = 1;
+    }
+}
+
+static void BenchRc_Disconnect(struct BenchRcDevice *dev)
+{
+    struct BenchRc *bench = dev->bench;
+
+    ++dev->seq;
+    dev->recovered = 0;
+    MqttSendQueue_Destroy(&dev->queue);
+    MqttSendQueue_Init(&dev->queue);
+
+    if(BENCH_RC_LEGACY == bench->mode) {
+        BenchRc_Push(bench, bench->now, dev->index, BENCH_RC_ATTEMPT, 0);
+    }
+    else {
+        MqttReconnect_HandleDisconnect(&dev->rc, bench->now / 1000);
+        BenchRc_Push(bench, MqttReconnect_Deadline(&dev->rc) * 1000, dev->index,
+                     BENCH_RC_ATTEMPT, 0);
+    }
+}
+
+static void BenchRc_Step(struct BenchRc *bench)
+{
+    const struct BenchRcEvent ev = BenchRc_Pop(bench);
+    struct BenchRcDevice *dev = bench->devices + ev.device;
+    uint32_t before;
+
+    if(ev.seq != dev->seq) {
+        return;
+    }
+    bench->now = ev.at;
+
+    switch(ev.kind) {
+    case BENCH_RC_ATTEMPT:
+        ++dev->seq;
+        BenchRc_Push(bench, bench->now + 2 * bench->latency_us, ev.device, BENCH_RC_OPEN, 0);
+        break;
+
+    case BENCH_RC_OPEN:
+        BenchRc_Open(dev);
+        break;
+
+    case BENCH_RC_UP:
+        before = dev->down.size;
+        BenchRc_Deliver(dev, dev->server, &dev->up, ev.limit);
+        if(dev->down.size > before) {
+            BenchRc_Push(bench, bench->now + bench->latency_us, ev.device, BENCH_RC_DOWN,
+                         dev->down.size);
+        }
+        break;
+
+    default:
+        BenchRc_Deliver(dev, dev->client, &dev->down, ev.limit);
+        if(dev->refused) {
+            // the broker closed the connection after refusing it
+            ++bench->refused;
+            ++dev->seq;
+            MqttSendQueue_Destroy(&dev->queue);
+            MqttSendQueue_Init(&dev->queue);
+            if(BENCH_RC_LEGACY == bench->mode) {
+                BenchRc_Push(bench, bench->now + BENCH_RC_LEGACY_RETRY_US, ev.device,
+                             BENCH_RC_ATTEMPT, 0);
+            }
+            else {
+                BenchRc_Push(bench, MqttReconnect_Deadline(&dev->rc) * 1000, ev.device,
+                             BENCH_RC_ATTEMPT, 0);
+            }
+        }
+        break;
+    }
+}
+
+static int BenchRc_InitDevice(struct BenchRc *bench, uint32_t index)
+{
+    struct BenchRcDevice *dev = bench->devices + index;
+    uint32_t i;
+
+    dev->bench = bench;
+    dev->index = index;
+    MqttSendQueue_Init(&dev->queue);
+    for(i = 0; i < BENCH_RC_MAX_QUEUED; ++i) {
+        MqttBuffer_Init(dev->pubs + i);
+    }
+
+    if((MQTTERR_NOERROR != Mqtt_InitContext(dev->client, 2048)) ||
+       (MQTTERR_NOERROR != Mqtt_InitContext(dev->server, 2048))) {
+        return -1;
+    }
+    dev->client->read_func = BenchRc_ClientRead;
+    dev->client->read_func_arg = dev;
+    dev->client->writev_func = BenchRc_ClientWritev;
+    dev->client->writev_func_arg = dev;
+    dev->client->handle_conn_ack = BenchRc_HandleConnAck;
+    dev->client->handle_conn_ack_arg = dev;
+    dev->client->handle_sub_ack = BenchRc_HandleSubAck;
+    dev->client->handle_sub_ack_arg = dev;
+    dev->client->handle_pub_ack = BenchRc_HandlePubAck;
+    dev->client->handle_pub_ack_arg = dev;
+
+    dev->server->read_func = BenchRc_ServerRead;
+    dev->server->read_func_arg = dev;
+    dev->server->writev_func = BenchRc_ServerWritev;
+    dev->server->writev_func_arg = dev;
+    dev->server->handle_connect = BenchRc_HandleConnect;
+    dev->server->handle_connect_arg = dev;
+    dev->server->handle_subscribe = BenchRc_HandleSubscribe;
+    dev->server->handle_subscribe_arg = dev;
+    dev->server->handle_publish = BenchRc_HandlePublish;
+    dev->server->handle_publish_arg = dev;
+
+    // the device id seeds the jitter, devices dropped together come back apart
+    MqttReconnect_Init(&dev->rc, index * 2654435761u + 1);
+    dev->rc.clean_session = BENCH_RC_RESUME != bench->mode;
+    dev->rc.pack_connect = BenchRc_PackConnect;
+    dev->rc.pack_connect_arg = dev;
+    for(i = 0; i < bench->topic_count; ++i) {
+        if(MQTTERR_NOERROR != MqttReconnect_AddTopic(&dev->rc, bench->topics[i], MQTT_QOS_LEVEL1)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// the publishes a device produced while the broker was away
+static int BenchRc_QueuePublishes(struct BenchRc *bench, struct BenchRcDevice *dev)
+{
+    struct MqttBuffer buf[1];
+    uint32_t i;
+    int err = MQTTERR_NOERROR;
+
+    for(i = 0; (i < bench->queued) && (MQTTERR_NOERROR == err); ++i) {
+        if(BENCH_RC_LEGACY == bench->mode) {
+            MqttBuffer_Reset(dev->pubs + i);
+            err = BenchRc_PackPublish(bench, dev->pubs + i, dev->index, i);
+            continue;
+        }
+
+        MqttBuffer_Init(buf);
+        err = BenchRc_PackPublish(bench, buf, dev->index, i);
+        if(MQTTERR_NOERROR == err) {
+            err = MqttReconnect_QueuePublish(&dev->rc, buf);
+        }
+        MqttBuffer_Destroy(buf);
+    }
+    return err;
+}
+
+static int BenchRc_Run(enum BenchRcMode mode, uint32_t device_count, uint32_t topic_count,
+                       uint32_t queued, double rate, uint32_t latency_ms)
+{
+    struct BenchRc bench;
+    int64_t *samples = NULL;
+    uint32_t i;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.mode = mode;
+    bench.device_count = device_count;
+    bench.topic_count = topic_count;
+    bench.latency_us = (int64_t)latency_ms * 1000;
+    bench.rate = rate;
+    bench.burst = rate / 10;
+    bench.tokens = bench.burst;
+    for(i = 0; i < topic_count; ++i) {
+        sprintf(bench.topic_storage[i], "fleet/cmd/+/%s/%u", i % 2 ? "config" : "ota", i);
+        bench.topics[i] = bench.topic_storage[i];
+    }
+
+    bench.devices = (struct BenchRcDevice*)calloc(device_count, sizeof(struct BenchRcDevice));
+    samples = (int64_t*)malloc(device_count * sizeof(int64_t));
+    for(i = 0; bench.devices && samples && (i < device_count) && !bench.failed; ++i) {
+        bench.failed = BenchRc_InitDevice(&bench, i) < 0;
+    }
+    if(!bench.devices || !samples) {
+        bench.failed = 1;
+    }
+
+    // the fleet comes up once so that the broker holds the sessions, then the outage hits
+    for(i = 0; (i < device_count) && !bench.failed; ++i) {
+        BenchRc_Push(&bench, 0, i, BENCH_RC_ATTEMPT, 0);
+    }
+    while(bench.heap_size && !bench.failed && (bench.recovered < device_count)) {
+        BenchRc_Step(&bench);
+    }
+
+    bench.outage_at = bench.now + 1000000;
+    bench.now = bench.outage_at;
+    bench.heap_size = 0;
+    bench.recovered = 0;
+    bench.attempts = bench.refused = bench.flushes = bench.up_bytes = 0;
+    bench.pack_ns = 0;
+    bench.queued = queued;
+    bench.tokens = bench.burst;
+    bench.refilled_at = bench.now;
+    for(i = 0; (i < device_count) && !bench.failed; ++i) {
+        bench.failed = MQTTERR_NOERROR != BenchRc_QueuePublishes(&bench, bench.devices + i);
+        BenchRc_Disconnect(bench.devices + i);
+    }
+    while(bench.heap_size && !bench.failed && (bench.recovered < device_count)) {
+        BenchRc_Step(&bench);
+    }
+
+    if(bench.failed || (bench.recovered != device_count)) {
+        fprintf(stderr, "%s: failed, %u of %u devices recovered.\n",
+                bench_rc_modes[mode], bench.recovered, device_count);
+        bench.failed = 1;
+    }
+    else {
+        for(i = 0; i < device_count; ++i) {
+            samples[i] = bench.devices[i].recovered_at - bench.outage_at;
+        }
+        Bench_SortSamples(samples, device_count);
+        printf("{\"bench\":\"reconnect\",\"mode\":\"%s\",\"devices\":%u,\"topics\":%u,"
+               "\"queued_pkts\":%u,\"connect_rate\":%.0f,\"latency_ms\":%u,"
+               "\"recover_p50_ms\":%.1f,\"recover_p99_ms\":%.1f,\"recover_max_ms\":%.1f,"
+               "\"attempts_per_device\":%.2f,\"refused\":%llu,\"flushes_per_device\":%.2f,"
+               "\"up_bytes_per_device\":%.1f,\"pack_ns_per_attempt\":%.1f}\n",
+               bench_rc_modes[mode], device_count, topic_count, queued, rate, latency_ms,
+               Bench_Percentile(samples, device_count, 50) / 1000.0,
+               Bench_Percentile(samples, device_count, 99) / 1000.0,
+               samples[device_count - 1] / 1000.0,
+               (double)bench.attempts / device_count, (unsigned long long)bench.refused,
+               (double)bench.flushes / device_count, (double)bench.up_bytes / device_count,
+               (double)bench.pack_ns / bench.attempts);
+        fflush(stdout);
+    }
+
+    for(i = 0; bench.devices && (i < device_count); ++i) {
+        struct BenchRcDevice *dev = bench.devices + i;
+        uint32_t j;
+        if(!dev->bench) {
+            break;
+        }
+        Mqtt_DestroyContext(dev->client);
+        Mqtt_DestroyContext(dev->server);
+        MqttSendQueue_Destroy(&dev->queue);
+        MqttReconnect_Destroy(&dev->rc);
+        for(j = 0; j < BENCH_RC_MAX_QUEUED; ++j) {
+            MqttBuffer_Destroy(dev->pubs + j);
+        }
+        free(dev->up.data);
+        free(dev->down.data);
+    }
+    free(bench.devices);
+    free(bench.heap);
+    free(samples);
+    return bench.failed ? -1 : 0;
+}
+
+static void BenchRc_Usage(const char *name)
+{
+    printf("usage: %s [options]\n", name);
+    printf("  -n devices         devices in the fleet (default 10000)\n");
+    printf("  -t topics          subscriptions per device, at most %u (default 8)\n",
+           BENCH_RC_MAX_TOPICS);
+    printf("  -q pkts            QoS1 publishes queued per device, at most %u (default 4)\n",
+           BENCH_RC_MAX_QUEUED - 1);
+    printf("  -r connects/s      connects the broker admits per second (default 5000)\n");
+    printf("  -l ms              one-way network latency (default 25)\n");
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t device_count = 10000, topic_count = 8, queued = 4, latency_ms = 25, mode;
+    double rate = 5000;
+    int failed = 0, opt;
+
+    while((opt = getopt(argc, argv, "hn:t:q:r:l:")) != -1) {
+        switch(opt) {
+        case 'n': device_count = (uint32_t)atol(optarg); break;
+        case 't': topic_count = (uint32_t)atol(optarg); break;
+        case 'q': queued = (uint32_t)atol(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'l': latency_ms = (uint32_t)atol(optarg); break;
+        default:
+            BenchRc_Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if((0 == device_count) || (0 == topic_count) || (topic_count > BENCH_RC_MAX_TOPICS) ||
+       (queued >= BENCH_RC_MAX_QUEUED) || (rate < 10)) {
+        BenchRc_Usage(argv[0]);
+        return 1;
+    }
+
+    for(mode = BENCH_RC_LEGACY; mode <= BENCH_RC_RESUME; ++mode) {
+        failed |= BenchRc_Run((enum BenchRcMode)mode, device_count, topic_count, queued,
+                              rate, latency_ms) < 0;
+    }
+
+    return failed ? 1 : 0;
+}
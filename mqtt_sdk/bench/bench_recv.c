@@ -0,0 +1,522 @@
+/*
+ * Receive path benchmark: pre-generated server-to-client byte streams are
+ * fed to Mqtt_RecvPkt through an in-memory read_func/writev_func pair, so
+ * only the parser, the dispatch and the automatic responses are measured.
+ * read_func and writev_func calls stand in for the syscalls a socket
+ * transport would make. One JSON line is printed per scenario. With -m
+ * the context carries a MqttMetrics block, which shows its overhead.
+ * The creq_table scenario routes the commands through a MqttCmdTable and
+ * answers each one with an automatic $crsp reply.
+ */
+#include "mqtt/mqtt.h"
+#include "mqtt/mqtt_cmd_table.h"
+#include "mqtt/mqtt_metrics.h"
+#include "mqtt/mqtt_trace.h"
+#include "bench_util.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct BenchRecvStream {
+    char *data;
+    uint32_t len;
+    uint32_t capacity;
+    uint32_t pos;
+    uint32_t chunk;     /* 每次read_func最多返回的字节数，0为不限制 */
+    uint32_t messages;  /* 流中的数据包个数 */
+
+    uint64_t read_calls;
+    uint64_t writev_calls;
+    uint64_t written_bytes;
+    uint64_t handled;
+};
+
+// the commands of the creq_table scenario, one handler for each
+#define BENCH_RECV_COMMANDS 64
+
+struct BenchRecvScenario {
+    const char *name;
+    uint32_t chunk;
+    int (*generate)(struct BenchRecvStream *stream, uint32_t count, uint32_t payload_bytes);
+    int commands;   /* 非0时用命令表处理$creq并自动回复 */
+};
+
+static int BenchRecv_Reserve(struct BenchRecvStream *stream, uint32_t bytes)
+{
+    char *data;
+    uint32_t capacity = stream->capacity ? stream->capacity : 4096;
+
+    if(stream->len + bytes <= stream->capacity) {
+        return 0;
+    }
+
+    while(capacity < stream->len + bytes) {
+        capacity *= 2;
+    }
+
+    data = (char*)realloc(stream->data, capacity);
+    if(!data) {
+        return -1;
+    }
+
+    stream->data = data;
+    stream->capacity = capacity;
+    return 0;
+}
+
+static int BenchRecv_AppendBytes(struct BenchRecvStream *stream, const char *bytes, uint32_t len)
+{
+    if(BenchRecv_Reserve(stream, len) < 0) {
+        return -1;
+    }
+
+    memcpy(stream->data + stream->len, bytes, len);
+    stream->len += len;
+    ++stream->messages;
+    return 0;
+}
+
+// flattens a packet built by the SDK packers, the wire format is the same in both directions
+static int BenchRecv_AppendPkt(struct BenchRecvStream *stream, struct MqttBuffer *buf)
+{
+    const struct MqttExtent *ext;
+
+    if(BenchRecv_Reserve(stream, buf->buffered_bytes) < 0) {
+        return -1;
+    }
+
+    for(ext = buf->first_ext; ext; ext = ext->next) {
+        memcpy(stream->data + stream->len, ext->payload, ext->len);
+        stream->len += ext->len;
+    }
+
+    ++stream->messages;
+    MqttBuffer_Reset(buf);
+    return 0;
+}
+
+static int BenchRecv_AppendPublish(struct BenchRecvStream *stream, uint16_t pkt_id,
+                                   const char *topic, const char *payload,
+                                   uint32_t payload_bytes, enum MqttQosLevel qos)
+{
+    struct MqttBuffer buf[1];
+    int err;
+
+    MqttBuffer_Init(buf);
+    err = Mqtt_PackPublishPkt(buf, pkt_id, topic, payload, payload_bytes, qos, 0, 0);
+    if(MQTTERR_NOERROR == err) {
+        err = BenchRecv_AppendPkt(stream, buf);
+    }
+    MqttBuffer_Destroy(buf);
+
+    return MQTTERR_NOERROR == err ? 0 : -1;
+}
+
+static int BenchRecv_AppendAck(struct BenchRecvStream *stream, char type, uint16_t pkt_id)
+{
+    char pkt[4];
+
+    pkt[0] = type;
+    pkt[1] = 2;
+    pkt[2] = (char)(pkt_id >> 8);
+    pkt[3] = (char)(pkt_id & 0xFF);
+    return BenchRecv_AppendBytes(stream, pkt, 4);
+}
+
+static char *BenchRecv_Payload(uint32_t payload_bytes)
+{
+    char *payload = (char*)malloc(payload_bytes + 1);
+    if(payload) {
+        memset(payload, 'x', payload_bytes);
+    }
+    return payload;
+}
+
+static int BenchRecv_GenQos0(struct BenchRecvStream *stream, uint32_t count, uint32_t payload_bytes)
+{
+    char *payload = BenchRecv_Payload(payload_bytes);
+    uint32_t i;
+    int err = payload ? 0 : -1;
+
+    for(i = 0; (i < count) && (0 == err); ++i) {
+        err = BenchRecv_AppendPublish(stream, 1, "device/0001/downlink", payload,
+                                      payload_bytes, MQTT_QOS_LEVEL0);
+    }
+
+    free(payload);
+    return err;
+}
+
+// QoS0, QoS1 and QoS2 in turn, every QoS2 message is followed by the broker's PUBREL
+static int BenchRecv_GenMixed(struct BenchRecvStream *stream, uint32_t count, uint32_t payload_bytes)
+{
+    char *payload = BenchRecv_Payload(payload_bytes);
+    uint32_t i;
+    int err = payload ? 0 : -1;
+
+    for(i = 0; (i < count) && (0 == err); ++i) {
+        const uint16_t pkt_id = (uint16_t)(i % 65535 + 1);
+        const enum MqttQosLevel qos = (enum MqttQosLevel)(i % 3);
+
+        err = BenchRecv_AppendPublish(stream, pkt_id, "device/0001/downlink", payload,
+                                      payload_bytes, qos);
+        if((0 == err) && (MQTT_QOS_LEVEL2 == qos)) {
+            err = BenchRecv_AppendAck(stream, (char)(MQTT_PKT_PUBREL << 4 | 0x02), pkt_id);
+        }
+    }
+
+    free(payload);
+    return err;
+}
+
+static int BenchRecv_GenCmd(struct BenchRecvStream *stream, uint32_t count, uint32_t payload_bytes)
+{
+    char *payload = BenchRecv_Payload(payload_bytes);
+    char topic[64];
+    uint32_t i;
+    int err = payload ? 0 : -1;
+
+    for(i = 0; (i < count) && (0 == err); ++i) {
+        snprintf(topic, sizeof(topic), "$creq/7c6d3a1e-4f0b-4bc2-9c1d-%012u", i);
+        err = BenchRecv_AppendPublish(stream, 1, topic, payload, payload_bytes,
+                                      MQTT_QOS_LEVEL0);
+    }
+
+    free(payload);
+    return err;
+}
+
+// the argument starts with one of the registered command names, e.g. "set_17:xxxx"
+static int BenchRecv_GenNamedCmd(struct BenchRecvStream *stream, uint32_t count,
+                                 uint32_t payload_bytes)
+{
+    char *payload = BenchRecv_Payload(payload_bytes + 16);
+    char topic[64];
+    uint32_t i;
+    int len, err = payload ? 0 : -1;
+
+    for(i = 0; (i < count) && (0 == err); ++i) {
+        snprintf(topic, sizeof(topic), "$creq/7c6d3a1e-4f0b-4bc2-9c1d-%012u", i);
+        len = sprintf(payload, "set_%u:", i % BENCH_RECV_COMMANDS);
+        memset(payload + len, 'x', payload_bytes);
+        err = BenchRecv_AppendPublish(stream, 1, topic, payload, payload_bytes + len,
+                                      MQTT_QOS_LEVEL0);
+    }
+
+    free(payload);
+    return err;
+}
+
+static int BenchRecv_GenPubAck(struct BenchRecvStream *stream, uint32_t count, uint32_t payload_bytes)
+{
+    uint32_t i;
+    (void)payload_bytes;
+
+    for(i = 0; i < count; ++i) {
+        if(BenchRecv_AppendAck(stream, (char)(MQTT_PKT_PUBACK << 4),
+                               (uint16_t)(i % 65535 + 1)) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int BenchRecv_GenSubAck(struct BenchRecvStream *stream, uint32_t count, uint32_t payload_bytes)
+{
+    char pkt[12];
+    uint32_t i;
+    (void)payload_bytes;
+
+    // eight granted topics per SUBACK
+    pkt[0] = (char)(MQTT_PKT_SUBACK << 4);
+    pkt[1] = 10;
+    memset(pkt + 4, MQTT_QOS_LEVEL1, 8);
+
+    for(i = 0; i < count; ++i) {
+        const uint16_t pkt_id = (uint16_t)(i % 65535 + 1);
+        pkt[2] = (char)(pkt_id >> 8);
+        pkt[3] = (char)(pkt_id & 0xFF);
+        if(BenchRecv_AppendBytes(stream, pkt, sizeof(pkt)) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int BenchRecv_Read(void *arg, void *buf, uint32_t count)
+{
+    struct BenchRecvStream *stream = (struct BenchRecvStream*)arg;
+    uint32_t bytes = stream->len - stream->pos;
+
+    ++stream->read_calls;
+    if(bytes > count) {
+        bytes = count;
+    }
+    if(stream->chunk && (bytes > stream->chunk)) {
+        bytes = stream->chunk;
+    }
+
+    memcpy(buf, stream->data + stream->pos, bytes);
+    stream->pos += bytes;
+    return (int)bytes;
+}
+
+static int BenchRecv_Writev(void *arg, const struct iovec *iov, int iovcnt)
+{
+    struct BenchRecvStream *stream = (struct BenchRecvStream*)arg;
+    int i, bytes = 0;
+
+    ++stream->writev_calls;
+    for(i = 0; i < iovcnt; ++i) {
+        bytes += (int)iov[i].iov_len;
+    }
+
+    stream->written_bytes += (uint64_t)bytes;
+    return bytes;
+}
+
+static int BenchRecv_HandlePublish(void *arg, uint16_t pkt_id, const char *topic,
+                                   const char *payload, uint32_t payloadsize,
+                                   int dup, enum MqttQosLevel qos)
+{
+    (void)pkt_id; (void)topic; (void)payload; (void)payloadsize; (void)dup; (void)qos;
+    ++((struct BenchRecvStream*)arg)->handled;
+    return 0;
+}
+
+static int BenchRecv_HandleCmd(void *arg, uint16_t pkt_id, const char *cmdid,
+                               int64_t timestamp, const char *desc, const char *cmdarg,
+                               uint32_t cmdarg_len, int dup, enum MqttQosLevel qos)
+{
+    (void)pkt_id; (void)cmdid; (void)timestamp; (void)desc;
+    (void)cmdarg; (void)cmdarg_len; (void)dup; (void)qos;
+    ++((struct BenchRecvStream*)arg)->handled;
+    return 0;
+}
+
+static int BenchRecv_HandleNamedCmd(void *arg, uint16_t pkt_id, const char *cmdid,
+                                    const char *cmdarg, uint32_t cmdarg_len,
+                                    int dup, enum MqttQosLevel qos, struct MqttCmdReply *reply)
+{
+    (void)pkt_id; (void)cmdid; (void)cmdarg; (void)cmdarg_len; (void)dup; (void)qos;
+    ++((struct BenchRecvStream*)arg)->handled;
+
+    reply->send = 1;
+    reply->data = "ok";
+    reply->size = 2;
+    return 0;
+}
+
+static int BenchRecv_HandleAck(void *arg, uint16_t pkt_id)
+{
+    (void)pkt_id;
+    ++((struct BenchRecvStream*)arg)->handled;
+    return 0;
+}
+
+static int BenchRecv_HandleSubAck(void *arg, uint16_t pkt_id, const char *codes, uint32_t count)
+{
+    (void)pkt_id; (void)codes; (void)count;
+    ++((struct BenchRecvStream*)arg)->handled;
+    return 0;
+}
+
+static int BenchRecv_Run(const struct BenchRecvScenario *sc, uint32_t count,
+                         uint32_t payload_bytes, uint32_t buf_size, int64_t budget_ns,
+                         struct MqttMetrics *metrics)
+{
+    struct BenchRecvStream stream;
+    struct MqttContext ctx[1];
+    struct MqttMetrics snapshot;
+    struct MqttCmdTable table;
+    char name[16];
+    uint64_t rounds = 0, messages, calls, allocs;
+    int64_t start, elapsed;
+    int err = MQTTERR_NOERROR;
+    uint32_t i;
+
+    memset(&stream, 0, sizeof(stream));
+    stream.chunk = sc->chunk;
+    if(sc->generate(&stream, count, payload_bytes) < 0) {
+        fprintf(stderr, "Failed to generate the %s stream.\n", sc->name);
+        free(stream.data);
+        return -1;
+    }
+
+    if(MQTTERR_NOERROR != Mqtt_InitContext(ctx, buf_size)) {
+        free(stream.data);
+        return -1;
+    }
+
+    ctx->read_func = BenchRecv_Read;
+    ctx->read_func_arg = &stream;
+    ctx->writev_func = BenchRecv_Writev;
+    ctx->writev_func_arg = &stream;
+    ctx->handle_publish = BenchRecv_HandlePublish;
+    ctx->handle_publish_arg = &stream;
+    ctx->handle_cmd = BenchRecv_HandleCmd;
+    ctx->handle_cmd_arg = &stream;
+    ctx->handle_pub_ack = BenchRecv_HandleAck;
+    ctx->handle_pub_ack_arg = &stream;
+    ctx->handle_pub_rel = BenchRecv_HandleAck;
+    ctx->handle_pub_rel_arg = &stream;
+    ctx->handle_sub_ack = BenchRecv_HandleSubAck;
+    ctx->handle_sub_ack_arg = &stream;
+    if(metrics) {
+        MqttMetrics_Init(metrics);
+        ctx->metrics = metrics;
+    }
+
+    if(sc->commands) {
+        if(MQTTERR_NOERROR != MqttCmdTable_Init(&table)) {
+            Mqtt_DestroyContext(ctx);
+            free(stream.data);
+            return -1;
+        }
+        for(i = 0; i < BENCH_RECV_COMMANDS; ++i) {
+            snprintf(name, sizeof(name), "set_%u", i);
+            MqttCmdTable_Add(&table, name, 0, BenchRecv_HandleNamedCmd, &stream);
+        }
+        ctx->commands = &table;
+    }
+
+    // every round replays the whole stream, the end of the stream reads as end of file
+    allocs = Bench_AllocCount();
+    start = Bench_NowNs();
+    do {
+        stream.pos = 0;
+        while(MQTTERR_NOERROR == (err = Mqtt_RecvPkt(ctx))) {
+        }
+        ++rounds;
+        elapsed = Bench_NowNs() - start;
+    } while((MQTTERR_ENDOFFILE == err) && (elapsed < budget_ns));
+    allocs = Bench_AllocCount() - allocs;
+
+    Mqtt_DestroyContext(ctx);
+    if(sc->commands) {
+        MqttCmdTable_Destroy(&table);
+    }
+
+    messages = rounds * stream.messages;
+    // every command of creq_table is answered with one writev_func call
+    if((MQTTERR_ENDOFFILE != err) || (stream.handled != messages) ||
+       (sc->commands && (stream.writev_calls != messages))) {
+        fprintf(stderr, "%s: Mqtt_RecvPkt returned %d, %lu of %lu messages handled.\n",
+                sc->name, err, (unsigned long)stream.handled, (unsigned long)messages);
+        free(stream.data);
+        return -1;
+    }
+
+    calls = stream.read_calls + stream.writev_calls;
+    printf("{\"bench\":\"recv\",\"scenario\":\"%s\",\"chunk\":%u,\"payload_bytes\":%u,"
+           "\"buf_size\":%u,\"messages\":%lu,\"stream_bytes\":%lu,\"msgs_per_sec\":%.0f,"
+           "\"bytes_per_sec\":%.0f,\"read_calls\":%lu,\"writev_calls\":%lu,"
+           "\"syscalls_per_msg\":%.3f,\"heap_allocs_per_msg\":%.3f",
+           sc->name, sc->chunk, payload_bytes, buf_size, (unsigned long)messages,
+           (unsigned long)(rounds * stream.len), messages * 1e9 / elapsed,
+           rounds * stream.len * 1e9 / elapsed, (unsigned long)stream.read_calls,
+           (unsigned long)stream.writev_calls, (double)calls / messages,
+           (double)allocs / messages);
+    if(metrics) {
+        MqttMetrics_Snapshot(metrics, &snapshot);
+        printf(",\"callback_p50_ns\":%lu,\"callback_p99_ns\":%lu,\"moved_bytes_per_msg\":%.1f,"
+               "\"allocs_per_msg\":%.3f",
+               (unsigned long)MqttHistogram_Percentile(&snapshot.callback, 50),
+               (unsigned long)MqttHistogram_Percentile(&snapshot.callback, 99),
+               (double)snapshot.recv_moved_bytes / messages, (double)snapshot.allocs / messages);
+    }
+    printf("}\n");
+    fflush(stdout);
+
+    free(stream.data);
+    return 0;
+}
+
+static void BenchRecv_Usage(const char *name)
+{
+    printf("usage: %s [options]\n", name);
+    printf("  -n messages        messages per generated stream (default 10000)\n");
+    printf("  -s bytes           PUBLISH and $creq payload size (default 64)\n");
+    printf("  -b bytes           receive buffer of the context (default 65536)\n");
+    printf("  -t ms              time budget per scenario (default 500)\n");
+    printf("  -m                 attach a MqttMetrics block to the context\n");
+    printf("  -T file            write the trace spans as Chrome trace JSON\n");
+    printf("                     (needs the SDK built with MQTT_ENABLE_TRACE)\n");
+}
+
+int main(int argc, char **argv)
+{
+    static const struct BenchRecvScenario scenarios[] = {
+        {"publish_qos0", 0, BenchRecv_GenQos0, 0},
+        {"publish_mixed", 0, BenchRecv_GenMixed, 0},
+        {"creq", 0, BenchRecv_GenCmd, 0},
+        {"creq_table", 0, BenchRecv_GenNamedCmd, 1},
+        {"puback_flood", 0, BenchRecv_GenPubAck, 0},
+        {"suback_flood", 0, BenchRecv_GenSubAck, 0},
+        {"publish_mixed_1byte", 1, BenchRecv_GenMixed, 0},
+        {"creq_1byte", 1, BenchRecv_GenCmd, 0}
+    };
+    uint32_t count = 10000, payload_bytes = 64, buf_size = 65536, i;
+    int64_t budget_ms = 500;
+    struct MqttMetrics *metrics = NULL;
+    struct MqttTraceChrome chrome;
+    struct MqttTraceHooks hooks;
+    const char *trace_file = NULL;
+    FILE *fp;
+    int failed = 0;
+    int opt;
+
+    while((opt = getopt(argc, argv, "hn:s:b:t:mT:")) != -1) {
+        switch(opt) {
+        case 'n': count = (uint32_t)atoi(optarg); break;
+        case 's': payload_bytes = (uint32_t)atoi(optarg); break;
+        case 'b': buf_size = (uint32_t)atoi(optarg); break;
+        case 't': budget_ms = atoi(optarg); break;
+        case 'm': metrics = (struct MqttMetrics*)malloc(sizeof(*metrics)); break;
+        case 'T': trace_file = optarg; break;
+        default:
+            BenchRecv_Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if(trace_file) {
+#if !MQTT_ENABLE_TRACE
+        fprintf(stderr, "The SDK is built without MQTT_ENABLE_TRACE, the trace stays empty.\n");
+#endif
+        // the buffer fills within the first rounds, later events are dropped
+        if(MQTTERR_NOERROR != MqttTraceChrome_Init(&chrome, 1 << 20)) {
+            fprintf(stderr, "Failed to allocate the trace buffer.\n");
+            return 1;
+        }
+        MqttTraceChrome_GetHooks(&chrome, &hooks);
+        MqttTrace_SetHooks(&hooks);
+    }
+
+    for(i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); ++i) {
+        if(BenchRecv_Run(scenarios + i, count, payload_bytes, buf_size,
+                         budget_ms * 1000000, metrics) < 0) {
+            failed = 1;
+        }
+    }
+
+    if(trace_file) {
+        MqttTrace_SetHooks(NULL);
+        fp = fopen(trace_file, "w");
+        if(!fp || (MqttTraceChrome_Write(&chrome, fp) < 0)) {
+            fprintf(stderr, "Failed to write %s.\n", trace_file);
+            failed = 1;
+        }
+        if(fp) {
+            fclose(fp);
+        }
+        MqttTraceChrome_Destroy(&chrome);
+    }
+
+    free(metrics);
+    return failed;
+}
@@ -0,0 +1,313 @@
+/*
+ * Scaling benchmark of MqttShardedEngine: N simulated devices connect to the
+ * local stand-in broker, then each publishes QoS1 messages with a bounded
+ * in-flight window. The run is repeated for 1, 2, 4, ... shards up to the
+ * number of online CPUs and one JSON line is printed per shard count.
+ */
+#include "mqtt/mqtt_shard.h"
+#include "bench_broker.h"
+#include "bench_util.h"
+
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct BenchShardRun {
+    uint32_t messages;
+    uint32_t window;
+    uint32_t payload_size;
+    enum MqttQosLevel qos;
+    char *payload;
+
+    uint64_t connected;
+    uint64_t acked;
+    uint64_t failed;
+};
+
+struct BenchShardConn {
+    struct BenchShardRun *run;
+    struct MqttConnection *conn;
+    uint32_t sent;
+    uint32_t acked;
+};
+
+struct BenchShardSlice {
+    struct BenchShardConn *conns;
+    uint32_t first;
+    uint32_t step;
+    uint32_t count;
+};
+
+static int BenchShard_Publish(struct BenchShardConn *bc)
+{
+    struct BenchShardRun *run = bc->run;
+    struct MqttBuffer buf[1];
+    int err;
+
+    MqttBuffer_Init(buf);
+    err = Mqtt_PackPublishPkt(buf, (uint16_t)(bc->sent % 65535 + 1), "bench/telemetry",
+                              run->payload, run->payload_size, run->qos, 0, 0);
+    if(MQTTERR_NOERROR == err) {
+        err = MqttEngine_SendPkt(bc->conn, buf);
+    }
+    MqttBuffer_Destroy(buf);
+
+    ++bc->sent;
+    if(MQTT_QOS_LEVEL0 == run->qos) {
+        __atomic_add_fetch(&run->acked, 1, __ATOMIC_RELAXED);
+    }
+
+    return err;
+}
+
+static int BenchShard_HandleConnAck(void *arg, char flags, char ret_code)
+{
+    struct BenchShardConn *bc = (struct BenchShardConn*)arg;
+    (void)flags;
+
+    __atomic_add_fetch(MQTT_CONNACK_ACCEPTED == ret_code ? &bc->run->connected :
+                       &bc->run->failed, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int BenchShard_HandlePubAck(void *arg, uint16_t pkt_id)
+{
+    struct BenchShardConn *bc = (struct BenchShardConn*)arg;
+    (void)pkt_id;
+
+    ++bc->acked;
+    __atomic_add_fetch(&bc->run->acked, 1, __ATOMIC_RELAXED);
+
+    if(bc->sent < bc->run->messages) {
+        return BenchShard_Publish(bc);
+    }
+
+    return 0;
+}
+
+static void BenchShard_HandleClose(void *arg, struct MqttConnection *conn, int err)
+{
+    struct BenchShardConn *bc = (struct BenchShardConn*)arg;
+    (void)conn;
+
+    bc->conn = NULL;
+    if(bc->acked < bc->run->messages) {
+        fprintf(stderr, "connection closed early, error %d\n", err);
+        __atomic_add_fetch(&bc->run->failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// runs on the shard thread, every connection starts with a full window
+static void BenchShard_Start(void *arg, struct MqttEngine *engine)
+{
+    struct BenchShardSlice *slice = (struct BenchShardSlice*)arg;
+    uint32_t i;
+    (void)engine;
+
+    for(i = slice->first; i < slice->count; i += slice->step) {
+        struct BenchShardConn *bc = slice->conns + i;
+        uint32_t window = bc->run->qos == MQTT_QOS_LEVEL0 ? bc->run->messages : bc->run->window;
+
+        while(bc->conn && (bc->sent < window) && (bc->sent < bc->run->messages)) {
+            if(BenchShard_Publish(bc) != MQTTERR_NOERROR) {
+                MqttEngine_CloseConnection(bc->conn, MQTTERR_IO);
+                break;
+            }
+        }
+    }
+}
+
+static int BenchShard_WaitFor(uint64_t *counter, uint64_t *failed, uint64_t target,
+                              int64_t timeout_ns)
+{
+    const int64_t deadline = Bench_NowNs() + timeout_ns;
+    struct timespec pause = {0, 200000};
+
+    while(__atomic_load_n(counter, __ATOMIC_RELAXED) + __atomic_load_n(failed, __ATOMIC_RELAXED) < target) {
+        if(Bench_NowNs() > deadline) {
+            return -1;
+        }
+        nanosleep(&pause, NULL);
+    }
+
+    return 0;
+}
+
+static int BenchShard_Run(uint16_t port, uint32_t shards, uint32_t conn_count,
+                          struct BenchShardRun *run, int pin_cpu)
+{
+    struct MqttShardedEngine se[1];
+    struct BenchShardConn *conns;
+    struct BenchShardSlice *slices;
+    struct MqttBuffer buf[1];
+    char id[32];
+    int64_t t0, t1, t2;
+    uint32_t i;
+    int err;
+
+    run->connected = run->acked = run->failed = 0;
+
+    conns = (struct BenchShardConn*)calloc(conn_count, sizeof(*conns));
+    slices = (struct BenchShardSlice*)calloc(shards, sizeof(*slices));
+    if(!conns || !slices) {
+        free(conns);
+        free(slices);
+        return -1;
+    }
+
+    err = MqttShardedEngine_Init(se, shards, conn_count / shards + 1, pin_cpu);
+    if(MQTTERR_NOERROR != err) {
+        fprintf(stderr, "Failed to init the sharded engine, errcode is %d.\n", err);
+        free(conns);
+        free(slices);
+        return -1;
+    }
+
+    t0 = Bench_NowNs();
+    MqttBuffer_Init(buf);
+    for(i = 0; i < conn_count; ++i) {
+        struct BenchShardConn *bc = conns + i;
+        struct MqttShard *shard = MqttShardedEngine_GetShard(se, i);
+
+        bc->run = run;
+        err = MqttEngine_Connect(shard->engine, "127.0.0.1", port, 4096, &bc->conn);
+        if(MQTTERR_NOERROR != err) {
+            fprintf(stderr, "Failed to connect device %u, errcode is %d.\n", i, err);
+            ++run->failed;
+            continue;
+        }
+
+        bc->conn->ctx->handle_conn_ack = BenchShard_HandleConnAck;
+        bc->conn->ctx->handle_conn_ack_arg = bc;
+        bc->conn->ctx->handle_pub_ack = BenchShard_HandlePubAck;
+        bc->conn->ctx->handle_pub_ack_arg = bc;
+        bc->conn->handle_close = BenchShard_HandleClose;
+        bc->conn->handle_close_arg = bc;
+
+        snprintf(id, sizeof(id), "bench%u", i);
+        err = Mqtt_PackConnectPkt(buf, 0, id, 1, NULL, NULL, 0, MQTT_QOS_LEVEL0, 0,
+                                  "bench", "bench", 5);
+        if(MQTTERR_NOERROR == err) {
+            err = MqttEngine_SendPkt(bc->conn, buf);
+        }
+        MqttBuffer_Reset(buf);
+    }
+    MqttBuffer_Destroy(buf);
+
+    MqttShardedEngine_Start(se);
+    if(BenchShard_WaitFor(&run->connected, &run->failed, conn_count, 60000000000LL) < 0) {
+        fprintf(stderr, "Timed out waiting for CONNACK (%lu of %u).\n",
+                (unsigned long)run->connected, conn_count);
+    }
+    t1 = Bench_NowNs();
+
+    for(i = 0; i < shards; ++i) {
+        slices[i].conns = conns;
+        slices[i].first = i;
+        slices[i].step = shards;
+        slices[i].count = conn_count;
+        MqttShard_Post(se->shards + i, BenchShard_Start, slices + i);
+    }
+
+    if(BenchShard_WaitFor(&run->acked, &run->failed,
+                          (uint64_t)run->connected * run->messages, 120000000000LL) < 0) {
+        fprintf(stderr, "Timed out waiting for PUBACK (%lu).\n", (unsigned long)run->acked);
+    }
+    t2 = Bench_NowNs();
+
+    MqttShardedEngine_Destroy(se);
+
+    printf("{\"bench\":\"shard\",\"shards\":%u,\"pinned\":%d,\"connections\":%u,"
+           "\"connected\":%lu,\"failed\":%lu,\"qos\":%d,\"payload_bytes\":%u,\"window\":%u,"
+           "\"messages\":%lu,\"connect_ms\":%.3f,\"publish_ms\":%.3f,\"msgs_per_sec\":%.0f}\n",
+           shards, pin_cpu, conn_count, (unsigned long)run->connected,
+           (unsigned long)run->failed, (int)run->qos, run->payload_size, run->window,
+           (unsigned long)run->acked, (t1 - t0) / 1e6, (t2 - t1) / 1e6,
+           run->acked / ((t2 - t1) / 1e9));
+    fflush(stdout);
+
+    free(conns);
+    free(slices);
+    return 0;
+}
+
+static void BenchShard_Usage(const char *name)
+{
+    printf("usage: %s [options]\n", name);
+    printf("  -c connections     simulated devices (default 10000)\n");
+    printf("  -m messages        messages per device (default 20)\n");
+    printf("  -w window          in-flight QoS1 messages per device (default 4)\n");
+    printf("  -s bytes           payload size (default 64)\n");
+    printf("  -q qos             0 or 1 (default 1)\n");
+    printf("  -t shards          largest shard count (default: online CPUs)\n");
+    printf("  -p                 pin each shard thread to a CPU\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct BenchBroker broker[1];
+    struct BenchShardRun run;
+    uint32_t conn_count = 10000, max_shards = 0, fd_limit, shards;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int pin_cpu = 0;
+    int opt;
+
+    memset(&run, 0, sizeof(run));
+    run.messages = 20;
+    run.window = 4;
+    run.payload_size = 64;
+    run.qos = MQTT_QOS_LEVEL1;
+
+    while((opt = getopt(argc, argv, "hc:m:w:s:q:t:p")) != -1) {
+        switch(opt) {
+        case 'c': conn_count = (uint32_t)atoi(optarg); break;
+        case 'm': run.messages = (uint32_t)atoi(optarg); break;
+        case 'w': run.window = (uint32_t)atoi(optarg); break;
+        case 's': run.payload_size = (uint32_t)atoi(optarg); break;
+        case 'q': run.qos = atoi(optarg) ? MQTT_QOS_LEVEL1 : MQTT_QOS_LEVEL0; break;
+        case 't': max_shards = (uint32_t)atoi(optarg); break;
+        case 'p': pin_cpu = 1; break;
+        default:
+            BenchShard_Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if(0 == max_shards) {
+        max_shards = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+
+    // every device needs a descriptor on both the client and the broker side
+    fd_limit = Bench_RaiseFdLimit();
+    if(2 * conn_count + 64 > fd_limit) {
+        conn_count = (fd_limit - 64) / 2;
+        fprintf(stderr, "The descriptor limit is %u, using %u connections.\n",
+                fd_limit, conn_count);
+    }
+
+    run.payload = (char*)malloc(run.payload_size + 1);
+    memset(run.payload, 'x', run.payload_size);
+
+    if(BenchBroker_Start(broker, 0) < 0) {
+        fprintf(stderr, "Failed to start the stand-in broker.\n");
+        return 1;
+    }
+
+    for(shards = 1; ; shards *= 2) {
+        if(shards > max_shards) {
+            shards = max_shards;
+        }
+
+        BenchShard_Run(broker->port, shards, conn_count, &run, pin_cpu);
+        if(shards == max_shards) {
+            break;
+        }
+    }
+
+    BenchBroker_Stop(broker);
+    free(run.payload);
+    return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * Subscription routing benchmark: a MqttSubTrie holding many filters is
+ * compared with the linear scan an application does without it, matching
+ * every filter against every incoming topic. Both must report the same
+ * number of matches per topic. One JSON line is printed per run, and the
+ * process fails when the two disagree or the trie does not empty out.
+ */
+#include "mqtt/mqtt_sub_trie.h"
+#include "bench_util.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_SUB_TRIE_NAME_LEN 48
+
+struct BenchSubTrie {
+    char (*filters)[BENCH_SUB_TRIE_NAME_LEN];
+    char (*topics)[BENCH_SUB_TRIE_NAME_LEN];
+    uint32_t filter_count;
+    uint32_t topic_count;
+    uint64_t handled;
+};
+
+static int BenchSubTrie_Handle(void *arg, uint16_t pkt_id, const char *topic,
+                               const char *payload, uint32_t payloadsize,
+                               int dup, enum MqttQosLevel qos)
+{
+    ++((struct BenchSubTrie*)arg)->handled;
+    return 0;
+}
+
+// MQTT topic matching the way an application would do it, one filter at a time
+static int BenchSubTrie_LinearMatch(const char *filter, const char *topic)
+{
+    if(('$' == *topic) && (('+' == *filter) || ('#' == *filter))) {
+        return 0;
+    }
+
+    for(;;) {
+        if('#' == *filter) {
+            return 1;
+        }
+
+        const int plus = '+' == *filter;
+
+        if(plus) {
+            ++filter;
+        }
+        else {
+            while(('\0' != *filter) && ('/' != *filter) && (*filter == *topic)) {
+                ++filter;
+                ++topic;
+            }
+            if(('\0' != *filter) && ('/' != *filter)) {
+                return 0;
+            }
+        }
+
+        // skip what '+' matched, or fail when the topic level is longer
+        while(('\0' != *topic) && ('/' != *topic)) {
+            if(!plus) {
+                return 0;
+            }
+            ++topic;
+        }
+
+        if('\0' == *filter) {
+            return '\0' == *topic;
+        }
+
+        // "a/#" also matches "a"
+        if('\0' == *topic) {
+            return 0 == strcmp(filter, "/#");
+        }
+
+        ++filter;
+        ++topic;
+    }
+}
+
+// a mix of exact filters and filters with '+' or '#', all different
+static void BenchSubTrie_Generate(struct BenchSubTrie *bench)
+{
+    uint32_t i, site;
+
+    for(i = 0; i < bench->filter_count; ++i) {
+        site = i % 64;
+        switch(i % 16) {
+        case 12:
+        case 13:
+            snprintf(bench->filters[i], BENCH_SUB_TRIE_NAME_LEN, "site/%u/dev/+/m%u", site, i);
+            break;
+        case 14:
+            snprintf(bench->filters[i], BENCH_SUB_TRIE_NAME_LEN, "site/%u/#", 64 + i);
+            break;
+        case 15:
+            snprintf(bench->filters[i], BENCH_SUB_TRIE_NAME_LEN, "+/%u/dev/%u/temp", site, i);
+            break;
+        default:
+            snprintf(bench->filters[i], BENCH_SUB_TRIE_NAME_LEN, "site/%u/dev/%u/temp", site, i);
+            break;
+        }
+    }
+
+    // every topic is a concrete instance of some filter, a quarter match nothing
+    for(i = 0; i < bench->topic_count; ++i) {
+        const uint32_t n = (uint32_t)(((uint64_t)i * 2654435761u) % bench->filter_count);
+
+        site = n % 64;
+        if(3 == i % 4) {
+            snprintf(bench->topics[i], BENCH_SUB_TRIE_NAME_LEN, "site/%u/dev/%u/humidity", site, n);
+            continue;
+        }
+
+        switch(n % 16) {
+        case 12:
+        case 13:
+            snprintf(bench->topics[i], BENCH_SUB_TRIE_NAME_LEN, "site/%u/dev/x%u/m%u", site, i, n);
+            break;
+        case 14:
+            snprintf(bench->topics[i], BENCH_SUB_TRIE_NAME_LEN, "site/%u/a/b", 64 + n);
+            break;
+        case 15:
+            snprintf(bench->topics[i], BENCH_SUB_TRIE_NAME_LEN, "zone/%u/dev/%u/temp", site, n);
+            break;
+        default:
+            snprintf(bench->topics[i], BENCH_SUB_TRIE_NAME_LEN, "site/%u/dev/%u/temp", site, n);
+            break;
+        }
+    }
+}
+
+static void BenchSubTrie_Usage(const char *name)
+{
+    printf("usage: %s [options]\n", name);
+    printf("  -n filters         registered filters (default 10000)\n");
+    printf("  -p topics          distinct incoming topics (default 1024)\n");
+    printf("  -t ms              time budget per method (default 500)\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct BenchSubTrie bench;
+    struct MqttSubTrie trie;
+    uint32_t filter_count = 10000, topic_count = 1024, i, j;
+    uint64_t linear_matches = 0, trie_matches = 0, rounds;
+    int64_t budget_ns = 500 * 1000000LL, start, build_ns, trie_ns, linear_ns, remove_ns;
+    int failed = 0, err, opt;
+
+    while((opt = getopt(argc, argv, "hn:p:t:")) != -1) {
+        switch(opt) {
+        case 'n': filter_count = (uint32_t)atoi(optarg); break;
+        case 'p': topic_count = (uint32_t)atoi(optarg); break;
+        case 't': budget_ns = atoi(optarg) * 1000000LL; break;
+        default:
+            BenchSubTrie_Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if(!filter_count || !topic_count) {
+        BenchSubTrie_Usage(argv[0]);
+        return 1;
+    }
+
+    memset(&bench, 0, sizeof(bench));
+    bench.filter_count = filter_count;
+    bench.topic_count = topic_count;
+    bench.filters = malloc((size_t)filter_count * BENCH_SUB_TRIE_NAME_LEN);
+    bench.topics = malloc((size_t)topic_count * BENCH_SUB_TRIE_NAME_LEN);
+    if(!bench.filters || !bench.topics || (MqttSubTrie_Init(&trie) < 0)) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+    BenchSubTrie_Generate(&bench);
+
+    start = Bench_NowNs();
+    for(i = 0; i < filter_count; ++i) {
+        err = MqttSubTrie_Add(&trie, bench.filters[i], BenchSubTrie_Handle, &bench);
+        if(err < 0) {
+            fprintf(stderr, "Failed to add %s: %d.\n", bench.filters[i], err);
+            return 1;
+        }
+    }
+    build_ns = Bench_NowNs() - start;
+
+    // the same answers first, then the timing
+    for(i = 0; i < topic_count; ++i) {
+        uint32_t expected = 0;
+        for(j = 0; j < filter_count; ++j) {
+            expected += (uint32_t)BenchSubTrie_LinearMatch(bench.filters[j], bench.topics[i]);
+        }
+        err = MqttSubTrie_Dispatch(&trie, 0, bench.topics[i], "", 0, 0, MQTT_QOS_LEVEL0);
+        if(err != (int)expected) {
+            fprintf(stderr, "%s: the trie matched %d filters, the linear scan %u.\n",
+                    bench.topics[i], err, expected);
+            failed = 1;
+        }
+        linear_matches += expected;
+    }
+
+    start = Bench_NowNs();
+    for(rounds = 0; Bench_NowNs() - start < budget_ns; ++rounds) {
+        for(i = 0; i < topic_count; ++i) {
+            trie_matches += (uint32_t)MqttSubTrie_Dispatch(&trie, 0, bench.topics[i], "", 0,
+                                                           0, MQTT_QOS_LEVEL0);
+        }
+    }
+    trie_ns = (Bench_NowNs() - start) / (int64_t)(rounds * topic_count);
+
+    start = Bench_NowNs();
+    for(rounds = 0; Bench_NowNs() - start < budget_ns; ++rounds) {
+        for(i = 0; i < topic_count; ++i) {
+            for(j = 0; j < filter_count; ++j) {
+                if(BenchSubTrie_LinearMatch(bench.filters[j], bench.topics[i])) {
+                    BenchSubTrie_Handle(&bench, 0, bench.topics[i], "", 0, 0, MQTT_QOS_LEVEL0);
+                }
+            }
+        }
+    }
+    linear_ns = (Bench_NowNs() - start) / (int64_t)(rounds * topic_count);
+
+    printf("{\"bench\":\"sub_trie\",\"filters\":%u,\"topics\":%u,\"nodes\":%u,"
+           "\"matches_per_topic\":%.3f,\"add_ns\":%lld,\"trie_ns\":%lld,\"linear_ns\":%lld,",
+           trie.filters, topic_count, trie.nodes, (double)linear_matches / topic_count,
+           (long long)(build_ns / filter_count), (long long)trie_ns, (long long)linear_ns);
+
+    start = Bench_NowNs();
+    for(i = 0; i < filter_count; ++i) {
+        if(MqttSubTrie_Remove(&trie, bench.filters[i]) < 0) {
+            failed = 1;
+        }
+    }
+    remove_ns = Bench_NowNs() - start;
+    if(trie.filters || trie.nodes) {
+        failed = 1;
+    }
+
+    printf("\"remove_ns\":%lld,\"ok\":%s}\n", (long long)(remove_ns / filter_count),
+           failed ? "false" : "true");
+    fflush(stdout);
+
+    MqttSubTrie_Destroy(&trie);
+    free(bench.filters);
+    free(bench.topics);
+    return failed;
+}
@@ -0,0 +1,270 @@
+/*
+ * Resubscribe benchmark: a gateway resubscribing thousands of filters after a
+ * reconnect packs them with Mqtt_PackSubscribePkt (one QoS for all), with
+ * Mqtt_PackSubscribePkt plus Mqtt_AppendSubscribeTopic, and with
+ * Mqtt_PackSubscribeBatch (per-topic QoS) into one packet and split at a
+ * packet size limit. Every output carrying per-topic QoS is received by a
+ * server side context and checked topic by topic. Reports the packing cost
+ * per topic, the allocations and extents per resubscribe. One JSON line per
+ * method.
+ */
+#include "mqtt/mqtt.h"
+#include "bench_util.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum BenchSubMethod {
+    BENCH_SUB_PACK,
+    BENCH_SUB_APPEND,
+    BENCH_SUB_BATCH,
+    BENCH_SUB_BATCH_SPLIT
+};
+
+static const char *bench_sub_methods[] = {"pack", "append", "batch", "batch_split"};
+
+struct BenchSubFilters {
+    const char **names;
+    struct MqttSubscribeTopic *topics;
+    uint32_t count;
+};
+
+struct BenchSubStream {
+    char *data;
+    uint32_t size;
+    uint32_t pos;
+    const struct BenchSubFilters *filters;
+    uint32_t received;
+    uint32_t mismatches;
+};
+
+static int BenchSub_GenFilters(struct BenchSubFilters *filters, uint32_t count)
+{
+    static const char *kinds[] = {"telemetry/#", "cmd/+/request", "ota/+", "config"};
+    char name[128];
+    uint32_t i;
+
+    filters->names = (const char**)calloc(count, sizeof(const char*));
+    filters->topics = (struct MqttSubscribeTopic*)calloc(count, sizeof(struct MqttSubscribeTopic));
+    if(!filters->names || !filters->topics) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    for(i = 0; i < count; ++i) {
+        sprintf(name, "gw/7f3a/site-%02u/dev-%06u/%s", i % 32, i, kinds[i % 4]);
+        filters->names[i] = strdup(name);
+        if(!filters->names[i]) {
+            return MQTTERR_OUTOFMEMORY;
+        }
+        filters->topics[i].topic = filters->names[i];
+        filters->topics[i].len = (uint16_t)strlen(name);
+        filters->topics[i].qos = (enum MqttQosLevel)(i % 4 == 1 ? MQTT_QOS_LEVEL1 : MQTT_QOS_LEVEL0);
+    }
+
+    filters->count = count;
+    return MQTTERR_NOERROR;
+}
+
+static void BenchSub_FreeFilters(struct BenchSubFilters *filters)
+{
+    uint32_t i;
+
+    for(i = 0; filters->names && (i < filters->count); ++i) {
+        free((char*)filters->names[i]);
+    }
+    free(filters->names);
+    free(filters->topics);
+}
+
+static int BenchSub_Pack(enum BenchSubMethod method, const struct BenchSubFilters *filters,
+                         uint32_t max_pkt_size, struct MqttBuffer *buf, uint32_t *pkts)
+{
+    uint32_t i;
+    int err;
+
+    *pkts = 1;
+    switch(method) {
+    case BENCH_SUB_PACK:
+        return Mqtt_PackSubscribePkt(buf, 1, MQTT_QOS_LEVEL0, filters->names,
+                                     (int)filters->count);
+
+    case BENCH_SUB_APPEND:
+        err = Mqtt_PackSubscribePkt(buf, 1, filters->topics[0].qos, filters->names, 1);
+        for(i = 1; (i < filters->count) && (MQTTERR_NOERROR == err); ++i) {
+            err = Mqtt_AppendSubscribeTopic(buf, filters->names[i], filters->topics[i].qos);
+        }
+        return err;
+
+    case BENCH_SUB_BATCH:
+        return Mqtt_PackSubscribeBatch(buf, 1, filters->topics, filters->count, 0, pkts);
+
+    default:
+        return Mqtt_PackSubscribeBatch(buf, 1, filters->topics, filters->count,
+                                       max_pkt_size, pkts);
+    }
+}
+
+static int BenchSub_Read(void *arg, void *buf, uint32_t count)
+{
+    struct BenchSubStream *stream = (struct BenchSubStream*)arg;
+    uint32_t n = stream->size - stream->pos;
+
+    n = n < count ? n : count;
+    memcpy(buf, stream->data + stream->pos, n);
+    stream->pos += n;
+    return (int)n;
+}
+
+static int BenchSub_Writev(void *arg, const struct iovec *iov, int iovcnt)
+{
+    int i, bytes = 0;
+
+    (void)arg;
+    for(i = 0; i < iovcnt; ++i) {
+        bytes += (int)iov[i].iov_len;
+    }
+    return bytes;
+}
+
+static int BenchSub_HandleSubscribe(void *arg, uint16_t pkt_id, const char *topic,
+                                    enum MqttQosLevel qos)
+{
+    struct BenchSubStream *stream = (struct BenchSubStream*)arg;
+    const struct MqttSubscribeTopic *expected = stream->filters->topics + stream->received;
+
+    (void)pkt_id;
+    if((stream->received >= stream->filters->count) ||
+       (0 != strcmp(topic, expected->topic)) || (qos != expected->qos)) {
+        ++stream->mismatches;
+    }
+    ++stream->received;
+    return qos;
+}
+
+// feeds the packets through a server side context, returns the mismatching topics
+static int BenchSub_Verify(const struct BenchSubFilters *filters, const struct MqttBuffer *buf)
+{
+    struct BenchSubStream stream;
+    struct MqttContext ctx[1];
+    struct MqttExtent *ext;
+    int err = MQTTERR_NOERROR;
+
+    memset(&stream, 0, sizeof(stream));
+    stream.filters = filters;
+    stream.data = (char*)malloc(buf->buffered_bytes);
+    if(!stream.data || (MQTTERR_NOERROR != Mqtt_InitContext(ctx, buf->buffered_bytes))) {
+        free(stream.data);
+        return -1;
+    }
+
+    for(ext = buf->first_ext; ext; ext = ext->next) {
+        memcpy(stream.data + stream.size, ext->payload, ext->len);
+        stream.size += ext->len;
+    }
+
+    ctx->read_func = BenchSub_Read;
+    ctx->read_func_arg = &stream;
+    ctx->writev_func = BenchSub_Writev;
+    ctx->handle_subscribe = BenchSub_HandleSubscribe;
+    ctx->handle_subscribe_arg = &stream;
+    while((stream.pos < stream.size) && (err >= 0)) {
+        err = Mqtt_RecvPkt(ctx);
+    }
+
+    Mqtt_DestroyContext(ctx);
+    free(stream.data);
+    return (err < 0) || (stream.received != filters->count) ? -1 : (int)stream.mismatches;
+}
+
+static int BenchSub_Run(enum BenchSubMethod method, const struct BenchSubFilters *filters,
+                        uint32_t max_pkt_size, uint32_t rounds)
+{
+    struct MqttBuffer buf[1];
+    struct MqttExtent *ext;
+    int64_t start, elapsed = 0;
+    uint64_t allocs = 0;
+    uint32_t i, pkts = 0, extents = 0, bytes = 0;
+    int err = MQTTERR_NOERROR, mismatches = 0;
+
+    MqttBuffer_Init(buf);
+    for(i = 0; (i < rounds) && (MQTTERR_NOERROR == err); ++i) {
+        MqttBuffer_Reset(buf);
+        allocs -= Bench_AllocCount();
+        start = Bench_NowNs();
+        err = BenchSub_Pack(method, filters, max_pkt_size, buf, &pkts);
+        elapsed += Bench_NowNs() - start;
+        allocs += Bench_AllocCount();
+    }
+
+    if(MQTTERR_NOERROR == err) {
+        for(ext = buf->first_ext; ext; ext = ext->next) {
+            ++extents;
+        }
+        bytes = buf->buffered_bytes;
+        if(BENCH_SUB_PACK != method) {
+            mismatches = BenchSub_Verify(filters, buf);
+        }
+    }
+    MqttBuffer_Destroy(buf);
+
+    if((MQTTERR_NOERROR != err) || (0 != mismatches)) {
+        fprintf(stderr, "%s: failed, error %d, %d mismatches.\n",
+                bench_sub_methods[method], err, mismatches);
+        return -1;
+    }
+
+    printf("{\"bench\":\"subscribe_batch\",\"method\":\"%s\",\"topics\":%u,"
+           "\"max_pkt_size\":%u,\"pkts\":%u,\"wire_bytes\":%u,\"extents\":%u,"
+           "\"allocs\":%.1f,\"ns_per_topic\":%.1f}\n",
+           bench_sub_methods[method], filters->count,
+           BENCH_SUB_BATCH_SPLIT == method ? max_pkt_size : 0, pkts, bytes, extents,
+           (double)allocs / rounds, (double)elapsed / rounds / filters->count);
+    fflush(stdout);
+    return 0;
+}
+
+static void BenchSub_Usage(const char *name)
+{
+    printf("usage: %s [options]\n", name);
+    printf("  -t topics          filters per resubscribe (default 5000)\n");
+    printf("  -r rounds          resubscribes per method (default 200)\n");
+    printf("  -m bytes           packet size limit of batch_split (default 4096)\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct BenchSubFilters filters;
+    uint32_t count = 5000, rounds = 200, max_pkt_size = 4096, method;
+    int failed = 0, opt;
+
+    while((opt = getopt(argc, argv, "ht:r:m:")) != -1) {
+        switch(opt) {
+        case 't': count = (uint32_t)atol(optarg); break;
+        case 'r': rounds = (uint32_t)atol(optarg); break;
+        case 'm': max_pkt_size = (uint32_t)atol(optarg); break;
+        default:
+            BenchSub_Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if((0 == count) || (0 == rounds) || (max_pkt_size < 128)) {
+        BenchSub_Usage(argv[0]);
+        return 1;
+    }
+
+    memset(&filters, 0, sizeof(filters));
+    if(MQTTERR_NOERROR != BenchSub_GenFilters(&filters, count)) {
+        BenchSub_FreeFilters(&filters);
+        return 1;
+    }
+
+    for(method = BENCH_SUB_PACK; method <= BENCH_SUB_BATCH_SPLIT; ++method) {
+        failed |= BenchSub_Run((enum BenchSubMethod)method, &filters, max_pkt_size, rounds) < 0;
+    }
+
+    BenchSub_FreeFilters(&filters);
+    return failed ? 1 : 0;
+}
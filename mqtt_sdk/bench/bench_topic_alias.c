@@ -0,0 +1,258 @@
+/*
+ * MQTT 5 topic alias benchmark: small payloads are published round robin to
+ * a set of long custom topics, once with Mqtt_PackPublishPkt and once with
+ * Mqtt_PackPublishPktV5 after a simulated CONNACK granting the alias table,
+ * then received through Mqtt_RecvPkt with an in-memory read_func and checked
+ * against the expected topic. Reports the wire bytes and the packing and
+ * receiving cost per message. One JSON line is printed per topic set.
+ */
+#include "mqtt/mqtt.h"
+#include "mqtt/mqtt_v5.h"
+#include "bench_util.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_ALIAS_MAX_TOPICS 1024
+
+struct BenchAliasStream {
+    char *data;
+    uint32_t size;
+    uint32_t capacity;
+    uint32_t pos;
+    char **topics;
+    uint32_t topic_count;
+    uint32_t payload_size;
+    uint32_t received;
+    uint32_t mismatches;
+};
+
+// a telemetry topic of 60 to 100 bytes as used by gateways forwarding sub devices
+static void BenchAlias_GenTopic(char *out, uint32_t index)
+{
+    static const char *channels[] = {
+        "temperature", "humidity", "vibration/rms", "power/active", "door/state"
+    };
+
+    sprintf(out, "factory/shenzhen-bao-an/building-%02u/line-%u/gateway-7f3a/device-%08x/"
+            "telemetry/%s", index % 12, index % 5, index * 2654435761u,
+            channels[index % 5]);
+}
+
+static int BenchAlias_Append(struct BenchAliasStream *stream, struct MqttBuffer *buf)
+{
+    struct MqttExtent *ext;
+    char *data;
+
+    if(stream->size + buf->buffered_bytes > stream->capacity) {
+        stream->capacity = (stream->size + buf->buffered_bytes) * 2;
+        data = (char*)realloc(stream->data, stream->capacity);
+        if(!data) {
+            return MQTTERR_OUTOFMEMORY;
+        }
+        stream->data = data;
+    }
+
+    for(ext = buf->first_ext; ext; ext = ext->next) {
+        memcpy(stream->data + stream->size, ext->payload, ext->len);
+        stream->size += ext->len;
+    }
+    return MQTTERR_NOERROR;
+}
+
+static int BenchAlias_Read(void *arg, void *buf, uint32_t count)
+{
+    struct BenchAliasStream *stream = (struct BenchAliasStream*)arg;
+    uint32_t n = stream->size - stream->pos;
+
+    n = n < count ? n : count;
+    memcpy(buf, stream->data + stream->pos, n);
+    stream->pos += n;
+    return (int)n;
+}
+
+static int BenchAlias_HandlePublish(void *arg, uint16_t pkt_id, const char *topic,
+                                    const char *payload, uint32_t payloadsize,
+                                    int dup, enum MqttQosLevel qos)
+{
+    struct BenchAliasStream *stream = (struct BenchAliasStream*)arg;
+    const char *expected = stream->topics[stream->received % stream->topic_count];
+
+    (void)pkt_id; (void)payload; (void)dup; (void)qos;
+    ++stream->received;
+    if((payloadsize != stream->payload_size) || (0 != strcmp(topic, expected))) {
+        ++stream->mismatches;
+    }
+    return 0;
+}
+
+// packs count messages round robin over the topics into stream, returns the packing time
+static int64_t BenchAlias_Pack(struct MqttV5Session *session, struct BenchAliasStream *stream,
+                               const char *payload, uint32_t count)
+{
+    struct MqttBuffer buf[1];
+    int64_t start, elapsed = 0;
+    const char *topic;
+    uint32_t i;
+    int err = MQTTERR_NOERROR;
+
+    MqttBuffer_Init(buf);
+    for(i = 0; (i < count) && (MQTTERR_NOERROR == err); ++i) {
+        topic = stream->topics[i % stream->topic_count];
+        start = Bench_NowNs();
+        if(session) {
+            err = Mqtt_PackPublishPktV5(session, buf, 1, topic, payload, stream->payload_size,
+                                        MQTT_QOS_LEVEL0, 0, 0);
+        }
+        else {
+            err = Mqtt_PackPublishPkt(buf, 1, topic, payload, stream->payload_size,
+                                      MQTT_QOS_LEVEL0, 0, 0);
+        }
+        elapsed += Bench_NowNs() - start;
+        if(MQTTERR_NOERROR == err) {
+            err = BenchAlias_Append(stream, buf);
+        }
+        MqttBuffer_Reset(buf);
+    }
+    MqttBuffer_Destroy(buf);
+
+    return MQTTERR_NOERROR == err ? elapsed : -1;
+}
+
+static int64_t BenchAlias_Recv(struct MqttV5Session *session, struct BenchAliasStream *stream)
+{
+    struct MqttContext ctx[1];
+    int64_t start, elapsed;
+    int err = MQTTERR_NOERROR;
+
+    if(MQTTERR_NOERROR != Mqtt_InitContext(ctx, 64 * 1024)) {
+        return -1;
+    }
+    ctx->read_func = BenchAlias_Read;
+    ctx->read_func_arg = stream;
+    ctx->handle_publish = BenchAlias_HandlePublish;
+    ctx->handle_publish_arg = stream;
+    ctx->v5 = session;
+
+    start = Bench_NowNs();
+    while((stream->pos < stream->size) && (err >= 0)) {
+        err = Mqtt_RecvPkt(ctx);
+    }
+    elapsed = Bench_NowNs() - start;
+
+    Mqtt_DestroyContext(ctx);
+    return err >= 0 ? elapsed : -1;
+}
+
+static int BenchAlias_Run(char **topics, uint32_t topic_count, uint32_t alias_max,
+                          uint32_t payload_size, uint32_t count)
+{
+    struct BenchAliasStream plain, aliased;
+    struct MqttV5Session sender, receiver;
+    char payload[1024], connack_props[4];
+    int64_t plain_pack, alias_pack, plain_recv, alias_recv;
+    uint32_t i, topic_bytes = 0;
+    int failed;
+
+    for(i = 0; i < payload_size; ++i) {
+        payload[i] = (char)('0' + i % 10);
+    }
+    for(i = 0; i < topic_count; ++i) {
+        topic_bytes += (uint32_t)strlen(topics[i]);
+    }
+
+    memset(&plain, 0, sizeof(plain));
+    plain.topics = topics;
+    plain.topic_count = topic_count;
+    plain.payload_size = payload_size;
+    aliased = plain;
+
+    // the server grants alias_max aliases, the receiver accepts as many
+    MqttV5Session_Init(&sender);
+    MqttV5Session_Init(&receiver);
+    sender.topic_alias_maximum = (uint16_t)alias_max;
+    receiver.topic_alias_maximum = (uint16_t)alias_max;
+    connack_props[0] = 3;
+    connack_props[1] = MQTT_V5_PROP_TOPIC_ALIAS_MAXIMUM;
+    connack_props[2] = (char)(alias_max >> 8);
+    connack_props[3] = (char)alias_max;
+    failed = MqttV5Session_HandleConnAckProps(&sender, connack_props, 4) < 0;
+
+    plain_pack = BenchAlias_Pack(NULL, &plain, payload, count);
+    alias_pack = BenchAlias_Pack(&sender, &aliased, payload, count);
+    plain_recv = BenchAlias_Recv(NULL, &plain);
+    alias_recv = BenchAlias_Recv(&receiver, &aliased);
+
+    failed = failed || (plain_pack < 0) || (alias_pack < 0) || (plain_recv < 0) ||
+        (alias_recv < 0) || (aliased.received != count) || (aliased.mismatches != 0) ||
+        (plain.mismatches != 0);
+    if(failed) {
+        fprintf(stderr, "topics %u: failed, %u of %u received, %u mismatches.\n",
+                topic_count, aliased.received, count, aliased.mismatches);
+    }
+    else {
+        printf("{\"bench\":\"topic_alias\",\"topics\":%u,\"avg_topic_bytes\":%.1f,"
+               "\"alias_max\":%u,\"payload_bytes\":%u,\"pkts\":%u,"
+               "\"alias_hit_rate\":%.3f,\"wire_bytes_v311\":%.1f,\"wire_bytes_v5\":%.1f,"
+               "\"pack_ns_v311\":%.1f,\"pack_ns_v5\":%.1f,"
+               "\"recv_ns_v311\":%.1f,\"recv_ns_v5\":%.1f}\n",
+               topic_count, (double)topic_bytes / topic_count, alias_max, payload_size, count,
+               (double)sender.alias_hits / count,
+               (double)plain.size / count, (double)aliased.size / count,
+               (double)plain_pack / count, (double)alias_pack / count,
+               (double)plain_recv / count, (double)alias_recv / count);
+        fflush(stdout);
+    }
+
+    MqttV5Session_Destroy(&sender);
+    MqttV5Session_Destroy(&receiver);
+    free(plain.data);
+    free(aliased.data);
+    return failed ? -1 : 0;
+}
+
+static void BenchAlias_Usage(const char *name)
+{
+    printf("usage: %s [options]\n", name);
+    printf("  -n pkts            packets per topic set (default 200000)\n");
+    printf("  -a aliases         Topic Alias Maximum granted by the server (default 16)\n");
+    printf("  -s bytes           payload size, at most 1024 (default 24)\n");
+}
+
+int main(int argc, char **argv)
+{
+    static const uint32_t topic_counts[] = {1, 8, 16, 64};
+    static char *topics[BENCH_ALIAS_MAX_TOPICS];
+    static char storage[BENCH_ALIAS_MAX_TOPICS][128];
+    uint32_t count = 200000, alias_max = 16, payload_size = 24, i;
+    int failed = 0, opt;
+
+    while((opt = getopt(argc, argv, "hn:a:s:")) != -1) {
+        switch(opt) {
+        case 'n': count = (uint32_t)atol(optarg); break;
+        case 'a': alias_max = (uint32_t)atoi(optarg); break;
+        case 's': payload_size = (uint32_t)atoi(optarg); break;
+        default:
+            BenchAlias_Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if((alias_max > 65535) || (payload_size > 1024)) {
+        BenchAlias_Usage(argv[0]);
+        return 1;
+    }
+
+    for(i = 0; i < BENCH_ALIAS_MAX_TOPICS; ++i) {
+        BenchAlias_GenTopic(storage[i], i);
+        topics[i] = storage[i];
+    }
+
+    for(i = 0; i < sizeof(topic_counts) / sizeof(topic_counts[0]); ++i) {
+        failed |= BenchAlias_Run(topics, topic_counts[i], alias_max, payload_size, count) < 0;
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,418 @@
+/*
+ * Compares the io_uring transport with the epoll engine on one thread: every
+ * device publishes QoS1 messages with a bounded in-flight window to the local
+ * stand-in broker, and the system calls made by the client thread during the
+ * publish phase are counted. The epoll side is counted by interposing the
+ * socket calls libmqtt makes, the io_uring side counts its io_uring_enter calls.
+ * One JSON line is printed per backend.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // RTLD_NEXT
+#endif
+
+#include "mqtt/mqtt_engine.h"
+#include "mqtt/mqtt_uring.h"
+#include "bench_broker.h"
+#include "bench_util.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// only the client thread counts, the broker thread makes the same calls
+static __thread int bench_counting;
+static __thread uint64_t bench_syscalls;
+
+ssize_t recv(int fd, void *buf, size_t len, int flags)
+{
+    static ssize_t (*next)(int, void*, size_t, int);
+    if(!next) {
+        next = (ssize_t (*)(int, void*, size_t, int))dlsym(RTLD_NEXT, "recv");
+    }
+    bench_syscalls += bench_counting;
+    return next(fd, buf, len, flags);
+}
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+    static ssize_t (*next)(int, const struct msghdr*, int);
+    if(!next) {
+        next = (ssize_t (*)(int, const struct msghdr*, int))dlsym(RTLD_NEXT, "sendmsg");
+    }
+    bench_syscalls += bench_counting;
+    return next(fd, msg, flags);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+    static int (*next)(int, struct epoll_event*, int, int);
+    if(!next) {
+        next = (int (*)(int, struct epoll_event*, int, int))dlsym(RTLD_NEXT, "epoll_wait");
+    }
+    bench_syscalls += bench_counting;
+    return next(epfd, events, maxevents, timeout);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    static int (*next)(int, int, int, struct epoll_event*);
+    if(!next) {
+        next = (int (*)(int, int, int, struct epoll_event*))dlsym(RTLD_NEXT, "epoll_ctl");
+    }
+    bench_syscalls += bench_counting;
+    return next(epfd, op, fd, event);
+}
+
+struct BenchUringRun {
+    uint32_t messages;
+    uint32_t window;
+    uint32_t payload_size;
+    char *payload;
+
+    uint64_t connected;
+    uint64_t acked;
+    uint64_t failed;
+};
+
+struct BenchUringConn {
+    struct BenchUringRun *run;
+    struct MqttContext *ctx;
+    int (*send_pkt)(struct BenchUringConn *bc, const struct MqttBuffer *buf);
+    void *conn;
+    uint32_t sent;
+    uint32_t acked;
+};
+
+static int BenchUring_SendEngine(struct BenchUringConn *bc, const struct MqttBuffer *buf)
+{
+    return MqttEngine_SendPkt((struct MqttConnection*)bc->conn, buf);
+}
+
+static int BenchUring_SendUring(struct BenchUringConn *bc, const struct MqttBuffer *buf)
+{
+    return MqttUring_SendPkt((struct MqttUringConn*)bc->conn, buf);
+}
+
+static int BenchUring_Publish(struct BenchUringConn *bc)
+{
+    struct BenchUringRun *run = bc->run;
+    struct MqttBuffer buf[1];
+    int err;
+
+    MqttBuffer_Init(buf);
+    err = Mqtt_PackPublishPkt(buf, (uint16_t)(bc->sent % 65535 + 1), "bench/telemetry",
+                              run->payload, run->payload_size, MQTT_QOS_LEVEL1, 0, 0);
+    if(MQTTERR_NOERROR == err) {
+        err = bc->send_pkt(bc, buf);
+    }
+    MqttBuffer_Destroy(buf);
+
+    ++bc->sent;
+    return err;
+}
+
+static int BenchUring_HandleConnAck(void *arg, char flags, char ret_code)
+{
+    struct BenchUringConn *bc = (struct BenchUringConn*)arg;
+    (void)flags;
+
+    if(MQTT_CONNACK_ACCEPTED == ret_code) {
+        ++bc->run->connected;
+    }
+    else {
+        ++bc->run->failed;
+    }
+    return 0;
+}
+
+static int BenchUring_HandlePubAck(void *arg, uint16_t pkt_id)
+{
+    struct BenchUringConn *bc = (struct BenchUringConn*)arg;
+    (void)pkt_id;
+
+    ++bc->acked;
+    ++bc->run->acked;
+
+    if(bc->sent < bc->run->messages) {
+        return BenchUring_Publish(bc);
+    }
+
+    return 0;
+}
+
+static void BenchUring_HandleEngineClose(void *arg, struct MqttConnection *conn, int err)
+{
+    struct BenchUringConn *bc = (struct BenchUringConn*)arg;
+    (void)conn;
+
+    bc->conn = NULL;
+    if(bc->acked < bc->run->messages) {
+        fprintf(stderr, "connection closed early, error %d\n", err);
+        ++bc->run->failed;
+    }
+}
+
+static void BenchUring_HandleUringClose(void *arg, struct MqttUringConn *conn, int err)
+{
+    (void)conn;
+    BenchUring_HandleEngineClose(arg, NULL, err);
+}
+
+static int BenchUring_Dial(uint16_t port)
+{
+    struct sockaddr_in addr;
+    int fd, on = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+static void BenchUring_Setup(struct BenchUringConn *bc, uint32_t index)
+{
+    struct MqttBuffer buf[1];
+    char id[32];
+
+    bc->ctx->handle_conn_ack = BenchUring_HandleConnAck;
+    bc->ctx->handle_conn_ack_arg = bc;
+    bc->ctx->handle_pub_ack = BenchUring_HandlePubAck;
+    bc->ctx->handle_pub_ack_arg = bc;
+
+    MqttBuffer_Init(buf);
+    snprintf(id, sizeof(id), "bench%u", index);
+    if((Mqtt_PackConnectPkt(buf, 0, id, 1, NULL, NULL, 0, MQTT_QOS_LEVEL0, 0,
+                            "bench", "bench", 5) != MQTTERR_NOERROR) ||
+       (bc->send_pkt(bc, buf) != MQTTERR_NOERROR)) {
+        ++bc->run->failed;
+    }
+    MqttBuffer_Destroy(buf);
+}
+
+static void BenchUring_StartWindow(struct BenchUringConn *conns, uint32_t conn_count)
+{
+    uint32_t i;
+
+    for(i = 0; i < conn_count; ++i) {
+        struct BenchUringConn *bc = conns + i;
+        while(bc->conn && (bc->sent < bc->run->window) && (bc->sent < bc->run->messages)) {
+            if(BenchUring_Publish(bc) != MQTTERR_NOERROR) {
+                ++bc->run->failed;
+                break;
+            }
+        }
+    }
+}
+
+static void BenchUring_Report(const char *backend, struct BenchUringRun *run,
+                              uint32_t conn_count, uint64_t syscalls, int64_t ns)
+{
+    printf("{\"bench\":\"uring\",\"backend\":\"%s\",\"connections\":%u,\"connected\":%lu,"
+           "\"failed\":%lu,\"payload_bytes\":%u,\"window\":%u,\"messages\":%lu,"
+           "\"publish_ms\":%.3f,\"msgs_per_sec\":%.0f,\"syscalls\":%lu,"
+           "\"syscalls_per_msg\":%.3f}\n",
+           backend, conn_count, (unsigned long)run->connected, (unsigned long)run->failed,
+           run->payload_size, run->window, (unsigned long)run->acked, ns / 1e6,
+           run->acked / (ns / 1e9), (unsigned long)syscalls,
+           run->acked ? (double)syscalls / run->acked : 0.0);
+    fflush(stdout);
+}
+
+static int BenchUring_RunEngine(uint16_t port, uint32_t conn_count, struct BenchUringRun *run)
+{
+    struct MqttEngine engine[1];
+    struct BenchUringConn *conns;
+    const int64_t deadline = Bench_NowNs() + 120000000000LL;
+    uint64_t target;
+    int64_t t0;
+    uint32_t i;
+
+    run->connected = run->acked = run->failed = 0;
+    conns = (struct BenchUringConn*)calloc(conn_count, sizeof(*conns));
+    if(!conns || (MqttEngine_Init(engine, conn_count) != MQTTERR_NOERROR)) {
+        free(conns);
+        return -1;
+    }
+
+    for(i = 0; i < conn_count; ++i) {
+        struct MqttConnection *conn;
+        struct BenchUringConn *bc = conns + i;
+
+        bc->run = run;
+        if(MqttEngine_Connect(engine, "127.0.0.1", port, 4096, &conn) != MQTTERR_NOERROR) {
+            ++run->failed;
+            continue;
+        }
+
+        conn->handle_close = BenchUring_HandleEngineClose;
+        conn->handle_close_arg = bc;
+        bc->conn = conn;
+        bc->ctx = conn->ctx;
+        bc->send_pkt = BenchUring_SendEngine;
+        BenchUring_Setup(bc, i);
+    }
+
+    while((run->connected + run->failed < conn_count) && (Bench_NowNs() < deadline)) {
+        MqttEngine_RunOnce(engine, 100);
+    }
+
+    target = run->connected * run->messages;
+    bench_syscalls = 0;
+    bench_counting = 1;
+    t0 = Bench_NowNs();
+
+    BenchUring_StartWindow(conns, conn_count);
+    while((run->acked < target) && (run->failed == 0) && (Bench_NowNs() < deadline)) {
+        MqttEngine_RunOnce(engine, 100);
+    }
+
+    bench_counting = 0;
+    BenchUring_Report("epoll", run, conn_count, bench_syscalls, Bench_NowNs() - t0);
+
+    MqttEngine_Destroy(engine);
+    free(conns);
+    return 0;
+}
+
+static int BenchUring_RunUring(uint16_t port, uint32_t conn_count, struct BenchUringRun *run)
+{
+    struct MqttUring ring[1];
+    struct BenchUringConn *conns;
+    const int64_t deadline = Bench_NowNs() + 120000000000LL;
+    uint64_t target, enter_calls;
+    int64_t t0;
+    uint32_t i;
+    int err;
+
+    run->connected = run->acked = run->failed = 0;
+    conns = (struct BenchUringConn*)calloc(conn_count, sizeof(*conns));
+    if(!conns) {
+        return -1;
+    }
+
+    err = MqttUring_Init(ring, 4096, 4096, 4096);
+    if(MQTTERR_NOERROR != err) {
+        fprintf(stderr, "io_uring is not available, errcode is %d.\n", err);
+        free(conns);
+        return -1;
+    }
+
+    for(i = 0; i < conn_count; ++i) {
+        struct MqttUringConn *conn;
+        struct BenchUringConn *bc = conns + i;
+        int fd = BenchUring_Dial(port);
+
+        bc->run = run;
+        if((fd < 0) || (MqttUring_AddConnection(ring, fd, 4096, &conn) != MQTTERR_NOERROR)) {
+            if(fd >= 0) {
+                close(fd);
+            }
+            ++run->failed;
+            continue;
+        }
+
+        conn->handle_close = BenchUring_HandleUringClose;
+        conn->handle_close_arg = bc;
+        bc->conn = conn;
+        bc->ctx = conn->ctx;
+        bc->send_pkt = BenchUring_SendUring;
+        BenchUring_Setup(bc, i);
+    }
+
+    while((run->connected + run->failed < conn_count) && (Bench_NowNs() < deadline)) {
+        MqttUring_RunOnce(ring, 100);
+    }
+
+    target = run->connected * run->messages;
+    enter_calls = ring->enter_calls;
+    t0 = Bench_NowNs();
+
+    BenchUring_StartWindow(conns, conn_count);
+    while((run->acked < target) && (run->failed == 0) && (Bench_NowNs() < deadline)) {
+        MqttUring_RunOnce(ring, 100);
+    }
+
+    BenchUring_Report("io_uring", run, conn_count, ring->enter_calls - enter_calls,
+                      Bench_NowNs() - t0);
+
+    MqttUring_Destroy(ring);
+    free(conns);
+    return 0;
+}
+
+static void BenchUring_Usage(const char *name)
+{
+    printf("usage: %s [options]\n", name);
+    printf("  -c connections     simulated devices (default 100)\n");
+    printf("  -m messages        messages per device (default 2000)\n");
+    printf("  -w window          in-flight QoS1 messages per device (default 8)\n");
+    printf("  -s bytes           payload size (default 64)\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct BenchBroker broker[1];
+    struct BenchUringRun run;
+    uint32_t conn_count = 100, fd_limit;
+    int opt;
+
+    memset(&run, 0, sizeof(run));
+    run.messages = 2000;
+    run.window = 8;
+    run.payload_size = 64;
+
+    while((opt = getopt(argc, argv, "hc:m:w:s:")) != -1) {
+        switch(opt) {
+        case 'c': conn_count = (uint32_t)atoi(optarg); break;
+        case 'm': run.messages = (uint32_t)atoi(optarg); break;
+        case 'w': run.window = (uint32_t)atoi(optarg); break;
+        case 's': run.payload_size = (uint32_t)atoi(optarg); break;
+        default:
+            BenchUring_Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    fd_limit = Bench_RaiseFdLimit();
+    if(2 * conn_count + 64 > fd_limit) {
+        conn_count = (fd_limit - 64) / 2;
+        fprintf(stderr, "The descriptor limit is %u, using %u connections.\n",
+                fd_limit, conn_count);
+    }
+
+    run.payload = (char*)malloc(run.payload_size + 1);
+    memset(run.payload, 'x', run.payload_size);
+
+    if(BenchBroker_Start(broker, 0) < 0) {
+        fprintf(stderr, "Failed to start the stand-in broker.\n");
+        return 1;
+    }
+
+    BenchUring_RunEngine(broker->port, conn_count, &run);
+    BenchUring_RunUring(broker->port, conn_count, &run);
+
+    BenchBroker_Stop(broker);
+    free(run.payload);
+    return 0;
+}
@@ -0,0 +1,61 @@
+#include "bench_util.h"
+
+#include <sys/resource.h>
+#include <stdlib.h>
+#include <time.h>
+
+int64_t Bench_NowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint32_t Bench_RaiseFdLimit(void)
+{
+    struct rlimit rl;
+
+    if(getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        return 1024;
+    }
+
+    if(rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    return rl.rlim_cur > UINT32_MAX ? UINT32_MAX : (uint32_t)rl.rlim_cur;
+}
+
+static int Bench_CompareSamples(const void *a, const void *b)
+{
+    const int64_t x = *(const int64_t*)a;
+    const int64_t y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+void Bench_SortSamples(int64_t *samples, uint32_t count)
+{
+    qsort(samples, count, sizeof(int64_t), Bench_CompareSamples);
+}
+
+int64_t Bench_Percentile(const int64_t *sorted, uint32_t count, double percent)
+{
+    uint32_t idx;
+
+    if(0 == count) {
+        return 0;
+    }
+
+    // nearest rank
+    idx = (uint32_t)(percent / 100.0 * count + 0.999999);
+    if(idx < 1) {
+        idx = 1;
+    }
+    if(idx > count) {
+        idx = count;
+    }
+
+    return sorted[idx - 1];
+}
@@ -0,0 +1,53 @@
+#ifndef ONENET_BENCH_UTIL_H
+#define ONENET_BENCH_UTIL_H
+
+#include <stdint.h>
+
+/**
+ * 返回单调时钟的当前时间(纳秒)
+ */
+int64_t Bench_NowNs(void);
+
+/**
+ * 将进程可打开的文件描述符个数提高到硬限制
+ * @return 调整后的文件描述符上限
+ */
+uint32_t Bench_RaiseFdLimit(void);
+
+/**
+ * 将样本按升序排序
+ * @param samples 样本数组
+ * @param count 样本个数
+ */
+void Bench_SortSamples(int64_t *samples, uint32_t count);
+/**
+ * 获取已排序样本的百分位数
+ * @param sorted 升序排列的样本数组
+ * @param count 样本个数
+ * @param percent 百分位，如50、99、99.9
+ * @return 对应的样本值，没有样本时返回0
+ */
+int64_t Bench_Percentile(const int64_t *sorted, uint32_t count, double percent);
+
+/**
+ * 返回当前线程调用malloc、calloc和realloc的累计次数，
+ * 只有链接了bench_alloc.c的程序才能使用
+ */
+uint64_t Bench_AllocCount(void);
+/**
+ * 返回当前线程通过malloc、calloc和realloc申请的累计字节数，
+ * 只有链接了bench_alloc.c的程序才能使用
+ */
+uint64_t Bench_AllocBytes(void);
+/**
+ * 禁止或允许当前线程申请堆内存，禁止时malloc、calloc和realloc返回NULL，
+ * 只有链接了bench_alloc.c的程序才能使用
+ * @param forbid 非0时禁止
+ */
+void Bench_ForbidAlloc(int forbid);
+/**
+ * 返回当前线程在禁止期间被拒绝的申请次数
+ */
+uint64_t Bench_RefusedAllocs(void);
+
+#endif // ONENET_BENCH_UTIL_H
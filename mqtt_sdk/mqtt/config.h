@@ -17,4 +17,11 @@ struct iovec {
 
 #define MQTT_DEFAULT_ALIGNMENT sizeof(int)
 
+/**
+ * 为1时把跟踪钩子(@see mqtt_trace.h)编译进SDK，为0时跟踪代码完全不参与编译
+ */
+#ifndef MQTT_ENABLE_TRACE
+#define MQTT_ENABLE_TRACE 0
+#endif
+
 #endif // ONENET_CONFIG_H
@@ -31,7 +31,9 @@ enum MqttError {
     MQTTERR_INTERNAL                 = -11,/**< 系统内部错误 */
     MQTTERR_NOT_IN_SUBOBJECT         = -12,/**< 调用Mqtt_AppendDPFinishObject，但没有匹配的Mqtt_AppendDPStartObject */
     MQTTERR_INCOMPLETE_SUBOBJECT     = -13,/**< 调用Mqtt_PackDataPointFinish时，包含的子数据结构不完整 */
-    MQTTERR_FAILED_SEND_RESPONSE     = -14 /**< 处理publish系列消息后，发送响应包失败 */
+    MQTTERR_FAILED_SEND_RESPONSE     = -14,/**< 处理publish系列消息后，发送响应包失败 */
+    MQTTERR_TIMEOUT                  = -15,/**< 等待服务器响应超时 */
+    MQTTERR_QUOTA_EXCEEDED           = -16 /**< 未确认的发布数据达到服务器的接收上限(MQTT 5) */
 };
 
 /** MQTT数据包类型 */
@@ -111,6 +113,12 @@ enum MqttSaveDataType{
 };
 
     
+struct MqttMetrics;
+struct MqttSubTrie;
+struct MqttCmdTable;
+struct MqttCompression;
+struct MqttV5Session;
+
 /** MQTT 运行时上下文 */
 struct MqttContext {
     char *bgn;
@@ -190,6 +198,65 @@ struct MqttContext {
              dup为命令是否为重发状态， qos为QoS等级
 			 成功则返回非负数
          */
+
+    /* 以下回调函数用于服务器端(如测试用的本地服务器替身)，客户端不需要设置，
+       为NULL时收到对应的数据包将返回MQTTERR_ILLEGAL_PKT */
+    void *handle_connect_arg; /**< 处理连接请求的回调函数的关联参数 */
+    int (*handle_connect)(void *arg, const char *id, uint16_t keep_alive,
+                          int clean_session, const char *will_topic,
+                          const char *will_msg, uint16_t msg_len,
+                          enum MqttQosLevel will_qos, int will_retain,
+                          const char *user, const char *password, uint16_t pswd_len);
+        /**< 处理连接请求的回调函数，参数的含义同 @see Mqtt_PackConnectPkt，
+             没有的字段为NULL，返回 @see MqttRetCode 中的连接返回码，接受连接并
+             保留了原会话时返回MQTT_CONNACK_ACCEPTED | (MQTT_CONNACK_SP << 8)，
+             SDK将会自动发送CONNACK，失败返回负数
+         */
+
+    void *handle_subscribe_arg; /**< 处理订阅的回调函数的关联参数 */
+    int (*handle_subscribe)(void *arg, uint16_t pkt_id, const char *topic,
+                            enum MqttQosLevel qos);
+        /**< 处理订阅的回调函数，订阅数据包中的每个topic调用一次，返回授予的QoS等级
+             或MQTT_SUBACK_FAILUER，全部处理完后SDK将会自动发送SUBACK，失败返回负数
+         */
+
+    void *handle_unsubscribe_arg; /**< 处理取消订阅的回调函数的关联参数 */
+    int (*handle_unsubscribe)(void *arg, uint16_t pkt_id, const char *topic);
+        /**< 处理取消订阅的回调函数，取消订阅数据包中的每个topic调用一次，
+             全部处理完后SDK将会自动发送UNSUBACK，成功则返回非负数
+         */
+
+    void *handle_ping_req_arg; /**< 处理ping请求的回调函数的关联参数 */
+    int (*handle_ping_req)(void *arg);
+        /**< 处理ping请求的回调函数，成功则返回非负数，SDK将会自动发送PINGRESP */
+
+    void *handle_disconnect_arg; /**< 处理断开连接的回调函数的关联参数 */
+    int (*handle_disconnect)(void *arg);
+        /**< 处理断开连接的回调函数，成功则返回非负数 */
+
+    struct MqttMetrics *metrics;
+        /**< 统计数据，为NULL(默认)时不统计，由使用者分配并用 @see MqttMetrics_Init 初始化，
+             须在上下文销毁后释放 */
+
+    struct MqttSubTrie *subscriptions;
+        /**< 订阅表，为NULL(默认)时除命令($creq)外的发布数据都交给handle_publish，
+             否则交给匹配的过滤器(包括"$SYS/#"等以'$'开头的过滤器)的处理函数，
+             没有匹配的过滤器时才调用handle_publish
+             (为NULL时忽略该数据)，@see MqttSubTrie_Dispatch */
+
+    struct MqttCmdTable *commands;
+        /**< 命令表，为NULL(默认)时所有命令都交给handle_cmd，否则按命令名交给注册的
+             处理函数并自动发送其设置的回复，没有匹配的处理函数时才调用handle_cmd
+             (为NULL时忽略该命令)，@see MqttCmdTable_Add */
+
+    struct MqttCompression *compression;
+        /**< 负载压缩，为NULL(默认)时不解压，否则不以'$'开头的topic收到的带压缩头部的
+             负载先解压再交给处理函数，发送时用 @see MqttCompression_PackPublishPkt 封装 */
+
+    struct MqttV5Session *v5;
+        /**< MQTT 5会话，为NULL(默认)时使用MQTT 3.1.1，否则按MQTT 5的格式解析服务器发来的
+             数据包并还原topic别名，CONNACK等的原因码通过ret_code和会话的reason_code给出，
+             @see MqttV5Session_Init，只用于客户端 */
 };
 
 /**
@@ -263,6 +330,20 @@ int Mqtt_PackPublishPkt(struct MqttBuffer *buf, uint16_t pkt_id, const char *top
                         const char *payload, uint32_t size,
                         enum MqttQosLevel qos, int retain, int own);
 
+/**
+ * 封装负载为共享数据块的发布数据包，同一负载发布到多个topic或连接时只保存一份
+ * @param buf 存储数据包的缓冲区对象
+ * @param pkt_id 数据包ID，非0
+ * @param topic 数据发送到哪个topic
+ * @param shared 共享数据块，buf持有一个引用，重置或销毁时释放
+ * @param qos QoS等级
+ * @param retain 非0时，服务器将该publish消息保存到topic下，并替换已有的publish消息
+ * @return 成功则返回MQTTERR_NOERROR
+ */
+int Mqtt_PackPublishSharedPkt(struct MqttBuffer *buf, uint16_t pkt_id, const char *topic,
+                              struct MqttSharedPayload *shared, enum MqttQosLevel qos,
+                              int retain);
+
 /**
  * 设置发布数据数据包为重发的发布数据数据包
  * @param buf 存储有PUBLISH数据包的缓冲区
@@ -309,6 +390,36 @@ int Mqtt_PackSubscribePkt(struct MqttBuffer *buf, uint16_t pkt_id,
  */
     int Mqtt_AppendUnsubscribeTopic(struct MqttBuffer *buf, const char *topic);
 
+/** 批量订阅或取消订阅中的一个topic */
+struct MqttSubscribeTopic {
+    const char *topic;     /**< topic过滤器，不需要以'\0'结尾 */
+    uint16_t len;          /**< topic的字节数，非0 */
+    enum MqttQosLevel qos; /**< 订阅的QoS等级，取消订阅时忽略 */
+};
+
+/**
+ * 批量封装订阅数据包，每个topic可使用不同的QoS，数据包超过max_pkt_size时
+ * 自动拆分为多个数据包，依次存放在buf中
+ * @param buf 存储数据包的缓冲区对象
+ * @param pkt_id 第一个数据包的ID，非0，之后的数据包依次加1(跳过0)
+ * @param topics 订阅的topic
+ * @param count topics的个数
+ * @param max_pkt_size 一个数据包最多的字节数(含固定头部)，为0时只受协议的上限限制
+ * @param pkt_count 保存封装的数据包个数，可为NULL
+ * @return 成功返回MQTTERR_NOERROR，单个topic就超过max_pkt_size时返回MQTTERR_PKT_TOO_LARGE
+ * @remark 每个数据包只占用一个内存块，topic只被读取一次用于检查、一次用于拷贝
+ */
+int Mqtt_PackSubscribeBatch(struct MqttBuffer *buf, uint16_t pkt_id,
+                            const struct MqttSubscribeTopic *topics, uint32_t count,
+                            uint32_t max_pkt_size, uint32_t *pkt_count);
+/**
+ * 批量封装取消订阅数据包，参数的含义同 @see Mqtt_PackSubscribeBatch，topics的qos被忽略
+ * @return 成功返回MQTTERR_NOERROR
+ */
+int Mqtt_PackUnsubscribeBatch(struct MqttBuffer *buf, uint16_t pkt_id,
+                              const struct MqttSubscribeTopic *topics, uint32_t count,
+                              uint32_t max_pkt_size, uint32_t *pkt_count);
+
 /**
  * 封装ping数据包
  * @param buf 存储数据包的缓冲区对象
@@ -323,6 +434,41 @@ int Mqtt_PackSubscribePkt(struct MqttBuffer *buf, uint16_t pkt_id,
  */
 int Mqtt_PackDisconnectPkt(struct MqttBuffer *buf);
 
+/**
+ * 封装连接确认数据包(服务器端使用)
+ * @param buf 存储数据包的缓冲区对象
+ * @param flags 连接确认标志， @see MqttConnAckFlag
+ * @param ret_code 连接返回码， @see MqttRetCode
+ * @return 成功返回MQTTERR_NOERROR
+ */
+int Mqtt_PackConnAckPkt(struct MqttBuffer *buf, char flags, char ret_code);
+
+/**
+ * 封装订阅确认数据包(服务器端使用)
+ * @param buf 存储数据包的缓冲区对象
+ * @param pkt_id 被确认的订阅数据包的ID
+ * @param codes 按顺序对应订阅数据包中每个topic的返回码， @see MqttRetCode
+ * @param count codes的个数
+ * @return 成功返回MQTTERR_NOERROR
+ */
+int Mqtt_PackSubAckPkt(struct MqttBuffer *buf, uint16_t pkt_id,
+                       const char *codes, uint32_t count);
+
+/**
+ * 封装取消订阅确认数据包(服务器端使用)
+ * @param buf 存储数据包的缓冲区对象
+ * @param pkt_id 被确认的取消订阅数据包的ID
+ * @return 成功返回MQTTERR_NOERROR
+ */
+int Mqtt_PackUnsubAckPkt(struct MqttBuffer *buf, uint16_t pkt_id);
+
+/**
+ * 封装ping响应数据包(服务器端使用)
+ * @param buf 存储数据包的缓冲区对象
+ * @return 成功返回MQTTERR_NOERROR
+ */
+int Mqtt_PackPingRespPkt(struct MqttBuffer *buf);
+
 /**
  * 封装命令返回数据包(OneNet扩展)
  * @param buf 存储数据包的缓冲区对象
@@ -337,6 +483,111 @@ int Mqtt_PackDisconnectPkt(struct MqttBuffer *buf);
 int Mqtt_PackCmdRetPkt(struct MqttBuffer *buf, uint16_t pkt_id, const char *cmdid,
                        const char *ret, uint32_t ret_len,  enum MqttQosLevel qos, int own);
 
+/**
+ * 开始封装由多个数据点组成的数据点数据包(OneNet扩展)，之后用Mqtt_AppendDP*系列函数
+ * 添加数据点，最后调用 @see Mqtt_PackDataPointFinish 结束封装
+ * @param buf 存储数据包的缓冲区对象，必须为空
+ * @param pkt_id 数据包ID，非0
+ * @param qos QoS等级
+ * @param retain 非0时，服务器将该publish消息保存到topic下，并替换已有的publish消息
+ * @param topic 非0时发布到"$dp"，否则发布到"$crsp/"
+ * @return 成功返回MQTTERR_NOERROR
+ */
+int Mqtt_PackDataPointStart(struct MqttBuffer *buf, uint16_t pkt_id,
+                            enum MqttQosLevel qos, int retain, int topic);
+/**
+ * 添加值为null的数据点
+ * @param buf 存储数据点数据包的缓冲区对象
+ * @param dsid 数据流ID
+ * @return 成功返回MQTTERR_NOERROR
+ */
+int Mqtt_AppendDPNull(struct MqttBuffer *buf, const char *dsid);
+/**
+ * 添加整数类型的数据点
+ * @param buf 存储数据点数据包的缓冲区对象
+ * @param dsid 数据流ID
+ * @param ts 毫秒时间戳，为0或负数时，系统取默认时间
+ * @param value 数据点的值
+ * @return 成功返回MQTTERR_NOERROR
+ */
+int Mqtt_AppendDPInt(struct MqttBuffer *buf, const char *dsid, int64_t ts, int value);
+/**
+ * 添加浮点类型的数据点
+ * @param buf 存储数据点数据包的缓冲区对象
+ * @param dsid 数据流ID
+ * @param ts 毫秒时间戳，为0或负数时，系统取默认时间
+ * @param value 数据点的值
+ * @return 成功返回MQTTERR_NOERROR
+ */
+int Mqtt_AppendDPDouble(struct MqttBuffer *buf, const char *dsid, int64_t ts, double value);
+/**
+ * 添加字符串类型的数据点
+ * @param buf 存储数据点数据包的缓冲区对象
+ * @param dsid 数据流ID
+ * @param ts 毫秒时间戳，为0或负数时，系统取默认时间
+ * @param value 数据点的值，必须是UTF-8编码，为NULL时作为空字符串
+ * @return 成功返回MQTTERR_NOERROR
+ */
+int Mqtt_AppendDPString(struct MqttBuffer *buf, const char *dsid, int64_t ts, const char *value);
+/**
+ * 开始添加对象类型的数据点，之后用Mqtt_AppendDPSubvalue*系列函数添加其成员，
+ * 最后调用 @see Mqtt_AppendDPFinishObject
+ * @param buf 存储数据点数据包的缓冲区对象
+ * @param dsid 数据流ID
+ * @param ts 毫秒时间戳，为0或负数时，系统取默认时间
+ * @return 成功返回MQTTERR_NOERROR
+ */
+int Mqtt_AppendDPStartObject(struct MqttBuffer *buf, const char *dsid, int64_t ts);
+/**
+ * 结束添加对象类型的数据点
+ * @param buf 存储数据点数据包的缓冲区对象
+ * @return 成功返回MQTTERR_NOERROR
+ */
+int Mqtt_AppendDPFinishObject(struct MqttBuffer *buf);
+/**
+ * 添加整数类型的对象成员
+ * @param buf 存储数据点数据包的缓冲区对象
+ * @param name 成员名称
+ * @param value 成员的值
+ * @return 成功返回MQTTERR_NOERROR
+ */
+int Mqtt_AppendDPSubvalueInt(struct MqttBuffer *buf, const char *name, int value);
+/**
+ * 添加浮点类型的对象成员
+ * @param buf 存储数据点数据包的缓冲区对象
+ * @param name 成员名称
+ * @param value 成员的值
+ * @return 成功返回MQTTERR_NOERROR
+ */
+int Mqtt_AppendDPSubvalueDouble(struct MqttBuffer *buf, const char *name, double value);
+/**
+ * 添加字符串类型的对象成员
+ * @param buf 存储数据点数据包的缓冲区对象
+ * @param name 成员名称
+ * @param value 成员的值，必须是UTF-8编码
+ * @return 成功返回MQTTERR_NOERROR
+ */
+int Mqtt_AppendDPSubvalueString(struct MqttBuffer *buf, const char *name, const char *value);
+/**
+ * 开始添加对象类型的成员，最后调用 @see Mqtt_AppendDPFinishSubobject
+ * @param buf 存储数据点数据包的缓冲区对象
+ * @param name 成员名称
+ * @return 成功返回MQTTERR_NOERROR
+ */
+int Mqtt_AppendDPStartSubobject(struct MqttBuffer *buf, const char *name);
+/**
+ * 结束添加对象类型的成员
+ * @param buf 存储数据点数据包的缓冲区对象
+ * @return 成功返回MQTTERR_NOERROR
+ */
+int Mqtt_AppendDPFinishSubobject(struct MqttBuffer *buf);
+/**
+ * 结束封装数据点数据包
+ * @param buf 存储数据点数据包的缓冲区对象
+ * @return 成功返回MQTTERR_NOERROR，有未结束的对象时返回MQTTERR_INCOMPLETE_SUBOBJECT
+ */
+int Mqtt_PackDataPointFinish(struct MqttBuffer *buf);
+
 /**
  * 封装二进制类型数据点（OneNet扩展）,支持数据类型type=2
  * @param buf 存储数据包的缓冲区对象
@@ -377,6 +628,48 @@ int Mqtt_PackDataPointByString(struct MqttBuffer *buf, uint16_t pkt_id, int64_t
                                    int32_t type, const char *str, uint32_t size,
                                    enum MqttQosLevel qos, int retain, int own);
 
+/**
+ * 批量封装浮点类型数据点（OneNet扩展，类型7），一次遍历时间戳和值的数组。
+ * 一个类型7的负载只有一个类型和时间，其后是若干组"数据流编号、个数(1～500)、
+ * 浮点数"，因此时间戳在同一秒的相邻数据点放在一个数据包中，每500个一组；
+ * 每个不同的秒一个数据包，依次存放在buf中。浮点数按低位在前(小端)写入
+ * @param buf 存储数据包的缓冲区对象
+ * @param pkt_id 第一个数据包的ID，非0，之后的数据包依次加1(跳过0)
+ * @param ds_name 数据流编号
+ * @param ts 秒级时间戳的数组，与values一一对应，为0或负数的元素取当前时间；
+ *           为NULL时所有数据点放在一个不带时间的数据包中
+ * @param values 数据点的值
+ * @param count 数据点个数，非0
+ * @param qos QoS等级
+ * @param retain 非0时，服务器将该publish消息保存到topic下，并替换已有的publish消息
+ * @param pkt_count 保存封装的数据包个数，失败时为buf中已封装的完整数据包个数，可为NULL
+ * @return 成功返回MQTTERR_NOERROR
+ * @remark values被拷贝到缓冲区；除数据块外不申请内存
+ */
+int Mqtt_PackDataPointFloats(struct MqttBuffer *buf, uint16_t pkt_id, uint16_t ds_name,
+                             const int64_t *ts, const float *values, uint32_t count,
+                             enum MqttQosLevel qos, int retain, uint32_t *pkt_count);
+
+/**
+ * 批量封装带时间的字符串类型数据点（OneNet扩展，类型6），与
+ * @see Mqtt_PackDataPointByString 相同，每个数据点一个数据包，依次存放在buf中，
+ * 时间的转换按秒缓存
+ * @param buf 存储数据包的缓冲区对象
+ * @param pkt_id 第一个数据包的ID，非0，之后的数据包依次加1(跳过0)
+ * @param ts 秒级时间戳的数组，规则同 @see Mqtt_PackDataPointFloats
+ * @param values 数据点的值
+ * @param sizes values中每个字符串的字节数，不超过65535，为NULL时values必须以'\0'结尾
+ * @param count 数据点个数，非0
+ * @param qos QoS等级
+ * @param retain 非0时，服务器将该publish消息保存到topic下，并替换已有的publish消息
+ * @param pkt_count 保存封装的数据包个数，失败时为buf中已封装的完整数据包个数，可为NULL
+ * @return 成功返回MQTTERR_NOERROR
+ * @remark values被拷贝到缓冲区
+ */
+int Mqtt_PackDataPointStrings(struct MqttBuffer *buf, uint16_t pkt_id, const int64_t *ts,
+                              const char *const *values, const uint32_t *sizes, uint32_t count,
+                              enum MqttQosLevel qos, int retain, uint32_t *pkt_count);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif // __cplusplus
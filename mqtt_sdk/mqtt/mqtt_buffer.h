@@ -15,6 +15,39 @@ struct MqttExtent {
     struct MqttExtent *next;
 };
 
+/**
+ * 引用计数的共享数据块，可同时加入多个缓冲区(如同一负载发布到多个topic或连接)，
+ * 内存中只保存一份，最后一个引用释放时才释放数据。引用计数为原子操作，可跨线程使用
+ */
+struct MqttSharedPayload {
+    char *data;    /**< 数据的起始地址 */
+    uint32_t size; /**< 数据的字节数 */
+
+    /* 以下成员内部使用 */
+    uint32_t refs;
+    void (*release)(void *arg, char *data);
+    void *release_arg;
+};
+
+struct MqttSharedRef;
+
+/**
+ * 缓冲区申请内存块(chunk)的策略，所有成员为0时与默认策略相同：
+ * 每个内存块至少1024字节，不增长
+ */
+struct MqttBufferPolicy {
+    uint32_t initial_size;   /**< 第一个从堆上申请的内存块的最小字节数，0表示1024 */
+    uint32_t growth_factor;  /**< 之后每个内存块的最小字节数是前一个的几倍，0和1表示不增长 */
+    uint32_t max_chunk_size;
+        /**< 内存块最小字节数增长的上限，0表示不限制；单个数据块更大时仍按其大小申请 */
+    char *initial_buffer;
+        /**< 调用者提供的初始内存(如栈上的数组)，先于堆内存使用，SDK不会释放，
+             缓冲区重置后重新使用，为NULL时不使用 */
+    uint32_t initial_buffer_size; /**< 初始内存的字节数 */
+    int fixed_storage;
+        /**< 非0时只使用initial_buffer，用完后分配失败而不申请堆内存，@see MqttBuffer_InitFixed */
+};
+
 struct MqttBuffer {
     struct MqttExtent *first_ext;
     struct MqttExtent *last_ext;
@@ -25,6 +58,35 @@ struct MqttBuffer {
     uint32_t alloc_count;
     uint32_t alloc_max_count;
     uint32_t buffered_bytes;
+
+    /* 以下成员用于统计，@see MqttBuffer_GetStats */
+    uint32_t requested_bytes; /**< 通过MqttBuffer_AllocExtent申请的字节数 */
+    uint32_t extent_count;    /**< 分配的数据块个数 */
+    uint32_t allocated_bytes; /**< 从堆上申请的内存块(chunk)的总字节数 */
+
+    /* 以下成员为内存块策略，@see MqttBuffer_SetPolicy */
+    struct MqttBufferPolicy policy;
+    uint32_t next_chunk_size;
+
+    struct MqttSharedRef *shared_refs; /**< 缓冲区持有的共享数据块引用，重置时释放 */
+};
+
+/**
+ * 缓冲区的内存统计。单个缓冲区的统计在重置前只增不减，
+ * 全局统计包括进程内所有缓冲区
+ */
+struct MqttBufferStats {
+    uint64_t requested_bytes; /**< MqttBuffer_AllocExtent申请的字节数(不含数据块头部) */
+    uint64_t extents;         /**< 分配的数据块个数，每个占用sizeof(struct MqttExtent)字节的头部 */
+    uint64_t allocated_bytes;
+        /**< 内存块的总字节数，单个缓冲区的统计包括调用者提供的初始内存，全局统计只包括堆内存 */
+    uint64_t chunks;          /**< 从堆上申请的内存块个数 */
+    uint64_t live_bytes;      /**< 尚未释放的内存块字节数 */
+    uint64_t live_chunks;     /**< 尚未释放的内存块个数，进程退出前不为0说明有缓冲区未销毁 */
+    uint64_t peak_bytes;      /**< live_bytes的最大值 */
+    double fragmentation;
+        /**< 内存块中没有用于数据的比例：1 - requested_bytes / allocated_bytes，
+             包括数据块头部、对齐填充和内存块末尾未用完的部分 */
 };
 
 /**
@@ -32,6 +94,24 @@ struct MqttBuffer {
  * @param buf 被初始化的缓冲区对象
  */
 void MqttBuffer_Init(struct MqttBuffer *buf);
+/**
+ * 初始化只使用调用者提供的内存的缓冲区，不会申请堆内存
+ * @param buf 被初始化的缓冲区对象
+ * @param storage 调用者提供的内存(如静态数组)，在buf销毁前必须一直有效
+ * @param size storage的字节数
+ * @remark 内存用完后 @see MqttBuffer_AllocExtent 返回NULL，
+ *         各Mqtt_PackXxx函数返回MQTTERR_OUTOFMEMORY；重置后从头使用storage
+ */
+void MqttBuffer_InitFixed(struct MqttBuffer *buf, char *storage, uint32_t size);
+/**
+ * 设置缓冲区申请内存块的策略，缓冲区重置后策略仍然有效
+ * @param buf 缓冲区对象，必须是刚初始化或重置后的空缓冲区
+ * @param policy 内存块策略，被复制，为NULL时恢复默认策略
+ * @return 成功则返回MQTTERR_NOERROR，缓冲区不为空时返回MQTTERR_INVALID_PARAMETER
+ * @remark 使用initial_buffer时，数据包的数据块可能位于调用者提供的内存中，
+ *         交给发送队列等保存数据包的模块时内容被复制，@see MqttBuffer_Move
+ */
+int MqttBuffer_SetPolicy(struct MqttBuffer *buf, const struct MqttBufferPolicy *policy);
 /**
  * 销毁缓冲区对象
  * @param buf 被销毁的缓冲区对象
@@ -65,6 +145,71 @@ int MqttBuffer_Append(struct MqttBuffer *buf, char *payload, uint32_t size, int
  * @remark 若ext不是buf分配的，则需保证ext在buf被销毁前一直有效
  */
 void MqttBuffer_AppendExtent(struct MqttBuffer *buf, struct MqttExtent *ext);
+/**
+ * 把缓冲区的内容移交给另一个缓冲区对象，发送队列等保存数据包的模块用它接收数据包
+ * @param dst 接收内容的缓冲区对象，不需要初始化，原有内容被覆盖而不释放
+ * @param src 被移交内容的缓冲区对象，返回后为空，内存块策略不变
+ * @return 成功则返回MQTTERR_NOERROR，复制时申请内存失败返回MQTTERR_OUTOFMEMORY，
+ *         此时src不变
+ * @remark 通常只移交缓冲区头部，数据不复制；src使用initial_buffer(如
+ *         @see MqttBuffer_InitFixed)时数据块可能位于调用者的内存中，内容被复制到dst
+ *         的一个堆上的数据块，调用者之后可以重新使用该内存
+ */
+int MqttBuffer_Move(struct MqttBuffer *dst, struct MqttBuffer *src);
+/**
+ * 将共享数据块添加到缓冲区的末尾，缓冲区持有一个引用，重置或销毁时释放
+ * @param buf 存储数据块的缓冲区对象
+ * @param shared 共享数据块
+ * @return 成功则返回 MQTTERR_NOERROR
+ */
+int MqttBuffer_AppendShared(struct MqttBuffer *buf, struct MqttSharedPayload *shared);
+
+/**
+ * 创建共享数据块，数据被拷贝到与引用计数一起申请的内存中
+ * @param data 数据的起始地址
+ * @param size 数据的字节数
+ * @return 引用计数为1的共享数据块，失败时返回NULL
+ */
+struct MqttSharedPayload *MqttSharedPayload_Create(const char *data, uint32_t size);
+/**
+ * 创建引用调用者数据的共享数据块，不拷贝数据
+ * @param data 数据的起始地址
+ * @param size 数据的字节数
+ * @param release 最后一个引用释放时调用，可为NULL
+ * @param release_arg release的第一个参数
+ * @return 引用计数为1的共享数据块，失败时返回NULL
+ */
+struct MqttSharedPayload *MqttSharedPayload_Wrap(char *data, uint32_t size,
+                                                 void (*release)(void *arg, char *data),
+                                                 void *release_arg);
+/**
+ * 增加一个引用
+ * @param shared 共享数据块
+ */
+void MqttSharedPayload_Retain(struct MqttSharedPayload *shared);
+/**
+ * 释放一个引用，最后一个引用释放时释放数据块
+ * @param shared 共享数据块
+ */
+void MqttSharedPayload_Release(struct MqttSharedPayload *shared);
+
+/**
+ * 获取一个缓冲区的内存统计
+ * @param buf 缓冲区对象
+ * @param stats 保存统计数据，live_bytes和peak_bytes均为当前已申请的字节数
+ */
+void MqttBuffer_GetStats(const struct MqttBuffer *buf, struct MqttBufferStats *stats);
+/**
+ * 获取进程内所有缓冲区的内存统计，可在任意线程调用
+ * @param stats 保存统计数据
+ * @remark requested_bytes和extents在缓冲区重置或销毁时才累加，
+ *         其余数值在申请和释放内存块时更新
+ */
+void MqttBuffer_GetGlobalStats(struct MqttBufferStats *stats);
+/**
+ * 清零全局的累计统计，live_bytes和live_chunks保持不变，peak_bytes重置为live_bytes
+ */
+void MqttBuffer_ResetGlobalStats(void);
 
 #ifdef __cplusplus
 } // extern "C"
@@ -0,0 +1,100 @@
+#ifndef ONENET_MQTT_CMD_TABLE_H
+#define ONENET_MQTT_CMD_TABLE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "config.h"
+#include "mqtt.h"
+
+/**
+ * 命令的自动回复，由命令处理函数填写，SDK在处理函数返回非负数后
+ * 封装"$crsp/命令ID"数据包并发送，命令ID直接引用收到的数据包，不复制
+ */
+struct MqttCmdReply {
+    int send;               /**< 非0时发送回复，调用处理函数前为0 */
+    const char *data;       /**< 回复数据，只需在处理函数返回后、发送完成前有效 */
+    uint32_t size;          /**< 回复数据的字节数 */
+    enum MqttQosLevel qos;  /**< 回复的QoS等级，只能为MQTT_QOS_LEVEL0(默认)或MQTT_QOS_LEVEL1，
+                                 其他等级返回MQTTERR_INVALID_PARAMETER */
+    uint16_t pkt_id;        /**< 回复的数据包ID，QoS等级为1时必须设置 */
+};
+
+/**
+ * 命令处理函数，参数的含义同 @see MqttContext 的handle_cmd，
+ * reply用于设置自动回复，成功返回非负数
+ */
+typedef int (*MqttCmdHandler)(void *arg, uint16_t pkt_id, const char *cmdid,
+                              const char *cmdarg, uint32_t cmdarg_len,
+                              int dup, enum MqttQosLevel qos,
+                              struct MqttCmdReply *reply);
+
+/** 命令表的节点，内部使用 */
+struct MqttCmdNode;
+
+/**
+ * 命令表：把命令名映射到处理函数的基数树(路径压缩的前缀树)，查找的复杂度
+ * 与命令名的长度成正比。命令名默认取命令参数中第一个分隔符之前的部分，
+ * 也可以取命令ID(设置by_cmdid)。每个名字可注册一个完全匹配的处理函数和
+ * 一个前缀匹配的处理函数，查找时优先完全匹配，其次最长的前缀匹配
+ */
+struct MqttCmdTable {
+    char delimiter;
+        /**< 命令名和参数之间的分隔符，@see MqttCmdTable_Init 设为':'，
+             为'\0'时整个命令参数都是命令名 */
+    int by_cmdid;    /**< 非0时用命令ID而不是命令参数查找 */
+    uint32_t names;  /**< 已注册的处理函数个数 */
+
+    /* 以下成员内部使用 */
+    struct MqttCmdNode *root;
+};
+
+/**
+ * 初始化命令表，使用完后必须用 @see MqttCmdTable_Destroy 销毁
+ * @param table 被初始化的命令表
+ * @return 成功则返回MQTTERR_NOERROR
+ */
+int MqttCmdTable_Init(struct MqttCmdTable *table);
+/**
+ * 销毁命令表，释放所有节点
+ * @param table 被销毁的命令表
+ */
+void MqttCmdTable_Destroy(struct MqttCmdTable *table);
+
+/**
+ * 注册命令处理函数，已注册时替换原来的处理函数
+ * @param table 命令表
+ * @param name 命令名或命令名前缀，不能为空字符串，可以包含任意字符
+ * @param prefix 非0时匹配所有以name开头的命令名
+ * @param handler 处理函数，不能为NULL
+ * @param arg handler的关联参数
+ * @return 成功则返回MQTTERR_NOERROR
+ */
+int MqttCmdTable_Add(struct MqttCmdTable *table, const char *name, int prefix,
+                     MqttCmdHandler handler, void *arg);
+/**
+ * 删除命令处理函数
+ * @param table 命令表
+ * @param name 命令名或命令名前缀
+ * @param prefix 与注册时相同
+ * @return 成功则返回MQTTERR_NOERROR，未注册时返回MQTTERR_INVALID_PARAMETER
+ */
+int MqttCmdTable_Remove(struct MqttCmdTable *table, const char *name, int prefix);
+/**
+ * 查找命令名对应的处理函数
+ * @param table 命令表
+ * @param name 命令名，不需要以'\0'结尾
+ * @param name_len 命令名的字节数
+ * @param arg 保存处理函数的关联参数
+ * @return 处理函数，没有匹配的名字时返回NULL
+ */
+MqttCmdHandler MqttCmdTable_Lookup(const struct MqttCmdTable *table, const char *name,
+                                   uint32_t name_len, void **arg);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // ONENET_MQTT_CMD_TABLE_H
@@ -0,0 +1,117 @@
+#ifndef ONENET_MQTT_COMPRESS_H
+#define ONENET_MQTT_COMPRESS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "config.h"
+#include "mqtt.h"
+
+/** 压缩负载头部的字节数：3字节标记、1字节方法、4字节原始长度(大端) */
+#define MQTT_COMPRESS_HEADER_SIZE 8
+
+/**
+ * 发布数据的负载压缩：负载不小于threshold的数据包用内置的LZ4块格式压缩，
+ * 压缩后的负载以头部标记，收到带标记的负载时自动解压。只用于不以'$'开头的
+ * 自定义topic，平台的"$dp"等系统topic不识别压缩格式，始终原样发送；
+ * 收发双方都必须启用压缩
+ */
+struct MqttCompression {
+    uint32_t threshold;
+        /**< 负载不小于该字节数时才压缩，@see MqttCompression_Init 默认为256 */
+    uint32_t max_decoded_size;
+        /**< 解压后负载的最大字节数，超过时当作非法数据包，默认为1MB */
+
+    uint64_t compressed_pkts;  /**< 压缩发送的数据包个数 */
+    uint64_t plain_pkts;       /**< 因过小或压缩无收益而原样发送的数据包个数 */
+    uint64_t bytes_in;         /**< 压缩前的负载字节数，只统计压缩发送的数据包 */
+    uint64_t bytes_out;        /**< 压缩后的负载字节数(含头部)，bytes_in除以它为压缩比 */
+    uint64_t decoded_pkts;     /**< 解压的数据包个数 */
+
+    /* 以下成员内部使用 */
+    uint32_t *table;
+    char *scratch;
+    uint32_t scratch_capacity;
+    char *decoded;
+    uint32_t decoded_capacity;
+};
+
+/**
+ * 压缩后数据的最大字节数
+ * @param size 压缩前的字节数
+ * @return 不可压缩的数据压缩后最多占用的字节数
+ */
+uint32_t MqttLz_Bound(uint32_t size);
+/**
+ * 用LZ4块格式压缩数据
+ * @param table 4096个元素的散列表，内容不需要初始化
+ * @param src 被压缩的数据
+ * @param size src的字节数
+ * @param dst 存放压缩结果的缓冲区
+ * @param capacity dst的字节数
+ * @return 压缩后的字节数，dst放不下时返回0
+ */
+uint32_t MqttLz_Compress(uint32_t *table, const char *src, uint32_t size,
+                         char *dst, uint32_t capacity);
+/**
+ * 解压LZ4块格式的数据
+ * @param src 压缩后的数据
+ * @param size src的字节数
+ * @param dst 存放解压结果的缓冲区
+ * @param decoded_size 解压后的字节数，必须与压缩前相同
+ * @return 成功返回MQTTERR_NOERROR，数据损坏时返回MQTTERR_ILLEGAL_PKT
+ */
+int MqttLz_Decompress(const char *src, uint32_t size, char *dst, uint32_t decoded_size);
+
+/**
+ * 初始化负载压缩，使用完后必须用 @see MqttCompression_Destroy 销毁
+ * @param comp 被初始化的对象
+ * @param threshold 压缩的最小负载字节数，为0时使用256
+ * @return 成功则返回MQTTERR_NOERROR
+ */
+int MqttCompression_Init(struct MqttCompression *comp, uint32_t threshold);
+/**
+ * 销毁负载压缩
+ * @param comp 被销毁的对象
+ */
+void MqttCompression_Destroy(struct MqttCompression *comp);
+
+/**
+ * 封装发布数据包，负载达到阈值且压缩有收益时压缩，参数同 @see Mqtt_PackPublishPkt
+ * @param comp 负载压缩对象
+ * @return 成功则返回MQTTERR_NOERROR，payload指向comp内部的压缩缓冲区时返回
+ *         MQTTERR_INVALID_PARAMETER
+ * @remark 负载总是被拷贝到buf；解压得到的负载可以直接传入，不影响它的有效性
+ */
+int MqttCompression_PackPublishPkt(struct MqttCompression *comp, struct MqttBuffer *buf,
+                                   uint16_t pkt_id, const char *topic,
+                                   const char *payload, uint32_t size,
+                                   enum MqttQosLevel qos, int retain);
+/**
+ * 判断负载是否带压缩头部
+ * @param payload 负载
+ * @param size payload的字节数
+ * @return 带头部时返回非0
+ */
+int MqttCompression_IsFramed(const char *payload, uint32_t size);
+/**
+ * 解压带压缩头部的负载，收到发布数据时SDK自动调用
+ * @param comp 负载压缩对象
+ * @param payload 负载
+ * @param size payload的字节数
+ * @param out 保存解压后的负载，可能指向comp内部的解压缓冲区，下次用comp解压前有效，
+ *            用comp封装不影响它
+ * @param out_size 保存解压后负载的字节数
+ * @return 成功则返回MQTTERR_NOERROR，负载损坏或过大时返回MQTTERR_ILLEGAL_PKT，
+ *         payload指向comp内部的解压缓冲区时返回MQTTERR_INVALID_PARAMETER
+ */
+int MqttCompression_Decode(struct MqttCompression *comp, const char *payload, uint32_t size,
+                           char **out, uint32_t *out_size);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // ONENET_MQTT_COMPRESS_H
@@ -0,0 +1,125 @@
+#ifndef ONENET_MQTT_CONNECT_CACHE_H
+#define ONENET_MQTT_CONNECT_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "config.h"
+#include "mqtt.h"
+
+/** 一个缓存的CONNECT数据包，内部使用 */
+struct MqttConnectEntry {
+    char *data;
+    uint32_t size;
+    uint32_t capacity;
+};
+
+/**
+ * CONNECT数据包缓存：设备的CONNECT内容(客户端ID、用户名、密码等)在重连之间不变，
+ * 封装一次后按下标保存为连续的字节，重连时不再检查字符和分配内存，一次写操作即可
+ * 发出。数据包存放在大块内存中，地址在缓存销毁前不变；缓存可保存到文件，
+ * 进程重启后直接加载
+ */
+struct MqttConnectCache {
+    uint32_t count;   /**< 缓存的数据包个数，下标为0～count-1 */
+    uint64_t bytes;   /**< 数据包的总字节数 */
+    uint64_t memory;  /**< 占用的内存字节数，包括数据块和索引 */
+
+    /* 以下成员内部使用 */
+    struct MqttConnectEntry *entries;
+    uint32_t capacity;
+    char **blocks;
+    uint32_t block_count;
+    uint32_t block_capacity;
+    char *block_pos;
+    uint32_t block_left;
+};
+
+/**
+ * 初始化CONNECT数据包缓存，使用完后必须用 @see MqttConnectCache_Destroy 销毁
+ * @param cache 被初始化的缓存
+ */
+void MqttConnectCache_Init(struct MqttConnectCache *cache);
+/**
+ * 销毁缓存，释放所有数据包
+ * @param cache 被销毁的缓存
+ */
+void MqttConnectCache_Destroy(struct MqttConnectCache *cache);
+
+/**
+ * 加入一个封装好的CONNECT数据包
+ * @param cache 缓存
+ * @param pkt 用 @see Mqtt_PackConnectPkt 或 @see Mqtt_PackConnectPktV5 封装的数据包，内容被复制
+ * @param index 保存数据包的下标
+ * @return 成功则返回MQTTERR_NOERROR，不是完整的CONNECT数据包时返回MQTTERR_INVALID_PARAMETER
+ */
+int MqttConnectCache_Put(struct MqttConnectCache *cache, const struct MqttBuffer *pkt,
+                         uint32_t *index);
+/**
+ * 替换一个数据包，如密码(鉴权信息)过期后重新封装的CONNECT
+ * @param cache 缓存
+ * @param index 数据包的下标
+ * @param pkt 新的数据包，内容被复制
+ * @return 成功则返回MQTTERR_NOERROR
+ * @remark 新数据包不大于原来的时在原地址覆盖，因此不能在引用原数据包的缓冲区
+ *         (@see MqttConnectCache_Append)发送完之前调用
+ */
+int MqttConnectCache_Update(struct MqttConnectCache *cache, uint32_t index,
+                            const struct MqttBuffer *pkt);
+/**
+ * 获取数据包的内容
+ * @param cache 缓存
+ * @param index 数据包的下标
+ * @param data 保存数据包的起始地址
+ * @param size 保存数据包的字节数
+ * @return 成功则返回MQTTERR_NOERROR，下标超出范围时返回MQTTERR_INVALID_PARAMETER
+ */
+int MqttConnectCache_Get(const struct MqttConnectCache *cache, uint32_t index,
+                         const char **data, uint32_t *size);
+/**
+ * 把数据包以引用的方式加入缓冲区的末尾，不复制内容，可用作重连管理器的
+ * pack_connect(@see MqttReconnect)，或放入发送队列
+ * @param cache 缓存
+ * @param index 数据包的下标
+ * @param buf 缓冲区对象
+ * @return 成功则返回MQTTERR_NOERROR
+ * @remark buf必须在缓存销毁前发送完或销毁
+ */
+int MqttConnectCache_Append(const struct MqttConnectCache *cache, uint32_t index,
+                            struct MqttBuffer *buf);
+/**
+ * 用一次writev_func调用发送数据包
+ * @param cache 缓存
+ * @param index 数据包的下标
+ * @param ctx MQTT运行时上下文
+ * @return 同 @see Mqtt_SendPkt，下标超出范围时返回MQTTERR_INVALID_PARAMETER
+ */
+int MqttConnectCache_Send(const struct MqttConnectCache *cache, uint32_t index,
+                          struct MqttContext *ctx);
+
+/**
+ * 把所有数据包按下标顺序保存到文件
+ * @param cache 缓存
+ * @param path 文件路径，已存在时被覆盖
+ * @return 成功则返回MQTTERR_NOERROR，写文件失败时返回MQTTERR_IO
+ * @remark 文件中包含设备的密码，POSIX系统上以0600权限创建(已存在的文件也改为0600)，
+ *         只有所有者可读写；其他系统上应由调用者限制其访问权限
+ */
+int MqttConnectCache_Save(const struct MqttConnectCache *cache, const char *path);
+/**
+ * 从 @see MqttConnectCache_Save 保存的文件加载数据包，下标与保存时相同
+ * @param cache 空的缓存
+ * @param path 文件路径
+ * @return 成功则返回MQTTERR_NOERROR，缓存不为空时返回MQTTERR_INVALID_PARAMETER，
+ *         读文件失败时返回MQTTERR_IO，文件格式错误时返回MQTTERR_ILLEGAL_PKT，
+ *         失败时缓存仍为空
+ */
+int MqttConnectCache_Load(struct MqttConnectCache *cache, const char *path);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // ONENET_MQTT_CONNECT_CACHE_H
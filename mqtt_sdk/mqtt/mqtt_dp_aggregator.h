@@ -0,0 +1,126 @@
+#ifndef ONENET_MQTT_DP_AGGREGATOR_H
+#define ONENET_MQTT_DP_AGGREGATOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "config.h"
+#include "mqtt.h"
+
+/** 一个数据流已累积的数据点，内部使用 */
+struct MqttDpStream {
+    char *dsid;
+    uint32_t dsid_len;
+    uint32_t points;
+    char *data;       /* 以','分隔的"时间":值 */
+    uint32_t len;
+    uint32_t capacity;
+};
+
+/**
+ * 数据点聚合器：按数据流累积数据点，累积的数据达到字节预算或最早的数据点
+ * 等待超过期限时，把所有数据点封装为一个"$dp"数据包(类型2，同一数据流的
+ * 多个数据点放在一起)，交给flush_func发送
+ */
+struct MqttDpAggregator {
+    uint32_t max_bytes;
+        /**< 一个数据包的数据点部分最多的字节数，加入的数据点会超过时先发送已累积的 */
+    uint32_t max_delay_ms;
+        /**< 数据点最长的等待时间（毫秒），从最早的未发送数据点加入时算起，为0时每次
+             @see MqttDpAggregator_Flush 都发送 */
+    enum MqttQosLevel qos; /**< 数据包的QoS等级 */
+
+    void *flush_func_arg; /**< flush_func和alloc_pkt_id的关联参数 */
+    int (*flush_func)(void *arg, uint16_t pkt_id, struct MqttBuffer *buf);
+        /**< 发送封装好的数据包的回调函数，可直接发送(@see Mqtt_SendPkt)，
+             也可移交给发送队列(@see MqttSendQueue_Push)或 @see MqttEngine_SendQosPkt，
+             返回后buf被重置，失败返回负数；pkt_id为数据包ID，用于匹配PUBACK等确认，
+             QoS0时为0 */
+    uint16_t (*alloc_pkt_id)(void *arg);
+        /**< 为QoS1/QoS2数据包分配数据包ID的回调函数，应与应用自己的数据包共用同一个
+             分配器，以免同一连接上的ID冲突；返回0表示没有可用的ID，此时不发送，
+             数据点保留，返回MQTTERR_QUOTA_EXCEEDED。为NULL时从1开始依次编号，
+             只适用于连接上没有其他QoS1/QoS2数据包的情况 */
+
+    uint32_t pending_points; /**< 未发送的数据点个数 */
+    uint32_t pending_bytes;  /**< 未发送的数据点封装后的字节数 */
+    uint64_t flushed_points;  /**< 已发送的数据点个数 */
+    uint64_t flushed_pkts;    /**< 已发送的数据包个数，flushed_points除以它为平均批量 */
+    uint64_t size_flushes;    /**< 因达到字节预算而发送的次数 */
+    uint64_t deadline_flushes; /**< 因到达期限而发送的次数 */
+    uint32_t last_batch;      /**< 最后一个数据包中的数据点个数 */
+
+    /* 以下成员内部使用 */
+    struct MqttDpStream *streams;
+    uint32_t stream_count;
+    uint32_t stream_capacity;
+    uint32_t active_streams;
+    int64_t first_pending;
+    uint16_t next_pkt_id;
+    char *scratch;
+    uint32_t scratch_capacity;
+    int64_t cached_second;
+    char cached_time[20];
+    struct MqttBuffer buf;
+};
+
+/**
+ * 初始化数据点聚合器，使用完后必须用 @see MqttDpAggregator_Destroy 销毁
+ * @param agg 被初始化的聚合器
+ * @param max_bytes 字节预算，为0时使用4096
+ * @param max_delay_ms 最长的等待时间（毫秒）
+ */
+void MqttDpAggregator_Init(struct MqttDpAggregator *agg, uint32_t max_bytes,
+                           uint32_t max_delay_ms);
+/**
+ * 销毁聚合器，丢弃未发送的数据点
+ * @param agg 被销毁的聚合器
+ */
+void MqttDpAggregator_Destroy(struct MqttDpAggregator *agg);
+
+/**
+ * 加入整数类型的数据点
+ * @param agg 聚合器
+ * @param dsid 数据流ID
+ * @param ts 毫秒时间戳，为0或负数时取加入时的系统时间
+ * @param value 数据点的值
+ * @param now 当前时间（毫秒，单调时钟），用于计算期限
+ * @return 成功则返回MQTTERR_NOERROR，发送已累积的数据点失败时返回flush_func的错误，
+ *         或alloc_pkt_id没有可用的ID时返回MQTTERR_QUOTA_EXCEEDED(数据点未加入)
+ */
+int MqttDpAggregator_AddInt(struct MqttDpAggregator *agg, const char *dsid, int64_t ts,
+                            int value, int64_t now);
+/**
+ * 加入浮点类型的数据点，参数同 @see MqttDpAggregator_AddInt
+ */
+int MqttDpAggregator_AddDouble(struct MqttDpAggregator *agg, const char *dsid, int64_t ts,
+                               double value, int64_t now);
+/**
+ * 加入字符串类型的数据点，参数同 @see MqttDpAggregator_AddInt
+ * @param value 数据点的值，必须是UTF-8编码，为NULL时作为空字符串
+ */
+int MqttDpAggregator_AddString(struct MqttDpAggregator *agg, const char *dsid, int64_t ts,
+                               const char *value, int64_t now);
+
+/**
+ * 到达期限时发送已累积的数据点
+ * @param agg 聚合器
+ * @param now 当前时间（毫秒，单调时钟）
+ * @param force 非0时忽略期限，立即发送
+ * @return 成功则返回MQTTERR_NOERROR，alloc_pkt_id没有可用的ID时返回MQTTERR_QUOTA_EXCEEDED
+ */
+int MqttDpAggregator_Flush(struct MqttDpAggregator *agg, int64_t now, int force);
+/**
+ * 获取发送已累积的数据点的期限
+ * @param agg 聚合器
+ * @return 需要调用 @see MqttDpAggregator_Flush 的时间（毫秒），没有数据点时返回-1
+ */
+int64_t MqttDpAggregator_Deadline(const struct MqttDpAggregator *agg);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // ONENET_MQTT_DP_AGGREGATOR_H
@@ -0,0 +1,210 @@
+#ifndef ONENET_MQTT_ENGINE_H
+#define ONENET_MQTT_ENGINE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "config.h"
+#include "mqtt.h"
+#include "mqtt_timer.h"
+#include "mqtt_send_queue.h"
+
+struct MqttEngine;
+struct MqttConnection;
+
+/** 等待确认的QoS1/QoS2发布数据包，内部使用 */
+struct MqttInflight {
+    struct MqttInflight *next;
+    struct MqttConnection *conn;
+    uint16_t pkt_id;
+    uint16_t retries;
+    struct MqttTimer timer;
+    struct MqttBuffer buf[1];
+};
+
+/** 由 @see MqttEngine 管理的一个MQTT连接 */
+struct MqttConnection {
+    int fd;                        /**< 非阻塞socket，由引擎负责关闭 */
+    uint64_t id;                   /**< 连接ID，可跨线程保存，@see MqttEngine_FindConnection */
+    struct MqttContext ctx[1];
+        /**< 连接的MQTT运行时上下文，read_func/writev_func由引擎设置，
+             handle_*回调由使用者设置 */
+    uint16_t keep_alive;
+        /**< 保活时间间隔（秒），应与 @see Mqtt_PackConnectPkt 的keep_alive一致，
+             为0时不自动发送ping数据包 */
+    uint32_t max_pending_bytes; /**< 待发送数据的上限（字节数），为0时不限制 */
+    uint16_t retry_interval;
+        /**< 未确认的QoS1/QoS2发布数据包的重发间隔（秒），@see MqttEngine_SendQosPkt */
+    uint16_t max_retries;  /**< 最大重发次数，超过后以MQTTERR_TIMEOUT关闭连接，0表示不限 */
+    struct MqttSendQueue sendq[1];
+        /**< @see MqttEngine_QueuePkt 使用的发送队列，使用者可设置其cork_bytes和cork_ms */
+
+    void *handle_close_arg; /**< 连接关闭回调函数的关联参数 */
+    void (*handle_close)(void *arg, struct MqttConnection *conn, int err);
+        /**< 连接关闭时的回调函数，err为关闭的原因（@see MqttError），
+             对端正常关闭时为MQTTERR_ENDOFFILE，回调返回后conn将被释放 */
+
+    /* 以下成员由引擎内部使用 */
+    struct MqttEngine *engine;
+    uint32_t slot;
+    uint32_t events;
+    int read_blocked;
+    int closed;
+    int close_err;
+    struct MqttBuffer pending[1];
+    uint32_t sended_bytes;
+    int64_t last_send;
+    int64_t ping_sent;
+    struct MqttTimer keep_alive_timer;
+    struct MqttInflight *inflight;
+    struct MqttTimer cork_timer;
+    int queued;
+    struct MqttConnection *next_queued;
+    struct MqttConnection *next_closed;
+};
+
+/** 基于epoll的多连接事件循环 */
+struct MqttEngine {
+    int epfd;
+    int wakefd;
+    volatile int running;
+
+    void *handle_wakeup_arg; /**< 唤醒回调函数的关联参数 */
+    void (*handle_wakeup)(void *arg, struct MqttEngine *engine);
+        /**< 其他线程调用 @see MqttEngine_Wakeup 后，在引擎线程中被调用 */
+
+    struct MqttConnection **conns;
+    uint32_t *slot_gen;
+    uint32_t *free_slots;
+    uint32_t free_count;
+    uint32_t slot_count;
+    uint32_t conn_count;
+    uint32_t max_conns;
+    struct MqttConnection *closed;
+    struct MqttConnection *queued;
+    void *events;
+    int max_events;
+    int64_t now;
+    struct MqttTimerWheel timers[1]; /**< 引擎的定时器，可用于使用者自己的定时器 */
+};
+
+/**
+ * 初始化事件循环引擎，引擎在使用完后，必须用 @see MqttEngine_Destroy 销毁
+ * @param engine 被初始化的引擎
+ * @param max_conns 引擎最多管理的连接数
+ * @return 成功则返回MQTTERR_NOERROR
+ */
+int MqttEngine_Init(struct MqttEngine *engine, uint32_t max_conns);
+/**
+ * 销毁引擎，关闭其管理的所有连接(不调用handle_close)
+ * @param engine 被销毁的引擎
+ */
+void MqttEngine_Destroy(struct MqttEngine *engine);
+
+/**
+ * 将一个已连接或正在连接的socket交由引擎管理
+ * @param engine 事件循环引擎
+ * @param fd socket文件描述符，将被设置为非阻塞模式
+ * @param buf_size 接收数据缓冲区的大小（字节数）
+ * @param conn 返回新建的连接对象
+ * @return 成功则返回MQTTERR_NOERROR
+ */
+int MqttEngine_AddConnection(struct MqttEngine *engine, int fd, uint32_t buf_size,
+                             struct MqttConnection **conn);
+/**
+ * 以非阻塞方式建立TCP连接，并交由引擎管理
+ * @param engine 事件循环引擎
+ * @param host 服务器地址
+ * @param port 服务器端口
+ * @param buf_size 接收数据缓冲区的大小（字节数）
+ * @param conn 返回新建的连接对象
+ * @return 成功则返回MQTTERR_NOERROR
+ * @remark 连接建立前发送的数据会被缓存，连接建立后自动发送
+ */
+int MqttEngine_Connect(struct MqttEngine *engine, const char *host, unsigned short port,
+                       uint32_t buf_size, struct MqttConnection **conn);
+/**
+ * 关闭连接，handle_close将在本轮事件处理结束前被调用
+ * @param conn 将要关闭的连接
+ * @param err 关闭的原因
+ */
+void MqttEngine_CloseConnection(struct MqttConnection *conn, int err);
+
+/**
+ * 根据连接ID查找连接
+ * @param engine 事件循环引擎
+ * @param id 连接ID
+ * @return 连接已关闭或不存在时返回NULL
+ */
+struct MqttConnection *MqttEngine_FindConnection(struct MqttEngine *engine, uint64_t id);
+
+/**
+ * 发送数据包，未能立即发送的数据被复制到连接的待发送缓冲区，
+ * 在socket可写时继续发送
+ * @param conn 发送数据的连接
+ * @param buf 保存将要发送数据包的缓冲区对象，返回后即可重置或销毁
+ * @return 成功则返回MQTTERR_NOERROR
+ */
+int MqttEngine_SendPkt(struct MqttConnection *conn, const struct MqttBuffer *buf);
+/**
+ * 将数据包加入连接的发送队列，本轮事件处理结束时(或暂缓期限到达时)与
+ * 队列中的其他数据包合并发送
+ * @param conn 发送数据的连接
+ * @param buf 保存数据包的缓冲区对象，其内容被移交给队列，返回后buf为空，
+ *            可直接用于打包下一个数据包，规则同 @see MqttSendQueue_Push
+ * @return 成功则返回MQTTERR_NOERROR
+ * @remark @see MqttEngine_SendPkt 会先发送队列中的数据，以保持数据包的顺序
+ */
+int MqttEngine_QueuePkt(struct MqttConnection *conn, struct MqttBuffer *buf);
+/**
+ * 发送QoS1/QoS2发布数据包，在收到确认前每隔retry_interval秒设置DUP标志后重发
+ * @param conn 发送数据的连接
+ * @param pkt_id 数据包ID
+ * @param buf 保存发布数据包的缓冲区对象，其内容被移交给连接(@see MqttBuffer_Move)，
+ *            返回后buf为空；数据块位于调用者提供的initial_buffer中时被复制，
+ *            发送失败时内容仍在buf中
+ * @return 成功则返回MQTTERR_NOERROR
+ * @remark 使用者须在handle_pub_ack(QoS1)或handle_pub_rec(QoS2)中调用
+ *         @see MqttEngine_AckPkt；retry_interval为0时只发送一次
+ */
+int MqttEngine_SendQosPkt(struct MqttConnection *conn, uint16_t pkt_id,
+                          struct MqttBuffer *buf);
+/**
+ * 确认发布数据包已被服务器接收，停止重发
+ * @param conn 连接
+ * @param pkt_id 数据包ID
+ * @return 成功则返回MQTTERR_NOERROR，没有对应的数据包时返回MQTTERR_INVALID_PARAMETER
+ */
+int MqttEngine_AckPkt(struct MqttConnection *conn, uint16_t pkt_id);
+
+/**
+ * 等待并处理一轮I/O事件和保活定时器
+ * @param engine 事件循环引擎
+ * @param timeout_ms 最长等待时间（毫秒），-1表示直到下一个定时器到期
+ * @return 成功则返回处理的事件数，失败返回MQTTERR_IO
+ */
+int MqttEngine_RunOnce(struct MqttEngine *engine, int timeout_ms);
+/**
+ * 运行事件循环，直到 @see MqttEngine_Stop 被调用
+ * @param engine 事件循环引擎
+ * @return 成功则返回MQTTERR_NOERROR
+ */
+int MqttEngine_Run(struct MqttEngine *engine);
+/**
+ * 使 @see MqttEngine_Run 在本轮事件处理后返回，可在回调函数中调用
+ * @param engine 事件循环引擎
+ */
+void MqttEngine_Stop(struct MqttEngine *engine);
+/**
+ * 唤醒阻塞在epoll_wait中的引擎线程，并调用handle_wakeup，可在任意线程中调用
+ * @param engine 事件循环引擎
+ */
+void MqttEngine_Wakeup(struct MqttEngine *engine);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // ONENET_MQTT_ENGINE_H
@@ -0,0 +1,116 @@
+#ifndef ONENET_MQTT_METRICS_H
+#define ONENET_MQTT_METRICS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "config.h"
+#include "mqtt.h"
+
+#define MQTT_HISTOGRAM_SUB_BITS 3
+#define MQTT_HISTOGRAM_SUB_BUCKETS (1 << MQTT_HISTOGRAM_SUB_BITS)
+#define MQTT_HISTOGRAM_BUCKETS ((64 - MQTT_HISTOGRAM_SUB_BITS + 1) * MQTT_HISTOGRAM_SUB_BUCKETS)
+#define MQTT_METRICS_PKT_TYPES 16
+#define MQTT_METRICS_ERRORS 16
+#define MQTT_METRICS_PENDING 256
+
+/**
+ * 对数线性(HDR风格)直方图：数值按最高有效位分组，每组再均分为8个桶，
+ * 相对误差不超过12.5%，记录的复杂度为O(1)，不申请内存
+ */
+struct MqttHistogram {
+    uint64_t count;   /**< 记录的数值个数 */
+    uint64_t sum;     /**< 记录的数值之和 */
+    uint64_t max;     /**< 记录的最大值 */
+    uint64_t buckets[MQTT_HISTOGRAM_BUCKETS];
+};
+
+/** 等待确认的数据包，内部使用 */
+struct MqttMetricsPending {
+    int64_t sent;
+    uint16_t pkt_id;
+    uint8_t ack_type;
+};
+
+/**
+ * MQTT运行时上下文的统计数据，设置到 @see MqttContext 的metrics成员后由SDK更新。
+ * 只有处理该上下文的线程写入，其他线程可随时通过 @see MqttMetrics_Snapshot 读取，
+ * 读写都不加锁
+ */
+struct MqttMetrics {
+    uint32_t callback_interval;
+        /**< 每处理多少个数据包测量一次callback耗时，@see MqttMetrics_Init 设为16，
+             为1时每个都测量；读取时钟的开销与解析一个小数据包相当 */
+
+    uint64_t pkts_in[MQTT_METRICS_PKT_TYPES];   /**< 按类型(@see MqttPacketType)统计的收到的数据包个数 */
+    uint64_t bytes_in[MQTT_METRICS_PKT_TYPES];  /**< 按类型统计的收到的字节数(含固定头部) */
+    uint64_t pkts_out[MQTT_METRICS_PKT_TYPES];  /**< 按类型统计的发送的数据包个数 */
+    uint64_t bytes_out[MQTT_METRICS_PKT_TYPES]; /**< 按类型统计的发送的字节数(含固定头部) */
+    uint64_t errors[MQTT_METRICS_ERRORS];
+        /**< Mqtt_RecvPkt和Mqtt_SendPkt返回的错误个数，下标为错误码(@see MqttError)的相反数 */
+    uint64_t buf_overflows;   /**< 数据包超过接收缓冲区的次数 */
+    uint64_t recv_moved_bytes; /**< Mqtt_RecvPkt把不完整的数据包移到缓冲区开头时移动的字节数 */
+    uint64_t allocs;
+        /**< SDK为该上下文申请内存的次数，包括Mqtt_SendPkt的iovec数组(超过8个数据块时)
+             和自动回复的数据包 */
+    uint64_t unmatched_acks;
+        /**< 找不到对应的已发送数据包的确认个数(如发送记录已被相同下标的数据包覆盖) */
+
+    struct MqttHistogram ack_rtt;
+        /**< 确认往返时间（纳秒）：QoS1发布到PUBACK、QoS2发布到PUBCOMP、
+             订阅到SUBACK、取消订阅到UNSUBACK，重发的数据包从第一次发送算起 */
+    struct MqttHistogram callback;
+        /**< 处理一个收到的数据包的耗时（纳秒），包括回调函数和自动回复 */
+
+    /* 以下成员内部使用 */
+    struct MqttMetricsPending pending[MQTT_METRICS_PENDING];
+    uint32_t callback_countdown;
+};
+
+/**
+ * 初始化统计数据：清零所有计数，callback_interval设为16
+ * @param metrics 被初始化的统计数据
+ */
+void MqttMetrics_Init(struct MqttMetrics *metrics);
+/**
+ * 读取统计数据的快照，可在任意线程调用
+ * @param metrics 统计数据
+ * @param snapshot 保存快照，只复制计数和直方图
+ * @remark 快照中的各个数值分别读取，彼此之间不保证一致
+ */
+void MqttMetrics_Snapshot(const struct MqttMetrics *metrics, struct MqttMetrics *snapshot);
+/**
+ * 获取单调时钟的当前时间
+ * @return 纳秒数，只用于计算时间差
+ */
+int64_t MqttMetrics_Now(void);
+
+/**
+ * 记录一个数值
+ * @param hist 直方图
+ * @param value 被记录的数值
+ */
+void MqttHistogram_Record(struct MqttHistogram *hist, uint64_t value);
+/**
+ * 计算百分位数
+ * @param hist 直方图(一般为快照中的直方图)
+ * @param percent 百分比，0~100
+ * @return 百分位数所在桶的中间值(不超过最大值)，没有记录时返回0
+ */
+uint64_t MqttHistogram_Percentile(const struct MqttHistogram *hist, double percent);
+
+/* 以下函数由SDK内部调用 */
+int MqttMetrics_CountIncoming(struct MqttMetrics *metrics, char type, const char *pkt,
+                              uint32_t size, uint32_t total);
+void MqttMetrics_CountOutgoing(struct MqttMetrics *metrics, const struct MqttBuffer *buf);
+void MqttMetrics_CountError(struct MqttMetrics *metrics, int err);
+void MqttMetrics_CountAllocs(struct MqttMetrics *metrics, const struct MqttBuffer *buf);
+void MqttMetrics_Add(uint64_t *counter, uint64_t value);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // ONENET_MQTT_METRICS_H
@@ -0,0 +1,157 @@
+#ifndef ONENET_MQTT_RECONNECT_H
+#define ONENET_MQTT_RECONNECT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "config.h"
+#include "mqtt.h"
+#include "mqtt_send_queue.h"
+
+/** 重连管理器的状态 */
+enum MqttReconnectState {
+    MQTT_RECONNECT_WAITING    = 0, /**< 等待下一次连接，@see MqttReconnect_Deadline */
+    MQTT_RECONNECT_CONNECTING = 1, /**< 已发出CONNECT，等待CONNACK */
+    MQTT_RECONNECT_CONNECTED  = 2  /**< 连接已建立 */
+};
+
+/**
+ * 重连管理器：记录设备的订阅和离线期间待发送的发布数据，重新连接时把CONNECT、
+ * 批量的SUBSCRIBE和待发送的发布数据一起放入发送队列，一次writev发出，不必等待
+ * CONNACK和SUBACK；clean_session为0且上次连接服务器保留了会话时不再重新订阅，
+ * 只有CONNACK表明会话已丢失时才补发SUBSCRIBE。连接失败或断开后按带随机抖动的
+ * 指数退避安排下一次连接，避免大量设备同时断线后同时重连压垮服务器
+ */
+struct MqttReconnect {
+    uint32_t min_backoff_ms;
+        /**< 第一次退避的上限（毫秒），@see MqttReconnect_Init 设为1000 */
+    uint32_t max_backoff_ms;
+        /**< 退避的上限（毫秒），@see MqttReconnect_Init 设为60000，每次连续失败
+             上限翻倍直到该值，实际等待时间在0到上限之间随机选取 */
+    uint32_t max_pkt_size;
+        /**< 重新订阅时一个SUBSCRIBE数据包的最大字节数，为0时所有topic放在一个数据包中 */
+    uint32_t max_queued_bytes;
+        /**< 待发送的发布数据的字节上限，超出时丢弃最早的，@see MqttReconnect_Init 设为256KB */
+    uint16_t sub_pkt_id;
+        /**< 重新订阅的SUBSCRIBE数据包从该ID开始连续编号，@see MqttReconnect_Init 设为
+             0xF000，应用自己的数据包ID应避开这一范围 */
+    int clean_session;
+        /**< 必须与pack_connect使用的clean_session一致，为0时才可能跳过重新订阅 */
+
+    void *pack_connect_arg; /**< pack_connect的关联参数 */
+    int (*pack_connect)(void *arg, struct MqttBuffer *buf);
+        /**< 封装CONNECT数据包的回调函数，如调用 @see Mqtt_PackConnectPkt，必须设置，
+             失败返回负数 */
+
+    enum MqttReconnectState state; /**< 当前状态 */
+    uint32_t failures;         /**< 连续失败的次数，连接建立后清零 */
+    uint32_t queued_pkts;      /**< 待发送的发布数据包个数 */
+    uint32_t queued_bytes;     /**< 待发送的发布数据的字节数 */
+    uint64_t attempts;         /**< 发起连接的次数 */
+    uint64_t resubscribes;     /**< 发送了SUBSCRIBE的连接次数 */
+    uint64_t sessions_resumed; /**< 服务器保留了会话、跳过重新订阅的连接次数 */
+    uint64_t replayed_pkts;    /**< 随CONNECT一起发送且连接被接受的待发送发布数据包个数 */
+    uint64_t dropped_pkts;     /**< 超出max_queued_bytes被丢弃的发布数据包个数 */
+
+    /* 以下成员内部使用 */
+    struct MqttSubscribeTopic *topics;
+    uint32_t topic_count;
+    uint32_t topic_capacity;
+    struct MqttBuffer *pkts;   /* 待发送的发布数据，环形数组 */
+    uint32_t head;
+    uint32_t capacity;
+    uint32_t rng;
+    int64_t next_attempt;
+    int session_present;       /* 服务器保存有会话，即上次以非clean_session建立过连接 */
+    int subscribes_sent;       /* 本次连接已随CONNECT发送了SUBSCRIBE */
+    uint32_t replaying;        /* 已随CONNECT发送、等待CONNACK确认的待发送数据包个数 */
+};
+
+/**
+ * 初始化重连管理器，使用完后必须用 @see MqttReconnect_Destroy 销毁，
+ * 初始状态为MQTT_RECONNECT_WAITING，可立即连接
+ * @param rc 被初始化的重连管理器
+ * @param seed 随机抖动的种子，应每个设备不同(如客户端ID的哈希值)，
+ *             使同时断线的设备分散重连
+ */
+void MqttReconnect_Init(struct MqttReconnect *rc, uint32_t seed);
+/**
+ * 销毁重连管理器，丢弃待发送的发布数据
+ * @param rc 被销毁的重连管理器
+ */
+void MqttReconnect_Destroy(struct MqttReconnect *rc);
+
+/**
+ * 加入重新连接时要恢复的订阅，topic已存在时只更新QoS等级，
+ * 当前连接上的订阅仍由应用发送
+ * @param rc 重连管理器
+ * @param topic 订阅的topic，内容被复制
+ * @param qos QoS等级
+ * @return 成功则返回MQTTERR_NOERROR
+ */
+int MqttReconnect_AddTopic(struct MqttReconnect *rc, const char *topic, enum MqttQosLevel qos);
+/**
+ * 移除重新连接时要恢复的订阅
+ * @param rc 重连管理器
+ * @param topic 订阅的topic
+ * @return 成功则返回MQTTERR_NOERROR，没有该订阅时返回MQTTERR_INVALID_PARAMETER
+ */
+int MqttReconnect_RemoveTopic(struct MqttReconnect *rc, const char *topic);
+/**
+ * 把断线期间产生的发布数据包加入待发送列表，下次连接时随CONNECT一起发送，
+ * 直到服务器接受连接后才从列表中移除
+ * @param rc 重连管理器
+ * @param buf 保存数据包的缓冲区对象，其内容被移交给重连管理器(@see MqttBuffer_Move)，
+ *            返回后buf为空；数据块位于调用者提供的initial_buffer中时被复制
+ * @return 成功则返回MQTTERR_NOERROR，数据包本身超过max_queued_bytes时返回
+ *         MQTTERR_PKT_TOO_LARGE
+ * @remark 须用Mqtt_PackPublishPkt封装，不能使用只在一个连接内有效的MQTT 5别名；
+ *         QoS1/QoS2的数据包被服务器接收后仍由应用负责确认和重发
+ */
+int MqttReconnect_QueuePublish(struct MqttReconnect *rc, struct MqttBuffer *buf);
+
+/**
+ * 开始一次连接：新的网络连接建立后调用，依次把CONNECT、需要恢复的订阅和待发送的
+ * 发布数据(复制到一块连续内存)放入发送队列，之后调用一次 @see MqttSendQueue_Flush
+ * 即可全部发出
+ * @param rc 重连管理器
+ * @param queue 新连接的发送队列
+ * @param now 当前时间（毫秒）
+ * @return 成功则返回MQTTERR_NOERROR，pack_connect为NULL时返回MQTTERR_EMPTY_CALLBACK
+ * @remark clean_session为0且之前建立过连接时预计服务器保留了会话，不放入SUBSCRIBE，
+ *         @see MqttReconnect_HandleConnAck
+ */
+int MqttReconnect_Begin(struct MqttReconnect *rc, struct MqttSendQueue *queue, int64_t now);
+/**
+ * 处理CONNACK，在上下文的handle_conn_ack中调用
+ * @param rc 重连管理器
+ * @param flags 连接确认标志，@see MqttConnAckFlag
+ * @param ret_code 连接返回码，@see MqttRetCode
+ * @param queue 连接的发送队列，会话已丢失而需要补发的SUBSCRIBE放入其中
+ * @param now 当前时间（毫秒）
+ * @return 成功则返回MQTTERR_NOERROR
+ * @remark 连接被拒绝时安排下一次连接，应用应关闭网络连接
+ */
+int MqttReconnect_HandleConnAck(struct MqttReconnect *rc, char flags, char ret_code,
+                                struct MqttSendQueue *queue, int64_t now);
+/**
+ * 连接失败或断开后调用，按连续失败的次数安排下一次连接
+ * @param rc 重连管理器
+ * @param now 当前时间（毫秒）
+ */
+void MqttReconnect_HandleDisconnect(struct MqttReconnect *rc, int64_t now);
+/**
+ * 获取下一次连接的时间
+ * @param rc 重连管理器
+ * @return 应建立网络连接并调用 @see MqttReconnect_Begin 的时间（毫秒），
+ *         不在MQTT_RECONNECT_WAITING状态时返回-1
+ */
+int64_t MqttReconnect_Deadline(const struct MqttReconnect *rc);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // ONENET_MQTT_RECONNECT_H
@@ -0,0 +1,77 @@
+#ifndef ONENET_MQTT_SEND_QUEUE_H
+#define ONENET_MQTT_SEND_QUEUE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "config.h"
+#include "mqtt.h"
+
+/**
+ * 连接的发送队列：接收任意多个已打包的数据包，合并后用尽量少的writev_func
+ * 调用发送，并记录跨数据包的已发送偏移
+ */
+struct MqttSendQueue {
+    uint32_t cork_bytes;
+        /**< 排队数据少于该字节数时暂缓发送(类似Nagle算法)，为0时不暂缓 */
+    uint32_t cork_ms;
+        /**< 暂缓发送的最长时间（毫秒），从最早的未发送数据包入队时算起，为0时不暂缓 */
+
+    uint32_t queued_bytes;   /**< 未发送的字节数 */
+    uint32_t queued_pkts;    /**< 未发送完的数据包个数 */
+    uint64_t writev_calls;   /**< 调用writev_func的次数 */
+    uint64_t sended_pkts;    /**< 已发送完的数据包个数 */
+
+    /* 以下成员内部使用 */
+    struct MqttBuffer *pkts; /* 环形数组 */
+    uint32_t head;
+    uint32_t capacity;
+    uint32_t sended_bytes;   /* 队首数据包已发送的字节数 */
+    int64_t first_queued;
+};
+
+/**
+ * 初始化发送队列，使用完后必须用 @see MqttSendQueue_Destroy 销毁
+ * @param queue 被初始化的发送队列
+ */
+void MqttSendQueue_Init(struct MqttSendQueue *queue);
+/**
+ * 销毁发送队列，丢弃未发送的数据
+ * @param queue 被销毁的发送队列
+ */
+void MqttSendQueue_Destroy(struct MqttSendQueue *queue);
+/**
+ * 将数据包加入发送队列的末尾
+ * @param queue 发送队列
+ * @param buf 保存数据包的缓冲区对象，其内容被移交给队列(@see MqttBuffer_Move)，
+ *            返回后buf为空，可直接用于打包下一个数据包；数据块位于调用者提供的
+ *            initial_buffer中时被复制，之后该内存可重新使用
+ * @param now 当前时间（毫秒），用于计算暂缓发送的期限
+ * @return 成功则返回MQTTERR_NOERROR
+ */
+int MqttSendQueue_Push(struct MqttSendQueue *queue, struct MqttBuffer *buf, int64_t now);
+/**
+ * 发送队列中的数据，直到全部发送完或writev_func不能再接收更多数据
+ * @param queue 发送队列
+ * @param ctx 提供writev_func的MQTT运行时上下文
+ * @param now 当前时间（毫秒）
+ * @param force 非0时忽略暂缓发送的限制
+ * @return 成功则返回MQTTERR_NOERROR(可能仍有数据未发送，@see queued_bytes)，
+ *         writev_func失败时返回MQTTERR_IO
+ */
+int MqttSendQueue_Flush(struct MqttSendQueue *queue, struct MqttContext *ctx,
+                        int64_t now, int force);
+/**
+ * 获取暂缓发送的期限
+ * @param queue 发送队列
+ * @return 需要调用 @see MqttSendQueue_Flush 的时间（毫秒），队列为空时返回-1
+ */
+int64_t MqttSendQueue_Deadline(const struct MqttSendQueue *queue);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // ONENET_MQTT_SEND_QUEUE_H
@@ -0,0 +1,104 @@
+#ifndef ONENET_MQTT_SHARD_H
+#define ONENET_MQTT_SHARD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <pthread.h>
+#include "config.h"
+#include "mqtt.h"
+#include "mqtt_engine.h"
+
+struct MqttShardedEngine;
+
+/** 提交给分片线程执行的任务，内部使用 */
+struct MqttShardTask {
+    struct MqttShardTask *next;
+    uint64_t conn_id;
+    void *func_arg;
+    void (*func)(void *arg, struct MqttEngine *engine);
+    struct MqttBuffer buf[1];
+};
+
+/** 一个分片：独占一个线程和一个 @see MqttEngine，分片之间不共享连接 */
+struct MqttShard {
+    struct MqttEngine engine[1]; /**< 分片的引擎，只能在分片线程中访问(线程启动前除外) */
+    struct MqttShardedEngine *owner;
+    uint32_t index;
+    int cpu;                     /**< 绑定的CPU，-1表示不绑定 */
+    uint64_t dropped_pkts;       /**< 因连接已关闭而丢弃的已提交数据包个数 */
+
+    /* 以下成员内部使用 */
+    pthread_t thread;
+    int started;
+    struct MqttShardTask *tasks;
+};
+
+/** 多线程分片引擎，每个线程运行一个事件循环 */
+struct MqttShardedEngine {
+    struct MqttShard *shards;
+    uint32_t shard_count;
+};
+
+/**
+ * 初始化分片引擎，使用完后必须用 @see MqttShardedEngine_Destroy 销毁
+ * @param se 被初始化的分片引擎
+ * @param shard_count 分片(线程)个数，为0时取在线CPU个数
+ * @param max_conns 每个分片最多管理的连接数
+ * @param pin_cpu 非0时，将每个分片线程绑定到一个CPU上
+ * @return 成功则返回MQTTERR_NOERROR
+ * @remark 启动前可直接在各分片的engine上建立连接
+ */
+int MqttShardedEngine_Init(struct MqttShardedEngine *se, uint32_t shard_count,
+                           uint32_t max_conns, int pin_cpu);
+/**
+ * 停止并销毁分片引擎
+ * @param se 被销毁的分片引擎
+ */
+void MqttShardedEngine_Destroy(struct MqttShardedEngine *se);
+/**
+ * 为每个分片启动一个线程运行事件循环
+ * @param se 分片引擎
+ * @return 成功则返回MQTTERR_NOERROR
+ */
+int MqttShardedEngine_Start(struct MqttShardedEngine *se);
+/**
+ * 停止所有分片线程，并等待其退出
+ * @param se 分片引擎
+ */
+void MqttShardedEngine_Stop(struct MqttShardedEngine *se);
+/**
+ * 根据关键字(如设备序号)选择分片
+ * @param se 分片引擎
+ * @param key 关键字
+ * @return 关键字对应的分片
+ */
+struct MqttShard *MqttShardedEngine_GetShard(struct MqttShardedEngine *se, uint64_t key);
+
+/**
+ * 在分片线程中执行func，可在任意线程中调用
+ * @param shard 执行任务的分片
+ * @param func 任务函数，engine为分片的引擎
+ * @param arg func的关联参数
+ * @return 成功则返回MQTTERR_NOERROR
+ */
+int MqttShard_Post(struct MqttShard *shard,
+                   void (*func)(void *arg, struct MqttEngine *engine), void *arg);
+/**
+ * 提交数据包，由分片线程通过conn_id对应的连接发送，可在任意线程中调用
+ * @param shard 连接所在的分片
+ * @param conn_id 连接ID，@see MqttConnection
+ * @param buf 保存数据包的缓冲区对象，其内容被移交给分片(@see MqttBuffer_Move)，
+ *            返回后buf为空；数据块位于调用者提供的initial_buffer中时被复制
+ * @return 成功则返回MQTTERR_NOERROR
+ * @remark 若连接在发送前已关闭，数据包被丢弃并计入dropped_pkts
+ */
+int MqttShard_SubmitPkt(struct MqttShard *shard, uint64_t conn_id, struct MqttBuffer *buf);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // ONENET_MQTT_SHARD_H
@@ -0,0 +1,102 @@
+#ifndef ONENET_MQTT_SUB_TRIE_H
+#define ONENET_MQTT_SUB_TRIE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "config.h"
+#include "mqtt.h"
+
+/**
+ * 订阅的处理函数，参数的含义同 @see MqttContext 的handle_publish，成功返回非负数
+ */
+typedef int (*MqttSubHandler)(void *arg, uint16_t pkt_id, const char *topic,
+                              const char *payload, uint32_t payloadsize,
+                              int dup, enum MqttQosLevel qos);
+
+/** 订阅树的节点，内部使用 */
+struct MqttSubNode;
+
+/**
+ * 客户端的订阅表：按主题的层级('/'分隔)组织成前缀树，支持'+'和'#'通配符，
+ * 每个过滤器对应一个处理函数。子节点保存在以(父节点, 层级名)为键的散列表中，
+ * 匹配一个主题的复杂度与主题的层数成正比，与过滤器个数无关
+ */
+struct MqttSubTrie {
+    uint32_t filters; /**< 已注册的过滤器个数 */
+    uint32_t nodes;   /**< 节点个数(不含根节点) */
+
+    /* 以下成员内部使用 */
+    struct MqttSubNode *root;
+    struct MqttSubNode **buckets;
+    uint32_t bucket_count;
+};
+
+/**
+ * 初始化订阅表，使用完后必须用 @see MqttSubTrie_Destroy 销毁
+ * @param trie 被初始化的订阅表
+ * @return 成功则返回MQTTERR_NOERROR
+ */
+int MqttSubTrie_Init(struct MqttSubTrie *trie);
+/**
+ * 销毁订阅表，释放所有节点
+ * @param trie 被销毁的订阅表
+ */
+void MqttSubTrie_Destroy(struct MqttSubTrie *trie);
+
+/**
+ * 注册过滤器的处理函数，过滤器已存在时替换其处理函数
+ * @param trie 订阅表
+ * @param filter 主题过滤器，'+'必须单独占一层，'#'必须单独占最后一层
+ * @param handler 处理函数，不能为NULL
+ * @param arg handler的关联参数
+ * @return 成功则返回MQTTERR_NOERROR
+ */
+int MqttSubTrie_Add(struct MqttSubTrie *trie, const char *filter,
+                    MqttSubHandler handler, void *arg);
+/**
+ * 删除过滤器，并释放不再使用的节点
+ * @param trie 订阅表
+ * @param filter 主题过滤器
+ * @return 成功则返回MQTTERR_NOERROR，过滤器不存在时返回MQTTERR_INVALID_PARAMETER
+ */
+int MqttSubTrie_Remove(struct MqttSubTrie *trie, const char *filter);
+
+/**
+ * 调用所有匹配主题的过滤器的处理函数，一个主题可匹配多个过滤器(如"a/+"和"a/#")，
+ * 调用顺序不确定。以'$'开头的主题不匹配第一层为通配符的过滤器
+ * @param trie 订阅表
+ * @param topic 收到的数据所属的主题，其余参数的含义同handle_publish
+ * @return 匹配的过滤器个数，处理函数返回负数时立即返回该值
+ * @remark 处理函数中不能注册或删除过滤器
+ */
+int MqttSubTrie_Dispatch(const struct MqttSubTrie *trie, uint16_t pkt_id, const char *topic,
+                         const char *payload, uint32_t payloadsize,
+                         int dup, enum MqttQosLevel qos);
+
+/**
+ * 封装订阅数据包，并为每个topic注册同一个处理函数，参数的含义同 @see Mqtt_PackSubscribePkt
+ * @param trie 订阅表
+ * @param handler 处理函数
+ * @param arg handler的关联参数
+ * @return 成功返回MQTTERR_NOERROR，失败时订阅表中可能已注册了部分topic
+ */
+int MqttSubTrie_PackSubscribePkt(struct MqttSubTrie *trie, struct MqttBuffer *buf,
+                                 uint16_t pkt_id, enum MqttQosLevel qos,
+                                 const char *topics[], int topics_len,
+                                 MqttSubHandler handler, void *arg);
+/**
+ * 封装取消订阅数据包，并删除这些topic的处理函数，参数的含义同 @see Mqtt_PackUnsubscribePkt
+ * @param trie 订阅表
+ * @return 成功返回MQTTERR_NOERROR，订阅表中不存在的topic被忽略
+ */
+int MqttSubTrie_PackUnsubscribePkt(struct MqttSubTrie *trie, struct MqttBuffer *buf,
+                                   uint16_t pkt_id, const char *topics[], int topics_len);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // ONENET_MQTT_SUB_TRIE_H
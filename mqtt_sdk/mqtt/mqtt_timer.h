@@ -0,0 +1,98 @@
+#ifndef ONENET_MQTT_TIMER_H
+#define ONENET_MQTT_TIMER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "config.h"
+
+#define MQTT_TIMER_WHEEL_BITS 8
+#define MQTT_TIMER_WHEEL_SLOTS (1 << MQTT_TIMER_WHEEL_BITS)
+#define MQTT_TIMER_WHEEL_LEVELS 4
+
+struct MqttTimer;
+
+/** 定时器双向链表的节点，内部使用 */
+struct MqttTimerLink {
+    struct MqttTimerLink *prev;
+    struct MqttTimerLink *next;
+};
+
+/** 定时器，一般嵌入到连接等对象中，不需要单独分配内存 */
+struct MqttTimer {
+    struct MqttTimerLink link; /* 必须是第一个成员 */
+    int64_t expire;            /**< 到期时间（毫秒） */
+    int level;                 /* 所在的层，内部使用 */
+
+    void *func_arg; /**< 到期回调函数的关联参数 */
+    void (*func)(void *arg, struct MqttTimer *timer);
+        /**< 到期回调函数，调用时定时器已停止，可在其中重新启动 */
+};
+
+/**
+ * 分层时间轮：4层，每层256个槽，时间单位为毫秒，最长定时约49天，
+ * 启动和停止定时器的复杂度为O(1)
+ */
+struct MqttTimerWheel {
+    int64_t now;      /**< 已处理到的时间（毫秒） */
+    uint32_t count;   /**< 运行中的定时器个数 */
+    uint32_t level_count[MQTT_TIMER_WHEEL_LEVELS];
+    struct MqttTimerLink slots[MQTT_TIMER_WHEEL_LEVELS][MQTT_TIMER_WHEEL_SLOTS];
+};
+
+/**
+ * 初始化时间轮
+ * @param wheel 被初始化的时间轮
+ * @param now 当前时间（毫秒），之后传入的时间必须使用同一时钟
+ */
+void MqttTimerWheel_Init(struct MqttTimerWheel *wheel, int64_t now);
+/**
+ * 推进时间轮，依次调用所有到期定时器的回调函数
+ * @param wheel 时间轮
+ * @param now 当前时间（毫秒）
+ * @return 到期的定时器个数
+ */
+uint32_t MqttTimerWheel_Advance(struct MqttTimerWheel *wheel, int64_t now);
+/**
+ * 获取距离下一次需要推进时间轮的毫秒数，可直接用作poll等函数的超时时间
+ * @param wheel 时间轮
+ * @return 没有运行中的定时器时返回-1
+ * @remark 返回值不会晚于最早的到期时间，但可能早于它(此时推进时间轮不会有定时器到期)
+ */
+int64_t MqttTimerWheel_NextTimeout(const struct MqttTimerWheel *wheel);
+
+/**
+ * 初始化定时器
+ * @param timer 被初始化的定时器
+ * @param func 到期回调函数
+ * @param arg func的关联参数
+ */
+void MqttTimer_Init(struct MqttTimer *timer,
+                    void (*func)(void *arg, struct MqttTimer *timer), void *arg);
+/**
+ * 启动定时器，若定时器已在运行，则重新设置其到期时间
+ * @param wheel 时间轮
+ * @param timer 定时器
+ * @param expire 到期时间（毫秒），早于当前时间时将在下一次推进时到期
+ */
+void MqttTimer_Start(struct MqttTimerWheel *wheel, struct MqttTimer *timer, int64_t expire);
+/**
+ * 停止定时器，对未运行的定时器调用也是安全的
+ * @param wheel 时间轮
+ * @param timer 定时器
+ */
+void MqttTimer_Stop(struct MqttTimerWheel *wheel, struct MqttTimer *timer);
+/**
+ * 判断定时器是否在运行
+ * @param timer 定时器
+ * @return 运行中返回非0
+ */
+int MqttTimer_IsActive(const struct MqttTimer *timer);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // ONENET_MQTT_TIMER_H
@@ -0,0 +1,131 @@
+#ifndef ONENET_MQTT_TRACE_H
+#define ONENET_MQTT_TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include "config.h"
+#include "mqtt.h"
+
+#if MQTT_TRACE_USDT
+#include <sys/sdt.h>
+#endif
+
+/** SDK内部被跟踪的阶段 */
+enum MqttTraceSpan {
+    MQTT_TRACE_DISPATCH, /**< 处理一个收到的数据包(Mqtt_Dispatch)，包括回调函数和自动回复 */
+    MQTT_TRACE_CALLBACK, /**< 用户的handle_publish或handle_cmd回调函数 */
+    MQTT_TRACE_WRITEV,   /**< 调用writev_func发送数据 */
+    MQTT_TRACE_PACK,     /**< 封装数据包(Mqtt_PackXxxPkt) */
+    MQTT_TRACE_SPAN_COUNT
+};
+
+/**
+ * 跟踪钩子，每个阶段开始时调用begin，结束时在同一线程调用end。
+ * pkt_type为数据包类型(@see MqttPacketType)，pkt_id为数据包ID，没有时均为0
+ */
+struct MqttTraceHooks {
+    void *arg; /**< 钩子函数的自定义参数 */
+    void (*begin)(void *arg, enum MqttTraceSpan span, int pkt_type, uint16_t pkt_id);
+    void (*end)(void *arg, enum MqttTraceSpan span, int pkt_type, uint16_t pkt_id);
+};
+
+/**
+ * 设置全局的跟踪钩子，对所有上下文生效
+ * @param hooks 跟踪钩子，被复制，为NULL时取消跟踪
+ * @remark 钩子被读取时不加锁，应在启动收发数据的线程之前设置；
+ *         SDK编译时MQTT_ENABLE_TRACE为0则钩子不会被调用
+ */
+void MqttTrace_SetHooks(const struct MqttTraceHooks *hooks);
+/**
+ * 获取阶段的名称
+ * @param span 阶段
+ * @return 阶段名称，如"dispatch"
+ */
+const char *MqttTrace_SpanName(enum MqttTraceSpan span);
+
+/** Chrome跟踪事件，内部使用 */
+struct MqttTraceEvent {
+    int64_t ts;
+    uint32_t tid;
+    uint16_t pkt_id;
+    uint8_t span;
+    uint8_t pkt_type;
+    uint8_t phase;
+};
+
+/**
+ * 把跟踪钩子收集的事件导出为Chrome跟踪格式(chrome://tracing或Perfetto)，
+ * 记录事件时不加锁也不申请内存，事件数达到容量后丢弃新的事件
+ */
+struct MqttTraceChrome {
+    uint32_t capacity; /**< 最多保存的事件个数 */
+    uint32_t count;    /**< 已记录的事件个数(含被丢弃的) */
+
+    /* 以下成员内部使用 */
+    int64_t start;
+    struct MqttTraceEvent *events;
+};
+
+/**
+ * 初始化Chrome跟踪导出
+ * @param chrome 被初始化的导出对象
+ * @param capacity 最多保存的事件个数，每个数据包的每个阶段占两个
+ * @return 成功则返回MQTTERR_NOERROR
+ */
+int MqttTraceChrome_Init(struct MqttTraceChrome *chrome, uint32_t capacity);
+/**
+ * 释放Chrome跟踪导出占用的内存
+ * @param chrome 导出对象
+ */
+void MqttTraceChrome_Destroy(struct MqttTraceChrome *chrome);
+/**
+ * 获取把事件记录到导出对象的跟踪钩子
+ * @param chrome 导出对象
+ * @param hooks 保存跟踪钩子，可传给 @see MqttTrace_SetHooks
+ */
+void MqttTraceChrome_GetHooks(struct MqttTraceChrome *chrome, struct MqttTraceHooks *hooks);
+/**
+ * 把记录的事件写为Chrome跟踪JSON
+ * @param chrome 导出对象
+ * @param fp 输出文件
+ * @return 成功则返回写出的事件个数
+ * @remark 应在停止跟踪(或所有被跟踪的线程结束)后调用
+ */
+int MqttTraceChrome_Write(const struct MqttTraceChrome *chrome, FILE *fp);
+
+/* 以下由SDK内部使用 */
+#if MQTT_TRACE_USDT
+#define MQTT_TRACE_PROBE(name, span, type, id) DTRACE_PROBE3(mqtt, name, span, type, id)
+#else
+#define MQTT_TRACE_PROBE(name, span, type, id) ((void)0)
+#endif
+
+#if MQTT_ENABLE_TRACE
+extern struct MqttTraceHooks MqttTrace_Hooks;
+
+#define MQTT_TRACE_BEGIN(span, type, id) do { \
+        MQTT_TRACE_PROBE(span_begin, span, type, id); \
+        if(MqttTrace_Hooks.begin) { \
+            MqttTrace_Hooks.begin(MqttTrace_Hooks.arg, span, type, id); \
+        } \
+    } while(0)
+#define MQTT_TRACE_END(span, type, id) do { \
+        if(MqttTrace_Hooks.end) { \
+            MqttTrace_Hooks.end(MqttTrace_Hooks.arg, span, type, id); \
+        } \
+        MQTT_TRACE_PROBE(span_end, span, type, id); \
+    } while(0)
+#else
+#define MQTT_TRACE_BEGIN(span, type, id) ((void)0)
+#define MQTT_TRACE_END(span, type, id) ((void)0)
+#endif
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // ONENET_MQTT_TRACE_H
@@ -0,0 +1,146 @@
+#ifndef ONENET_MQTT_URING_H
+#define ONENET_MQTT_URING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include "config.h"
+#include "mqtt.h"
+
+struct MqttUring;
+
+/** 由 @see MqttUring 管理的一个MQTT连接 */
+struct MqttUringConn {
+    int fd;                    /**< socket文件描述符，由MqttUring负责关闭 */
+    struct MqttContext ctx[1];
+        /**< 连接的MQTT运行时上下文，read_func/writev_func由MqttUring设置，
+             handle_*回调由使用者设置 */
+
+    void *handle_close_arg; /**< 连接关闭回调函数的关联参数 */
+    void (*handle_close)(void *arg, struct MqttUringConn *conn, int err);
+        /**< 连接关闭时的回调函数，err为关闭的原因，回调返回后conn将被释放 */
+
+    /* 以下成员内部使用 */
+    struct MqttUring *ring;
+    struct MqttUringConn *prev;
+    struct MqttUringConn *next;
+    struct MqttUringConn *next_dirty;
+    struct MqttUringConn *next_closed;
+    int dirty;
+    int rx_head;               /* 已接收未读取的缓冲区链表，-1为空 */
+    int rx_tail;
+    uint32_t rx_offset;
+    int rx_eof;
+    int rx_error;
+    int read_blocked;
+    int recv_armed;
+    int closed;
+    int close_err;
+    uint32_t refs;             /* 未完成的io_uring请求个数 */
+
+    struct MqttBuffer pending[1];   /* 等待提交的数据 */
+    struct MqttBuffer sending[1];   /* 已提交、未完成的数据 */
+    uint32_t sended_bytes;
+    uint32_t send_inflight;
+    int send_err;
+    struct iovec *send_iov;
+    void *send_msgs;
+};
+
+/** 基于io_uring的多连接事件循环：多重接收+共享的内核选择缓冲区，链式sendmsg发送 */
+struct MqttUring {
+    int ring_fd;
+    uint32_t conn_count;
+
+    uint64_t enter_calls;      /**< io_uring_enter系统调用次数 */
+    uint64_t recv_completions; /**< 接收完成事件个数 */
+    uint64_t send_submissions; /**< 提交的sendmsg请求个数 */
+
+    /* 以下成员内部使用 */
+    struct MqttUringConn *conns;
+    struct MqttUringConn *dirty;
+    struct MqttUringConn *closed;
+    int destroying;
+    void *ring_ptr;             /* 提交队列和完成队列共用一个映射 */
+    size_t ring_len;
+    void *sqes;
+    size_t sqes_len;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    unsigned to_submit;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    void *cqes;
+
+    void *buf_ring;
+    size_t buf_ring_len;
+    char *bufs;
+    uint32_t buf_size;
+    uint16_t buf_count;
+    uint16_t buf_tail;
+    uint32_t *buf_len;
+    int *buf_next;
+};
+
+/**
+ * 初始化io_uring事件循环，使用完后必须用 @see MqttUring_Destroy 销毁
+ * @param ring 被初始化的事件循环
+ * @param entries 提交队列的长度
+ * @param buf_count 接收缓冲区个数，必须为2的幂，所有连接共享
+ * @param buf_size 每个接收缓冲区的大小（字节数）
+ * @return 成功则返回MQTTERR_NOERROR，内核不支持时返回MQTTERR_IO
+ */
+int MqttUring_Init(struct MqttUring *ring, uint32_t entries, uint16_t buf_count,
+                   uint32_t buf_size);
+/**
+ * 销毁事件循环，关闭其管理的所有连接(不调用handle_close)
+ * @param ring 被销毁的事件循环
+ */
+void MqttUring_Destroy(struct MqttUring *ring);
+
+/**
+ * 将一个已连接的socket交由事件循环管理
+ * @param ring 事件循环
+ * @param fd socket文件描述符
+ * @param buf_size 接收数据缓冲区的大小（字节数）
+ * @param conn 返回新建的连接对象
+ * @return 成功则返回MQTTERR_NOERROR
+ */
+int MqttUring_AddConnection(struct MqttUring *ring, int fd, uint32_t buf_size,
+                            struct MqttUringConn **conn);
+/**
+ * 关闭连接，未完成的请求全部完成后调用handle_close并释放conn
+ * @param conn 将要关闭的连接
+ * @param err 关闭的原因
+ */
+void MqttUring_CloseConnection(struct MqttUringConn *conn, int err);
+
+/**
+ * 发送数据包，数据被复制到连接的发送缓冲区，在下一次 @see MqttUring_RunOnce 时提交
+ * @param conn 发送数据的连接
+ * @param buf 保存将要发送数据包的缓冲区对象，返回后即可重置或销毁
+ * @return 成功则返回MQTTERR_NOERROR
+ */
+int MqttUring_SendPkt(struct MqttUringConn *conn, const struct MqttBuffer *buf);
+
+/**
+ * 提交请求，等待并处理完成事件
+ * @param ring 事件循环
+ * @param timeout_ms 最长等待时间（毫秒），-1表示一直等待
+ * @return 成功则返回处理的完成事件数，失败返回MQTTERR_IO
+ */
+int MqttUring_RunOnce(struct MqttUring *ring, int timeout_ms);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // ONENET_MQTT_URING_H
@@ -0,0 +1,211 @@
+#ifndef ONENET_MQTT_V5_H
+#define ONENET_MQTT_V5_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "config.h"
+#include "mqtt.h"
+
+/** MQTT 5的属性标识，只列出SDK封装或解析的 */
+enum MqttV5Property {
+    MQTT_V5_PROP_SESSION_EXPIRY      = 0x11,
+    MQTT_V5_PROP_RECEIVE_MAXIMUM     = 0x21,
+    MQTT_V5_PROP_TOPIC_ALIAS_MAXIMUM = 0x22,
+    MQTT_V5_PROP_TOPIC_ALIAS         = 0x23,
+    MQTT_V5_PROP_MAXIMUM_PACKET_SIZE = 0x27
+};
+
+/** 出方向的别名，内部使用 */
+struct MqttV5OutAlias;
+/** 入方向的别名，内部使用 */
+struct MqttV5InAlias;
+
+/**
+ * MQTT 5会话：设置到MqttContext的v5成员后，上下文按MQTT 5的格式解析收到的数据包，
+ * 发送的CONNECT、PUBLISH、SUBSCRIBE和UNSUBSCRIBE须用Mqtt_Pack*PktV5系列函数封装。
+ * 会话维护两个方向的topic别名表：发布时topic第一次出现发送topic并建立别名，之后
+ * 只发送2字节的别名；收到的发布数据中的别名由SDK还原为topic再交给处理函数
+ */
+struct MqttV5Session {
+    uint16_t topic_alias_maximum;
+        /**< 本端的别名表大小，CONNECT时作为Topic Alias Maximum发送(入方向)，出方向使用
+             它与服务器的Topic Alias Maximum中较小的一个，@see MqttV5Session_Init 设为16，
+             为0时不使用别名 */
+    uint16_t receive_maximum;
+        /**< 本端同时接收的未确认QoS1/QoS2发布数据的上限，CONNECT时作为Receive Maximum
+             发送，为0(默认)时不发送，即65535，@see MqttV5Session_Attach */
+    uint32_t maximum_packet_size;
+        /**< 本端接收的数据包的最大字节数，CONNECT时作为Maximum Packet Size发送，为0(默认)
+             时不发送，即不限制，@see MqttV5Session_Attach */
+
+    uint16_t server_topic_alias_maximum; /**< CONNACK中服务器的Topic Alias Maximum */
+    uint16_t server_receive_maximum;
+        /**< CONNACK中服务器的Receive Maximum，未给出时为65535，未确认的QoS1/QoS2发布数据
+             达到该数量时 @see Mqtt_PackPublishPktV5 返回MQTTERR_QUOTA_EXCEEDED */
+    uint32_t server_maximum_packet_size;
+        /**< CONNACK中服务器的Maximum Packet Size，为0时不限制，超过它的发布数据包
+             封装时返回MQTTERR_PKT_TOO_LARGE */
+    uint16_t inflight;
+        /**< 已封装但未确认的QoS1/QoS2发布数据包个数，收到PUBACK、PUBCOMP或失败的PUBREC时
+             由SDK减少 */
+    uint8_t reason_code;
+        /**< 最近收到的CONNACK、PUBACK、PUBREC、PUBREL、PUBCOMP或DISCONNECT中的原因码，
+             不小于0x80时表示失败 */
+
+    uint64_t alias_hits;        /**< 只发送别名的发布数据包个数 */
+    uint64_t alias_assigns;     /**< 发送topic并建立或替换别名的发布数据包个数 */
+    uint64_t topic_bytes_saved; /**< 因使用别名少发送的topic字节数 */
+    uint64_t inbound_aliases;   /**< 收到的只带别名的发布数据包个数 */
+
+    /* 以下成员内部使用 */
+    struct MqttV5OutAlias *out_aliases;
+    uint16_t *out_buckets;
+    uint32_t out_bucket_count;
+    uint16_t out_capacity;
+    uint16_t out_count;
+    uint64_t out_clock;
+    struct MqttV5InAlias *in_aliases;
+    uint16_t in_capacity;
+};
+
+/**
+ * 初始化MQTT 5会话，使用完后必须用 @see MqttV5Session_Destroy 销毁
+ * @param session 被初始化的会话
+ */
+void MqttV5Session_Init(struct MqttV5Session *session);
+/**
+ * 销毁MQTT 5会话
+ * @param session 被销毁的会话
+ */
+void MqttV5Session_Destroy(struct MqttV5Session *session);
+/**
+ * 把会话设置为上下文的v5成员，并按上下文接收缓冲区的大小设置receive_maximum
+ * (每1KB一条，1～65535)和maximum_packet_size(缓冲区的字节数)，使服务器发来的数据
+ * 不会超出缓冲区
+ * @param session 会话
+ * @param ctx 已用 @see Mqtt_InitContext 初始化的上下文
+ */
+void MqttV5Session_Attach(struct MqttV5Session *session, struct MqttContext *ctx);
+/**
+ * 清空两个方向的别名表、未确认的发布数据计数和服务器的参数，连接断开后、
+ * 重新连接前必须调用，别名只在一个网络连接内有效
+ * @param session 会话
+ */
+void MqttV5Session_Reset(struct MqttV5Session *session);
+
+/**
+ * 应用CONNACK中的属性并清空别名表，收到CONNACK时SDK自动调用
+ * @param session 会话
+ * @param props CONNACK中以属性长度开始的属性部分
+ * @param size props的字节数
+ * @return 成功则返回MQTTERR_NOERROR，属性格式错误时返回MQTTERR_ILLEGAL_PKT
+ */
+int MqttV5Session_HandleConnAckProps(struct MqttV5Session *session, const char *props,
+                                     uint32_t size);
+/**
+ * 获取还能发送的QoS1/QoS2发布数据包个数
+ * @param session 会话
+ * @return 服务器的Receive Maximum减去未确认的发布数据包个数
+ */
+uint32_t MqttV5Session_SendQuota(const struct MqttV5Session *session);
+/**
+ * 归还一个发送配额，已封装的QoS1/QoS2发布数据包不再发送(如被丢弃)时调用
+ * @param session 会话
+ */
+void MqttV5Session_ReleaseQuota(struct MqttV5Session *session);
+/**
+ * 为发布数据的topic查找或建立出方向的别名，由 @see Mqtt_PackPublishPktV5 调用
+ * @param session 会话
+ * @param topic topic，不需要以'\0'结尾
+ * @param len topic的字节数
+ * @param alias 保存别名
+ * @return 不使用别名时返回0，新建立的别名(须同时发送topic)返回1，
+ *         已建立的别名返回2，失败返回负数
+ * @remark 别名表满时替换最久未使用的别名
+ */
+int MqttV5Session_OutboundAlias(struct MqttV5Session *session, const char *topic, uint32_t len,
+                                uint16_t *alias);
+/**
+ * 撤销新建立的出方向别名，携带它的数据包封装失败时由 @see Mqtt_PackPublishPktV5 调用
+ * @param session 会话
+ * @param alias @see MqttV5Session_OutboundAlias 返回1时的别名
+ */
+void MqttV5Session_DropOutboundAlias(struct MqttV5Session *session, uint16_t alias);
+/**
+ * 处理收到的发布数据中的别名，由SDK在收到发布数据时调用
+ * @param session 会话
+ * @param alias 别名，非0
+ * @param topic 数据包中的topic，为空字符串时查找别名，否则建立别名
+ * @param len topic的字节数
+ * @param resolved 保存还原的topic，以'\0'结尾，下次处理该别名前有效
+ * @param resolved_len 保存还原的topic的字节数
+ * @return 成功则返回MQTTERR_NOERROR，别名超出范围或未建立时返回MQTTERR_ILLEGAL_PKT
+ */
+int MqttV5Session_InboundAlias(struct MqttV5Session *session, uint16_t alias,
+                               const char *topic, uint16_t len,
+                               const char **resolved, uint16_t *resolved_len);
+
+/**
+ * 读取MQTT 5的变长整数(与剩余长度的编码相同)
+ * @param data 数据的起始地址
+ * @param size data的字节数
+ * @param value 保存读取的整数
+ * @return 整数占用的字节数，数据不完整或格式错误时返回-1
+ */
+int MqttV5_ReadVarInt(const char *data, uint32_t size, uint32_t *value);
+/**
+ * 读取下一个属性
+ * @param cursor 当前位置，读取后移到下一个属性
+ * @param end 属性部分的结束位置
+ * @param id 保存属性标识
+ * @param value 保存整数类型属性的值，其他类型为0
+ * @return 读取到属性时返回1，已到结束位置返回0，格式错误或未知的属性返回MQTTERR_ILLEGAL_PKT
+ */
+int MqttV5_ReadProperty(const char **cursor, const char *end, uint8_t *id, uint32_t *value);
+
+/**
+ * 封装MQTT 5的连接请求数据包，参数的含义同 @see Mqtt_PackConnectPkt，
+ * clean_session为MQTT 5的Clean Start，属性包括session的topic_alias_maximum、
+ * receive_maximum和maximum_packet_size
+ * @param session 会话
+ * @return 成功则返回MQTTERR_NOERROR
+ */
+int Mqtt_PackConnectPktV5(const struct MqttV5Session *session, struct MqttBuffer *buf,
+                          uint16_t keep_alive, const char *id, int clean_session,
+                          const char *will_topic, const char *will_msg, uint16_t msg_len,
+                          enum MqttQosLevel qos, int will_retain, const char *user,
+                          const char *password, uint16_t pswd_len);
+/**
+ * 封装MQTT 5的发布数据包，参数的含义同 @see Mqtt_PackPublishPkt，
+ * topic有别名时只发送别名
+ * @param session 会话
+ * @return 成功则返回MQTTERR_NOERROR，QoS1/QoS2的数据包没有发送配额时返回
+ *         MQTTERR_QUOTA_EXCEEDED，超过服务器的Maximum Packet Size时返回MQTTERR_PKT_TOO_LARGE
+ * @remark 只带别名的数据包只能在封装它的连接上发送，断线重连后重发的数据包须重新封装；
+ *         封装成功的QoS1/QoS2数据包占用一个发送配额，直到收到确认
+ */
+int Mqtt_PackPublishPktV5(struct MqttV5Session *session, struct MqttBuffer *buf,
+                          uint16_t pkt_id, const char *topic,
+                          const char *payload, uint32_t size,
+                          enum MqttQosLevel qos, int retain, int own);
+/**
+ * 封装MQTT 5的订阅数据包，参数的含义同 @see Mqtt_PackSubscribePkt
+ * @return 成功则返回MQTTERR_NOERROR
+ */
+int Mqtt_PackSubscribePktV5(struct MqttBuffer *buf, uint16_t pkt_id, enum MqttQosLevel qos,
+                            const char *topics[], int topics_len);
+/**
+ * 封装MQTT 5的取消订阅数据包，参数的含义同 @see Mqtt_PackUnsubscribePkt
+ * @return 成功则返回MQTTERR_NOERROR
+ */
+int Mqtt_PackUnsubscribePktV5(struct MqttBuffer *buf, uint16_t pkt_id,
+                              const char *topics[], int topics_len);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // ONENET_MQTT_V5_H
@@ -3,6 +3,12 @@ base on
 v2.0 2016/4/19
  */
 #include "mqtt/mqtt.h"
+#include "mqtt/mqtt_metrics.h"
+#include "mqtt/mqtt_sub_trie.h"
+#include "mqtt/mqtt_cmd_table.h"
+#include "mqtt/mqtt_compress.h"
+#include "mqtt/mqtt_v5.h"
+#include "mqtt/mqtt_trace.h"
 #include "mqtt/cJSON.h"
 #include <stdlib.h>
 #include <string.h>
@@ -14,6 +20,13 @@ v2.0 2016/4/19
 #define CMD_TOPIC_PREFIX_LEN 5 // strlen(CMD_TOPIC_PREFIX)
 #define RESP_CMD_TOPIC_PREFIX "$crsp/"
 #define RESP_CMD_TOPIC_PREFIX_LEN 6
+
+// a PUBACK, PUBREC, PUBREL or PUBCOMP fits in one extent of this storage
+#define MQTT_ACK_STORAGE 64
+// the automatic $crsp reply references the cmdid and the data, the headers fit here
+#define MQTT_CMD_REPLY_STORAGE 256
+// Mqtt_SendPkt builds the iovec array on the stack up to this many extents
+#define MQTT_SEND_STACK_IOV 8
 #define FORMAT_TIME_STRING_SIZE 23
 
 // range of int: (-2147483648  2147483648), and 1 byte for terminating null byte.
@@ -267,7 +280,8 @@ static int Mqtt_IsLegalUtf8(const char *first, int len)
             break;
         }
     case 1:
-        if(((*first >= 0x80) && (*first < 0xC2)) || (*first > 0xF4)) {
+        if((((unsigned char)*first >= 0x80) && ((unsigned char)*first < 0xC2)) ||
+           ((unsigned char)*first > 0xF4)) {
             return MQTTERR_NOT_UTF8;
         }
     }
@@ -277,25 +291,37 @@ static int Mqtt_IsLegalUtf8(const char *first, int len)
 
 static int Mqtt_CheckUtf8(const char *str, size_t len)
 {
-    size_t i;
+    size_t i = 0;
+    uint64_t word;
+    char utf8_char_len;
+    int ret;
+
+    while(i < len) {
+        // topics are mostly ascii, eight such bytes without '\0' are taken at once
+        if(i + 8 <= len) {
+            memcpy(&word, str + i, 8);
+            if(!(word & 0x8080808080808080ull) &&
+               !((word - 0x0101010101010101ull) & 0x8080808080808080ull)) {
+                i += 8;
+                continue;
+            }
+        }
 
-    for(i = 0; i < len;) {
-        int ret;
-        char utf8_char_len = Mqtt_TrailingBytesForUTF8[(uint8_t)str[i]] + 1;
+        if('\0' == str[i]) {
+            break;
+        }
 
+        utf8_char_len = Mqtt_TrailingBytesForUTF8[(uint8_t)str[i]] + 1;
         if(i + utf8_char_len > len) {
             return MQTTERR_NOT_UTF8;
         }
 
-        ret = Mqtt_IsLegalUtf8(str, utf8_char_len);
+        ret = Mqtt_IsLegalUtf8(str + i, utf8_char_len);
         if(ret != MQTTERR_NOERROR) {
             return ret;
         }
 
         i += utf8_char_len;
-        if('\0'== str[i]) {
-            break;
-        }
     }
 
     return (int)i;
@@ -366,11 +392,42 @@ inline int Mqtt_HandlePingResp(struct MqttContext *ctx, char flags,
     return ctx->handle_ping_resp(ctx->handle_ping_resp_arg);
 }
 
+// an MQTT 5 CONNACK: ack flags, reason code and properties,
+// not static because the inline Mqtt_HandleConnAck calls it
+int Mqtt_HandleConnAckV5(struct MqttContext *ctx, char flags,
+                         char *pkt, size_t size)
+{
+    uint8_t ack_flags, reason;
+    int err;
+
+    if((0 != flags) || (size < 3)) {
+        return MQTTERR_ILLEGAL_PKT;
+    }
+
+    ack_flags = (uint8_t)pkt[0];
+    reason = (uint8_t)pkt[1];
+    if((ack_flags & 0xFE) || ((ack_flags & 0x01) && (reason >= 0x80))) {
+        return MQTTERR_ILLEGAL_PKT;
+    }
+
+    err = MqttV5Session_HandleConnAckProps(ctx->v5, pkt + 2, (uint32_t)(size - 2));
+    if(err < 0) {
+        return err;
+    }
+
+    ctx->v5->reason_code = reason;
+    return ctx->handle_conn_ack(ctx->handle_conn_ack_arg, (char)ack_flags, (char)reason);
+}
+
 inline int Mqtt_HandleConnAck(struct MqttContext *ctx, char flags,
                               char *pkt, size_t size)
 {
     char ack_flags, ret_code;
 
+    if(ctx->v5) {
+        return Mqtt_HandleConnAckV5(ctx, flags, pkt, size);
+    }
+
     if((0 != flags) || (2 != size)) {
         return MQTTERR_ILLEGAL_PKT;
     }
@@ -385,6 +442,188 @@ inline int Mqtt_HandleConnAck(struct MqttContext *ctx, char flags,
     return ctx->handle_conn_ack(ctx->handle_conn_ack_arg, ack_flags, ret_code);
 }
 
+// packs $crsp/<cmdid> referencing cmdid and data, only the headers are written to buf
+static int Mqtt_PackCmdReply(struct MqttBuffer *buf, uint16_t pkt_id,
+                             const char *cmdid, uint32_t cmdid_len,
+                             const char *data, uint32_t size, enum MqttQosLevel qos)
+{
+    struct MqttExtent *fix_head, *variable_head, *id_ext;
+    size_t total_len;
+    char *cursor;
+    int ret;
+
+    // a reply is acknowledged at most once, there is no PUBREC handling for it
+    if(((MQTT_QOS_LEVEL0 != qos) && (MQTT_QOS_LEVEL1 != qos)) ||
+       ((MQTT_QOS_LEVEL1 == qos) && (0 == pkt_id))) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    if(RESP_CMD_TOPIC_PREFIX_LEN + cmdid_len > 0xFFFF) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    fix_head = MqttBuffer_AllocExtent(buf, 5);
+    variable_head = MqttBuffer_AllocExtent(buf, 2 + RESP_CMD_TOPIC_PREFIX_LEN);
+    if(!fix_head || !variable_head) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    total_len = 2 + RESP_CMD_TOPIC_PREFIX_LEN + cmdid_len + size;
+    fix_head->payload[0] = MQTT_PKT_PUBLISH << 4;
+    if(MQTT_QOS_LEVEL1 == qos) {
+        fix_head->payload[0] |= 0x02;
+        total_len += 2;
+    }
+
+    ret = Mqtt_DumpLength(total_len, fix_head->payload + 1);
+    if(ret < 0) {
+        return MQTTERR_PKT_TOO_LARGE;
+    }
+    fix_head->len = ret + 1;
+
+    cursor = variable_head->payload;
+    Mqtt_WB16((uint16_t)(RESP_CMD_TOPIC_PREFIX_LEN + cmdid_len), cursor);
+    memcpy(cursor + 2, RESP_CMD_TOPIC_PREFIX, RESP_CMD_TOPIC_PREFIX_LEN);
+
+    MqttBuffer_AppendExtent(buf, fix_head);
+    MqttBuffer_AppendExtent(buf, variable_head);
+    if(MqttBuffer_Append(buf, (char*)cmdid, cmdid_len, 0) < 0) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    if(MQTT_QOS_LEVEL1 == qos) {
+        id_ext = MqttBuffer_AllocExtent(buf, 2);
+        if(!id_ext) {
+            return MQTTERR_OUTOFMEMORY;
+        }
+        Mqtt_WB16(pkt_id, id_ext->payload);
+        MqttBuffer_AppendExtent(buf, id_ext);
+    }
+
+    if(size && (MqttBuffer_Append(buf, (char*)data, size, 0) < 0)) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    return MQTTERR_NOERROR;
+}
+
+// routes a $creq command through ctx->commands and sends the reply the handler asked for
+static int Mqtt_DispatchCmd(struct MqttContext *ctx, uint16_t pkt_id, const char *cmdid,
+                            const char *arg, uint32_t arg_len, int dup, enum MqttQosLevel qos)
+{
+    const struct MqttCmdTable *table = ctx->commands;
+    const char *name = arg, *delimiter;
+    uint32_t name_len = arg_len;
+    struct MqttCmdReply reply;
+    MqttCmdHandler handler;
+    void *handler_arg;
+    struct MqttBuffer buf[1];
+    char storage[MQTT_CMD_REPLY_STORAGE];
+    int err;
+
+    if(table->by_cmdid) {
+        name = cmdid;
+        name_len = (uint32_t)strlen(cmdid);
+    }
+    else if(table->delimiter) {
+        delimiter = (const char*)memchr(arg, table->delimiter, arg_len);
+        if(delimiter) {
+            name_len = (uint32_t)(delimiter - arg);
+        }
+    }
+
+    handler = MqttCmdTable_Lookup(table, name, name_len, &handler_arg);
+    if(!handler) {
+        if(!ctx->handle_cmd) {
+            return MQTTERR_NOERROR;
+        }
+        return ctx->handle_cmd(ctx->handle_cmd_arg, pkt_id, cmdid, 0, "",
+                               arg, arg_len, dup, qos);
+    }
+
+    memset(&reply, 0, sizeof(reply));
+    reply.qos = MQTT_QOS_LEVEL0;
+    err = handler(handler_arg, pkt_id, cmdid, arg, arg_len, dup, qos, &reply);
+    if((err < 0) || !reply.send) {
+        return err;
+    }
+
+    // the cmdid still sits in the receive buffer, the reply goes out before it is reused
+    MqttBuffer_InitFixed(buf, storage, sizeof(storage));
+    err = Mqtt_PackCmdReply(buf, reply.pkt_id, cmdid, (uint32_t)strlen(cmdid),
+                            reply.data, reply.size, reply.qos);
+    if((MQTTERR_NOERROR == err) &&
+       (Mqtt_SendPkt(ctx, buf, 0) != (int)buf->buffered_bytes)) {
+        err = MQTTERR_FAILED_SEND_RESPONSE;
+    }
+
+    MqttBuffer_Destroy(buf);
+    return err;
+}
+
+// skips the MQTT 5 properties in front of the payload and resolves the topic alias,
+// the topic then points at the alias table when the packet carries an alias
+static int Mqtt_ReadPublishPropsV5(struct MqttContext *ctx, char **topic, uint16_t *topic_len,
+                                   char **payload, size_t *payload_len)
+{
+    const char *cursor, *end, *resolved;
+    uint32_t props_len, value;
+    uint16_t alias = 0;
+    uint8_t id;
+    int bytes, ret;
+
+    bytes = MqttV5_ReadVarInt(*payload, (uint32_t)*payload_len, &props_len);
+    if((bytes < 0) || (props_len > *payload_len - (size_t)bytes)) {
+        return MQTTERR_ILLEGAL_PKT;
+    }
+
+    cursor = *payload + bytes;
+    end = cursor + props_len;
+    while((ret = MqttV5_ReadProperty(&cursor, end, &id, &value)) > 0) {
+        if(MQTT_V5_PROP_TOPIC_ALIAS == id) {
+            alias = (uint16_t)value;
+        }
+    }
+    if(ret < 0) {
+        return ret;
+    }
+
+    *payload += bytes + props_len;
+    *payload_len -= bytes + props_len;
+
+    if(0 == alias) {
+        return 0 == *topic_len ? MQTTERR_ILLEGAL_PKT : MQTTERR_NOERROR;
+    }
+
+    ret = MqttV5Session_InboundAlias(ctx->v5, alias, *topic, *topic_len, &resolved, topic_len);
+    if(ret < 0) {
+        return ret;
+    }
+
+    *topic = (char*)resolved;
+    return MQTTERR_NOERROR;
+}
+
+// the filters of the subscription table first, handle_publish when none matched
+static int Mqtt_DeliverPublish(struct MqttContext *ctx, uint16_t pkt_id, const char *topic,
+                               const char *payload, uint32_t payload_len, int dup,
+                               enum MqttQosLevel qos)
+{
+    int err = 0;
+
+    if(ctx->subscriptions) {
+        err = MqttSubTrie_Dispatch(ctx->subscriptions, pkt_id, topic,
+                                   payload, payload_len, dup, qos);
+    }
+
+    if((0 == err) && ctx->handle_publish) {
+        err = ctx->handle_publish(ctx->handle_publish_arg, pkt_id, topic,
+                                  payload, payload_len, dup, qos);
+    }
+
+    return err;
+}
+
 static int Mqtt_HandlePublish(struct MqttContext *ctx, char flags,
                               char *pkt, size_t size)
 {
@@ -449,6 +688,13 @@ static int Mqtt_HandlePublish(struct MqttContext *ctx, char flags,
     assert(NULL != topic);
     topic[topic_len] = '\0';
 
+    if(ctx->v5) {
+        err = Mqtt_ReadPublishPropsV5(ctx, &topic, &topic_len, &payload, &payload_len);
+        if(err < 0) {
+            return err;
+        }
+    }
+
     if(Mqtt_CheckUtf8(topic, topic_len) != topic_len) {
         return MQTTERR_ILLEGAL_PKT;
     }
@@ -517,22 +763,50 @@ static int Mqtt_HandlePublish(struct MqttContext *ctx, char flags,
             }
             */
 
-            err = ctx->handle_cmd(ctx->handle_cmd_arg, pkt_id, cmdid,
-                                  ts, desc, arg, arg_len, dup,
-                                  (enum MqttQosLevel)qos);
+            MQTT_TRACE_BEGIN(MQTT_TRACE_CALLBACK, MQTT_PKT_PUBLISH, pkt_id);
+            if(ctx->commands) {
+                err = Mqtt_DispatchCmd(ctx, pkt_id, cmdid, arg, arg_len, dup,
+                                       (enum MqttQosLevel)qos);
+            }
+            else {
+                err = ctx->handle_cmd(ctx->handle_cmd_arg, pkt_id, cmdid,
+                                      ts, desc, arg, arg_len, dup,
+                                      (enum MqttQosLevel)qos);
+            }
+            MQTT_TRACE_END(MQTT_TRACE_CALLBACK, MQTT_PKT_PUBLISH, pkt_id);
 
         }
+        else {
+            // other system topics such as $dp, or $SYS filters of the subscription table
+            MQTT_TRACE_BEGIN(MQTT_TRACE_CALLBACK, MQTT_PKT_PUBLISH, pkt_id);
+            err = Mqtt_DeliverPublish(ctx, pkt_id, topic, payload, (uint32_t)payload_len,
+                                      dup, (enum MqttQosLevel)qos);
+            MQTT_TRACE_END(MQTT_TRACE_CALLBACK, MQTT_PKT_PUBLISH, pkt_id);
+        }
     }
     else {
-        err = ctx->handle_publish(ctx->handle_publish_arg, pkt_id, topic,
-                                  payload, payload_len, dup,
-                                  (enum MqttQosLevel)qos);
+        if(ctx->compression && MqttCompression_IsFramed(payload, (uint32_t)payload_len)) {
+            uint32_t decoded_len;
+
+            err = MqttCompression_Decode(ctx->compression, payload, (uint32_t)payload_len,
+                                         &payload, &decoded_len);
+            if(err < 0) {
+                return err;
+            }
+            payload_len = decoded_len;
+        }
+
+        MQTT_TRACE_BEGIN(MQTT_TRACE_CALLBACK, MQTT_PKT_PUBLISH, pkt_id);
+        err = Mqtt_DeliverPublish(ctx, pkt_id, topic, payload, (uint32_t)payload_len,
+                                  dup, (enum MqttQosLevel)qos);
+        MQTT_TRACE_END(MQTT_TRACE_CALLBACK, MQTT_PKT_PUBLISH, pkt_id);
     }
 
     // send the publish response.
     if(err >= 0) {
         struct MqttBuffer response[1];
-        MqttBuffer_Init(response);
+        char storage[MQTT_ACK_STORAGE];
+        MqttBuffer_InitFixed(response, storage, sizeof(storage));
 
         switch(qos) {
         case MQTT_QOS_LEVEL2:
@@ -550,6 +824,9 @@ static int Mqtt_HandlePublish(struct MqttContext *ctx, char flags,
         }
 
         if((MQTTERR_NOERROR == err) && (MQTT_QOS_LEVEL0 != qos)) {
+            if(ctx->metrics) {
+                MqttMetrics_CountAllocs(ctx->metrics, response);
+            }
             if(Mqtt_SendPkt(ctx, response, 0) != response->buffered_bytes) {
                 err = MQTTERR_FAILED_SEND_RESPONSE;
             }
@@ -564,12 +841,39 @@ static int Mqtt_HandlePublish(struct MqttContext *ctx, char flags,
     return err;
 }
 
+// checks the length of PUBACK, PUBREC, PUBREL and PUBCOMP, MQTT 5 may append a reason
+// code and properties which are kept in the session; not static because the inline
+// ack handlers call it
+int Mqtt_CheckAck(struct MqttContext *ctx, const char *pkt, size_t size)
+{
+    uint32_t props_len;
+    int bytes;
+
+    if(!ctx->v5) {
+        return 2 == size ? MQTTERR_NOERROR : MQTTERR_ILLEGAL_PKT;
+    }
+
+    if(size < 2) {
+        return MQTTERR_ILLEGAL_PKT;
+    }
+
+    if(size > 3) {
+        bytes = MqttV5_ReadVarInt(pkt + 3, (uint32_t)(size - 3), &props_len);
+        if((bytes < 0) || (props_len != size - 3 - (size_t)bytes)) {
+            return MQTTERR_ILLEGAL_PKT;
+        }
+    }
+
+    ctx->v5->reason_code = size > 2 ? (uint8_t)pkt[2] : 0;
+    return MQTTERR_NOERROR;
+}
+
 inline int Mqtt_HandlePubAck(struct MqttContext *ctx, char flags,
                              char *pkt, size_t size)
 {
     uint16_t pkt_id;
 
-    if((0 != flags) || (2 != size)) {
+    if((0 != flags) || (Mqtt_CheckAck(ctx, pkt, size) < 0)) {
         return MQTTERR_ILLEGAL_PKT;
     }
 
@@ -578,6 +882,10 @@ inline int Mqtt_HandlePubAck(struct MqttContext *ctx, char flags,
         return MQTTERR_ILLEGAL_PKT;
     }
 
+    if(ctx->v5) {
+        MqttV5Session_ReleaseQuota(ctx->v5);
+    }
+
     return ctx->handle_pub_ack(ctx->handle_pub_ack_arg, pkt_id);
 }
 
@@ -587,7 +895,7 @@ inline int Mqtt_HandlePubRec(struct MqttContext *ctx, char flags,
     uint16_t pkt_id;
     int err;
 
-    if((0 != flags) || (2 != size)) {
+    if((0 != flags) || (Mqtt_CheckAck(ctx, pkt, size) < 0)) {
         return MQTTERR_ILLEGAL_PKT;
     }
 
@@ -596,13 +904,23 @@ inline int Mqtt_HandlePubRec(struct MqttContext *ctx, char flags,
         return MQTTERR_ILLEGAL_PKT;
     }
 
+    // an MQTT 5 PUBREC with a failure reason ends the exchange without PUBREL
+    if(ctx->v5 && (ctx->v5->reason_code >= 0x80)) {
+        MqttV5Session_ReleaseQuota(ctx->v5);
+        return ctx->handle_pub_rec(ctx->handle_pub_rec_arg, pkt_id);
+    }
+
     err = ctx->handle_pub_rec(ctx->handle_pub_rec_arg, pkt_id);
     if(err >= 0) {
         struct MqttBuffer response[1];
-        MqttBuffer_Init(response);
+        char storage[MQTT_ACK_STORAGE];
+        MqttBuffer_InitFixed(response, storage, sizeof(storage));
 
         err = Mqtt_PackPubRelPkt(response, pkt_id);
         if(MQTTERR_NOERROR == err) {
+            if(ctx->metrics) {
+                MqttMetrics_CountAllocs(ctx->metrics, response);
+            }
             if(Mqtt_SendPkt(ctx, response, 0) != response->buffered_bytes) {
                 err = MQTTERR_FAILED_SEND_RESPONSE;
             }
@@ -620,7 +938,7 @@ inline int Mqtt_HandlePubRel(struct MqttContext *ctx, char flags,
     uint16_t pkt_id;
     int err;
 
-    if((2 != flags) || (2 != size)) {
+    if((2 != flags) || (Mqtt_CheckAck(ctx, pkt, size) < 0)) {
         return MQTTERR_ILLEGAL_PKT;
     }
 
@@ -632,9 +950,13 @@ inline int Mqtt_HandlePubRel(struct MqttContext *ctx, char flags,
     err = ctx->handle_pub_rel(ctx->handle_pub_rel_arg, pkt_id);
     if(err >= 0) {
         struct MqttBuffer response[1];
-        MqttBuffer_Init(response);
+        char storage[MQTT_ACK_STORAGE];
+        MqttBuffer_InitFixed(response, storage, sizeof(storage));
         err = Mqtt_PackPubCompPkt(response, pkt_id);
         if(MQTTERR_NOERROR == err) {
+            if(ctx->metrics) {
+                MqttMetrics_CountAllocs(ctx->metrics, response);
+            }
             if(Mqtt_SendPkt(ctx, response, 0) != response->buffered_bytes) {
                 err = MQTTERR_FAILED_SEND_RESPONSE;
             }
@@ -650,7 +972,7 @@ inline int Mqtt_HandlePubComp(struct MqttContext *ctx, char flags,
 {
     uint16_t pkt_id;
 
-    if((0 != flags) || (2 != size)) {
+    if((0 != flags) || (Mqtt_CheckAck(ctx, pkt, size) < 0)) {
         return MQTTERR_ILLEGAL_PKT;
     }
 
@@ -659,6 +981,10 @@ inline int Mqtt_HandlePubComp(struct MqttContext *ctx, char flags,
         return MQTTERR_ILLEGAL_PKT;
     }
 
+    if(ctx->v5) {
+        MqttV5Session_ReleaseQuota(ctx->v5);
+    }
+
     return ctx->handle_pub_comp(ctx->handle_pub_comp_arg, pkt_id);
 }
 
@@ -666,7 +992,9 @@ inline int Mqtt_HandleSubAck(struct MqttContext *ctx, char flags,
                              char *pkt, size_t size)
 {
     uint16_t pkt_id;
-    char *code;
+    uint32_t props_len;
+    char *code, *codes;
+    int bytes;
 
     if((0 != flags) || (size < 2)) {
         return MQTTERR_ILLEGAL_PKT;
@@ -677,21 +1005,45 @@ inline int Mqtt_HandleSubAck(struct MqttContext *ctx, char flags,
         return MQTTERR_ILLEGAL_PKT;
     }
 
-    for(code = pkt + 2; code < pkt + size; ++code ) {
-        if(*code & 0x7C) {
+    codes = pkt + 2;
+    if(ctx->v5) {
+        // MQTT 5 reason codes such as 0x87 are not granted qos values
+        bytes = MqttV5_ReadVarInt(codes, (uint32_t)(size - 2), &props_len);
+        if((bytes < 0) || (props_len > size - 2 - (size_t)bytes)) {
             return MQTTERR_ILLEGAL_PKT;
         }
+        codes += bytes + props_len;
+    }
+    else {
+        for(code = codes; code < pkt + size; ++code ) {
+            if(*code & 0x7C) {
+                return MQTTERR_ILLEGAL_PKT;
+            }
+        }
     }
 
-    return ctx->handle_sub_ack(ctx->handle_sub_ack_arg, pkt_id, pkt + 2, size - 2);
+    return ctx->handle_sub_ack(ctx->handle_sub_ack_arg, pkt_id, codes,
+                               (uint32_t)(pkt + size - codes));
 }
 
 inline int Mqtt_HandleUnsubAck(struct MqttContext *ctx, char flags,
                                char *pkt, size_t size)
 {
     uint16_t pkt_id;
+    uint32_t props_len;
+    int bytes;
 
-    if((0 != flags) || (2 != size)) {
+    if(ctx->v5) {
+        // properties and one reason code per topic follow the packet identifier
+        if((0 != flags) || (size < 3)) {
+            return MQTTERR_ILLEGAL_PKT;
+        }
+        bytes = MqttV5_ReadVarInt(pkt + 2, (uint32_t)(size - 2), &props_len);
+        if((bytes < 0) || (props_len > size - 2 - (size_t)bytes)) {
+            return MQTTERR_ILLEGAL_PKT;
+        }
+    }
+    else if((0 != flags) || (2 != size)) {
         return MQTTERR_ILLEGAL_PKT;
     }
 
@@ -703,101 +1055,413 @@ inline int Mqtt_HandleUnsubAck(struct MqttContext *ctx, char flags,
     return ctx->handle_unsub_ack(ctx->handle_unsub_ack_arg, pkt_id);
 }
 
-static int Mqtt_Dispatch(struct MqttContext *ctx, char fh,  char *pkt, size_t size)
+// makes the length-prefixed string at *cursor a C string in place by moving it over
+// its own length prefix, and advances *cursor past it
+static char *Mqtt_ReadString(char **cursor, const char *end, uint16_t *len)
 {
-    const char flags = fh & 0x0F;
-
-    switch(((uint8_t)fh) >> 4) {
-    case MQTT_PKT_PINGRESP:
-        return Mqtt_HandlePingResp(ctx, flags, pkt, size);
-
-    case MQTT_PKT_CONNACK:
-        return Mqtt_HandleConnAck(ctx, flags, pkt, size);
-
-    case MQTT_PKT_PUBLISH:
-        return Mqtt_HandlePublish(ctx, flags, pkt, size);
-
-    case MQTT_PKT_PUBACK:
-        return Mqtt_HandlePubAck(ctx, flags, pkt, size);
-
-    case MQTT_PKT_PUBREC:
-        return Mqtt_HandlePubRec(ctx, flags, pkt, size);
-
-    case MQTT_PKT_PUBREL:
-        return Mqtt_HandlePubRel(ctx, flags, pkt, size);
+    char *str = *cursor;
+    uint16_t str_len;
 
-    case MQTT_PKT_PUBCOMP:
-        return Mqtt_HandlePubComp(ctx, flags, pkt, size);
+    if(end - str < 2) {
+        return NULL;
+    }
 
-    case MQTT_PKT_SUBACK:
-        return Mqtt_HandleSubAck(ctx, flags, pkt, size);
+    str_len = Mqtt_RB16(str);
+    if(end - str < 2 + str_len) {
+        return NULL;
+    }
 
-    case MQTT_PKT_UNSUBACK:
-        return Mqtt_HandleUnsubAck(ctx, flags, pkt, size);
+    memmove(str, str + 2, str_len);
+    str[str_len] = '\0';
+    *cursor = str + 2 + str_len;
 
-    default:
-        break;
+    if(len) {
+        *len = str_len;
     }
-
-    return MQTTERR_ILLEGAL_PKT;
+    return str;
 }
 
-int Mqtt_InitContext(struct MqttContext *ctx, uint32_t buf_size)
+static int Mqtt_SendResponse(struct MqttContext *ctx, struct MqttBuffer *response)
 {
-    memset(ctx, 0, sizeof(*ctx));
+    int err = MQTTERR_NOERROR;
 
-    ctx->bgn = (char*)malloc(buf_size);
-    if(NULL == ctx->bgn) {
-        return MQTTERR_OUTOFMEMORY;
+    if(ctx->metrics) {
+        MqttMetrics_CountAllocs(ctx->metrics, response);
+    }
+    if(Mqtt_SendPkt(ctx, response, 0) != response->buffered_bytes) {
+        err = MQTTERR_FAILED_SEND_RESPONSE;
     }
 
-    ctx->end = ctx->bgn + buf_size;
-    ctx->pos = ctx->bgn;
-
-    return MQTTERR_NOERROR;
-}
-
-void Mqtt_DestroyContext(struct MqttContext *ctx)
-{
-    free(ctx->bgn);
-    memset(ctx, 0, sizeof(*ctx));
+    MqttBuffer_Destroy(response);
+    return err;
 }
 
-int Mqtt_RecvPkt(struct MqttContext *ctx)
+static int Mqtt_HandleConnect(struct MqttContext *ctx, char flags,
+                              char *pkt, size_t size)
 {
-    int bytes;
-    uint32_t remaining_len = 0;
-    char *pkt, *cursor;
-
-    bytes = ctx->read_func(ctx->read_func_arg, ctx->pos, ctx->end - ctx->pos);
+    const char *end = pkt + size;
+    char *cursor = pkt;
+    char *protocol, *id;
+    char *will_topic = NULL, *will_msg = NULL, *user = NULL, *password = NULL;
+    uint16_t keep_alive, msg_len = 0, pswd_len = 0;
+    struct MqttBuffer response[1];
+    char level, connect_flags, ack_flags;
+    int err;
 
-    if(0 == bytes) {
-        ctx->pos = ctx->bgn; // clear the buffer
-        return MQTTERR_ENDOFFILE;
+    if(!ctx->handle_connect || (0 != flags)) {
+        return MQTTERR_ILLEGAL_PKT;
     }
 
-    if(bytes < 0) {
-        return MQTTERR_IO;
+    protocol = Mqtt_ReadString(&cursor, end, NULL);
+    if(!protocol || (end - cursor < 4)) {
+        return MQTTERR_ILLEGAL_PKT;
     }
 
-    ctx->pos += bytes;
-    if(ctx->pos > ctx->end) {
-        return MQTTERR_BUF_OVERFLOW;
+    level = cursor[0];
+    connect_flags = cursor[1];
+    keep_alive = Mqtt_RB16(cursor + 2);
+    cursor += 4;
+
+    if(connect_flags & 0x01) {
+        return MQTTERR_ILLEGAL_PKT;
     }
 
-    cursor = ctx->bgn;
-    while(1) {
-        int errcode;
+    if(!(id = Mqtt_ReadString(&cursor, end, NULL))) {
+        return MQTTERR_ILLEGAL_PKT;
+    }
 
-        if(ctx->pos - cursor  < 2) {
-            break;
+    if(connect_flags & MQTT_CONNECT_WILL_FLAG) {
+        if(!(will_topic = Mqtt_ReadString(&cursor, end, NULL)) ||
+           !(will_msg = Mqtt_ReadString(&cursor, end, &msg_len))) {
+            return MQTTERR_ILLEGAL_PKT;
         }
+    }
 
-        bytes = Mqtt_ReadLength(cursor + 1, ctx->pos - cursor - 1, &remaining_len);
+    if((connect_flags & MQTT_CONNECT_USER_NAME) &&
+       !(user = Mqtt_ReadString(&cursor, end, NULL))) {
+        return MQTTERR_ILLEGAL_PKT;
+    }
 
-        if(-1 == bytes) {
-            break;
-        }
+    if((connect_flags & MQTT_CONNECT_PASSORD) &&
+       !(password = Mqtt_ReadString(&cursor, end, &pswd_len))) {
+        return MQTTERR_ILLEGAL_PKT;
+    }
+
+    // only MQTT 3.1.1 is spoken, other levels are refused without asking the callback
+    if(strcmp(protocol, "MQTT") || (4 != level)) {
+        err = MQTT_CONNACK_UNACCEPTABLE_PRO_VERSION;
+    }
+    else {
+        err = ctx->handle_connect(ctx->handle_connect_arg, id, keep_alive,
+                                  connect_flags & MQTT_CONNECT_CLEAN_SESSION,
+                                  will_topic, will_msg, msg_len,
+                                  (enum MqttQosLevel)((connect_flags >> 3) & 0x03),
+                                  connect_flags & MQTT_CONNECT_WILL_RETAIN,
+                                  user, password, pswd_len);
+        if(err < 0) {
+            return err;
+        }
+    }
+
+    // the session present flag rides above the return code, it is only valid with acceptance
+    ack_flags = (MQTT_CONNACK_ACCEPTED == (err & 0xFF)) ? (char)((err >> 8) & MQTT_CONNACK_SP) : 0;
+    MqttBuffer_Init(response);
+    err = Mqtt_PackConnAckPkt(response, ack_flags, (char)(err & 0xFF));
+    if(MQTTERR_NOERROR != err) {
+        MqttBuffer_Destroy(response);
+        return err;
+    }
+
+    return Mqtt_SendResponse(ctx, response);
+}
+
+static int Mqtt_HandleSubscribe(struct MqttContext *ctx, char flags,
+                                char *pkt, size_t size)
+{
+    const char *end = pkt + size;
+    char *cursor, *topic;
+    struct MqttBuffer response[1];
+    uint16_t pkt_id, topic_len;
+    uint32_t count = 0;
+    int err;
+
+    // older versions of this sdk wrote 0 in the reserved flags, accept them too
+    if(!ctx->handle_subscribe || (flags & ~2) || (size < 2)) {
+        return MQTTERR_ILLEGAL_PKT;
+    }
+
+    pkt_id = Mqtt_RB16(pkt);
+    if(0 == pkt_id) {
+        return MQTTERR_ILLEGAL_PKT;
+    }
+
+    cursor = pkt + 2;
+    while(cursor < end) {
+        topic = Mqtt_ReadString(&cursor, end, &topic_len);
+        if(!topic || (0 == topic_len) || (cursor >= end) ||
+           ((uint8_t)*cursor > MQTT_QOS_LEVEL2) ||
+           (Mqtt_CheckUtf8(topic, topic_len) != topic_len)) {
+            return MQTTERR_ILLEGAL_PKT;
+        }
+
+        err = ctx->handle_subscribe(ctx->handle_subscribe_arg, pkt_id, topic,
+                                    (enum MqttQosLevel)*cursor);
+        if(err < 0) {
+            return err;
+        }
+        ++cursor;
+
+        // every entry takes at least three bytes, so the codes fit over the ones already read
+        pkt[2 + count++] = (char)err;
+    }
+
+    if(0 == count) {
+        return MQTTERR_ILLEGAL_PKT;
+    }
+
+    MqttBuffer_Init(response);
+    err = Mqtt_PackSubAckPkt(response, pkt_id, pkt + 2, count);
+    if(MQTTERR_NOERROR != err) {
+        MqttBuffer_Destroy(response);
+        return err;
+    }
+
+    return Mqtt_SendResponse(ctx, response);
+}
+
+static int Mqtt_HandleUnsubscribe(struct MqttContext *ctx, char flags,
+                                  char *pkt, size_t size)
+{
+    const char *end = pkt + size;
+    char *cursor, *topic;
+    struct MqttBuffer response[1];
+    uint16_t pkt_id, topic_len;
+    int err;
+
+    if(!ctx->handle_unsubscribe || (flags & ~2) || (size < 5)) {
+        return MQTTERR_ILLEGAL_PKT;
+    }
+
+    pkt_id = Mqtt_RB16(pkt);
+    if(0 == pkt_id) {
+        return MQTTERR_ILLEGAL_PKT;
+    }
+
+    cursor = pkt + 2;
+    while(cursor < end) {
+        topic = Mqtt_ReadString(&cursor, end, &topic_len);
+        if(!topic || (0 == topic_len) || (Mqtt_CheckUtf8(topic, topic_len) != topic_len)) {
+            return MQTTERR_ILLEGAL_PKT;
+        }
+
+        err = ctx->handle_unsubscribe(ctx->handle_unsubscribe_arg, pkt_id, topic);
+        if(err < 0) {
+            return err;
+        }
+    }
+
+    MqttBuffer_Init(response);
+    err = Mqtt_PackUnsubAckPkt(response, pkt_id);
+    if(MQTTERR_NOERROR != err) {
+        MqttBuffer_Destroy(response);
+        return err;
+    }
+
+    return Mqtt_SendResponse(ctx, response);
+}
+
+static int Mqtt_HandlePingReq(struct MqttContext *ctx, char flags,
+                              char *pkt, size_t size)
+{
+    struct MqttBuffer response[1];
+    int err;
+    (void)pkt;
+
+    if(!ctx->handle_ping_req || (0 != flags) || (0 != size)) {
+        return MQTTERR_ILLEGAL_PKT;
+    }
+
+    err = ctx->handle_ping_req(ctx->handle_ping_req_arg);
+    if(err < 0) {
+        return err;
+    }
+
+    MqttBuffer_Init(response);
+    err = Mqtt_PackPingRespPkt(response);
+    if(MQTTERR_NOERROR != err) {
+        MqttBuffer_Destroy(response);
+        return err;
+    }
+
+    return Mqtt_SendResponse(ctx, response);
+}
+
+static int Mqtt_HandleDisconnect(struct MqttContext *ctx, char flags,
+                                 char *pkt, size_t size)
+{
+    // an MQTT 5 server tells the client why it closes the connection
+    if(ctx->v5 && !ctx->handle_disconnect && (0 == flags)) {
+        ctx->v5->reason_code = size > 0 ? (uint8_t)pkt[0] : 0;
+        return MQTTERR_ENDOFFILE;
+    }
+
+    if(!ctx->handle_disconnect || (0 != flags) || (0 != size)) {
+        return MQTTERR_ILLEGAL_PKT;
+    }
+
+    return ctx->handle_disconnect(ctx->handle_disconnect_arg);
+}
+
+static int Mqtt_Dispatch(struct MqttContext *ctx, char fh,  char *pkt, size_t size)
+{
+    const char flags = fh & 0x0F;
+
+    switch(((uint8_t)fh) >> 4) {
+    case MQTT_PKT_PINGRESP:
+        return Mqtt_HandlePingResp(ctx, flags, pkt, size);
+
+    case MQTT_PKT_CONNACK:
+        return Mqtt_HandleConnAck(ctx, flags, pkt, size);
+
+    case MQTT_PKT_PUBLISH:
+        return Mqtt_HandlePublish(ctx, flags, pkt, size);
+
+    case MQTT_PKT_PUBACK:
+        return Mqtt_HandlePubAck(ctx, flags, pkt, size);
+
+    case MQTT_PKT_PUBREC:
+        return Mqtt_HandlePubRec(ctx, flags, pkt, size);
+
+    case MQTT_PKT_PUBREL:
+        return Mqtt_HandlePubRel(ctx, flags, pkt, size);
+
+    case MQTT_PKT_PUBCOMP:
+        return Mqtt_HandlePubComp(ctx, flags, pkt, size);
+
+    case MQTT_PKT_SUBACK:
+        return Mqtt_HandleSubAck(ctx, flags, pkt, size);
+
+    case MQTT_PKT_UNSUBACK:
+        return Mqtt_HandleUnsubAck(ctx, flags, pkt, size);
+
+    case MQTT_PKT_CONNECT:
+        return Mqtt_HandleConnect(ctx, flags, pkt, size);
+
+    case MQTT_PKT_SUBSCRIBE:
+        return Mqtt_HandleSubscribe(ctx, flags, pkt, size);
+
+    case MQTT_PKT_UNSUBSCRIBE:
+        return Mqtt_HandleUnsubscribe(ctx, flags, pkt, size);
+
+    case MQTT_PKT_PINGREQ:
+        return Mqtt_HandlePingReq(ctx, flags, pkt, size);
+
+    case MQTT_PKT_DISCONNECT:
+        return Mqtt_HandleDisconnect(ctx, flags, pkt, size);
+
+    default:
+        break;
+    }
+
+    return MQTTERR_ILLEGAL_PKT;
+}
+
+int Mqtt_InitContext(struct MqttContext *ctx, uint32_t buf_size)
+{
+    memset(ctx, 0, sizeof(*ctx));
+
+    ctx->bgn = (char*)malloc(buf_size);
+    if(NULL == ctx->bgn) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    ctx->end = ctx->bgn + buf_size;
+    ctx->pos = ctx->bgn;
+
+    return MQTTERR_NOERROR;
+}
+
+void Mqtt_DestroyContext(struct MqttContext *ctx)
+{
+    free(ctx->bgn);
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+#if MQTT_ENABLE_TRACE
+// the packet id of a received packet for the trace hooks, 0 when it has none
+static uint16_t Mqtt_TracePktId(char fh, const char *pkt, uint32_t size)
+{
+    uint16_t topic_len;
+
+    switch(((uint8_t)fh) >> 4) {
+    case MQTT_PKT_PUBLISH:
+        if(!(fh & 0x06) || (size < 2)) {
+            return 0;
+        }
+        topic_len = Mqtt_RB16(pkt);
+        return size >= 4u + topic_len ? Mqtt_RB16(pkt + 2 + topic_len) : 0;
+
+    case MQTT_PKT_PUBACK:
+    case MQTT_PKT_PUBREC:
+    case MQTT_PKT_PUBREL:
+    case MQTT_PKT_PUBCOMP:
+    case MQTT_PKT_SUBSCRIBE:
+    case MQTT_PKT_SUBACK:
+    case MQTT_PKT_UNSUBSCRIBE:
+    case MQTT_PKT_UNSUBACK:
+        return size >= 2 ? Mqtt_RB16(pkt) : 0;
+
+    default:
+        return 0;
+    }
+}
+#endif
+
+static int Mqtt_ReadPkts(struct MqttContext *ctx)
+{
+    int bytes;
+    uint32_t remaining_len = 0;
+    char *pkt, *cursor;
+    int64_t start = 0;
+
+    // a packet larger than the buffer, a zero-length read would look like end of file
+    if(ctx->pos == ctx->end) {
+        return MQTTERR_BUF_OVERFLOW;
+    }
+
+    bytes = ctx->read_func(ctx->read_func_arg, ctx->pos, ctx->end - ctx->pos);
+
+    if(0 == bytes) {
+        ctx->pos = ctx->bgn; // clear the buffer
+        return MQTTERR_ENDOFFILE;
+    }
+
+    if(bytes < 0) {
+        return MQTTERR_IO;
+    }
+
+    ctx->pos += bytes;
+    if(ctx->pos > ctx->end) {
+        return MQTTERR_BUF_OVERFLOW;
+    }
+
+    cursor = ctx->bgn;
+    while(1) {
+        int errcode;
+#if MQTT_ENABLE_TRACE
+        int trace_type;
+        uint16_t trace_id;
+#endif
+
+        if(ctx->pos - cursor  < 2) {
+            break;
+        }
+
+        bytes = Mqtt_ReadLength(cursor + 1, ctx->pos - cursor - 1, &remaining_len);
+
+        if(-1 == bytes) {
+            break;
+        }
         else if(-2 == bytes) {
             return MQTTERR_ILLEGAL_PKT;
         }
@@ -809,7 +1473,23 @@ int Mqtt_RecvPkt(struct MqttContext *ctx)
 
         pkt = cursor + bytes + 1;       
 
+        start = 0;
+        if(ctx->metrics && MqttMetrics_CountIncoming(ctx->metrics, cursor[0], pkt, remaining_len,
+                                                     bytes + 1 + remaining_len)) {
+            start = MqttMetrics_Now();
+        }
+
+#if MQTT_ENABLE_TRACE
+        // the handlers may rewrite the packet in place, read the id before
+        trace_type = ((uint8_t)cursor[0]) >> 4;
+        trace_id = Mqtt_TracePktId(cursor[0], pkt, remaining_len);
+#endif
+        MQTT_TRACE_BEGIN(MQTT_TRACE_DISPATCH, trace_type, trace_id);
         errcode = Mqtt_Dispatch(ctx, cursor[0], pkt, remaining_len);
+        MQTT_TRACE_END(MQTT_TRACE_DISPATCH, trace_type, trace_id);
+        if(start && ctx->metrics) {
+            MqttHistogram_Record(&ctx->metrics->callback, (uint64_t)(MqttMetrics_Now() - start));
+        }
         if(errcode < 0) {
             return errcode;
         }
@@ -817,17 +1497,30 @@ int Mqtt_RecvPkt(struct MqttContext *ctx)
 		cursor += bytes + 1 + remaining_len;
     }
 
+    // move the incomplete tail to the front, it is pos - cursor bytes long
     if(cursor > ctx->bgn) {
-        size_t movebytes = cursor - ctx->bgn;
+        size_t movebytes = ctx->pos - cursor;
         memmove(ctx->bgn, cursor, movebytes);
-        ctx->pos -= movebytes;
-
-        assert(ctx->pos >= ctx->bgn);
+        ctx->pos = ctx->bgn + movebytes;
+        if(ctx->metrics) {
+            MqttMetrics_Add(&ctx->metrics->recv_moved_bytes, movebytes);
+        }
     }
 
     return MQTTERR_NOERROR;
 }
 
+int Mqtt_RecvPkt(struct MqttContext *ctx)
+{
+    const int err = Mqtt_ReadPkts(ctx);
+
+    if((err < 0) && ctx->metrics) {
+        MqttMetrics_CountError(ctx->metrics, err);
+    }
+
+    return err;
+}
+
 int Mqtt_SendPkt(struct MqttContext *ctx, const struct MqttBuffer *buf, uint32_t offset)
 {
     const struct MqttExtent *cursor;
@@ -836,6 +1529,7 @@ int Mqtt_SendPkt(struct MqttContext *ctx, const struct MqttBuffer *buf, uint32_t
     int ext_count;
     int i;
     struct iovec *iov;
+    struct iovec stack_iov[MQTT_SEND_STACK_IOV];
 
     if(offset >= buf->buffered_bytes) {
         return 0;
@@ -860,9 +1554,27 @@ int Mqtt_SendPkt(struct MqttContext *ctx, const struct MqttBuffer *buf, uint32_t
 
     assert(first_ext);
 
-    iov = (struct iovec*)malloc(sizeof(struct iovec) * ext_count);
-    if(!iov) {
-        return MQTTERR_OUTOFMEMORY;
+    if(ctx->metrics) {
+        if(0 == offset) {
+            MqttMetrics_CountOutgoing(ctx->metrics, buf);
+        }
+    }
+
+    if(ext_count <= MQTT_SEND_STACK_IOV) {
+        iov = stack_iov;
+    }
+    else {
+        if(ctx->metrics) {
+            MqttMetrics_Add(&ctx->metrics->allocs, 1);
+        }
+
+        iov = (struct iovec*)malloc(sizeof(struct iovec) * ext_count);
+        if(!iov) {
+            if(ctx->metrics) {
+                MqttMetrics_CountError(ctx->metrics, MQTTERR_OUTOFMEMORY);
+            }
+            return MQTTERR_OUTOFMEMORY;
+        }
     }
 
     iov[0].iov_base = first_ext->payload + (offset - bytes);
@@ -875,24 +1587,36 @@ int Mqtt_SendPkt(struct MqttContext *ctx, const struct MqttBuffer *buf, uint32_t
         ++i;
     }
 
+    MQTT_TRACE_BEGIN(MQTT_TRACE_WRITEV, ((uint8_t)buf->first_ext->payload[0]) >> 4, 0);
     i = ctx->writev_func(ctx->writev_func_arg, iov, ext_count);
-    free(iov);
+    MQTT_TRACE_END(MQTT_TRACE_WRITEV, ((uint8_t)buf->first_ext->payload[0]) >> 4, 0);
+    if(iov != stack_iov) {
+        free(iov);
+    }
+
+    if((i < 0) && ctx->metrics) {
+        MqttMetrics_CountError(ctx->metrics, MQTTERR_IO);
+    }
 
     return i;
 }
 
 
 
-int Mqtt_PackConnectPkt(struct MqttBuffer *buf, uint16_t keep_alive, const char *id,
-                        int clean_session, const char *will_topic,
-                        const char *will_msg, uint16_t msg_len,
-                        enum MqttQosLevel qos, int will_retain, const char *user,
-                        const char *password, uint16_t pswd_len)
+// v5 is NULL for MQTT 3.1.1, otherwise its properties follow the keep alive
+static int Mqtt_DoPackConnectPkt(const struct MqttV5Session *v5,
+                                 struct MqttBuffer *buf, uint16_t keep_alive, const char *id,
+                                 int clean_session, const char *will_topic,
+                                 const char *will_msg, uint16_t msg_len,
+                                 enum MqttQosLevel qos, int will_retain, const char *user,
+                                 const char *password, uint16_t pswd_len)
 {
     int ret;
     uint16_t id_len, wt_len, user_len;
-    size_t total_len;
+    size_t total_len, head_len = 10;
     char flags = 0;
+    char props[16];
+    uint32_t props_len = 0;
     struct MqttExtent *fix_head, *variable_head, *payload;
     char *cursor;
 
@@ -902,16 +1626,38 @@ int Mqtt_PackConnectPkt(struct MqttBuffer *buf, uint16_t keep_alive, const char
         return MQTTERR_OUTOFMEMORY;
     }
 
-    variable_head = MqttBuffer_AllocExtent(buf, 10);
+    if(v5) {
+        props_len = 1; // the properties are shorter than 128 bytes
+        if(v5->topic_alias_maximum > 0) {
+            props[props_len] = MQTT_V5_PROP_TOPIC_ALIAS_MAXIMUM;
+            Mqtt_WB16(v5->topic_alias_maximum, props + props_len + 1);
+            props_len += 3;
+        }
+        if(v5->receive_maximum > 0) {
+            props[props_len] = MQTT_V5_PROP_RECEIVE_MAXIMUM;
+            Mqtt_WB16(v5->receive_maximum, props + props_len + 1);
+            props_len += 3;
+        }
+        if(v5->maximum_packet_size > 0) {
+            props[props_len] = MQTT_V5_PROP_MAXIMUM_PACKET_SIZE;
+            Mqtt_WB32(v5->maximum_packet_size, props + props_len + 1);
+            props_len += 5;
+        }
+        props[0] = (char)(props_len - 1);
+        head_len += props_len;
+    }
+
+    variable_head = MqttBuffer_AllocExtent(buf, head_len);
     if(NULL == variable_head) {
         return MQTTERR_OUTOFMEMORY;
     }
 
-    total_len = 10; // length of the variable header
-    id_len = Mqtt_CheckClentIdentifier(id);
-    if(id_len < 0) {
+    total_len = head_len; // length of the variable header
+    ret = Mqtt_CheckClentIdentifier(id);
+    if(ret < 0) {
         return MQTTERR_ILLEGAL_CHARACTER;
     }
+    id_len = (uint16_t)ret;
     total_len += id_len + 2;
 
     if(clean_session) {
@@ -951,6 +1697,9 @@ int Mqtt_PackConnectPkt(struct MqttBuffer *buf, uint16_t keep_alive, const char
 
     if(flags & MQTT_CONNECT_WILL_FLAG) {
         total_len += 4 + wt_len + msg_len;
+        if(v5) {
+            total_len += 1; // empty will properties
+        }
     }
 
     if(!user && password) {
@@ -985,7 +1734,10 @@ int Mqtt_PackConnectPkt(struct MqttBuffer *buf, uint16_t keep_alive, const char
 
 
 
-    payload = MqttBuffer_AllocExtent(buf, total_len - 10);
+    payload = MqttBuffer_AllocExtent(buf, total_len - head_len);
+    if(NULL == payload) {
+        return MQTTERR_OUTOFMEMORY;
+    }
     fix_head->payload[0] = MQTT_PKT_CONNECT << 4;
 
     ret = Mqtt_DumpLength(total_len, fix_head->payload + 1);
@@ -1000,9 +1752,12 @@ int Mqtt_PackConnectPkt(struct MqttBuffer *buf, uint16_t keep_alive, const char
     variable_head->payload[3] = 'Q';
     variable_head->payload[4] = 'T';
     variable_head->payload[5] = 'T';
-    variable_head->payload[6] = 4; // protocol level 4
+    variable_head->payload[6] = v5 ? 5 : 4; // protocol level
     variable_head->payload[7] = flags;
     Mqtt_WB16(keep_alive, variable_head->payload + 8);
+    if(v5) {
+        memcpy(variable_head->payload + 10, props, props_len);
+    }
 
     //write payload client_id
     cursor = payload->payload;
@@ -1014,6 +1769,9 @@ int Mqtt_PackConnectPkt(struct MqttBuffer *buf, uint16_t keep_alive, const char
             msg_len = 0;
         }
 
+        if(v5) {
+            *cursor++ = 0;
+        }
         Mqtt_PktWriteString(&cursor, will_topic, wt_len);
         Mqtt_PktWriteString(&cursor, will_msg, msg_len);
     }
@@ -1033,6 +1791,36 @@ int Mqtt_PackConnectPkt(struct MqttBuffer *buf, uint16_t keep_alive, const char
     return MQTTERR_NOERROR;
 }
 
+int Mqtt_PackConnectPkt(struct MqttBuffer *buf, uint16_t keep_alive, const char *id,
+                        int clean_session, const char *will_topic,
+                        const char *will_msg, uint16_t msg_len,
+                        enum MqttQosLevel qos, int will_retain, const char *user,
+                        const char *password, uint16_t pswd_len)
+{
+    int err;
+
+    MQTT_TRACE_BEGIN(MQTT_TRACE_PACK, MQTT_PKT_CONNECT, 0);
+    err = Mqtt_DoPackConnectPkt(NULL, buf, keep_alive, id, clean_session, will_topic, will_msg,
+                                msg_len, qos, will_retain, user, password, pswd_len);
+    MQTT_TRACE_END(MQTT_TRACE_PACK, MQTT_PKT_CONNECT, 0);
+    return err;
+}
+
+int Mqtt_PackConnectPktV5(const struct MqttV5Session *session, struct MqttBuffer *buf,
+                          uint16_t keep_alive, const char *id, int clean_session,
+                          const char *will_topic, const char *will_msg, uint16_t msg_len,
+                          enum MqttQosLevel qos, int will_retain, const char *user,
+                          const char *password, uint16_t pswd_len)
+{
+    int err;
+
+    MQTT_TRACE_BEGIN(MQTT_TRACE_PACK, MQTT_PKT_CONNECT, 0);
+    err = Mqtt_DoPackConnectPkt(session, buf, keep_alive, id, clean_session, will_topic,
+                                will_msg, msg_len, qos, will_retain, user, password, pswd_len);
+    MQTT_TRACE_END(MQTT_TRACE_PACK, MQTT_PKT_CONNECT, 0);
+    return err;
+}
+
 /*
 int Mqtt_PackConnectPkt(struct MqttBuffer *buf, uint16_t keep_alive, const char *id,
                         int clean_session, const char *will_topic,
@@ -1173,18 +1961,10 @@ int Mqtt_PackConnectPkt(struct MqttBuffer *buf, uint16_t keep_alive, const char
 */
 
 
-int Mqtt_PackPublishPkt(struct MqttBuffer *buf, uint16_t pkt_id, const char *topic,
-                        const char *payload, uint32_t size,
-                        enum MqttQosLevel qos, int retain, int own)
+// checks a topic to publish to and measures it
+static int Mqtt_CheckPublishTopic(const char *topic, size_t *len)
 {
-    int ret;
-    size_t topic_len, total_len;
-    struct MqttExtent *fix_head, *variable_head;
-    char *cursor;
-
-    if(0 == pkt_id) {
-        return MQTTERR_INVALID_PARAMETER;
-    }
+    size_t topic_len;
 
     for(topic_len = 0; '\0' != topic[topic_len]; ++topic_len) {
         if(('#' == topic[topic_len]) || ('+' == topic[topic_len])) {
@@ -1196,6 +1976,22 @@ int Mqtt_PackPublishPkt(struct MqttBuffer *buf, uint16_t pkt_id, const char *top
         return MQTTERR_NOT_UTF8;
     }
 
+    *len = topic_len;
+    return MQTTERR_NOERROR;
+}
+
+// the fixed and variable header of a PUBLISH carrying size bytes of payload, props are
+// the MQTT 5 properties including their length and NULL for MQTT 3.1.1
+static int Mqtt_PackPublishHeadEx(struct MqttBuffer *buf, uint16_t pkt_id,
+                                  const char *topic, size_t topic_len,
+                                  const char *props, uint32_t props_len,
+                                  uint32_t size, enum MqttQosLevel qos, int retain)
+{
+    int ret;
+    size_t total_len;
+    struct MqttExtent *fix_head, *variable_head;
+    char *cursor;
+
     fix_head = MqttBuffer_AllocExtent(buf, 5);
     if(NULL == fix_head) {
         return MQTTERR_OUTOFMEMORY;
@@ -1207,7 +2003,7 @@ int Mqtt_PackPublishPkt(struct MqttBuffer *buf, uint16_t pkt_id, const char *top
         fix_head->payload[0] |= 0x01;
     }
 
-    total_len = topic_len + size + 2;
+    total_len = topic_len + props_len + size + 2;
     switch(qos) {
     case MQTT_QOS_LEVEL0:
         break;
@@ -1235,19 +2031,160 @@ int Mqtt_PackPublishPkt(struct MqttBuffer *buf, uint16_t pkt_id, const char *top
     }
     cursor = variable_head->payload;
 
-    Mqtt_PktWriteString(&cursor, topic, topic_len);
+    Mqtt_PktWriteString(&cursor, topic, (uint16_t)topic_len);
     if(MQTT_QOS_LEVEL0 != qos) {
         Mqtt_WB16(pkt_id, cursor);
+        cursor += 2;
+    }
+    if(props) {
+        memcpy(cursor, props, props_len);
     }
 
     MqttBuffer_AppendExtent(buf, fix_head);
     MqttBuffer_AppendExtent(buf, variable_head);
-    if(0 != size) {
-        MqttBuffer_Append(buf, (char*)payload, size, own);
+
+    return MQTTERR_NOERROR;
+}
+
+static int Mqtt_PackPublishHead(struct MqttBuffer *buf, uint16_t pkt_id, const char *topic,
+                                uint32_t size, enum MqttQosLevel qos, int retain)
+{
+    size_t topic_len;
+    int err;
+
+    if(0 == pkt_id) {
+        return MQTTERR_INVALID_PARAMETER;
     }
 
+    err = Mqtt_CheckPublishTopic(topic, &topic_len);
+    if(err < 0) {
+        return err;
+    }
 
-    return MQTTERR_NOERROR;
+    return Mqtt_PackPublishHeadEx(buf, pkt_id, topic, topic_len, NULL, 0, size, qos, retain);
+}
+
+static int Mqtt_DoPackPublishPkt(struct MqttBuffer *buf, uint16_t pkt_id, const char *topic,
+                                 const char *payload, uint32_t size,
+                                 enum MqttQosLevel qos, int retain, int own)
+{
+    int err = Mqtt_PackPublishHead(buf, pkt_id, topic, size, qos, retain);
+
+    if((MQTTERR_NOERROR == err) && (0 != size)) {
+        err = MqttBuffer_Append(buf, (char*)payload, size, own);
+    }
+
+    return err;
+}
+
+int Mqtt_PackPublishPkt(struct MqttBuffer *buf, uint16_t pkt_id, const char *topic,
+                        const char *payload, uint32_t size,
+                        enum MqttQosLevel qos, int retain, int own)
+{
+    int err;
+
+    MQTT_TRACE_BEGIN(MQTT_TRACE_PACK, MQTT_PKT_PUBLISH, pkt_id);
+    err = Mqtt_DoPackPublishPkt(buf, pkt_id, topic, payload, size, qos, retain, own);
+    MQTT_TRACE_END(MQTT_TRACE_PACK, MQTT_PKT_PUBLISH, pkt_id);
+    return err;
+}
+
+static int Mqtt_DoPackPublishPktV5(struct MqttV5Session *session, struct MqttBuffer *buf,
+                                   uint16_t pkt_id, const char *topic,
+                                   const char *payload, uint32_t size,
+                                   enum MqttQosLevel qos, int retain, int own)
+{
+    char props[4] = {0};
+    uint32_t props_len = 1;
+    size_t topic_len, total_len;
+    uint16_t alias = 0;
+    int err, ret;
+
+    if(0 == pkt_id) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    err = Mqtt_CheckPublishTopic(topic, &topic_len);
+    if(err < 0) {
+        return err;
+    }
+
+    // the server disconnects a client exceeding its Receive Maximum
+    if((MQTT_QOS_LEVEL0 != qos) && (0 == MqttV5Session_SendQuota(session))) {
+        return MQTTERR_QUOTA_EXCEEDED;
+    }
+
+    ret = MqttV5Session_OutboundAlias(session, topic, (uint32_t)topic_len, &alias);
+    if(ret < 0) {
+        return ret;
+    }
+
+    if(ret > 0) {
+        props[0] = 3;
+        props[1] = MQTT_V5_PROP_TOPIC_ALIAS;
+        Mqtt_WB16(alias, props + 2);
+        props_len = 4;
+    }
+
+    // an established alias replaces the topic with an empty string
+    if(2 == ret) {
+        topic_len = 0;
+    }
+
+    if(session->server_maximum_packet_size > 0) {
+        total_len = 2 + topic_len + props_len + size + (MQTT_QOS_LEVEL0 != qos ? 2 : 0);
+        total_len += total_len < 128 ? 2 : total_len < 16384 ? 3 : total_len < 2097152 ? 4 : 5;
+        if(total_len > session->server_maximum_packet_size) {
+            err = MQTTERR_PKT_TOO_LARGE;
+        }
+    }
+
+    if(MQTTERR_NOERROR == err) {
+        err = Mqtt_PackPublishHeadEx(buf, pkt_id, topic, topic_len,
+                                     props, props_len, size, qos, retain);
+    }
+    if((MQTTERR_NOERROR == err) && (0 != size)) {
+        err = MqttBuffer_Append(buf, (char*)payload, size, own);
+    }
+    if((MQTTERR_NOERROR == err) && (MQTT_QOS_LEVEL0 != qos)) {
+        ++session->inflight;
+    }
+
+    // the server never learns an alias whose packet could not be packed
+    if((MQTTERR_NOERROR != err) && (1 == ret)) {
+        MqttV5Session_DropOutboundAlias(session, alias);
+    }
+
+    return err;
+}
+
+int Mqtt_PackPublishPktV5(struct MqttV5Session *session, struct MqttBuffer *buf,
+                          uint16_t pkt_id, const char *topic,
+                          const char *payload, uint32_t size,
+                          enum MqttQosLevel qos, int retain, int own)
+{
+    int err;
+
+    MQTT_TRACE_BEGIN(MQTT_TRACE_PACK, MQTT_PKT_PUBLISH, pkt_id);
+    err = Mqtt_DoPackPublishPktV5(session, buf, pkt_id, topic, payload, size, qos, retain, own);
+    MQTT_TRACE_END(MQTT_TRACE_PACK, MQTT_PKT_PUBLISH, pkt_id);
+    return err;
+}
+
+int Mqtt_PackPublishSharedPkt(struct MqttBuffer *buf, uint16_t pkt_id, const char *topic,
+                              struct MqttSharedPayload *shared, enum MqttQosLevel qos,
+                              int retain)
+{
+    int err;
+
+    MQTT_TRACE_BEGIN(MQTT_TRACE_PACK, MQTT_PKT_PUBLISH, pkt_id);
+    err = Mqtt_PackPublishHead(buf, pkt_id, topic, shared->size, qos, retain);
+    if(MQTTERR_NOERROR == err) {
+        err = MqttBuffer_AppendShared(buf, shared);
+    }
+    MQTT_TRACE_END(MQTT_TRACE_PACK, MQTT_PKT_PUBLISH, pkt_id);
+
+    return err;
 }
 
 int Mqtt_SetPktDup(struct MqttBuffer *buf)
@@ -1313,6 +2250,9 @@ static int Mqtt_PackPubRelPkt(struct MqttBuffer *buf, uint16_t pkt_id)
     }
 
     ext = MqttBuffer_AllocExtent(buf, 4);
+    if(!ext) {
+        return MQTTERR_OUTOFMEMORY;
+    }
     ext->payload[0]= MQTT_PKT_PUBREL << 4 | 0x02;
     ext->payload[1] = 2;
     Mqtt_WB16(pkt_id, ext->payload + 2);
@@ -1342,8 +2282,10 @@ static int Mqtt_PackPubCompPkt(struct MqttBuffer *buf, uint16_t pkt_id)
     return MQTTERR_NOERROR;
 }
 
-int Mqtt_PackSubscribePkt(struct MqttBuffer *buf, uint16_t pkt_id,
-                          enum MqttQosLevel qos, const char *topics[], int topics_len)
+// v5 adds the empty property section after the packet identifier
+static int Mqtt_DoPackSubscribePkt(struct MqttBuffer *buf, uint16_t pkt_id,
+                                   enum MqttQosLevel qos, const char *topics[], int topics_len,
+                                   int v5)
 {
 
     int ret;
@@ -1373,9 +2315,12 @@ int Mqtt_PackSubscribePkt(struct MqttBuffer *buf, uint16_t pkt_id,
     if(NULL == fixed_head) {
         return MQTTERR_OUTOFMEMORY;
     }
-    fixed_head->payload[0] = (char)((MQTT_PKT_SUBSCRIBE << 4) | 0x00);
+    fixed_head->payload[0] = (char)((MQTT_PKT_SUBSCRIBE << 4) | 0x02);
 
     remaining_len = 2 + 2*topics_len + topic_total_len + topics_len*1;  // 2 bytes packet id, 2 bytes topic length + topic + 1 byte reserve
+    if(v5) {
+        remaining_len += 1;
+    }
     ext = MqttBuffer_AllocExtent(buf, remaining_len);
     if(NULL == ext) {
         return MQTTERR_OUTOFMEMORY;
@@ -1390,6 +2335,9 @@ int Mqtt_PackSubscribePkt(struct MqttBuffer *buf, uint16_t pkt_id,
     cursor = ext->payload;
     Mqtt_WB16(pkt_id, cursor);
     cursor += 2;
+    if(v5) {
+        *cursor++ = 0;
+    }
 
     //write payload
     for(i=0; i<topics_len; ++i){
@@ -1408,6 +2356,28 @@ int Mqtt_PackSubscribePkt(struct MqttBuffer *buf, uint16_t pkt_id,
     return MQTTERR_NOERROR;
 }
 
+int Mqtt_PackSubscribePkt(struct MqttBuffer *buf, uint16_t pkt_id,
+                          enum MqttQosLevel qos, const char *topics[], int topics_len)
+{
+    int err;
+
+    MQTT_TRACE_BEGIN(MQTT_TRACE_PACK, MQTT_PKT_SUBSCRIBE, pkt_id);
+    err = Mqtt_DoPackSubscribePkt(buf, pkt_id, qos, topics, topics_len, 0);
+    MQTT_TRACE_END(MQTT_TRACE_PACK, MQTT_PKT_SUBSCRIBE, pkt_id);
+    return err;
+}
+
+int Mqtt_PackSubscribePktV5(struct MqttBuffer *buf, uint16_t pkt_id, enum MqttQosLevel qos,
+                            const char *topics[], int topics_len)
+{
+    int err;
+
+    MQTT_TRACE_BEGIN(MQTT_TRACE_PACK, MQTT_PKT_SUBSCRIBE, pkt_id);
+    err = Mqtt_DoPackSubscribePkt(buf, pkt_id, qos, topics, topics_len, 1);
+    MQTT_TRACE_END(MQTT_TRACE_PACK, MQTT_PKT_SUBSCRIBE, pkt_id);
+    return err;
+}
+
 int Mqtt_AppendSubscribeTopic(struct MqttBuffer *buf, const char *topic, enum MqttQosLevel qos)
 {
     struct MqttExtent *fixed_head = buf->first_ext;
@@ -1441,12 +2411,15 @@ int Mqtt_AppendSubscribeTopic(struct MqttBuffer *buf, const char *topic, enum Mq
         return MQTTERR_PKT_TOO_LARGE;
     }
 
+    // the remaining length may take more bytes now
+    buf->buffered_bytes += ret + 1 - fixed_head->len;
     fixed_head->len = ret + 1;
     MqttBuffer_AppendExtent(buf, ext);
     return MQTTERR_NOERROR;
 }
 
-int Mqtt_PackUnsubscribePkt(struct MqttBuffer *buf, uint16_t pkt_id, const char *topics[], int topics_len)
+static int Mqtt_DoPackUnsubscribePkt(struct MqttBuffer *buf, uint16_t pkt_id,
+                                     const char *topics[], int topics_len, int v5)
 {
     struct MqttExtent *fixed_head, *ext;
     size_t topic_len;
@@ -1473,13 +2446,16 @@ int Mqtt_PackUnsubscribePkt(struct MqttBuffer *buf, uint16_t pkt_id, const char
     }
 
     remaining_len = 2 + 2*topics_len + topic_total_len; // 2 bytes for packet id + 2 bytest topic_len + topic
+    if(v5) {
+        remaining_len += 1;
+    }
 
     fixed_head = MqttBuffer_AllocExtent(buf, 5);
     if(!fixed_head) {
         return MQTTERR_OUTOFMEMORY;
     }
 
-    fixed_head->payload[0] = (char)(MQTT_PKT_UNSUBSCRIBE << 4 | 0x00);
+    fixed_head->payload[0] = (char)(MQTT_PKT_UNSUBSCRIBE << 4 | 0x02);
     ret = Mqtt_DumpLength(remaining_len, fixed_head->payload + 1);
     if(ret < 0) {
         return MQTTERR_PKT_TOO_LARGE;
@@ -1494,6 +2470,9 @@ int Mqtt_PackUnsubscribePkt(struct MqttBuffer *buf, uint16_t pkt_id, const char
     cursor = ext->payload;
     Mqtt_WB16(pkt_id, cursor);
     cursor += 2;
+    if(v5) {
+        *cursor++ = 0;
+    }
 
     //write paylod
     for(i=0; i<topics_len; ++i){
@@ -1508,6 +2487,17 @@ int Mqtt_PackUnsubscribePkt(struct MqttBuffer *buf, uint16_t pkt_id, const char
     return MQTTERR_NOERROR;
 }
 
+int Mqtt_PackUnsubscribePkt(struct MqttBuffer *buf, uint16_t pkt_id, const char *topics[], int topics_len)
+{
+    return Mqtt_DoPackUnsubscribePkt(buf, pkt_id, topics, topics_len, 0);
+}
+
+int Mqtt_PackUnsubscribePktV5(struct MqttBuffer *buf, uint16_t pkt_id,
+                              const char *topics[], int topics_len)
+{
+    return Mqtt_DoPackUnsubscribePkt(buf, pkt_id, topics, topics_len, 1);
+}
+
 int Mqtt_AppendUnsubscribeTopic(struct MqttBuffer *buf, const char *topic)
 {
     struct MqttExtent *fixed_head = buf->first_ext;
@@ -1530,43 +2520,241 @@ int Mqtt_AppendUnsubscribeTopic(struct MqttBuffer *buf, const char *topic)
     cursor = ext->payload;
     Mqtt_PktWriteString(&cursor, topic, topic_len);
 
-    if(Mqtt_ReadLength(fixed_head->payload + 1, 4, &remaining_len) < 0) {
+    if(Mqtt_ReadLength(fixed_head->payload + 1, 4, &remaining_len) < 0) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    remaining_len += topic_len + 2;
+    ret = Mqtt_DumpLength(remaining_len, fixed_head->payload + 1);
+    if(ret < 0) {
+        return MQTTERR_PKT_TOO_LARGE;
+    }
+    buf->buffered_bytes += ret + 1 - fixed_head->len;
+    fixed_head->len = ret + 1;
+
+    MqttBuffer_AppendExtent(buf, ext);
+    return MQTTERR_NOERROR;
+}
+
+// the largest remaining length the variable length encoding can carry
+#define MQTT_MAX_REMAINING_LENGTH 268435455
+
+// bytes of a packet with remaining_len bytes after the fixed header
+static uint32_t Mqtt_PktSize(uint32_t remaining_len)
+{
+    return remaining_len + 2 + (remaining_len >= 128) + (remaining_len >= 16384) +
+        (remaining_len >= 2097152);
+}
+
+// packs topics into as many SUBSCRIBE or UNSUBSCRIBE packets of at most max_pkt_size
+// bytes as needed, each packet in one extent sized from the given lengths
+static int Mqtt_PackTopicBatch(struct MqttBuffer *buf, uint8_t type, uint16_t pkt_id,
+                               const struct MqttSubscribeTopic *topics, uint32_t count,
+                               uint32_t max_pkt_size, uint32_t *pkt_count)
+{
+    const int subscribe = (MQTT_PKT_SUBSCRIBE == type);
+    const uint32_t entry_extra = subscribe ? 3 : 2; // length prefix and subscription options
+    uint32_t i, first, remaining_len, pkt_size, pkts = 0;
+    struct MqttExtent *ext;
+    char *cursor;
+
+    if(pkt_count) {
+        *pkt_count = 0;
+    }
+
+    if((0 == pkt_id) || !topics || (0 == count)) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    if((0 == max_pkt_size) || (max_pkt_size > Mqtt_PktSize(MQTT_MAX_REMAINING_LENGTH))) {
+        max_pkt_size = Mqtt_PktSize(MQTT_MAX_REMAINING_LENGTH);
+    }
+
+    // the only pass over the topic bytes before they are copied
+    for(i = 0; i < count; ++i) {
+        if(!topics[i].topic || (0 == topics[i].len)) {
+            return MQTTERR_INVALID_PARAMETER;
+        }
+        if(subscribe && ((uint32_t)topics[i].qos > MQTT_QOS_LEVEL2)) {
+            return MQTTERR_INVALID_PARAMETER;
+        }
+        if(Mqtt_CheckUtf8(topics[i].topic, topics[i].len) != topics[i].len) {
+            return MQTTERR_NOT_UTF8;
+        }
+        if(Mqtt_PktSize(2 + topics[i].len + entry_extra) > max_pkt_size) {
+            return MQTTERR_PKT_TOO_LARGE;
+        }
+    }
+
+    for(i = 0; i < count; ) {
+        first = i;
+        remaining_len = 2; // packet identifier
+        while((i < count) &&
+              (Mqtt_PktSize(remaining_len + topics[i].len + entry_extra) <= max_pkt_size)) {
+            remaining_len += topics[i].len + entry_extra;
+            ++i;
+        }
+
+        pkt_size = Mqtt_PktSize(remaining_len);
+        ext = MqttBuffer_AllocExtent(buf, pkt_size);
+        if(!ext) {
+            return MQTTERR_OUTOFMEMORY;
+        }
+
+        cursor = ext->payload;
+        *cursor++ = (char)((type << 4) | 0x02);
+        cursor += Mqtt_DumpLength(remaining_len, cursor);
+        Mqtt_WB16(pkt_id, cursor);
+        cursor += 2;
+
+        for(; first < i; ++first) {
+            Mqtt_PktWriteString(&cursor, topics[first].topic, topics[first].len);
+            if(subscribe) {
+                *cursor++ = (char)topics[first].qos;
+            }
+        }
+        assert(cursor == ext->payload + pkt_size);
+
+        MqttBuffer_AppendExtent(buf, ext);
+        ++pkts;
+        pkt_id = (0xFFFF == pkt_id) ? 1 : pkt_id + 1;
+    }
+
+    if(pkt_count) {
+        *pkt_count = pkts;
+    }
+
+    return MQTTERR_NOERROR;
+}
+
+int Mqtt_PackSubscribeBatch(struct MqttBuffer *buf, uint16_t pkt_id,
+                            const struct MqttSubscribeTopic *topics, uint32_t count,
+                            uint32_t max_pkt_size, uint32_t *pkt_count)
+{
+    int err;
+
+    MQTT_TRACE_BEGIN(MQTT_TRACE_PACK, MQTT_PKT_SUBSCRIBE, pkt_id);
+    err = Mqtt_PackTopicBatch(buf, MQTT_PKT_SUBSCRIBE, pkt_id, topics, count,
+                              max_pkt_size, pkt_count);
+    MQTT_TRACE_END(MQTT_TRACE_PACK, MQTT_PKT_SUBSCRIBE, pkt_id);
+    return err;
+}
+
+int Mqtt_PackUnsubscribeBatch(struct MqttBuffer *buf, uint16_t pkt_id,
+                              const struct MqttSubscribeTopic *topics, uint32_t count,
+                              uint32_t max_pkt_size, uint32_t *pkt_count)
+{
+    int err;
+
+    MQTT_TRACE_BEGIN(MQTT_TRACE_PACK, MQTT_PKT_UNSUBSCRIBE, pkt_id);
+    err = Mqtt_PackTopicBatch(buf, MQTT_PKT_UNSUBSCRIBE, pkt_id, topics, count,
+                              max_pkt_size, pkt_count);
+    MQTT_TRACE_END(MQTT_TRACE_PACK, MQTT_PKT_UNSUBSCRIBE, pkt_id);
+    return err;
+}
+
+int Mqtt_PackPingReqPkt(struct MqttBuffer *buf)
+{
+    struct MqttExtent *ext = MqttBuffer_AllocExtent(buf, 2);
+    if(!ext) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    ext->payload[0] = (char)(MQTT_PKT_PINGREQ << 4);
+    ext->payload[1] = 0;
+    MqttBuffer_AppendExtent(buf, ext);
+
+    return MQTTERR_NOERROR;
+}
+
+int Mqtt_PackDisconnectPkt(struct MqttBuffer *buf)
+{
+    struct MqttExtent *ext = MqttBuffer_AllocExtent(buf, 2);
+    if(!ext) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    ext->payload[0] = (char)(MQTT_PKT_DISCONNECT << 4);
+    ext->payload[1] = 0;
+    MqttBuffer_AppendExtent(buf, ext);
+
+    return MQTTERR_NOERROR;
+}
+
+int Mqtt_PackConnAckPkt(struct MqttBuffer *buf, char flags, char ret_code)
+{
+    struct MqttExtent *ext = MqttBuffer_AllocExtent(buf, 4);
+    if(!ext) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    ext->payload[0] = (char)(MQTT_PKT_CONNACK << 4);
+    ext->payload[1] = 2;
+    ext->payload[2] = flags;
+    ext->payload[3] = ret_code;
+    MqttBuffer_AppendExtent(buf, ext);
+
+    return MQTTERR_NOERROR;
+}
+
+int Mqtt_PackSubAckPkt(struct MqttBuffer *buf, uint16_t pkt_id,
+                       const char *codes, uint32_t count)
+{
+    struct MqttExtent *ext;
+    int ret;
+
+    if((0 == pkt_id) || (0 == count)) {
         return MQTTERR_INVALID_PARAMETER;
     }
 
-    remaining_len += topic_len + 2;
-    ret = Mqtt_DumpLength(remaining_len, fixed_head->payload + 1);
+    ext = MqttBuffer_AllocExtent(buf, 5 + 2 + count);
+    if(!ext) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    ext->payload[0] = (char)(MQTT_PKT_SUBACK << 4);
+    ret = Mqtt_DumpLength(2 + count, ext->payload + 1);
     if(ret < 0) {
         return MQTTERR_PKT_TOO_LARGE;
     }
-    fixed_head->len = ret + 1;
 
+    Mqtt_WB16(pkt_id, ext->payload + 1 + ret);
+    memcpy(ext->payload + 3 + ret, codes, count);
+    ext->len = 3 + ret + count;
     MqttBuffer_AppendExtent(buf, ext);
+
     return MQTTERR_NOERROR;
 }
 
-int Mqtt_PackPingReqPkt(struct MqttBuffer *buf)
+int Mqtt_PackUnsubAckPkt(struct MqttBuffer *buf, uint16_t pkt_id)
 {
-    struct MqttExtent *ext = MqttBuffer_AllocExtent(buf, 2);
+    struct MqttExtent *ext;
+
+    if(0 == pkt_id) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    ext = MqttBuffer_AllocExtent(buf, 4);
     if(!ext) {
         return MQTTERR_OUTOFMEMORY;
     }
 
-    ext->payload[0] = (char)(MQTT_PKT_PINGREQ << 4);
-    ext->payload[1] = 0;
+    ext->payload[0] = (char)(MQTT_PKT_UNSUBACK << 4);
+    ext->payload[1] = 2;
+    Mqtt_WB16(pkt_id, ext->payload + 2);
     MqttBuffer_AppendExtent(buf, ext);
 
     return MQTTERR_NOERROR;
 }
 
-int Mqtt_PackDisconnectPkt(struct MqttBuffer *buf)
+int Mqtt_PackPingRespPkt(struct MqttBuffer *buf)
 {
     struct MqttExtent *ext = MqttBuffer_AllocExtent(buf, 2);
     if(!ext) {
         return MQTTERR_OUTOFMEMORY;
     }
 
-    ext->payload[0] = (char)(MQTT_PKT_DISCONNECT << 4);
+    ext->payload[0] = (char)(MQTT_PKT_PINGRESP << 4);
     ext->payload[1] = 0;
     MqttBuffer_AppendExtent(buf, ext);
 
@@ -1597,13 +2785,13 @@ int Mqtt_PackDataPointStart(struct MqttBuffer *buf, uint16_t pkt_id,
                             enum MqttQosLevel qos, int retain, int topic)
 {
     int err;
-    //struct MqttExtent *ext;
+    struct MqttExtent *ext;
+    struct DataPointPktInfo *info;
 
     if(buf->first_ext) {
         return MQTTERR_INVALID_PARAMETER;
     }
 
-
     if(topic) {
         err = Mqtt_PackPublishPkt(buf, pkt_id, "$dp", NULL, 0, qos, retain, 0);
     }
@@ -1615,16 +2803,16 @@ int Mqtt_PackDataPointStart(struct MqttBuffer *buf, uint16_t pkt_id,
         return err;
     }
 
-/*
+    // the builder state rides in the first payload extent until Mqtt_PackDataPointFinish
     ext = MqttBuffer_AllocExtent(buf, 2 + sizeof(struct DataPointPktInfo));
     if(!ext) {
         return MQTTERR_OUTOFMEMORY;
     }
 
-    ext->payload[0] = MQTT_DPTYPE_FLOAT;
+    ext->payload[0] = MQTT_DPTYPE_TRIPLE;
     ext->payload[1] = '{';
 
-    struct DataPointPktInfo *info = (struct DataPointPktInfo*)(ext->payload + 2);
+    info = (struct DataPointPktInfo*)(ext->payload + 2);
     info->tag = DATA_POINT_PKT_TAG;
     info->subobj_depth = 0;
 
@@ -1634,8 +2822,6 @@ int Mqtt_PackDataPointStart(struct MqttBuffer *buf, uint16_t pkt_id,
 
     MqttBuffer_AppendExtent(buf, ext);
 
-*/
-
     return MQTTERR_NOERROR;
 }
 
@@ -2032,134 +3218,474 @@ int Mqtt_PackDataPointFinish(struct MqttBuffer *buf)
 
 
 
-int Mqtt_PackDataPointByString(struct MqttBuffer *buf, uint16_t pkt_id, int64_t ts,
-                               int32_t type, const char *str, uint32_t size,
-                               enum MqttQosLevel qos, int retain, int own){
-    char *payload = NULL;
-    int32_t payload_size = 0;
+static int Mqtt_DoPackDataPointByString(struct MqttBuffer *buf, uint16_t pkt_id, int64_t ts,
+                                        int32_t type, const char *str, uint32_t size,
+                                        enum MqttQosLevel qos, int retain, int own){
+    struct MqttExtent *ext;
     struct tm *t = NULL;
-    int64_t now;
     time_t tt;
-    int32_t offset = 0;
-    int ret = 0;
+    uint32_t prefix_size;
+    char *cursor;
+    int err;
 
     if(kTypeFullJson == type ||
        kTypeBin == type ||
        kTypeSimpleJsonWithoutTime == type ||
        kTypeSimpleJsonWithTime == type ||
        kTypeString == type){
-        //payload total len
-        payload_size = 1 + 2 + size;
-        payload = (char*)malloc(payload_size);
-        if(NULL == payload){
-            return MQTTERR_OUTOFMEMORY;
+        prefix_size = 1 + 2;
+    }else if(kTypeStringWithTime == (type & 0x7F) ||
+             kTypeFloat == (type & 0x7F)){
+        prefix_size = kTypeFloat == (type & 0x7F) ? 1 : 1 + 2;
+        if(type & 0x80){
+            prefix_size += 6;
+            tt = ts > 0 ? (time_t)ts : time(NULL);
+            t = gmtime(&tt);
+            if(!t) {
+                return MQTTERR_INTERNAL;
+            }
         }
+    }else{
+        return MQTTERR_INVALID_PARAMETER;
+    }
 
-        //填充payload
-        payload[0] = type & 0xFF;
-        payload[1] = (size>>8)&0xFF;
-        payload[2] = size&0xFF;
-        memcpy(payload+3, str, size);
+    // the type, time and length go in front of str, which is appended as it is
+    err = Mqtt_PackPublishHead(buf, pkt_id, MQTTSAVEDPTOPICNAME, prefix_size + size, qos, retain);
+    if(MQTTERR_NOERROR != err) {
+        return err;
+    }
 
-        ret = Mqtt_PackPublishPkt(buf, pkt_id, MQTTSAVEDPTOPICNAME, payload, payload_size, qos, retain, own);
-    }else if(kTypeStringWithTime == (type & 0x7F) ||
-             kTypeFloat == (type & 0x7F)){
-        if(kTypeFloat == (type & 0x7F)){
-            payload_size = 1 + size;
-        }else{
-            payload_size = 1 + 2 + size;
+    ext = MqttBuffer_AllocExtent(buf, prefix_size);
+    if(NULL == ext){
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    //填充payload
+    cursor = ext->payload;
+    *(cursor++) = type & 0xFF;
+    if(t){
+        *(cursor++) = (t->tm_year+1900)%100;
+        *(cursor++) = (t->tm_mon+1)&0xFF;
+        *(cursor++) = (t->tm_mday)&0xFF;
+        *(cursor++) = (t->tm_hour)&0xFF;
+        *(cursor++) = (t->tm_min)&0xFF;
+        *(cursor++) = (t->tm_sec)&0xFF;
+    }
+    if(kTypeFloat != (type & 0x7F)){
+        *(cursor++) = (size>>8)&0xFF;
+        *(cursor++) = size&0xFF;
+    }
+    MqttBuffer_AppendExtent(buf, ext);
+
+    if(0 != size) {
+        return MqttBuffer_Append(buf, (char*)str, size, own);
+    }
+
+    return MQTTERR_NOERROR;
+}
+
+int Mqtt_PackDataPointByString(struct MqttBuffer *buf, uint16_t pkt_id, int64_t ts,
+                               int32_t type, const char *str, uint32_t size,
+                               enum MqttQosLevel qos, int retain, int own)
+{
+    int err;
+
+    MQTT_TRACE_BEGIN(MQTT_TRACE_PACK, MQTT_PKT_PUBLISH, pkt_id);
+    err = Mqtt_DoPackDataPointByString(buf, pkt_id, ts, type, str, size, qos, retain, own);
+    MQTT_TRACE_END(MQTT_TRACE_PACK, MQTT_PKT_PUBLISH, pkt_id);
+    return err;
+}
+
+// one gmtime per distinct second, bulk uploads have many samples per second
+struct MqttDpTimeCache {
+    int64_t second;
+    char bytes[6];
+};
+
+static int Mqtt_DpTime(struct MqttDpTimeCache *cache, int64_t second, char *out)
+{
+    time_t tt = (time_t)second;
+    struct tm t;
+
+    if(second != cache->second) {
+#ifdef WIN32
+        if(0 != gmtime_s(&t, &tt)) {
+            return MQTTERR_INTERNAL;
         }
-        if(type & 0x80){
-            payload_size += 6;
+#else
+        if(!gmtime_r(&tt, &t)) {
+            return MQTTERR_INTERNAL;
+        }
+#endif
+        cache->bytes[0] = (t.tm_year + 1900) % 100;
+        cache->bytes[1] = (t.tm_mon + 1) & 0xFF;
+        cache->bytes[2] = t.tm_mday & 0xFF;
+        cache->bytes[3] = t.tm_hour & 0xFF;
+        cache->bytes[4] = t.tm_min & 0xFF;
+        cache->bytes[5] = t.tm_sec & 0xFF;
+        cache->second = second;
+    }
+
+    memcpy(out, cache->bytes, 6);
+    return MQTTERR_NOERROR;
+}
+
+static uint32_t Mqtt_Bswap32(uint32_t v)
+{
+#if defined(__GNUC__)
+    return __builtin_bswap32(v);
+#else
+    return (v >> 24) | ((v >> 8) & 0xFF00) | ((v << 8) & 0xFF0000) | (v << 24);
+#endif
+}
+
+// the protocol puts the low byte first, only big-endian hosts swap the words
+static void Mqtt_WriteFloats(char *out, const float *values, uint32_t count)
+{
+    const uint16_t probe = 1;
+    uint32_t i, v;
+
+    if(1 == *(const uint8_t*)&probe) {
+        memcpy(out, values, (size_t)count * 4);
+        return;
+    }
+
+    for(i = 0; i < count; ++i) {
+        memcpy(&v, values + i, 4);
+        v = Mqtt_Bswap32(v);
+        memcpy(out + (size_t)i * 4, &v, 4);
+    }
+}
+
+// the protocol allows 1~500 values after each stream name and count
+#define MQTT_FLOAT_GROUP_MAX 500
+
+static int64_t Mqtt_DpSecond(const int64_t *ts, uint32_t i, int64_t now)
+{
+    return ts[i] > 0 ? ts[i] : now;
+}
+
+static int Mqtt_DoPackDataPointFloats(struct MqttBuffer *buf, uint16_t pkt_id, uint16_t ds_name,
+                                      const int64_t *ts, const float *values, uint32_t count,
+                                      enum MqttQosLevel qos, int retain, uint32_t *pkt_count)
+{
+    struct MqttDpTimeCache cache;
+    struct MqttExtent *ext;
+    const int64_t now = (int64_t)time(NULL);
+    int64_t second = 0;
+    uint64_t size;
+    uint32_t begin, end, i, n;
+    char *cursor;
+    int err;
+
+    if(pkt_count) {
+        *pkt_count = 0;
+    }
+
+    if((0 == pkt_id) || !values || (0 == count)) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    cache.second = -1;
+    for(begin = 0; begin < count; begin = end) {
+        // a type 7 payload has one time, every distinct second gets its own publish
+        end = count;
+        if(ts) {
+            second = Mqtt_DpSecond(ts, begin, now);
+            for(end = begin + 1; (end < count) && (Mqtt_DpSecond(ts, end, now) == second); ++end) {
+            }
+        }
+
+        // type and time once, then stream name, count and values for every 500 samples
+        n = end - begin;
+        size = 1 + (ts ? 6 : 0) + (uint64_t)(n + MQTT_FLOAT_GROUP_MAX - 1) / MQTT_FLOAT_GROUP_MAX * 4 +
+            (uint64_t)n * 4;
+        if(size > 0xFFFFFFF) {
+            return MQTTERR_PKT_TOO_LARGE;
         }
-        payload = (char*)malloc(payload_size);
-        if(NULL == payload){
+
+        // the payload is complete before the head goes in, a failure leaves whole packets only
+        ext = MqttBuffer_AllocExtent(buf, (uint32_t)size);
+        if(!ext) {
             return MQTTERR_OUTOFMEMORY;
         }
 
-        //填充payload
-        payload[0] = type & 0xFF;
-        if(ts <= 0){
-            time(&now);
+        cursor = ext->payload;
+        *(cursor++) = ts ? PAYLOADWITHTIME(kTypeFloat) : kTypeFloat;
+        if(ts) {
+            err = Mqtt_DpTime(&cache, second, cursor);
+            if(MQTTERR_NOERROR != err) {
+                return err;
+            }
+            cursor += 6;
         }
-        tt = (time_t)now;
-        t = gmtime(&tt);
-        if(!t) {
-            free(payload);
-            return MQTTERR_INTERNAL;
+
+        for(i = begin; i < end; i += n) {
+            n = end - i < MQTT_FLOAT_GROUP_MAX ? end - i : MQTT_FLOAT_GROUP_MAX;
+            *(cursor++) = (ds_name >> 8) & 0xFF;
+            *(cursor++) = ds_name & 0xFF;
+            *(cursor++) = (n >> 8) & 0xFF;
+            *(cursor++) = n & 0xFF;
+            Mqtt_WriteFloats(cursor, values + i, n);
+            cursor += (size_t)n * 4;
         }
-        if(type & 0x80){
-            payload[1] = (t->tm_year+1900)%100;
-            payload[2] = (t->tm_mon+1)&0xFF;
-            payload[3] = (t->tm_mday)&0xFF;
-            payload[4] = (t->tm_hour)&0xFF;
-            payload[5] = (t->tm_min)&0xFF;
-            payload[6] = (t->tm_sec)&0xFF;
-            offset = 6;
-        }
-        else{
-            offset = 0;
-        }
-        if(kTypeStringWithTime == (type & 0x7F)){
-            payload[offset + 1] = (size>>8)&0xFF;
-            payload[offset + 2] = size&0xFF;
-            offset += 2;
-        }
-        memcpy(payload + offset + 1, str, size);
-        ret = Mqtt_PackPublishPkt(buf, pkt_id, MQTTSAVEDPTOPICNAME, payload, payload_size, qos, retain, own);
-    }else{
+
+        err = Mqtt_PackPublishHead(buf, pkt_id, MQTTSAVEDPTOPICNAME, (uint32_t)size, qos, retain);
+        if(MQTTERR_NOERROR != err) {
+            return err;
+        }
+        MqttBuffer_AppendExtent(buf, ext);
+
+        if(pkt_count) {
+            ++*pkt_count;
+        }
+        pkt_id = (0xFFFF == pkt_id) ? 1 : pkt_id + 1;
+    }
+
+    return MQTTERR_NOERROR;
+}
+
+int Mqtt_PackDataPointFloats(struct MqttBuffer *buf, uint16_t pkt_id, uint16_t ds_name,
+                             const int64_t *ts, const float *values, uint32_t count,
+                             enum MqttQosLevel qos, int retain, uint32_t *pkt_count)
+{
+    int err;
+
+    MQTT_TRACE_BEGIN(MQTT_TRACE_PACK, MQTT_PKT_PUBLISH, pkt_id);
+    err = Mqtt_DoPackDataPointFloats(buf, pkt_id, ds_name, ts, values, count, qos, retain,
+                                     pkt_count);
+    MQTT_TRACE_END(MQTT_TRACE_PACK, MQTT_PKT_PUBLISH, pkt_id);
+    return err;
+}
+
+static int Mqtt_DoPackDataPointStrings(struct MqttBuffer *buf, uint16_t pkt_id, const int64_t *ts,
+                                       const char *const *values, const uint32_t *sizes,
+                                       uint32_t count, enum MqttQosLevel qos, int retain,
+                                       uint32_t *pkt_count)
+{
+    struct MqttDpTimeCache cache;
+    struct MqttExtent *ext;
+    const int64_t now = (int64_t)time(NULL);
+    uint32_t i, len, size;
+    char *cursor;
+    int err;
+
+    if(pkt_count) {
+        *pkt_count = 0;
+    }
+
+    if((0 == pkt_id) || !values || (0 == count)) {
         return MQTTERR_INVALID_PARAMETER;
     }
 
-    free(payload);
-    return ret;
+    for(i = 0; i < count; ++i) {
+        if(!values[i] || ((sizes ? sizes[i] : (uint32_t)strlen(values[i])) > 0xFFFF)) {
+            return MQTTERR_INVALID_PARAMETER;
+        }
+    }
+
+    // a type 6 payload is one record, the same as Mqtt_PackDataPointByString puts in a publish
+    cache.second = -1;
+    for(i = 0; i < count; ++i) {
+        len = sizes ? sizes[i] : (uint32_t)strlen(values[i]);
+        size = 1 + (ts ? 6 : 0) + 2 + len;
+
+        ext = MqttBuffer_AllocExtent(buf, size);
+        if(!ext) {
+            return MQTTERR_OUTOFMEMORY;
+        }
+
+        cursor = ext->payload;
+        *(cursor++) = ts ? PAYLOADWITHTIME(kTypeStringWithTime) : kTypeStringWithTime;
+        if(ts) {
+            err = Mqtt_DpTime(&cache, Mqtt_DpSecond(ts, i, now), cursor);
+            if(MQTTERR_NOERROR != err) {
+                return err;
+            }
+            cursor += 6;
+        }
+        *(cursor++) = (len >> 8) & 0xFF;
+        *(cursor++) = len & 0xFF;
+        memcpy(cursor, values[i], len);
+
+        err = Mqtt_PackPublishHead(buf, pkt_id, MQTTSAVEDPTOPICNAME, size, qos, retain);
+        if(MQTTERR_NOERROR != err) {
+            return err;
+        }
+        MqttBuffer_AppendExtent(buf, ext);
+
+        if(pkt_count) {
+            ++*pkt_count;
+        }
+        pkt_id = (0xFFFF == pkt_id) ? 1 : pkt_id + 1;
+    }
+
+    return MQTTERR_NOERROR;
 }
 
+int Mqtt_PackDataPointStrings(struct MqttBuffer *buf, uint16_t pkt_id, const int64_t *ts,
+                              const char *const *values, const uint32_t *sizes, uint32_t count,
+                              enum MqttQosLevel qos, int retain, uint32_t *pkt_count)
+{
+    int err;
 
-int Mqtt_PackDataPointByBinary(struct MqttBuffer *buf, uint16_t pkt_id, const char *dsid,
-                               const char *desc, int64_t ts, const char *bin, uint32_t size,
-                               enum MqttQosLevel qos, int retain, int own)
+    MQTT_TRACE_BEGIN(MQTT_TRACE_PACK, MQTT_PKT_PUBLISH, pkt_id);
+    err = Mqtt_DoPackDataPointStrings(buf, pkt_id, ts, values, sizes, count, qos, retain,
+                                      pkt_count);
+    MQTT_TRACE_END(MQTT_TRACE_PACK, MQTT_PKT_PUBLISH, pkt_id);
+    return err;
+}
+
+static struct tm *Mqtt_LocalTime(const time_t *tt, struct tm *out)
 {
-    char dp_type = kTypeBin & 0xFF;
-    uint32_t ds_info_len = 0;
-    char *ds_info_str = NULL;
-    cJSON *ds_info = cJSON_CreateObject();
-    uint32_t bin_offset = 0;
-    char time_buff[20];
-    int ret = MQTTERR_NOERROR;
-    
-    cJSON_AddStringToObject(ds_info, "ds_id", dsid);
-    if(ts <= 0){
-        time(&ts);
-    }
-        strftime(time_buff, 20, "%Y-%m-%d %H:%M:%S", localtime(&ts));
-        
-    cJSON_AddStringToObject(ds_info, "at", time_buff);
-    cJSON_AddStringToObject(ds_info, "desc", desc);
-    ds_info_str = cJSON_Print(ds_info);
-    ds_info_len = strlen(ds_info_str);
-#ifdef _debug
-    printf("save data type 2(binary),length:%d,\njson:%s\n", ds_info_len, ds_info_str);
+#ifdef WIN32
+    return localtime_s(out, tt) ? NULL : out;
+#else
+    // localtime checks the time zone file again on every call and may allocate, localtime_r does not
+    return localtime_r(tt, out);
 #endif
-    
+}
+
+// bytes of str as a quoted JSON string
+static uint32_t Mqtt_JsonStringLength(const char *str)
+{
+    uint32_t len = 2;
+
+    for(; *str; ++str) {
+        if(('\"' == *str) || ('\\' == *str) || ('\n' == *str) || ('\r' == *str) || ('\t' == *str)) {
+            len += 2;
+        }
+        else if((uint8_t)*str < 0x20) {
+            len += 6;
+        }
+        else {
+            ++len;
+        }
+    }
+
+    return len;
+}
+
+static char *Mqtt_WriteJsonString(char *cursor, const char *str)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    *(cursor++) = '\"';
+    for(; *str; ++str) {
+        switch(*str) {
+        case '\"': *(cursor++) = '\\'; *(cursor++) = '\"'; break;
+        case '\\': *(cursor++) = '\\'; *(cursor++) = '\\'; break;
+        case '\n': *(cursor++) = '\\'; *(cursor++) = 'n'; break;
+        case '\r': *(cursor++) = '\\'; *(cursor++) = 'r'; break;
+        case '\t': *(cursor++) = '\\'; *(cursor++) = 't'; break;
+        default:
+            if((uint8_t)*str < 0x20) {
+                memcpy(cursor, "\\u00", 4);
+                cursor[4] = hex[((uint8_t)*str) >> 4];
+                cursor[5] = hex[*str & 0x0F];
+                cursor += 6;
+            }
+            else {
+                *(cursor++) = *str;
+            }
+            break;
+        }
+    }
+    *(cursor++) = '\"';
+
+    return cursor;
+}
+
+static int Mqtt_DoPackDataPointByBinary(struct MqttBuffer *buf, uint16_t pkt_id, const char *dsid,
+                                        const char *desc, int64_t ts, const char *bin, uint32_t size,
+                                        enum MqttQosLevel qos, int retain, int own)
+{
+    static const char ds_id_key[] = "{\"ds_id\":";
+    static const char at_key[] = ",\"at\":\"";
+    static const char desc_key[] = "\",\"desc\":";
+    struct MqttExtent *ext;
+    uint32_t ds_info_len;
+    char time_buff[20];
+    struct tm local, *t;
+    time_t tt;
+    char *cursor;
+    int err;
+
+    if(NULL == dsid) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    if(NULL == desc) {
+        desc = "";
+    }
+
+    tt = ts > 0 ? (time_t)ts : time(NULL);
+    t = Mqtt_LocalTime(&tt, &local);
+    if(!t || (0 == strftime(time_buff, sizeof(time_buff), "%Y-%m-%d %H:%M:%S", t))) {
+        return MQTTERR_INTERNAL;
+    }
+
+    // the data stream info is written as compact JSON straight into the buffer
+    ds_info_len = (uint32_t)(sizeof(ds_id_key) - 1 + Mqtt_JsonStringLength(dsid) +
+                             sizeof(at_key) - 1 + strlen(time_buff) +
+                             sizeof(desc_key) - 1 + Mqtt_JsonStringLength(desc) + 1);
+    if(ds_info_len > 0xFFFF) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
     //payload的总长度
-    int32_t payload_size = 1 + 2 + ds_info_len + 4 + size;
-    char payload[payload_size];
+    err = Mqtt_PackPublishHead(buf, pkt_id, MQTTSAVEDPTOPICNAME, 1 + 2 + ds_info_len + 4 + size,
+                               qos, retain);
+    if(MQTTERR_NOERROR != err) {
+        return err;
+    }
+
+    ext = MqttBuffer_AllocExtent(buf, 1 + 2 + ds_info_len + 4);
+    if(NULL == ext) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
     //填充payload
-    payload[0] = dp_type;
-    payload[1] = (ds_info_len>>8)&0xFF;
-    payload[2] = ds_info_len & 0xFF;
-    memcpy(payload+3, ds_info_str, ds_info_len);
-    bin_offset = 1 + 2 + ds_info_len;
-    payload[bin_offset] = (size>>24) & 0xFF;
-    payload[bin_offset+1] = (size>>16) & 0xFF;
-    payload[bin_offset+2] = (size>>8) & 0xFF;
-    payload[bin_offset+3] = size & 0xFF;
-    memcpy(payload + bin_offset + 4,
-           bin, size);
-    ret = Mqtt_PackPublishPkt(buf, pkt_id, MQTTSAVEDPTOPICNAME, payload, payload_size, qos, retain, own);
-    free(ds_info_str);
-    return ret;
+    cursor = ext->payload;
+    *(cursor++) = kTypeBin & 0xFF;
+    *(cursor++) = (ds_info_len>>8)&0xFF;
+    *(cursor++) = ds_info_len & 0xFF;
+    memcpy(cursor, ds_id_key, sizeof(ds_id_key) - 1);
+    cursor = Mqtt_WriteJsonString(cursor + sizeof(ds_id_key) - 1, dsid);
+    memcpy(cursor, at_key, sizeof(at_key) - 1);
+    cursor += sizeof(at_key) - 1;
+    memcpy(cursor, time_buff, strlen(time_buff));
+    cursor += strlen(time_buff);
+    memcpy(cursor, desc_key, sizeof(desc_key) - 1);
+    cursor = Mqtt_WriteJsonString(cursor + sizeof(desc_key) - 1, desc);
+    *(cursor++) = '}';
+#ifdef _debug
+    printf("save data type 2(binary),length:%d,\njson:%.*s\n", ds_info_len, ds_info_len,
+           ext->payload + 3);
+#endif
+    *(cursor++) = (size>>24) & 0xFF;
+    *(cursor++) = (size>>16) & 0xFF;
+    *(cursor++) = (size>>8) & 0xFF;
+    *(cursor++) = size & 0xFF;
+    MqttBuffer_AppendExtent(buf, ext);
+
+    if(0 != size) {
+        return MqttBuffer_Append(buf, (char*)bin, size, own);
+    }
+
+    return MQTTERR_NOERROR;
+}
+
+int Mqtt_PackDataPointByBinary(struct MqttBuffer *buf, uint16_t pkt_id, const char *dsid,
+                               const char *desc, int64_t ts, const char *bin, uint32_t size,
+                               enum MqttQosLevel qos, int retain, int own)
+{
+    int err;
+
+    MQTT_TRACE_BEGIN(MQTT_TRACE_PACK, MQTT_PKT_PUBLISH, pkt_id);
+    err = Mqtt_DoPackDataPointByBinary(buf, pkt_id, dsid, desc, ts, bin, size, qos, retain, own);
+    MQTT_TRACE_END(MQTT_TRACE_PACK, MQTT_PKT_PUBLISH, pkt_id);
+    return err;
 }
 
 
@@ -4,10 +4,82 @@
 #include <assert.h>
 #include "mqtt/mqtt.h"
 
+#ifdef WIN32
+#include <windows.h>
+#endif
+
 static const uint32_t MQTT_MIN_EXTENT_SIZE = 1024;
 
-void MqttBuffer_Init(struct MqttBuffer *buf)
+// a reference held by a buffer, it lives in the buffer's own chunks
+struct MqttSharedRef {
+    struct MqttSharedPayload *shared;
+    struct MqttSharedRef *next;
+};
+
+// process wide statistics, updated once per chunk so the hot path stays untouched
+static struct MqttBufferStats MqttBuffer_GlobalStats;
+
+static void MqttBuffer_StatsAdd(uint64_t *counter, int64_t value)
+{
+#if defined(__GNUC__)
+    __atomic_fetch_add(counter, (uint64_t)value, __ATOMIC_RELAXED);
+#else
+    *(volatile uint64_t*)counter += (uint64_t)value;
+#endif
+}
+
+static uint64_t MqttBuffer_StatsLoad(const uint64_t *counter)
+{
+#if defined(__GNUC__)
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+#else
+    return *(const volatile uint64_t*)counter;
+#endif
+}
+
+static void MqttBuffer_StatsChunk(int64_t bytes, int64_t chunks)
+{
+    uint64_t live, peak;
+
+    MqttBuffer_StatsAdd(&MqttBuffer_GlobalStats.live_chunks, chunks);
+    if(bytes < 0) {
+        MqttBuffer_StatsAdd(&MqttBuffer_GlobalStats.live_bytes, bytes);
+        return;
+    }
+
+    MqttBuffer_StatsAdd(&MqttBuffer_GlobalStats.allocated_bytes, bytes);
+    MqttBuffer_StatsAdd(&MqttBuffer_GlobalStats.chunks, chunks);
+#if defined(__GNUC__)
+    live = __atomic_add_fetch(&MqttBuffer_GlobalStats.live_bytes, (uint64_t)bytes, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&MqttBuffer_GlobalStats.peak_bytes, __ATOMIC_RELAXED);
+    while((live > peak) &&
+          !__atomic_compare_exchange_n(&MqttBuffer_GlobalStats.peak_bytes, &peak, live, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+#else
+    live = MqttBuffer_GlobalStats.live_bytes += (uint64_t)bytes;
+    peak = MqttBuffer_GlobalStats.peak_bytes;
+    if(live > peak) {
+        MqttBuffer_GlobalStats.peak_bytes = live;
+    }
+#endif
+}
+
+static double MqttBuffer_Fragmentation(uint64_t requested_bytes, uint64_t allocated_bytes)
+{
+    if(0 == allocated_bytes) {
+        return 0;
+    }
+
+    return 1.0 - (double)requested_bytes / (double)allocated_bytes;
+}
+
+// empties the buffer but keeps its policy, the initial buffer is used again
+static void MqttBuffer_Clear(struct MqttBuffer *buf)
 {
+    const struct MqttBufferPolicy *policy = &buf->policy;
+    uint32_t skip;
+
     buf->first_ext = NULL;
     buf->last_ext = NULL;
     buf->available_bytes = 0;
@@ -16,6 +88,52 @@ void MqttBuffer_Init(struct MqttBuffer *buf)
     buf->alloc_max_count = 0;
     buf->first_available = NULL;
     buf->buffered_bytes = 0;
+    buf->requested_bytes = 0;
+    buf->extent_count = 0;
+    buf->allocated_bytes = 0;
+    buf->shared_refs = NULL;
+    buf->next_chunk_size = policy->initial_size ? policy->initial_size : MQTT_MIN_EXTENT_SIZE;
+
+    if(policy->initial_buffer) {
+        skip = (MQTT_DEFAULT_ALIGNMENT - (uint32_t)((size_t)policy->initial_buffer %
+                                                   MQTT_DEFAULT_ALIGNMENT)) % MQTT_DEFAULT_ALIGNMENT;
+        if(policy->initial_buffer_size > skip) {
+            buf->first_available = policy->initial_buffer + skip;
+            buf->available_bytes = policy->initial_buffer_size - skip;
+        }
+    }
+}
+
+void MqttBuffer_Init(struct MqttBuffer *buf)
+{
+    memset(&buf->policy, 0, sizeof(buf->policy));
+    MqttBuffer_Clear(buf);
+}
+
+void MqttBuffer_InitFixed(struct MqttBuffer *buf, char *storage, uint32_t size)
+{
+    memset(&buf->policy, 0, sizeof(buf->policy));
+    buf->policy.initial_buffer = storage;
+    buf->policy.initial_buffer_size = size;
+    buf->policy.fixed_storage = 1;
+    MqttBuffer_Clear(buf);
+}
+
+int MqttBuffer_SetPolicy(struct MqttBuffer *buf, const struct MqttBufferPolicy *policy)
+{
+    if(buf->first_ext || buf->alloc_count) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    if(policy) {
+        buf->policy = *policy;
+    }
+    else {
+        memset(&buf->policy, 0, sizeof(buf->policy));
+    }
+
+    MqttBuffer_Clear(buf);
+    return MQTTERR_NOERROR;
 }
 
 void MqttBuffer_Destroy(struct MqttBuffer *buf)
@@ -25,14 +143,27 @@ void MqttBuffer_Destroy(struct MqttBuffer *buf)
 
 void MqttBuffer_Reset(struct MqttBuffer *buf)
 {
+    struct MqttSharedRef *ref;
     uint32_t i;
+
+    // the references sit in the chunks, drop them before the chunks go
+    for(ref = buf->shared_refs; ref; ref = ref->next) {
+        MqttSharedPayload_Release(ref->shared);
+    }
+
     for(i = 0; i < buf->alloc_count; ++i) {
         free(buf->allocations[i]);
     }
     
     free(buf->allocations);
 
-    MqttBuffer_Init(buf);
+    if(buf->alloc_count > 0) {
+        MqttBuffer_StatsAdd(&MqttBuffer_GlobalStats.requested_bytes, buf->requested_bytes);
+        MqttBuffer_StatsAdd(&MqttBuffer_GlobalStats.extents, buf->extent_count);
+        MqttBuffer_StatsChunk(-(int64_t)buf->allocated_bytes, -(int64_t)buf->alloc_count);
+    }
+
+    MqttBuffer_Clear(buf);
 }
 
 struct MqttExtent *MqttBuffer_AllocExtent(struct MqttBuffer *buf, uint32_t bytes)
@@ -46,6 +177,10 @@ struct MqttExtent *MqttBuffer_AllocExtent(struct MqttBuffer *buf, uint32_t bytes
         uint32_t alloc_bytes;
         char *chunk;
 
+        if(buf->policy.fixed_storage) {
+            return NULL;
+        }
+
         if(buf->alloc_count == buf->alloc_max_count) {
             uint32_t max_count = buf->alloc_max_count * 2 + 1;
             char **tmp = (char**)malloc(max_count * sizeof(char**));
@@ -61,20 +196,27 @@ struct MqttExtent *MqttBuffer_AllocExtent(struct MqttBuffer *buf, uint32_t bytes
             buf->allocations = tmp;
         }
 
-        alloc_bytes = aligned_bytes < MQTT_MIN_EXTENT_SIZE ? MQTT_MIN_EXTENT_SIZE : aligned_bytes;
+        alloc_bytes = aligned_bytes < buf->next_chunk_size ? buf->next_chunk_size : aligned_bytes;
         chunk = (char*)malloc(alloc_bytes);
         if(NULL == chunk) {
             return NULL;
         }
 
+        if(buf->policy.growth_factor > 1) {
+            const uint64_t next = (uint64_t)buf->next_chunk_size * buf->policy.growth_factor;
+            const uint32_t max_size = buf->policy.max_chunk_size ? buf->policy.max_chunk_size : UINT32_MAX;
+            buf->next_chunk_size = next < max_size ? (uint32_t)next : max_size;
+        }
+
         buf->alloc_count += 1;
         buf->allocations[buf->alloc_count - 1] = chunk;
         buf->available_bytes = alloc_bytes;
         buf->first_available = chunk;
+        buf->allocated_bytes += alloc_bytes;
+        MqttBuffer_StatsChunk(alloc_bytes, 1);
     }
 
     assert(buf->available_bytes >= bytes);
-    assert(buf->alloc_count > 0);
 
     ext = (struct MqttExtent*)(buf->first_available);
     ext->len = bytes;
@@ -83,6 +225,8 @@ struct MqttExtent *MqttBuffer_AllocExtent(struct MqttBuffer *buf, uint32_t bytes
 
     buf->first_available += aligned_bytes;
     buf->available_bytes -= aligned_bytes;
+    buf->requested_bytes += bytes;
+    ++buf->extent_count;
 
     return ext;
 }
@@ -111,6 +255,95 @@ int MqttBuffer_Append(struct MqttBuffer *buf, char *payload, uint32_t size, int
 
 }
 
+int MqttBuffer_AppendShared(struct MqttBuffer *buf, struct MqttSharedPayload *shared)
+{
+    struct MqttExtent *ext = MqttBuffer_AllocExtent(buf, sizeof(struct MqttSharedRef));
+    struct MqttSharedRef *ref;
+
+    if(NULL == ext) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    ref = (struct MqttSharedRef*)ext->payload;
+    ref->shared = shared;
+    ref->next = buf->shared_refs;
+    buf->shared_refs = ref;
+    MqttSharedPayload_Retain(shared);
+
+    ext->payload = shared->data;
+    ext->len = shared->size;
+    MqttBuffer_AppendExtent(buf, ext);
+    return MQTTERR_NOERROR;
+}
+
+struct MqttSharedPayload *MqttSharedPayload_Create(const char *data, uint32_t size)
+{
+    struct MqttSharedPayload *shared;
+
+    // one allocation holds the header and the data right behind it
+    shared = (struct MqttSharedPayload*)malloc(sizeof(struct MqttSharedPayload) + size);
+    if(NULL == shared) {
+        return NULL;
+    }
+
+    shared->data = (char*)(shared + 1);
+    shared->size = size;
+    shared->refs = 1;
+    shared->release = NULL;
+    shared->release_arg = NULL;
+    memcpy(shared->data, data, size);
+
+    return shared;
+}
+
+struct MqttSharedPayload *MqttSharedPayload_Wrap(char *data, uint32_t size,
+                                                 void (*release)(void *arg, char *data),
+                                                 void *release_arg)
+{
+    struct MqttSharedPayload *shared;
+
+    shared = (struct MqttSharedPayload*)malloc(sizeof(struct MqttSharedPayload));
+    if(NULL == shared) {
+        return NULL;
+    }
+
+    shared->data = data;
+    shared->size = size;
+    shared->refs = 1;
+    shared->release = release;
+    shared->release_arg = release_arg;
+
+    return shared;
+}
+
+void MqttSharedPayload_Retain(struct MqttSharedPayload *shared)
+{
+#ifdef WIN32
+    InterlockedIncrement((volatile LONG*)&shared->refs);
+#else
+    __atomic_add_fetch(&shared->refs, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+void MqttSharedPayload_Release(struct MqttSharedPayload *shared)
+{
+#ifdef WIN32
+    if(0 != InterlockedDecrement((volatile LONG*)&shared->refs)) {
+        return;
+    }
+#else
+    // the last owner may run on another shard thread, it must see all earlier writes
+    if(0 != __atomic_sub_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+#endif
+
+    if(shared->release) {
+        shared->release(shared->release_arg, shared->data);
+    }
+    free(shared);
+}
+
 void MqttBuffer_AppendExtent(struct MqttBuffer *buf, struct MqttExtent *ext)
 {
     ext->next = NULL;
@@ -120,7 +353,6 @@ void MqttBuffer_AppendExtent(struct MqttBuffer *buf, struct MqttExtent *ext)
     }
     else {
         assert(NULL == buf->first_ext);
-        assert(1 <= buf->alloc_count);
 
         buf->first_ext = ext;
         buf->last_ext = ext;
@@ -128,3 +360,73 @@ void MqttBuffer_AppendExtent(struct MqttBuffer *buf, struct MqttExtent *ext)
 
     buf->buffered_bytes += ext->len;
 }
+
+int MqttBuffer_Move(struct MqttBuffer *dst, struct MqttBuffer *src)
+{
+    const struct MqttExtent *ext;
+    struct MqttExtent *copy;
+    char *cursor;
+
+    if(!src->policy.initial_buffer) {
+        *dst = *src;
+        MqttBuffer_Clear(src);
+        return MQTTERR_NOERROR;
+    }
+
+    // extents in the caller's initial buffer die with it, the packet gets one heap extent
+    MqttBuffer_Init(dst);
+    if(src->buffered_bytes) {
+        copy = MqttBuffer_AllocExtent(dst, src->buffered_bytes);
+        if(!copy) {
+            return MQTTERR_OUTOFMEMORY;
+        }
+
+        cursor = copy->payload;
+        for(ext = src->first_ext; ext; ext = ext->next) {
+            memcpy(cursor, ext->payload, ext->len);
+            cursor += ext->len;
+        }
+        MqttBuffer_AppendExtent(dst, copy);
+    }
+
+    MqttBuffer_Reset(src);
+    return MQTTERR_NOERROR;
+}
+
+void MqttBuffer_GetStats(const struct MqttBuffer *buf, struct MqttBufferStats *stats)
+{
+    stats->requested_bytes = buf->requested_bytes;
+    stats->extents = buf->extent_count;
+    stats->allocated_bytes = buf->allocated_bytes;
+    if(buf->policy.initial_buffer) {
+        stats->allocated_bytes += buf->policy.initial_buffer_size;
+    }
+    stats->chunks = buf->alloc_count;
+    stats->live_bytes = stats->allocated_bytes;
+    stats->live_chunks = buf->alloc_count;
+    stats->peak_bytes = stats->allocated_bytes;
+    stats->fragmentation = MqttBuffer_Fragmentation(stats->requested_bytes,
+                                                    stats->allocated_bytes);
+}
+
+void MqttBuffer_GetGlobalStats(struct MqttBufferStats *stats)
+{
+    stats->requested_bytes = MqttBuffer_StatsLoad(&MqttBuffer_GlobalStats.requested_bytes);
+    stats->extents = MqttBuffer_StatsLoad(&MqttBuffer_GlobalStats.extents);
+    stats->allocated_bytes = MqttBuffer_StatsLoad(&MqttBuffer_GlobalStats.allocated_bytes);
+    stats->chunks = MqttBuffer_StatsLoad(&MqttBuffer_GlobalStats.chunks);
+    stats->live_bytes = MqttBuffer_StatsLoad(&MqttBuffer_GlobalStats.live_bytes);
+    stats->live_chunks = MqttBuffer_StatsLoad(&MqttBuffer_GlobalStats.live_chunks);
+    stats->peak_bytes = MqttBuffer_StatsLoad(&MqttBuffer_GlobalStats.peak_bytes);
+    stats->fragmentation = MqttBuffer_Fragmentation(stats->requested_bytes,
+                                                    stats->allocated_bytes);
+}
+
+void MqttBuffer_ResetGlobalStats(void)
+{
+    MqttBuffer_GlobalStats.requested_bytes = 0;
+    MqttBuffer_GlobalStats.extents = 0;
+    MqttBuffer_GlobalStats.allocated_bytes = 0;
+    MqttBuffer_GlobalStats.chunks = 0;
+    MqttBuffer_GlobalStats.peak_bytes = MqttBuffer_StatsLoad(&MqttBuffer_GlobalStats.live_bytes);
+}
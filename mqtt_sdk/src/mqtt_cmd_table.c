@@ -0,0 +1,278 @@
+#include "mqtt/mqtt_cmd_table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct MqttCmdNode {
+    struct MqttCmdNode **children; /* 按标签的第一个字节升序排列 */
+    uint32_t child_count;
+    uint32_t child_capacity;
+    MqttCmdHandler exact;
+    void *exact_arg;
+    MqttCmdHandler prefix;
+    void *prefix_arg;
+    uint32_t label_len;
+    char label[1];
+};
+
+static struct MqttCmdNode *MqttCmdTable_NewNode(const char *label, uint32_t len)
+{
+    struct MqttCmdNode *node = (struct MqttCmdNode*)malloc(sizeof(struct MqttCmdNode) + len);
+
+    if(!node) {
+        return NULL;
+    }
+
+    memset(node, 0, sizeof(*node));
+    node->label_len = len;
+    memcpy(node->label, label, len);
+    return node;
+}
+
+static void MqttCmdTable_FreeNode(struct MqttCmdNode *node)
+{
+    uint32_t i;
+
+    for(i = 0; i < node->child_count; ++i) {
+        MqttCmdTable_FreeNode(node->children[i]);
+    }
+
+    free(node->children);
+    free(node);
+}
+
+// binary search on the first byte, *index is where the child is or would go
+static struct MqttCmdNode *MqttCmdTable_FindChild(const struct MqttCmdNode *node, char byte,
+                                                  uint32_t *index)
+{
+    uint32_t lo = 0, hi = node->child_count, mid;
+
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+        if((uint8_t)node->children[mid]->label[0] < (uint8_t)byte) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    *index = lo;
+    if((lo < node->child_count) && (node->children[lo]->label[0] == byte)) {
+        return node->children[lo];
+    }
+
+    return NULL;
+}
+
+static int MqttCmdTable_InsertChild(struct MqttCmdNode *node, uint32_t index,
+                                    struct MqttCmdNode *child)
+{
+    struct MqttCmdNode **children;
+    uint32_t capacity;
+
+    if(node->child_count == node->child_capacity) {
+        capacity = node->child_capacity ? node->child_capacity * 2 : 2;
+        children = (struct MqttCmdNode**)realloc(node->children,
+                                                 capacity * sizeof(struct MqttCmdNode*));
+        if(!children) {
+            return MQTTERR_OUTOFMEMORY;
+        }
+        node->children = children;
+        node->child_capacity = capacity;
+    }
+
+    memmove(node->children + index + 1, node->children + index,
+            (node->child_count - index) * sizeof(struct MqttCmdNode*));
+    node->children[index] = child;
+    ++node->child_count;
+    return MQTTERR_NOERROR;
+}
+
+// the node for name, splitting an edge or adding a leaf as needed
+static struct MqttCmdNode *MqttCmdTable_Insert(struct MqttCmdTable *table,
+                                               const char *name, uint32_t len)
+{
+    struct MqttCmdNode *node = table->root, *child, *mid;
+    uint32_t pos = 0, index, common;
+
+    while(pos < len) {
+        child = MqttCmdTable_FindChild(node, name[pos], &index);
+        if(!child) {
+            child = MqttCmdTable_NewNode(name + pos, len - pos);
+            if(!child) {
+                return NULL;
+            }
+            if(MqttCmdTable_InsertChild(node, index, child) < 0) {
+                free(child);
+                return NULL;
+            }
+            return child;
+        }
+
+        for(common = 1; (common < child->label_len) && (pos + common < len) &&
+                (child->label[common] == name[pos + common]); ++common) {
+        }
+
+        if(common < child->label_len) {
+            mid = MqttCmdTable_NewNode(child->label, common);
+            if(!mid || (MqttCmdTable_InsertChild(mid, 0, child) < 0)) {
+                free(mid);
+                return NULL;
+            }
+            memmove(child->label, child->label + common, child->label_len - common);
+            child->label_len -= common;
+            node->children[index] = mid;
+            child = mid;
+        }
+
+        node = child;
+        pos += common;
+    }
+
+    return node;
+}
+
+// returns non-zero when node is left without handlers and children
+static int MqttCmdTable_RemoveFrom(struct MqttCmdNode *node, const char *name, uint32_t len,
+                                   int prefix, int *found)
+{
+    struct MqttCmdNode *child;
+    uint32_t index;
+
+    if(0 == len) {
+        if(prefix && node->prefix) {
+            node->prefix = NULL;
+            node->prefix_arg = NULL;
+            *found = 1;
+        }
+        else if(!prefix && node->exact) {
+            node->exact = NULL;
+            node->exact_arg = NULL;
+            *found = 1;
+        }
+    }
+    else {
+        child = MqttCmdTable_FindChild(node, name[0], &index);
+        if(!child || (child->label_len > len) ||
+           (0 != memcmp(child->label, name, child->label_len))) {
+            return 0;
+        }
+
+        if(MqttCmdTable_RemoveFrom(child, name + child->label_len, len - child->label_len,
+                                   prefix, found)) {
+            MqttCmdTable_FreeNode(child);
+            --node->child_count;
+            memmove(node->children + index, node->children + index + 1,
+                    (node->child_count - index) * sizeof(struct MqttCmdNode*));
+        }
+    }
+
+    return !node->exact && !node->prefix && !node->child_count;
+}
+
+int MqttCmdTable_Init(struct MqttCmdTable *table)
+{
+    memset(table, 0, sizeof(*table));
+
+    table->root = MqttCmdTable_NewNode("", 0);
+    if(!table->root) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    table->delimiter = ':';
+    return MQTTERR_NOERROR;
+}
+
+void MqttCmdTable_Destroy(struct MqttCmdTable *table)
+{
+    if(table->root) {
+        MqttCmdTable_FreeNode(table->root);
+    }
+
+    memset(table, 0, sizeof(*table));
+}
+
+int MqttCmdTable_Add(struct MqttCmdTable *table, const char *name, int prefix,
+                     MqttCmdHandler handler, void *arg)
+{
+    struct MqttCmdNode *node;
+
+    if(!name || ('\0' == *name) || !handler) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    node = MqttCmdTable_Insert(table, name, (uint32_t)strlen(name));
+    if(!node) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    if(prefix) {
+        table->names += node->prefix ? 0 : 1;
+        node->prefix = handler;
+        node->prefix_arg = arg;
+    }
+    else {
+        table->names += node->exact ? 0 : 1;
+        node->exact = handler;
+        node->exact_arg = arg;
+    }
+
+    return MQTTERR_NOERROR;
+}
+
+int MqttCmdTable_Remove(struct MqttCmdTable *table, const char *name, int prefix)
+{
+    int found = 0;
+
+    if(!name || ('\0' == *name)) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    // the root is never freed, its result does not matter
+    MqttCmdTable_RemoveFrom(table->root, name, (uint32_t)strlen(name), prefix, &found);
+    if(!found) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    --table->names;
+    return MQTTERR_NOERROR;
+}
+
+MqttCmdHandler MqttCmdTable_Lookup(const struct MqttCmdTable *table, const char *name,
+                                   uint32_t name_len, void **arg)
+{
+    const struct MqttCmdNode *node = table->root, *child;
+    MqttCmdHandler best = NULL;
+    void *best_arg = NULL;
+    uint32_t pos = 0, index;
+
+    for(;;) {
+        if((pos == name_len) && node->exact) {
+            *arg = node->exact_arg;
+            return node->exact;
+        }
+
+        // a deeper prefix is a longer one, it wins
+        if(node->prefix) {
+            best = node->prefix;
+            best_arg = node->prefix_arg;
+        }
+
+        if(pos == name_len) {
+            break;
+        }
+
+        child = MqttCmdTable_FindChild(node, name[pos], &index);
+        if(!child || (child->label_len > name_len - pos) ||
+           (0 != memcmp(child->label, name + pos, child->label_len))) {
+            break;
+        }
+
+        node = child;
+        pos += child->label_len;
+    }
+
+    *arg = best_arg;
+    return best;
+}
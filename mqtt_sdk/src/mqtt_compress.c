@@ -0,0 +1,396 @@
+#include "mqtt/mqtt_compress.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MQTT_LZ_HASH_BITS 12
+#define MQTT_LZ_MIN_MATCH 4
+// the block format ends with at least 5 literals, the last match starts 12 bytes before the end
+#define MQTT_LZ_LAST_LITERALS 5
+#define MQTT_LZ_MFLIMIT 12
+#define MQTT_LZ_MAX_OFFSET 65535
+
+#define MQTT_COMPRESS_DEFAULT_THRESHOLD 256
+#define MQTT_COMPRESS_DEFAULT_MAX_DECODED (1024 * 1024)
+#define MQTT_COMPRESS_METHOD_STORED 0
+#define MQTT_COMPRESS_METHOD_LZ 1
+
+static const char MqttCompression_Magic[3] = {0x00, 'L', 'Z'};
+
+static uint32_t MqttLz_Read32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t MqttLz_Hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - MQTT_LZ_HASH_BITS);
+}
+
+static char *MqttLz_WriteLength(char *op, uint32_t len)
+{
+    while(len >= 255) {
+        *(op++) = (char)255;
+        len -= 255;
+    }
+    *(op++) = (char)len;
+    return op;
+}
+
+uint32_t MqttLz_Bound(uint32_t size)
+{
+    return size + size / 255 + 16;
+}
+
+// one literal run and an optional match, 0 when dst is too small
+static char *MqttLz_Emit(char *op, const char *op_end, const char *literals, uint32_t lit_len,
+                         uint32_t offset, uint32_t match_len)
+{
+    char *token = op;
+
+    if(op_end - op < (ptrdiff_t)(1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1)) {
+        return NULL;
+    }
+
+    ++op;
+    if(lit_len >= 15) {
+        *token = (char)(15 << 4);
+        op = MqttLz_WriteLength(op, lit_len - 15);
+    }
+    else {
+        *token = (char)(lit_len << 4);
+    }
+
+    memcpy(op, literals, lit_len);
+    op += lit_len;
+
+    if(0 == match_len) {
+        return op;
+    }
+
+    *(op++) = (char)(offset & 0xFF);
+    *(op++) = (char)(offset >> 8);
+
+    match_len -= MQTT_LZ_MIN_MATCH;
+    if(match_len >= 15) {
+        *token |= 15;
+        op = MqttLz_WriteLength(op, match_len - 15);
+    }
+    else {
+        *token |= (char)match_len;
+    }
+
+    return op;
+}
+
+uint32_t MqttLz_Compress(uint32_t *table, const char *src, uint32_t size,
+                         char *dst, uint32_t capacity)
+{
+    const char *op_end = dst + capacity;
+    char *op = dst;
+    uint32_t ip = 1, anchor = 0, candidate, seq, h, match_len, step;
+
+    if(size >= MQTT_LZ_MFLIMIT) {
+        memset(table, 0, sizeof(uint32_t) << MQTT_LZ_HASH_BITS);
+
+        while(ip <= size - MQTT_LZ_MFLIMIT) {
+            seq = MqttLz_Read32(src + ip);
+            h = MqttLz_Hash(seq);
+            candidate = table[h];
+            table[h] = ip;
+
+            if((candidate >= ip) || (ip - candidate > MQTT_LZ_MAX_OFFSET) ||
+               (MqttLz_Read32(src + candidate) != seq)) {
+                // skip faster through data that does not compress
+                step = 1 + ((ip - anchor) >> 6);
+                ip += step;
+                continue;
+            }
+
+            while((ip > anchor) && (candidate > 0) && (src[ip - 1] == src[candidate - 1])) {
+                --ip;
+                --candidate;
+            }
+
+            match_len = MQTT_LZ_MIN_MATCH;
+            while((ip + match_len < size - MQTT_LZ_LAST_LITERALS) &&
+                  (src[ip + match_len] == src[candidate + match_len])) {
+                ++match_len;
+            }
+
+            op = MqttLz_Emit(op, op_end, src + anchor, ip - anchor, ip - candidate, match_len);
+            if(!op) {
+                return 0;
+            }
+
+            ip += match_len;
+            anchor = ip;
+            if(ip - 2 <= size - MQTT_LZ_MFLIMIT) {
+                table[MqttLz_Hash(MqttLz_Read32(src + ip - 2))] = ip - 2;
+            }
+        }
+    }
+
+    op = MqttLz_Emit(op, op_end, src + anchor, size - anchor, 0, 0);
+    return op ? (uint32_t)(op - dst) : 0;
+}
+
+static int MqttLz_ReadLength(const uint8_t *src, uint32_t size, uint32_t *ip, uint32_t *len)
+{
+    uint8_t b;
+
+    do {
+        if(*ip >= size) {
+            return MQTTERR_ILLEGAL_PKT;
+        }
+        b = src[(*ip)++];
+        *len += b;
+    } while(255 == b);
+
+    return MQTTERR_NOERROR;
+}
+
+int MqttLz_Decompress(const char *src, uint32_t size, char *dst, uint32_t decoded_size)
+{
+    const uint8_t *in = (const uint8_t*)src;
+    uint32_t ip = 0, op = 0, lit_len, match_len, offset, i;
+    uint8_t token;
+
+    for(;;) {
+        if(ip >= size) {
+            return MQTTERR_ILLEGAL_PKT;
+        }
+
+        token = in[ip++];
+        lit_len = token >> 4;
+        if((15 == lit_len) && (MqttLz_ReadLength(in, size, &ip, &lit_len) < 0)) {
+            return MQTTERR_ILLEGAL_PKT;
+        }
+
+        if((lit_len > size - ip) || (lit_len > decoded_size - op)) {
+            return MQTTERR_ILLEGAL_PKT;
+        }
+
+        memcpy(dst + op, src + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        // the last sequence has literals only
+        if(ip == size) {
+            break;
+        }
+
+        if(size - ip < 2) {
+            return MQTTERR_ILLEGAL_PKT;
+        }
+
+        offset = in[ip] | ((uint32_t)in[ip + 1] << 8);
+        ip += 2;
+        if((0 == offset) || (offset > op)) {
+            return MQTTERR_ILLEGAL_PKT;
+        }
+
+        match_len = token & 15;
+        if((15 == match_len) && (MqttLz_ReadLength(in, size, &ip, &match_len) < 0)) {
+            return MQTTERR_ILLEGAL_PKT;
+        }
+        match_len += MQTT_LZ_MIN_MATCH;
+
+        if(match_len > decoded_size - op) {
+            return MQTTERR_ILLEGAL_PKT;
+        }
+
+        if(offset >= match_len) {
+            memcpy(dst + op, dst + op - offset, match_len);
+        }
+        else {
+            // an overlapping match repeats the last offset bytes
+            for(i = 0; i < match_len; ++i) {
+                dst[op + i] = dst[op + i - offset];
+            }
+        }
+        op += match_len;
+    }
+
+    return op == decoded_size ? MQTTERR_NOERROR : MQTTERR_ILLEGAL_PKT;
+}
+
+int MqttCompression_Init(struct MqttCompression *comp, uint32_t threshold)
+{
+    memset(comp, 0, sizeof(*comp));
+
+    comp->table = (uint32_t*)malloc(sizeof(uint32_t) << MQTT_LZ_HASH_BITS);
+    if(!comp->table) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    comp->threshold = threshold ? threshold : MQTT_COMPRESS_DEFAULT_THRESHOLD;
+    comp->max_decoded_size = MQTT_COMPRESS_DEFAULT_MAX_DECODED;
+    return MQTTERR_NOERROR;
+}
+
+void MqttCompression_Destroy(struct MqttCompression *comp)
+{
+    free(comp->table);
+    free(comp->scratch);
+    free(comp->decoded);
+    memset(comp, 0, sizeof(*comp));
+}
+
+static int MqttCompression_Reserve(char **data, uint32_t *capacity, uint32_t bytes)
+{
+    char *tmp;
+
+    if(bytes <= *capacity) {
+        return MQTTERR_NOERROR;
+    }
+
+    tmp = (char*)realloc(*data, bytes);
+    if(!tmp) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    *data = tmp;
+    *capacity = bytes;
+    return MQTTERR_NOERROR;
+}
+
+// whether payload points into data, which the next reserve may move
+static int MqttCompression_Inside(const char *data, uint32_t capacity, const char *payload)
+{
+    return data && (payload >= data) && (payload < data + capacity);
+}
+
+static void MqttCompression_WriteHeader(char *header, int method, uint32_t size)
+{
+    memcpy(header, MqttCompression_Magic, sizeof(MqttCompression_Magic));
+    header[3] = (char)method;
+    header[4] = (char)(size >> 24);
+    header[5] = (char)(size >> 16);
+    header[6] = (char)(size >> 8);
+    header[7] = (char)size;
+}
+
+int MqttCompression_PackPublishPkt(struct MqttCompression *comp, struct MqttBuffer *buf,
+                                   uint16_t pkt_id, const char *topic,
+                                   const char *payload, uint32_t size,
+                                   enum MqttQosLevel qos, int retain)
+{
+    uint32_t packed = 0;
+    int err;
+
+    if(!topic || ('$' == *topic)) {
+        return Mqtt_PackPublishPkt(buf, pkt_id, topic, payload, size, qos, retain, 1);
+    }
+
+    // the result is built in scratch, a payload there would be overwritten while read
+    if(MqttCompression_Inside(comp->scratch, comp->scratch_capacity, payload)) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    if(size >= comp->threshold) {
+        err = MqttCompression_Reserve(&comp->scratch, &comp->scratch_capacity,
+                                      MQTT_COMPRESS_HEADER_SIZE + MqttLz_Bound(size));
+        if(err < 0) {
+            return err;
+        }
+
+        // only worth it when the result, header included, is smaller
+        packed = MqttLz_Compress(comp->table, payload, size,
+                                 comp->scratch + MQTT_COMPRESS_HEADER_SIZE,
+                                 size > MQTT_COMPRESS_HEADER_SIZE ? size - MQTT_COMPRESS_HEADER_SIZE : 0);
+    }
+
+    if(packed > 0) {
+        MqttCompression_WriteHeader(comp->scratch, MQTT_COMPRESS_METHOD_LZ, size);
+        packed += MQTT_COMPRESS_HEADER_SIZE;
+        err = Mqtt_PackPublishPkt(buf, pkt_id, topic, comp->scratch, packed, qos, retain, 1);
+        if(MQTTERR_NOERROR == err) {
+            ++comp->compressed_pkts;
+            comp->bytes_in += size;
+            comp->bytes_out += packed;
+        }
+        return err;
+    }
+
+    ++comp->plain_pkts;
+    if(!MqttCompression_IsFramed(payload, size)) {
+        return Mqtt_PackPublishPkt(buf, pkt_id, topic, payload, size, qos, retain, 1);
+    }
+
+    // a plain payload that looks like a header is stored behind a real one
+    err = MqttCompression_Reserve(&comp->scratch, &comp->scratch_capacity,
+                                  MQTT_COMPRESS_HEADER_SIZE + size);
+    if(err < 0) {
+        return err;
+    }
+
+    MqttCompression_WriteHeader(comp->scratch, MQTT_COMPRESS_METHOD_STORED, size);
+    memcpy(comp->scratch + MQTT_COMPRESS_HEADER_SIZE, payload, size);
+    return Mqtt_PackPublishPkt(buf, pkt_id, topic, comp->scratch,
+                               MQTT_COMPRESS_HEADER_SIZE + size, qos, retain, 1);
+}
+
+int MqttCompression_IsFramed(const char *payload, uint32_t size)
+{
+    return (size >= MQTT_COMPRESS_HEADER_SIZE) &&
+        (0 == memcmp(payload, MqttCompression_Magic, sizeof(MqttCompression_Magic)));
+}
+
+int MqttCompression_Decode(struct MqttCompression *comp, const char *payload, uint32_t size,
+                           char **out, uint32_t *out_size)
+{
+    const uint8_t *header = (const uint8_t*)payload;
+    uint32_t decoded_size;
+    int err;
+
+    if(!MqttCompression_IsFramed(payload, size)) {
+        return MQTTERR_ILLEGAL_PKT;
+    }
+
+    decoded_size = ((uint32_t)header[4] << 24) | ((uint32_t)header[5] << 16) |
+        ((uint32_t)header[6] << 8) | header[7];
+
+    switch(header[3]) {
+    case MQTT_COMPRESS_METHOD_STORED:
+        if(decoded_size != size - MQTT_COMPRESS_HEADER_SIZE) {
+            return MQTTERR_ILLEGAL_PKT;
+        }
+        *out = (char*)payload + MQTT_COMPRESS_HEADER_SIZE;
+        break;
+
+    case MQTT_COMPRESS_METHOD_LZ:
+        if(decoded_size > comp->max_decoded_size) {
+            return MQTTERR_ILLEGAL_PKT;
+        }
+
+        // decoding has a buffer of its own so that a callback may pack with comp meanwhile
+        if(MqttCompression_Inside(comp->decoded, comp->decoded_capacity, payload)) {
+            return MQTTERR_INVALID_PARAMETER;
+        }
+
+        // the spare byte gives an empty payload a buffer too
+        err = MqttCompression_Reserve(&comp->decoded, &comp->decoded_capacity, decoded_size + 1);
+        if(err < 0) {
+            return err;
+        }
+
+        err = MqttLz_Decompress(payload + MQTT_COMPRESS_HEADER_SIZE,
+                                size - MQTT_COMPRESS_HEADER_SIZE, comp->decoded, decoded_size);
+        if(err < 0) {
+            return err;
+        }
+        *out = comp->decoded;
+        break;
+
+    default:
+        return MQTTERR_ILLEGAL_PKT;
+    }
+
+    *out_size = decoded_size;
+    ++comp->decoded_pkts;
+    return MQTTERR_NOERROR;
+}
@@ -0,0 +1,363 @@
+#include "mqtt/mqtt_connect_cache.h"
+#include "mqtt/mqtt_v5.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// packets are carved from blocks of this size, larger ones get a block of their own
+#define MQTT_CONNECT_CACHE_BLOCK 65536
+
+static const char mqtt_connect_cache_magic[4] = {'M', 'Q', 'C', 'C'};
+
+static uint32_t MqttConnectCache_RB32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void MqttConnectCache_WB32(uint32_t v, unsigned char *p)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+// a CONNECT whose remaining length covers exactly size bytes, head holds at least the fixed header
+static int MqttConnectCache_IsConnect(const char *head, uint32_t len, uint32_t size)
+{
+    uint32_t remaining_len;
+    int bytes;
+
+    if((len < 2) || ((MQTT_PKT_CONNECT << 4) != (uint8_t)head[0])) {
+        return 0;
+    }
+
+    bytes = MqttV5_ReadVarInt(head + 1, len - 1, &remaining_len);
+    return (bytes > 0) && (1 + (uint32_t)bytes + remaining_len == size);
+}
+
+static char *MqttConnectCache_Alloc(struct MqttConnectCache *cache, uint32_t size)
+{
+    const uint32_t block_size = size > MQTT_CONNECT_CACHE_BLOCK ? size : MQTT_CONNECT_CACHE_BLOCK;
+    char *block, *data;
+
+    if(size <= cache->block_left) {
+        data = cache->block_pos;
+        cache->block_pos += size;
+        cache->block_left -= size;
+        return data;
+    }
+
+    if(cache->block_count == cache->block_capacity) {
+        const uint32_t capacity = cache->block_capacity ? cache->block_capacity * 2 : 8;
+        char **blocks = (char**)realloc(cache->blocks, capacity * sizeof(char*));
+        if(!blocks) {
+            return NULL;
+        }
+        cache->blocks = blocks;
+        cache->block_capacity = capacity;
+    }
+
+    block = (char*)malloc(block_size);
+    if(!block) {
+        return NULL;
+    }
+    cache->blocks[cache->block_count++] = block;
+    cache->memory += block_size;
+
+    // an oversized packet leaves the current block open for the small ones
+    if(block_size > MQTT_CONNECT_CACHE_BLOCK) {
+        return block;
+    }
+
+    cache->block_pos = block + size;
+    cache->block_left = block_size - size;
+    return block;
+}
+
+// the fixed header may be spread over the first extents of the buffer
+static int MqttConnectCache_IsConnectPkt(const struct MqttBuffer *pkt)
+{
+    const struct MqttExtent *ext;
+    char head[5];
+    uint32_t i, len = 0;
+
+    for(ext = pkt->first_ext; ext && (len < sizeof(head)); ext = ext->next) {
+        for(i = 0; (i < ext->len) && (len < sizeof(head)); ++i) {
+            head[len++] = ext->payload[i];
+        }
+    }
+
+    return MqttConnectCache_IsConnect(head, len, pkt->buffered_bytes);
+}
+
+static void MqttConnectCache_Copy(char *data, const struct MqttBuffer *pkt)
+{
+    const struct MqttExtent *ext;
+
+    for(ext = pkt->first_ext; ext; ext = ext->next) {
+        memcpy(data, ext->payload, ext->len);
+        data += ext->len;
+    }
+}
+
+static struct MqttConnectEntry *MqttConnectCache_NewEntry(struct MqttConnectCache *cache)
+{
+    struct MqttConnectEntry *entries;
+
+    if(cache->count == cache->capacity) {
+        const uint32_t capacity = cache->capacity ? cache->capacity * 2 : 64;
+        entries = (struct MqttConnectEntry*)realloc(cache->entries, capacity * sizeof(*entries));
+        if(!entries) {
+            return NULL;
+        }
+        cache->memory += (uint64_t)(capacity - cache->capacity) * sizeof(*entries);
+        cache->entries = entries;
+        cache->capacity = capacity;
+    }
+
+    entries = cache->entries + cache->count;
+    memset(entries, 0, sizeof(*entries));
+    return entries;
+}
+
+void MqttConnectCache_Init(struct MqttConnectCache *cache)
+{
+    memset(cache, 0, sizeof(*cache));
+}
+
+void MqttConnectCache_Destroy(struct MqttConnectCache *cache)
+{
+    uint32_t i;
+
+    for(i = 0; i < cache->block_count; ++i) {
+        free(cache->blocks[i]);
+    }
+    free(cache->blocks);
+    free(cache->entries);
+    memset(cache, 0, sizeof(*cache));
+}
+
+int MqttConnectCache_Put(struct MqttConnectCache *cache, const struct MqttBuffer *pkt,
+                         uint32_t *index)
+{
+    struct MqttConnectEntry *entry;
+
+    if(!MqttConnectCache_IsConnectPkt(pkt)) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    entry = MqttConnectCache_NewEntry(cache);
+    if(entry) {
+        entry->data = MqttConnectCache_Alloc(cache, pkt->buffered_bytes);
+    }
+    if(!entry || !entry->data) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    MqttConnectCache_Copy(entry->data, pkt);
+    entry->size = entry->capacity = pkt->buffered_bytes;
+    cache->bytes += entry->size;
+    *index = cache->count++;
+    return MQTTERR_NOERROR;
+}
+
+int MqttConnectCache_Update(struct MqttConnectCache *cache, uint32_t index,
+                            const struct MqttBuffer *pkt)
+{
+    struct MqttConnectEntry *entry;
+    char *data;
+
+    if((index >= cache->count) || !MqttConnectCache_IsConnectPkt(pkt)) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    // a longer packet moves to new space, the old bytes stay unused until the cache is destroyed
+    entry = cache->entries + index;
+    data = entry->data;
+    if(pkt->buffered_bytes > entry->capacity) {
+        data = MqttConnectCache_Alloc(cache, pkt->buffered_bytes);
+        if(!data) {
+            return MQTTERR_OUTOFMEMORY;
+        }
+        entry->capacity = pkt->buffered_bytes;
+    }
+
+    MqttConnectCache_Copy(data, pkt);
+    cache->bytes += pkt->buffered_bytes;
+    cache->bytes -= entry->size;
+    entry->data = data;
+    entry->size = pkt->buffered_bytes;
+    return MQTTERR_NOERROR;
+}
+
+int MqttConnectCache_Get(const struct MqttConnectCache *cache, uint32_t index,
+                         const char **data, uint32_t *size)
+{
+    if(index >= cache->count) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    *data = cache->entries[index].data;
+    *size = cache->entries[index].size;
+    return MQTTERR_NOERROR;
+}
+
+int MqttConnectCache_Append(const struct MqttConnectCache *cache, uint32_t index,
+                            struct MqttBuffer *buf)
+{
+    if(index >= cache->count) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    return MqttBuffer_Append(buf, cache->entries[index].data, cache->entries[index].size, 0);
+}
+
+int MqttConnectCache_Send(const struct MqttConnectCache *cache, uint32_t index,
+                          struct MqttContext *ctx)
+{
+    struct MqttBuffer buf[1];
+    struct MqttExtent ext;
+
+    if(index >= cache->count) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    // a buffer on the stack around the cached bytes, nothing is allocated
+    ext.payload = cache->entries[index].data;
+    ext.len = cache->entries[index].size;
+    ext.next = NULL;
+    MqttBuffer_Init(buf);
+    MqttBuffer_AppendExtent(buf, &ext);
+
+    return Mqtt_SendPkt(ctx, buf, 0);
+}
+
+// the file holds the passwords, on POSIX only the owner may read it whatever the umask
+static FILE *MqttConnectCache_Create(const char *path)
+{
+#ifdef WIN32
+    return fopen(path, "wb");
+#else
+    FILE *fp;
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if(fd < 0) {
+        return NULL;
+    }
+
+    // an existing file keeps its mode through O_CREAT
+    if(fchmod(fd, 0600) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    fp = fdopen(fd, "wb");
+    if(!fp) {
+        close(fd);
+    }
+    return fp;
+#endif
+}
+
+int MqttConnectCache_Save(const struct MqttConnectCache *cache, const char *path)
+{
+    unsigned char head[8];
+    uint32_t i;
+    int ok;
+    FILE *fp;
+
+    fp = MqttConnectCache_Create(path);
+    if(!fp) {
+        return MQTTERR_IO;
+    }
+
+    memcpy(head, mqtt_connect_cache_magic, 4);
+    MqttConnectCache_WB32(cache->count, head + 4);
+    ok = 1 == fwrite(head, sizeof(head), 1, fp);
+
+    for(i = 0; ok && (i < cache->count); ++i) {
+        MqttConnectCache_WB32(cache->entries[i].size, head);
+        ok = (1 == fwrite(head, 4, 1, fp)) &&
+            (1 == fwrite(cache->entries[i].data, cache->entries[i].size, 1, fp));
+    }
+
+    ok = (0 == fclose(fp)) && ok;
+    return ok ? MQTTERR_NOERROR : MQTTERR_IO;
+}
+
+int MqttConnectCache_Load(struct MqttConnectCache *cache, const char *path)
+{
+    struct MqttConnectEntry *entry;
+    unsigned char head[8];
+    uint32_t i, count = 0, size;
+    int err = MQTTERR_NOERROR;
+    FILE *fp;
+
+    if(cache->count || cache->block_count) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    fp = fopen(path, "rb");
+    if(!fp) {
+        return MQTTERR_IO;
+    }
+
+    if(1 != fread(head, sizeof(head), 1, fp)) {
+        err = MQTTERR_IO;
+    }
+    else if(memcmp(head, mqtt_connect_cache_magic, 4)) {
+        err = MQTTERR_ILLEGAL_PKT;
+    }
+    else {
+        count = MqttConnectCache_RB32(head + 4);
+    }
+
+    for(i = 0; (MQTTERR_NOERROR == err) && (i < count); ++i) {
+        if(1 != fread(head, 4, 1, fp)) {
+            err = MQTTERR_IO;
+            break;
+        }
+
+        // a CONNECT is at most a few strings of 64KB, anything larger is not one
+        size = MqttConnectCache_RB32(head);
+        if((size < 2) || (size > 8 * 65536)) {
+            err = MQTTERR_ILLEGAL_PKT;
+            break;
+        }
+
+        entry = MqttConnectCache_NewEntry(cache);
+        if(entry) {
+            entry->data = MqttConnectCache_Alloc(cache, size);
+        }
+        if(!entry || !entry->data) {
+            err = MQTTERR_OUTOFMEMORY;
+            break;
+        }
+
+        if(1 != fread(entry->data, size, 1, fp)) {
+            err = MQTTERR_IO;
+        }
+        else if(!MqttConnectCache_IsConnect(entry->data, size, size)) {
+            err = MQTTERR_ILLEGAL_PKT;
+        }
+        else {
+            entry->size = entry->capacity = size;
+            cache->bytes += size;
+            ++cache->count;
+        }
+    }
+
+    fclose(fp);
+    if(MQTTERR_NOERROR != err) {
+        MqttConnectCache_Destroy(cache);
+    }
+    return err;
+}
@@ -0,0 +1,403 @@
+#include "mqtt/mqtt_dp_aggregator.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#define MQTT_DP_AGGREGATOR_DEFAULT_BYTES 4096
+// "yyyy-mm-dd hh:mm:ss.mmm", the same format as Mqtt_AppendDP*
+#define MQTT_DP_TIME_SIZE 23
+#define MQTT_DP_VALUE_SIZE 320
+
+static int64_t MqttDpAggregator_WallClockMs(void)
+{
+#ifdef WIN32
+    FILETIME ft;
+    ULARGE_INTEGER t;
+    GetSystemTimeAsFileTime(&ft);
+    t.LowPart = ft.dwLowDateTime;
+    t.HighPart = ft.dwHighDateTime;
+    // 100ns ticks since 1601-01-01
+    return (int64_t)(t.QuadPart / 10000) - 11644473600000LL;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+// the date and time are formatted once per second, most points share the second
+static int MqttDpAggregator_FormatTime(struct MqttDpAggregator *agg, int64_t ts, char *out)
+{
+    const int64_t second = ts / 1000;
+    time_t tt = (time_t)second;
+    struct tm t;
+
+    if(second != agg->cached_second) {
+#ifdef WIN32
+        if(0 != gmtime_s(&t, &tt)) {
+            return MQTTERR_INTERNAL;
+        }
+#else
+        if(!gmtime_r(&tt, &t)) {
+            return MQTTERR_INTERNAL;
+        }
+#endif
+        if(0 == strftime(agg->cached_time, sizeof(agg->cached_time), "%Y-%m-%d %H:%M:%S", &t)) {
+            return MQTTERR_INTERNAL;
+        }
+        agg->cached_second = second;
+    }
+
+    memcpy(out, agg->cached_time, 19);
+    out[19] = '.';
+    out[20] = (char)('0' + ts % 1000 / 100);
+    out[21] = (char)('0' + ts % 100 / 10);
+    out[22] = (char)('0' + ts % 10);
+    return MQTTERR_NOERROR;
+}
+
+static uint32_t MqttDpAggregator_EscapedLength(const char *str, size_t len)
+{
+    uint32_t bytes = 0;
+    size_t i;
+
+    for(i = 0; i < len; ++i) {
+        if(('\"' == str[i]) || ('\\' == str[i])) {
+            bytes += 2;
+        }
+        else if((uint8_t)str[i] < 0x20) {
+            bytes += 6;
+        }
+        else {
+            bytes += 1;
+        }
+    }
+
+    return bytes;
+}
+
+static char *MqttDpAggregator_WriteEscaped(char *cursor, const char *str, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t i;
+
+    for(i = 0; i < len; ++i) {
+        if(('\"' == str[i]) || ('\\' == str[i])) {
+            *(cursor++) = '\\';
+            *(cursor++) = str[i];
+        }
+        else if((uint8_t)str[i] < 0x20) {
+            memcpy(cursor, "\\u00", 4);
+            cursor[4] = hex[(uint8_t)str[i] >> 4];
+            cursor[5] = hex[(uint8_t)str[i] & 0x0F];
+            cursor += 6;
+        }
+        else {
+            *(cursor++) = str[i];
+        }
+    }
+
+    return cursor;
+}
+
+static int MqttDpAggregator_Reserve(char **data, uint32_t *capacity, uint32_t bytes)
+{
+    uint32_t size = *capacity ? *capacity : 256;
+    char *tmp;
+
+    if(bytes <= *capacity) {
+        return MQTTERR_NOERROR;
+    }
+
+    while(size < bytes) {
+        size *= 2;
+    }
+
+    tmp = (char*)realloc(*data, size);
+    if(!tmp) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    *data = tmp;
+    *capacity = size;
+    return MQTTERR_NOERROR;
+}
+
+static struct MqttDpStream *MqttDpAggregator_FindStream(struct MqttDpAggregator *agg,
+                                                        const char *dsid, uint32_t dsid_len)
+{
+    struct MqttDpStream *stream, *streams;
+    uint32_t i, capacity;
+
+    // a device reports a handful of streams, a scan beats hashing here
+    for(i = 0; i < agg->stream_count; ++i) {
+        stream = agg->streams + i;
+        if((stream->dsid_len == dsid_len) && (0 == memcmp(stream->dsid, dsid, dsid_len))) {
+            return stream;
+        }
+    }
+
+    if(agg->stream_count == agg->stream_capacity) {
+        capacity = agg->stream_capacity ? agg->stream_capacity * 2 : 8;
+        streams = (struct MqttDpStream*)realloc(agg->streams,
+                                                capacity * sizeof(struct MqttDpStream));
+        if(!streams) {
+            return NULL;
+        }
+        agg->streams = streams;
+        agg->stream_capacity = capacity;
+    }
+
+    stream = agg->streams + agg->stream_count;
+    memset(stream, 0, sizeof(*stream));
+    stream->dsid = (char*)malloc(dsid_len);
+    if(!stream->dsid) {
+        return NULL;
+    }
+
+    memcpy(stream->dsid, dsid, dsid_len);
+    stream->dsid_len = dsid_len;
+    ++agg->stream_count;
+    return stream;
+}
+
+void MqttDpAggregator_Init(struct MqttDpAggregator *agg, uint32_t max_bytes,
+                           uint32_t max_delay_ms)
+{
+    memset(agg, 0, sizeof(*agg));
+    agg->max_bytes = max_bytes ? max_bytes : MQTT_DP_AGGREGATOR_DEFAULT_BYTES;
+    agg->max_delay_ms = max_delay_ms;
+    agg->qos = MQTT_QOS_LEVEL0;
+    agg->next_pkt_id = 1;
+    agg->cached_second = -1;
+    MqttBuffer_Init(&agg->buf);
+}
+
+void MqttDpAggregator_Destroy(struct MqttDpAggregator *agg)
+{
+    uint32_t i;
+
+    for(i = 0; i < agg->stream_count; ++i) {
+        free(agg->streams[i].dsid);
+        free(agg->streams[i].data);
+    }
+
+    free(agg->streams);
+    free(agg->scratch);
+    MqttBuffer_Destroy(&agg->buf);
+    memset(agg, 0, sizeof(*agg));
+}
+
+// packs every pending point into one $dp packet and hands it to flush_func,
+// reason counts the flushes that got as far as flush_func
+static int MqttDpAggregator_Send(struct MqttDpAggregator *agg, uint64_t *reason)
+{
+    struct MqttDpStream *stream;
+    char *cursor;
+    uint32_t i;
+    uint16_t pkt_id = agg->next_pkt_id;
+    int err, active = 0;
+
+    if(!agg->flush_func) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    // QoS1/QoS2 ids come from the application's allocator, QoS0 never puts one on the wire
+    if((MQTT_QOS_LEVEL0 != agg->qos) && agg->alloc_pkt_id) {
+        pkt_id = agg->alloc_pkt_id(agg->flush_func_arg);
+        if(0 == pkt_id) {
+            return MQTTERR_QUOTA_EXCEEDED;
+        }
+    }
+
+    err = MqttDpAggregator_Reserve(&agg->scratch, &agg->scratch_capacity, agg->pending_bytes);
+    if(err < 0) {
+        return err;
+    }
+
+    cursor = agg->scratch;
+    *(cursor++) = MQTT_DPTYPE_TRIPLE;
+    *(cursor++) = '{';
+    for(i = 0; i < agg->stream_count; ++i) {
+        stream = agg->streams + i;
+        if(0 == stream->points) {
+            continue;
+        }
+
+        if(active++) {
+            *(cursor++) = ',';
+        }
+        *(cursor++) = '\"';
+        memcpy(cursor, stream->dsid, stream->dsid_len);
+        cursor += stream->dsid_len;
+        memcpy(cursor, "\":{", 3);
+        cursor += 3;
+        memcpy(cursor, stream->data, stream->len);
+        cursor += stream->len;
+        *(cursor++) = '}';
+    }
+    *(cursor++) = '}';
+
+    err = Mqtt_PackPublishPkt(&agg->buf, pkt_id, "$dp", agg->scratch,
+                              (uint32_t)(cursor - agg->scratch), agg->qos, 0, 1);
+    if(err < 0) {
+        MqttBuffer_Reset(&agg->buf);
+        return err;
+    }
+
+    if((MQTT_QOS_LEVEL0 == agg->qos) || !agg->alloc_pkt_id) {
+        agg->next_pkt_id = (uint16_t)(agg->next_pkt_id % 0xFFFF + 1);
+    }
+    err = agg->flush_func(agg->flush_func_arg, MQTT_QOS_LEVEL0 == agg->qos ? 0 : pkt_id,
+                          &agg->buf);
+    MqttBuffer_Reset(&agg->buf);
+
+    // the points are gone either way, a failed flush_func usually means a lost connection
+    for(i = 0; i < agg->stream_count; ++i) {
+        agg->streams[i].points = 0;
+        agg->streams[i].len = 0;
+    }
+
+    if(reason) {
+        ++*reason;
+    }
+    agg->flushed_points += agg->pending_points;
+    ++agg->flushed_pkts;
+    agg->last_batch = agg->pending_points;
+    agg->pending_points = 0;
+    agg->pending_bytes = 0;
+    agg->active_streams = 0;
+
+    return err < 0 ? err : MQTTERR_NOERROR;
+}
+
+static int MqttDpAggregator_Add(struct MqttDpAggregator *agg, const char *dsid, int64_t ts,
+                                const char *value, size_t value_len, int str, int64_t now)
+{
+    struct MqttDpStream *stream;
+    uint32_t dsid_len, point_len, extra;
+    char *cursor;
+    int err;
+
+    if(!dsid || (0 == (dsid_len = (uint32_t)strlen(dsid)))) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    stream = MqttDpAggregator_FindStream(agg, dsid, dsid_len);
+    if(!stream) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    if(ts <= 0) {
+        ts = MqttDpAggregator_WallClockMs();
+    }
+
+    // "time":value, a string value is quoted and escaped
+    point_len = MQTT_DP_TIME_SIZE + 3 +
+        (str ? MqttDpAggregator_EscapedLength(value, value_len) + 2 : (uint32_t)value_len);
+
+    // the type byte and the braces come with the first point of a packet,
+    // "dsid":{} with the first point of a stream
+    extra = point_len + (stream->points ? 1 : dsid_len + 5 + (agg->active_streams ? 1 : 0)) +
+        (agg->pending_points ? 0 : 3);
+    if(agg->pending_points && (agg->pending_bytes + extra > agg->max_bytes)) {
+        err = MqttDpAggregator_Send(agg, &agg->size_flushes);
+        if(err < 0) {
+            return err;
+        }
+        extra = point_len + dsid_len + 5 + 3;
+    }
+
+    err = MqttDpAggregator_Reserve(&stream->data, &stream->capacity,
+                                   stream->len + point_len + 1);
+    if(err < 0) {
+        return err;
+    }
+
+    cursor = stream->data + stream->len;
+    if(stream->points) {
+        *(cursor++) = ',';
+    }
+    *(cursor++) = '\"';
+    err = MqttDpAggregator_FormatTime(agg, ts, cursor);
+    if(err < 0) {
+        return err;
+    }
+    cursor += MQTT_DP_TIME_SIZE;
+    *(cursor++) = '\"';
+    *(cursor++) = ':';
+    if(str) {
+        *(cursor++) = '\"';
+        cursor = MqttDpAggregator_WriteEscaped(cursor, value, value_len);
+        *(cursor++) = '\"';
+    }
+    else {
+        memcpy(cursor, value, value_len);
+        cursor += value_len;
+    }
+    stream->len = (uint32_t)(cursor - stream->data);
+
+    if(0 == stream->points++) {
+        ++agg->active_streams;
+    }
+    if(0 == agg->pending_points++) {
+        agg->first_pending = now;
+    }
+    agg->pending_bytes += extra;
+
+    return MQTTERR_NOERROR;
+}
+
+int MqttDpAggregator_AddInt(struct MqttDpAggregator *agg, const char *dsid, int64_t ts,
+                            int value, int64_t now)
+{
+    char intbuf[MQTT_DP_VALUE_SIZE];
+    const int bytes = snprintf(intbuf, sizeof(intbuf), "%d", value);
+    return MqttDpAggregator_Add(agg, dsid, ts, intbuf, (size_t)bytes, 0, now);
+}
+
+int MqttDpAggregator_AddDouble(struct MqttDpAggregator *agg, const char *dsid, int64_t ts,
+                               double value, int64_t now)
+{
+    char dblbuf[MQTT_DP_VALUE_SIZE];
+    const int bytes = snprintf(dblbuf, sizeof(dblbuf), "%lf", value);
+    return MqttDpAggregator_Add(agg, dsid, ts, dblbuf, (size_t)bytes, 0, now);
+}
+
+int MqttDpAggregator_AddString(struct MqttDpAggregator *agg, const char *dsid, int64_t ts,
+                               const char *value, int64_t now)
+{
+    if(!value) {
+        value = "";
+    }
+
+    return MqttDpAggregator_Add(agg, dsid, ts, value, strlen(value), 1, now);
+}
+
+int MqttDpAggregator_Flush(struct MqttDpAggregator *agg, int64_t now, int force)
+{
+    if(0 == agg->pending_points) {
+        return MQTTERR_NOERROR;
+    }
+
+    if(!force && (now < MqttDpAggregator_Deadline(agg))) {
+        return MQTTERR_NOERROR;
+    }
+
+    return MqttDpAggregator_Send(agg, force ? NULL : &agg->deadline_flushes);
+}
+
+int64_t MqttDpAggregator_Deadline(const struct MqttDpAggregator *agg)
+{
+    if(0 == agg->pending_points) {
+        return -1;
+    }
+
+    return agg->first_pending + agg->max_delay_ms;
+}
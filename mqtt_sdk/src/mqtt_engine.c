@@ -0,0 +1,778 @@
+#include "mqtt/mqtt_engine.h"
+#include "mqtt/mqtt_metrics.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define MQTT_ENGINE_MAX_EVENTS 256
+// at most reads per readiness event, keeps one busy connection from starving the others
+#define MQTT_ENGINE_MAX_READS 16
+
+static int64_t MqttEngine_Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int MqttEngine_WouldBlock(int err)
+{
+    return (EAGAIN == err) || (EWOULDBLOCK == err) || (EINTR == err);
+}
+
+static int MqttEngine_UpdateEvents(struct MqttConnection *conn, uint32_t events)
+{
+    struct epoll_event evt;
+
+    if(conn->events == events) {
+        return MQTTERR_NOERROR;
+    }
+
+    evt.events = events;
+    evt.data.ptr = conn;
+    if(epoll_ctl(conn->engine->epfd, EPOLL_CTL_MOD, conn->fd, &evt) < 0) {
+        return MQTTERR_IO;
+    }
+
+    conn->events = events;
+    return MQTTERR_NOERROR;
+}
+
+static int MqttEngine_Read(void *arg, void *buf, uint32_t count)
+{
+    struct MqttConnection *conn = (struct MqttConnection*)arg;
+    ssize_t bytes = recv(conn->fd, buf, count, 0);
+
+    if(bytes > 0) {
+        conn->ping_sent = 0; // any inbound data proves the connection is alive
+    }
+    else if((bytes < 0) && MqttEngine_WouldBlock(errno)) {
+        conn->read_blocked = 1;
+    }
+
+    return (int)bytes;
+}
+
+static int MqttEngine_Pend(struct MqttConnection *conn, const struct iovec *iov,
+                           int iovcnt, uint32_t skip)
+{
+    int i;
+
+    for(i = 0; i < iovcnt; ++i) {
+        if(skip >= iov[i].iov_len) {
+            skip -= (uint32_t)iov[i].iov_len;
+            continue;
+        }
+
+        if(MqttBuffer_Append(conn->pending, (char*)iov[i].iov_base + skip,
+                             (uint32_t)iov[i].iov_len - skip, 1) != MQTTERR_NOERROR) {
+            return MQTTERR_OUTOFMEMORY;
+        }
+        skip = 0;
+    }
+
+    return MqttEngine_UpdateEvents(conn, EPOLLIN | EPOLLOUT);
+}
+
+static int MqttEngine_Writev(void *arg, const struct iovec *iov, int iovcnt)
+{
+    struct MqttConnection *conn = (struct MqttConnection*)arg;
+    struct msghdr msg;
+    uint32_t total = 0;
+    ssize_t bytes = 0;
+    int i;
+
+    if(conn->closed) {
+        return -1;
+    }
+
+    if(conn->keep_alive && !MqttTimer_IsActive(&conn->keep_alive_timer)) {
+        MqttTimer_Start(conn->engine->timers, &conn->keep_alive_timer,
+                        conn->engine->now + (int64_t)conn->keep_alive * 1000);
+    }
+
+    for(i = 0; i < iovcnt; ++i) {
+        total += (uint32_t)iov[i].iov_len;
+    }
+
+    // keep the packet order, nothing goes to the socket before the pending data
+    if(0 == conn->pending->buffered_bytes) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = (struct iovec*)iov;
+        msg.msg_iovlen = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+
+        bytes = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if(bytes < 0) {
+            if(!MqttEngine_WouldBlock(errno)) {
+                return -1;
+            }
+            bytes = 0;
+        }
+        else if(bytes > 0) {
+            conn->last_send = conn->engine->now;
+        }
+    }
+
+    if((uint32_t)bytes < total) {
+        if(conn->max_pending_bytes &&
+           (conn->pending->buffered_bytes + total - bytes > conn->max_pending_bytes)) {
+            errno = ENOBUFS;
+            return -1;
+        }
+
+        if(MqttEngine_Pend(conn, iov, iovcnt, (uint32_t)bytes) != MQTTERR_NOERROR) {
+            return -1;
+        }
+    }
+
+    return (int)total;
+}
+
+static int MqttEngine_Flush(struct MqttConnection *conn)
+{
+    struct iovec iov[64];
+    struct msghdr msg;
+    const struct MqttExtent *cursor;
+    uint32_t skip;
+    ssize_t bytes;
+    int count;
+
+    while(conn->sended_bytes < conn->pending->buffered_bytes) {
+        skip = conn->sended_bytes;
+        for(cursor = conn->pending->first_ext; cursor && skip >= cursor->len;
+            cursor = cursor->next) {
+            skip -= cursor->len;
+        }
+
+        for(count = 0; cursor && count < 64; cursor = cursor->next, ++count) {
+            iov[count].iov_base = cursor->payload + skip;
+            iov[count].iov_len = cursor->len - skip;
+            skip = 0;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        bytes = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if(bytes < 0) {
+            return MqttEngine_WouldBlock(errno) ? MQTTERR_NOERROR : MQTTERR_IO;
+        }
+
+        conn->sended_bytes += (uint32_t)bytes;
+        conn->last_send = conn->engine->now;
+    }
+
+    MqttBuffer_Reset(conn->pending);
+    conn->sended_bytes = 0;
+    return MqttEngine_UpdateEvents(conn, EPOLLIN);
+}
+
+static void MqttEngine_HandleInput(struct MqttConnection *conn)
+{
+    struct MqttContext *ctx = conn->ctx;
+    int i, err;
+
+    for(i = 0; (i < MQTT_ENGINE_MAX_READS) && !conn->closed; ++i) {
+        if(ctx->pos == ctx->end) {
+            MqttEngine_CloseConnection(conn, MQTTERR_BUF_OVERFLOW);
+            return;
+        }
+
+        conn->read_blocked = 0;
+        err = Mqtt_RecvPkt(ctx);
+        if(MQTTERR_NOERROR == err) {
+            continue;
+        }
+
+        if((MQTTERR_IO == err) && conn->read_blocked) {
+            return;
+        }
+
+        MqttEngine_CloseConnection(conn, err);
+        return;
+    }
+}
+
+// one timer per connection: idle deadline, then PINGRESP deadline once a ping is out
+static void MqttEngine_HandleKeepAlive(void *arg, struct MqttTimer *timer)
+{
+    struct MqttConnection *conn = (struct MqttConnection*)arg;
+    struct MqttEngine *engine = conn->engine;
+    const int64_t interval = (int64_t)conn->keep_alive * 1000;
+    const int64_t now = engine->now;
+    struct MqttBuffer ping[1];
+    int err;
+
+    if(0 == interval) {
+        return; // armed again by the next send once keep_alive is set
+    }
+
+    if(conn->ping_sent) {
+        if(now - conn->ping_sent >= interval) {
+            MqttEngine_CloseConnection(conn, MQTTERR_TIMEOUT);
+        }
+        else {
+            MqttTimer_Start(engine->timers, timer, conn->ping_sent + interval);
+        }
+        return;
+    }
+
+    // sends do not touch the timer, it is only pushed back when it fires early
+    if(now - conn->last_send < interval) {
+        MqttTimer_Start(engine->timers, timer, conn->last_send + interval);
+        return;
+    }
+
+    MqttBuffer_Init(ping);
+    err = Mqtt_PackPingReqPkt(ping);
+    if(MQTTERR_NOERROR == err) {
+        err = MqttEngine_SendPkt(conn, ping);
+    }
+    MqttBuffer_Destroy(ping);
+
+    if(MQTTERR_NOERROR != err) {
+        MqttEngine_CloseConnection(conn, err);
+        return;
+    }
+
+    conn->ping_sent = now;
+    MqttTimer_Start(engine->timers, timer, now + interval);
+}
+
+static void MqttEngine_HandleRetry(void *arg, struct MqttTimer *timer)
+{
+    struct MqttInflight *inflight = (struct MqttInflight*)arg;
+    struct MqttConnection *conn = inflight->conn;
+    int err;
+
+    if(conn->max_retries && (inflight->retries >= conn->max_retries)) {
+        MqttEngine_CloseConnection(conn, MQTTERR_TIMEOUT);
+        return;
+    }
+
+    ++inflight->retries;
+    Mqtt_SetPktDup(inflight->buf);
+    err = MqttEngine_SendPkt(conn, inflight->buf);
+    if(MQTTERR_NOERROR != err) {
+        MqttEngine_CloseConnection(conn, err);
+        return;
+    }
+
+    if(conn->retry_interval) {
+        MqttTimer_Start(conn->engine->timers, timer,
+                        conn->engine->now + (int64_t)conn->retry_interval * 1000);
+    }
+}
+
+static void MqttEngine_FlushQueue(struct MqttConnection *conn, int force)
+{
+    struct MqttEngine *engine = conn->engine;
+    int64_t deadline;
+
+    if(MqttSendQueue_Flush(conn->sendq, conn->ctx, engine->now, force) != MQTTERR_NOERROR) {
+        MqttEngine_CloseConnection(conn, MQTTERR_IO);
+        return;
+    }
+
+    // whatever is left is corked, writev_func never refuses data
+    deadline = MqttSendQueue_Deadline(conn->sendq);
+    if(deadline >= 0) {
+        MqttTimer_Start(engine->timers, &conn->cork_timer, deadline);
+    }
+    else {
+        MqttTimer_Stop(engine->timers, &conn->cork_timer);
+    }
+}
+
+static void MqttEngine_HandleCork(void *arg, struct MqttTimer *timer)
+{
+    (void)timer;
+    MqttEngine_FlushQueue((struct MqttConnection*)arg, 1);
+}
+
+// must run before the closed connections are reaped, they may still be listed
+static void MqttEngine_FlushQueued(struct MqttEngine *engine)
+{
+    while(engine->queued) {
+        struct MqttConnection *conn = engine->queued;
+        engine->queued = conn->next_queued;
+        conn->queued = 0;
+
+        if(!conn->closed) {
+            MqttEngine_FlushQueue(conn, 0);
+        }
+    }
+}
+
+static void MqttEngine_FreeInflight(struct MqttInflight *inflight)
+{
+    MqttBuffer_Destroy(inflight->buf);
+    free(inflight);
+}
+
+static void MqttEngine_FreeConnection(struct MqttConnection *conn)
+{
+    while(conn->inflight) {
+        struct MqttInflight *inflight = conn->inflight;
+        conn->inflight = inflight->next;
+        MqttEngine_FreeInflight(inflight);
+    }
+
+    Mqtt_DestroyContext(conn->ctx);
+    MqttBuffer_Destroy(conn->pending);
+    MqttSendQueue_Destroy(conn->sendq);
+    free(conn);
+}
+
+static void MqttEngine_ReapClosed(struct MqttEngine *engine)
+{
+    while(engine->closed) {
+        struct MqttConnection *conn = engine->closed;
+        engine->closed = conn->next_closed;
+
+        if(conn->handle_close) {
+            conn->handle_close(conn->handle_close_arg, conn, conn->close_err);
+        }
+        MqttEngine_FreeConnection(conn);
+    }
+}
+
+int MqttEngine_Init(struct MqttEngine *engine, uint32_t max_conns)
+{
+    struct epoll_event evt;
+
+    memset(engine, 0, sizeof(*engine));
+    engine->epfd = -1;
+    engine->wakefd = -1;
+
+    engine->conns = (struct MqttConnection**)calloc(max_conns, sizeof(struct MqttConnection*));
+    engine->slot_gen = (uint32_t*)calloc(max_conns, sizeof(uint32_t));
+    engine->free_slots = (uint32_t*)malloc(sizeof(uint32_t) * max_conns);
+    engine->max_events = MQTT_ENGINE_MAX_EVENTS;
+    engine->events = malloc(sizeof(struct epoll_event) * engine->max_events);
+    if(!engine->conns || !engine->slot_gen || !engine->free_slots || !engine->events) {
+        MqttEngine_Destroy(engine);
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    engine->epfd = epoll_create1(EPOLL_CLOEXEC);
+    engine->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if((engine->epfd < 0) || (engine->wakefd < 0)) {
+        MqttEngine_Destroy(engine);
+        return MQTTERR_IO;
+    }
+
+    // the wakeup eventfd is the only descriptor registered without a connection
+    evt.events = EPOLLIN;
+    evt.data.ptr = NULL;
+    if(epoll_ctl(engine->epfd, EPOLL_CTL_ADD, engine->wakefd, &evt) < 0) {
+        MqttEngine_Destroy(engine);
+        return MQTTERR_IO;
+    }
+
+    engine->max_conns = max_conns;
+    engine->now = MqttEngine_Now();
+    MqttTimerWheel_Init(engine->timers, engine->now);
+    return MQTTERR_NOERROR;
+}
+
+void MqttEngine_Destroy(struct MqttEngine *engine)
+{
+    uint32_t i;
+
+    for(i = 0; i < engine->slot_count; ++i) {
+        if(engine->conns[i]) {
+            close(engine->conns[i]->fd);
+            MqttEngine_FreeConnection(engine->conns[i]);
+        }
+    }
+
+    while(engine->closed) {
+        struct MqttConnection *conn = engine->closed;
+        engine->closed = conn->next_closed;
+        MqttEngine_FreeConnection(conn);
+    }
+
+    if(engine->epfd >= 0) {
+        close(engine->epfd);
+    }
+
+    if(engine->wakefd >= 0) {
+        close(engine->wakefd);
+    }
+
+    free(engine->conns);
+    free(engine->slot_gen);
+    free(engine->free_slots);
+    free(engine->events);
+    memset(engine, 0, sizeof(*engine));
+    engine->epfd = -1;
+    engine->wakefd = -1;
+}
+
+int MqttEngine_AddConnection(struct MqttEngine *engine, int fd, uint32_t buf_size,
+                             struct MqttConnection **conn)
+{
+    struct MqttConnection *c;
+    struct epoll_event evt;
+    int flags, err;
+
+    if((fd < 0) || !conn) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    if(engine->conn_count == engine->max_conns) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    flags = fcntl(fd, F_GETFL, 0);
+    if((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+        return MQTTERR_IO;
+    }
+
+    c = (struct MqttConnection*)calloc(1, sizeof(*c));
+    if(!c) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    err = Mqtt_InitContext(c->ctx, buf_size);
+    if(MQTTERR_NOERROR != err) {
+        free(c);
+        return err;
+    }
+
+    c->fd = fd;
+    c->engine = engine;
+    c->ctx->read_func = MqttEngine_Read;
+    c->ctx->read_func_arg = c;
+    c->ctx->writev_func = MqttEngine_Writev;
+    c->ctx->writev_func_arg = c;
+    MqttBuffer_Init(c->pending);
+    MqttTimer_Init(&c->keep_alive_timer, MqttEngine_HandleKeepAlive, c);
+    MqttTimer_Init(&c->cork_timer, MqttEngine_HandleCork, c);
+    MqttSendQueue_Init(c->sendq);
+
+    c->events = EPOLLIN;
+    evt.events = c->events;
+    evt.data.ptr = c;
+    if(epoll_ctl(engine->epfd, EPOLL_CTL_ADD, fd, &evt) < 0) {
+        MqttEngine_FreeConnection(c);
+        return MQTTERR_IO;
+    }
+
+    // slots never move, so a slot plus its generation identifies a connection
+    c->slot = engine->free_count ? engine->free_slots[--engine->free_count] :
+        engine->slot_count++;
+    c->id = ((uint64_t)engine->slot_gen[c->slot] << 32) | c->slot;
+    engine->conns[c->slot] = c;
+    ++engine->conn_count;
+
+    engine->now = MqttEngine_Now();
+    c->last_send = engine->now;
+
+    *conn = c;
+    return MQTTERR_NOERROR;
+}
+
+int MqttEngine_Connect(struct MqttEngine *engine, const char *host, unsigned short port,
+                       uint32_t buf_size, struct MqttConnection **conn)
+{
+    struct addrinfo hints, *res, *ai;
+    char service[8];
+    int fd = -1;
+    int err, on = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%u", (unsigned)port);
+
+    if(0 != getaddrinfo(host, service, &hints, &res)) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    for(ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+        if(fd < 0) {
+            continue;
+        }
+
+        if((0 == connect(fd, ai->ai_addr, ai->ai_addrlen)) || (EINPROGRESS == errno)) {
+            break;
+        }
+
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if(fd < 0) {
+        return MQTTERR_IO;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    err = MqttEngine_AddConnection(engine, fd, buf_size, conn);
+    if(MQTTERR_NOERROR != err) {
+        close(fd);
+    }
+
+    return err;
+}
+
+void MqttEngine_CloseConnection(struct MqttConnection *conn, int err)
+{
+    struct MqttEngine *engine = conn->engine;
+    struct MqttInflight *inflight;
+
+    if(conn->closed) {
+        return;
+    }
+
+    conn->closed = 1;
+    conn->close_err = err;
+
+    MqttTimer_Stop(engine->timers, &conn->keep_alive_timer);
+    MqttTimer_Stop(engine->timers, &conn->cork_timer);
+    for(inflight = conn->inflight; inflight; inflight = inflight->next) {
+        MqttTimer_Stop(engine->timers, &inflight->timer);
+    }
+
+    epoll_ctl(engine->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+
+    engine->conns[conn->slot] = NULL;
+    ++engine->slot_gen[conn->slot];
+    engine->free_slots[engine->free_count++] = conn->slot;
+    --engine->conn_count;
+
+    // freed after the current batch of events, which may still refer to it
+    conn->next_closed = engine->closed;
+    engine->closed = conn;
+}
+
+struct MqttConnection *MqttEngine_FindConnection(struct MqttEngine *engine, uint64_t id)
+{
+    const uint32_t slot = (uint32_t)id;
+    struct MqttConnection *conn;
+
+    if(slot >= engine->slot_count) {
+        return NULL;
+    }
+
+    conn = engine->conns[slot];
+    return (conn && (conn->id == id)) ? conn : NULL;
+}
+
+int MqttEngine_SendPkt(struct MqttConnection *conn, const struct MqttBuffer *buf)
+{
+    int bytes;
+
+    if(conn->closed) {
+        return MQTTERR_IO;
+    }
+
+    if(conn->sendq->queued_bytes) {
+        MqttEngine_FlushQueue(conn, 1);
+        if(conn->closed) {
+            return MQTTERR_IO;
+        }
+    }
+
+    bytes = Mqtt_SendPkt(conn->ctx, buf, 0);
+    if(bytes < 0) {
+        return (MQTTERR_OUTOFMEMORY == bytes) ? bytes : MQTTERR_IO;
+    }
+
+    return MQTTERR_NOERROR;
+}
+
+int MqttEngine_QueuePkt(struct MqttConnection *conn, struct MqttBuffer *buf)
+{
+    struct MqttEngine *engine = conn->engine;
+    int err;
+
+    if(conn->closed) {
+        return MQTTERR_IO;
+    }
+
+    // queued packets reach writev_func without Mqtt_SendPkt, count them here
+    if(conn->ctx->metrics) {
+        MqttMetrics_CountOutgoing(conn->ctx->metrics, buf);
+    }
+
+    err = MqttSendQueue_Push(conn->sendq, buf, engine->now);
+    if(MQTTERR_NOERROR != err) {
+        return err;
+    }
+
+    if(!conn->queued) {
+        conn->queued = 1;
+        conn->next_queued = engine->queued;
+        engine->queued = conn;
+    }
+
+    return MQTTERR_NOERROR;
+}
+
+int MqttEngine_SendQosPkt(struct MqttConnection *conn, uint16_t pkt_id,
+                          struct MqttBuffer *buf)
+{
+    struct MqttInflight *inflight;
+    int err;
+
+    if((0 == pkt_id) || !buf->first_ext) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    inflight = (struct MqttInflight*)malloc(sizeof(*inflight));
+    if(!inflight) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    // the packet is kept for retries, taken over before sending so a copy can fail first
+    err = MqttBuffer_Move(inflight->buf, buf);
+    if(MQTTERR_NOERROR != err) {
+        free(inflight);
+        return err;
+    }
+
+    err = MqttEngine_SendPkt(conn, inflight->buf);
+    if(MQTTERR_NOERROR != err) {
+        MqttBuffer_Move(buf, inflight->buf);
+        free(inflight);
+        return err;
+    }
+
+    inflight->conn = conn;
+    inflight->pkt_id = pkt_id;
+    inflight->retries = 0;
+    inflight->next = conn->inflight;
+    conn->inflight = inflight;
+
+    MqttTimer_Init(&inflight->timer, MqttEngine_HandleRetry, inflight);
+    if(conn->retry_interval) {
+        MqttTimer_Start(conn->engine->timers, &inflight->timer,
+                        conn->engine->now + (int64_t)conn->retry_interval * 1000);
+    }
+
+    return MQTTERR_NOERROR;
+}
+
+int MqttEngine_AckPkt(struct MqttConnection *conn, uint16_t pkt_id)
+{
+    struct MqttInflight **link, *inflight;
+
+    for(link = &conn->inflight; *link; link = &(*link)->next) {
+        inflight = *link;
+        if(inflight->pkt_id == pkt_id) {
+            *link = inflight->next;
+            MqttTimer_Stop(conn->engine->timers, &inflight->timer);
+            MqttEngine_FreeInflight(inflight);
+            return MQTTERR_NOERROR;
+        }
+    }
+
+    return MQTTERR_INVALID_PARAMETER;
+}
+
+int MqttEngine_RunOnce(struct MqttEngine *engine, int timeout_ms)
+{
+    struct epoll_event *events = (struct epoll_event*)engine->events;
+    int64_t wait;
+    int count, n;
+
+    engine->now = MqttEngine_Now();
+    MqttTimerWheel_Advance(engine->timers, engine->now);
+    MqttEngine_FlushQueued(engine);
+    MqttEngine_ReapClosed(engine);
+
+    wait = MqttTimerWheel_NextTimeout(engine->timers);
+    if((wait >= 0) && ((timeout_ms < 0) || (wait < timeout_ms))) {
+        timeout_ms = (int)wait;
+    }
+
+    count = epoll_wait(engine->epfd, events, engine->max_events, timeout_ms);
+    if(count < 0) {
+        return (EINTR == errno) ? 0 : MQTTERR_IO;
+    }
+
+    engine->now = MqttEngine_Now();
+    for(n = 0; n < count; ++n) {
+        struct MqttConnection *conn = (struct MqttConnection*)events[n].data.ptr;
+        const uint32_t ev = events[n].events;
+
+        if(!conn) {
+            uint64_t value;
+            if(read(engine->wakefd, &value, sizeof(value)) < 0) {
+                // nothing to drain, another event already did it
+            }
+
+            if(engine->handle_wakeup) {
+                engine->handle_wakeup(engine->handle_wakeup_arg, engine);
+            }
+            continue;
+        }
+
+        if(!conn->closed && (ev & EPOLLOUT)) {
+            if(MqttEngine_Flush(conn) != MQTTERR_NOERROR) {
+                MqttEngine_CloseConnection(conn, MQTTERR_IO);
+            }
+        }
+
+        if(!conn->closed && (ev & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            MqttEngine_HandleInput(conn);
+        }
+    }
+
+    MqttEngine_FlushQueued(engine);
+    MqttEngine_ReapClosed(engine);
+    return count;
+}
+
+int MqttEngine_Run(struct MqttEngine *engine)
+{
+    engine->running = 1;
+    while(engine->running) {
+        if(MqttEngine_RunOnce(engine, -1) < 0) {
+            engine->running = 0;
+            return MQTTERR_IO;
+        }
+    }
+
+    return MQTTERR_NOERROR;
+}
+
+void MqttEngine_Stop(struct MqttEngine *engine)
+{
+    engine->running = 0;
+}
+
+void MqttEngine_Wakeup(struct MqttEngine *engine)
+{
+    const uint64_t one = 1;
+    if(write(engine->wakefd, &one, sizeof(one)) < 0) {
+        // the counter is saturated, the engine is going to wake up anyway
+    }
+}
@@ -0,0 +1,326 @@
+#include "mqtt/mqtt_metrics.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define MQTT_METRICS_DEFAULT_CALLBACK_INTERVAL 16
+
+// the members from pkts_in up to the pending table are all uint64_t counters
+#define MQTT_METRICS_COUNTERS_BEGIN offsetof(struct MqttMetrics, pkts_in)
+#define MQTT_METRICS_COUNTERS ((offsetof(struct MqttMetrics, pending) - \
+                                MQTT_METRICS_COUNTERS_BEGIN) / sizeof(uint64_t))
+
+struct MqttMetricsReader {
+    const struct MqttExtent *ext;
+    uint32_t offset;
+};
+
+static uint64_t MqttMetrics_Load(const uint64_t *counter)
+{
+#if defined(__GNUC__)
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+#else
+    return *(const volatile uint64_t*)counter;
+#endif
+}
+
+void MqttMetrics_Add(uint64_t *counter, uint64_t value)
+{
+#if defined(__GNUC__)
+    // there is a single writer, a relaxed load and store avoid a locked instruction
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+                     __ATOMIC_RELAXED);
+#else
+    *(volatile uint64_t*)counter += value;
+#endif
+}
+
+static void MqttMetrics_Store(uint64_t *counter, uint64_t value)
+{
+#if defined(__GNUC__)
+    __atomic_store_n(counter, value, __ATOMIC_RELAXED);
+#else
+    *(volatile uint64_t*)counter = value;
+#endif
+}
+
+void MqttMetrics_Init(struct MqttMetrics *metrics)
+{
+    memset(metrics, 0, sizeof(*metrics));
+    metrics->callback_interval = MQTT_METRICS_DEFAULT_CALLBACK_INTERVAL;
+}
+
+void MqttMetrics_Snapshot(const struct MqttMetrics *metrics, struct MqttMetrics *snapshot)
+{
+    const uint64_t *src = (const uint64_t*)((const char*)metrics + MQTT_METRICS_COUNTERS_BEGIN);
+    uint64_t *dst = (uint64_t*)((char*)snapshot + MQTT_METRICS_COUNTERS_BEGIN);
+    size_t i;
+
+    snapshot->callback_interval = metrics->callback_interval;
+    for(i = 0; i < MQTT_METRICS_COUNTERS; ++i) {
+        dst[i] = MqttMetrics_Load(src + i);
+    }
+
+    memset(snapshot->pending, 0, sizeof(snapshot->pending));
+    snapshot->callback_countdown = 0;
+}
+
+int64_t MqttMetrics_Now(void)
+{
+#ifdef WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (int64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static uint32_t MqttHistogram_Index(uint64_t value)
+{
+    uint32_t msb = 0;
+
+    if(value < MQTT_HISTOGRAM_SUB_BUCKETS) {
+        return (uint32_t)value;
+    }
+
+#if defined(__GNUC__)
+    msb = 63 - (uint32_t)__builtin_clzll(value);
+#else
+    while(value >> (msb + 1)) {
+        ++msb;
+    }
+#endif
+
+    return (msb - MQTT_HISTOGRAM_SUB_BITS + 1) * MQTT_HISTOGRAM_SUB_BUCKETS +
+        (uint32_t)((value >> (msb - MQTT_HISTOGRAM_SUB_BITS)) & (MQTT_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+void MqttHistogram_Record(struct MqttHistogram *hist, uint64_t value)
+{
+    MqttMetrics_Add(hist->buckets + MqttHistogram_Index(value), 1);
+    MqttMetrics_Add(&hist->count, 1);
+    MqttMetrics_Add(&hist->sum, value);
+    if(value > hist->max) {
+        MqttMetrics_Store(&hist->max, value);
+    }
+}
+
+uint64_t MqttHistogram_Percentile(const struct MqttHistogram *hist, double percent)
+{
+    uint64_t target, seen = 0;
+    uint64_t lower, width;
+    uint32_t i, group;
+
+    if(0 == hist->count) {
+        return 0;
+    }
+
+    target = (uint64_t)(hist->count * percent / 100.0 + 0.5);
+    if(target < 1) {
+        target = 1;
+    }
+
+    for(i = 0; i < MQTT_HISTOGRAM_BUCKETS; ++i) {
+        seen += hist->buckets[i];
+        if(seen >= target) {
+            break;
+        }
+    }
+
+    if(i >= MQTT_HISTOGRAM_BUCKETS) {
+        return hist->max;
+    }
+
+    if(i < MQTT_HISTOGRAM_SUB_BUCKETS) {
+        return i;
+    }
+
+    group = i / MQTT_HISTOGRAM_SUB_BUCKETS;
+    lower = (uint64_t)(MQTT_HISTOGRAM_SUB_BUCKETS + i % MQTT_HISTOGRAM_SUB_BUCKETS) << (group - 1);
+    width = (uint64_t)1 << (group - 1);
+
+    return lower + width / 2 < hist->max ? lower + width / 2 : hist->max;
+}
+
+void MqttMetrics_CountError(struct MqttMetrics *metrics, int err)
+{
+    if((err < 0) && (-err < MQTT_METRICS_ERRORS)) {
+        MqttMetrics_Add(metrics->errors - err, 1);
+    }
+
+    if(MQTTERR_BUF_OVERFLOW == err) {
+        MqttMetrics_Add(&metrics->buf_overflows, 1);
+    }
+}
+
+void MqttMetrics_CountAllocs(struct MqttMetrics *metrics, const struct MqttBuffer *buf)
+{
+    uint64_t count = buf->alloc_count;
+    uint32_t max_count;
+
+    // the table of chunks grows to 1, 3, 7, ... entries, one allocation per step
+    for(max_count = buf->alloc_max_count; max_count; max_count >>= 1) {
+        ++count;
+    }
+
+    MqttMetrics_Add(&metrics->allocs, count);
+}
+
+int MqttMetrics_CountIncoming(struct MqttMetrics *metrics, char type, const char *pkt,
+                              uint32_t size, uint32_t total)
+{
+    const uint8_t pkt_type = ((uint8_t)type) >> 4;
+    struct MqttMetricsPending *pending;
+    uint16_t pkt_id;
+    int timed = 0;
+
+    MqttMetrics_Add(metrics->pkts_in + pkt_type, 1);
+    MqttMetrics_Add(metrics->bytes_in + pkt_type, total);
+
+    // only every callback_interval-th packet pays for reading the clock twice
+    if(metrics->callback_countdown > 1) {
+        --metrics->callback_countdown;
+    }
+    else {
+        metrics->callback_countdown = metrics->callback_interval;
+        timed = 1;
+    }
+
+    if(((MQTT_PKT_PUBACK != pkt_type) && (MQTT_PKT_PUBCOMP != pkt_type) &&
+        (MQTT_PKT_SUBACK != pkt_type) && (MQTT_PKT_UNSUBACK != pkt_type)) || (size < 2)) {
+        return timed;
+    }
+
+    pkt_id = (uint16_t)((((uint8_t)pkt[0]) << 8) | (uint8_t)pkt[1]);
+    pending = metrics->pending + pkt_id % MQTT_METRICS_PENDING;
+    if(pending->sent && (pending->pkt_id == pkt_id) && (pending->ack_type == pkt_type)) {
+        MqttHistogram_Record(&metrics->ack_rtt, (uint64_t)(MqttMetrics_Now() - pending->sent));
+        pending->sent = 0;
+    }
+    else {
+        MqttMetrics_Add(&metrics->unmatched_acks, 1);
+    }
+
+    return timed;
+}
+
+static int MqttMetrics_ReadByte(struct MqttMetricsReader *reader, uint8_t *byte)
+{
+    while(reader->ext && (reader->offset >= reader->ext->len)) {
+        reader->ext = reader->ext->next;
+        reader->offset = 0;
+    }
+
+    if(!reader->ext) {
+        return -1;
+    }
+
+    *byte = (uint8_t)reader->ext->payload[reader->offset++];
+    return 0;
+}
+
+static int MqttMetrics_Read16(struct MqttMetricsReader *reader, uint16_t *value)
+{
+    uint8_t hi, lo;
+
+    if((MqttMetrics_ReadByte(reader, &hi) < 0) || (MqttMetrics_ReadByte(reader, &lo) < 0)) {
+        return -1;
+    }
+
+    *value = (uint16_t)((hi << 8) | lo);
+    return 0;
+}
+
+static void MqttMetrics_Skip(struct MqttMetricsReader *reader, uint32_t bytes)
+{
+    while(reader->ext && bytes) {
+        const uint32_t available = reader->ext->len - reader->offset;
+
+        if(bytes < available) {
+            reader->offset += bytes;
+            return;
+        }
+
+        bytes -= available;
+        reader->ext = reader->ext->next;
+        reader->offset = 0;
+    }
+}
+
+// remembers when a packet expecting an acknowledgement was first sent
+static void MqttMetrics_Track(struct MqttMetrics *metrics, uint16_t pkt_id, uint8_t ack_type)
+{
+    struct MqttMetricsPending *pending = metrics->pending + pkt_id % MQTT_METRICS_PENDING;
+
+    if(pending->sent && (pending->pkt_id == pkt_id) && (pending->ack_type == ack_type)) {
+        return;
+    }
+
+    pending->sent = MqttMetrics_Now();
+    pending->pkt_id = pkt_id;
+    pending->ack_type = ack_type;
+}
+
+void MqttMetrics_CountOutgoing(struct MqttMetrics *metrics, const struct MqttBuffer *buf)
+{
+    struct MqttMetricsReader reader;
+    uint8_t header, byte;
+    uint32_t remaining, multiplier, header_len, consumed;
+    uint16_t pkt_id, topic_len;
+
+    reader.ext = buf->first_ext;
+    reader.offset = 0;
+
+    // a buffer may hold several packets, e.g. when the send queue merged them
+    while(0 == MqttMetrics_ReadByte(&reader, &header)) {
+        remaining = 0;
+        multiplier = 1;
+        header_len = 1;
+        do {
+            if((MqttMetrics_ReadByte(&reader, &byte) < 0) || (header_len > 4)) {
+                return;
+            }
+            remaining += (byte & 0x7F) * multiplier;
+            multiplier *= 128;
+            ++header_len;
+        } while(byte & 0x80);
+
+        MqttMetrics_Add(metrics->pkts_out + (header >> 4), 1);
+        MqttMetrics_Add(metrics->bytes_out + (header >> 4), header_len + remaining);
+
+        consumed = 0;
+        if((MQTT_PKT_PUBLISH == (header >> 4)) && (header & 0x06)) {
+            if((MqttMetrics_Read16(&reader, &topic_len) < 0) ||
+               (remaining < 4u + topic_len)) {
+                return;
+            }
+            MqttMetrics_Skip(&reader, topic_len);
+            if(MqttMetrics_Read16(&reader, &pkt_id) < 0) {
+                return;
+            }
+            MqttMetrics_Track(metrics, pkt_id,
+                              (header & 0x04) ? MQTT_PKT_PUBCOMP : MQTT_PKT_PUBACK);
+            consumed = 4 + topic_len;
+        }
+        else if(((MQTT_PKT_SUBSCRIBE == (header >> 4)) ||
+                 (MQTT_PKT_UNSUBSCRIBE == (header >> 4))) && (remaining >= 2)) {
+            if(MqttMetrics_Read16(&reader, &pkt_id) < 0) {
+                return;
+            }
+            MqttMetrics_Track(metrics, pkt_id, (uint8_t)((header >> 4) + 1));
+            consumed = 2;
+        }
+
+        MqttMetrics_Skip(&reader, remaining - consumed);
+    }
+}
@@ -0,0 +1,337 @@
+#include "mqtt/mqtt_reconnect.h"
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t MqttReconnect_Random(struct MqttReconnect *rc)
+{
+    // xorshift32, only has to spread the devices, not to be unpredictable
+    uint32_t x = rc->rng;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    rc->rng = x;
+    return x;
+}
+
+static int MqttReconnect_Grow(struct MqttReconnect *rc)
+{
+    const uint32_t capacity = rc->capacity ? rc->capacity * 2 : 8;
+    struct MqttBuffer *pkts;
+    uint32_t i;
+
+    pkts = (struct MqttBuffer*)malloc(capacity * sizeof(struct MqttBuffer));
+    if(!pkts) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    for(i = 0; i < rc->queued_pkts; ++i) {
+        pkts[i] = rc->pkts[(rc->head + i) % rc->capacity];
+    }
+
+    free(rc->pkts);
+    rc->pkts = pkts;
+    rc->head = 0;
+    rc->capacity = capacity;
+    return MQTTERR_NOERROR;
+}
+
+static void MqttReconnect_DropOldest(struct MqttReconnect *rc)
+{
+    struct MqttBuffer *pkt = rc->pkts + rc->head;
+
+    rc->queued_bytes -= pkt->buffered_bytes;
+    MqttBuffer_Destroy(pkt);
+    rc->head = (rc->head + 1) % rc->capacity;
+    --rc->queued_pkts;
+    if(rc->replaying) {
+        --rc->replaying;
+    }
+}
+
+static int MqttReconnect_PushSubscribes(struct MqttReconnect *rc, struct MqttSendQueue *queue,
+                                        int64_t now)
+{
+    struct MqttBuffer buf[1];
+    uint32_t pkt_count;
+    int err;
+
+    MqttBuffer_Init(buf);
+    // all the SUBSCRIBE packets sit in one buffer and leave with the same writev
+    err = Mqtt_PackSubscribeBatch(buf, rc->sub_pkt_id, rc->topics, rc->topic_count,
+                                  rc->max_pkt_size, &pkt_count);
+    if(MQTTERR_NOERROR == err) {
+        err = MqttSendQueue_Push(queue, buf, now);
+    }
+    MqttBuffer_Destroy(buf);
+
+    if(MQTTERR_NOERROR == err) {
+        rc->subscribes_sent = 1;
+        ++rc->resubscribes;
+    }
+    return err;
+}
+
+// copies the queued publishes into one extent, they are kept until the server accepts the connection
+static int MqttReconnect_PushQueued(struct MqttReconnect *rc, struct MqttSendQueue *queue,
+                                    int64_t now)
+{
+    struct MqttBuffer buf[1];
+    struct MqttExtent *ext;
+    const struct MqttExtent *cursor;
+    uint32_t i, offset = 0;
+    int err;
+
+    MqttBuffer_Init(buf);
+    ext = MqttBuffer_AllocExtent(buf, rc->queued_bytes);
+    if(!ext) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    for(i = 0; i < rc->queued_pkts; ++i) {
+        cursor = rc->pkts[(rc->head + i) % rc->capacity].first_ext;
+        for(; cursor; cursor = cursor->next) {
+            memcpy(ext->payload + offset, cursor->payload, cursor->len);
+            offset += cursor->len;
+        }
+    }
+
+    MqttBuffer_AppendExtent(buf, ext);
+    err = MqttSendQueue_Push(queue, buf, now);
+    MqttBuffer_Destroy(buf);
+
+    if(MQTTERR_NOERROR == err) {
+        rc->replaying = rc->queued_pkts;
+    }
+    return err;
+}
+
+void MqttReconnect_Init(struct MqttReconnect *rc, uint32_t seed)
+{
+    memset(rc, 0, sizeof(*rc));
+    rc->min_backoff_ms = 1000;
+    rc->max_backoff_ms = 60000;
+    rc->max_queued_bytes = 256 * 1024;
+    rc->sub_pkt_id = 0xF000;
+    rc->rng = seed ? seed : 0x9E3779B9;
+    rc->state = MQTT_RECONNECT_WAITING;
+}
+
+void MqttReconnect_Destroy(struct MqttReconnect *rc)
+{
+    uint32_t i;
+
+    for(i = 0; i < rc->topic_count; ++i) {
+        free((char*)rc->topics[i].topic);
+    }
+    free(rc->topics);
+
+    while(rc->queued_pkts) {
+        MqttReconnect_DropOldest(rc);
+    }
+    free(rc->pkts);
+
+    memset(rc, 0, sizeof(*rc));
+}
+
+int MqttReconnect_AddTopic(struct MqttReconnect *rc, const char *topic, enum MqttQosLevel qos)
+{
+    struct MqttSubscribeTopic *topics;
+    size_t len;
+    uint32_t i;
+
+    len = topic ? strlen(topic) : 0;
+    if((0 == len) || (len > 0xFFFF) || ((int)qos < MQTT_QOS_LEVEL0) || (qos > MQTT_QOS_LEVEL2)) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    for(i = 0; i < rc->topic_count; ++i) {
+        if((rc->topics[i].len == len) && (0 == memcmp(rc->topics[i].topic, topic, len))) {
+            rc->topics[i].qos = qos;
+            return MQTTERR_NOERROR;
+        }
+    }
+
+    if(rc->topic_count == rc->topic_capacity) {
+        const uint32_t capacity = rc->topic_capacity ? rc->topic_capacity * 2 : 8;
+        topics = (struct MqttSubscribeTopic*)realloc(rc->topics, capacity * sizeof(*topics));
+        if(!topics) {
+            return MQTTERR_OUTOFMEMORY;
+        }
+        rc->topics = topics;
+        rc->topic_capacity = capacity;
+    }
+
+    topics = rc->topics + rc->topic_count;
+    topics->topic = (const char*)malloc(len + 1);
+    if(!topics->topic) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+    memcpy((char*)topics->topic, topic, len + 1);
+    topics->len = (uint16_t)len;
+    topics->qos = qos;
+    ++rc->topic_count;
+
+    return MQTTERR_NOERROR;
+}
+
+int MqttReconnect_RemoveTopic(struct MqttReconnect *rc, const char *topic)
+{
+    uint32_t i;
+
+    for(i = 0; i < rc->topic_count; ++i) {
+        if(0 == strcmp(rc->topics[i].topic, topic)) {
+            free((char*)rc->topics[i].topic);
+            // keeps the order, the filters go out as they were added
+            memmove(rc->topics + i, rc->topics + i + 1,
+                    (rc->topic_count - i - 1) * sizeof(struct MqttSubscribeTopic));
+            --rc->topic_count;
+            return MQTTERR_NOERROR;
+        }
+    }
+
+    return MQTTERR_INVALID_PARAMETER;
+}
+
+int MqttReconnect_QueuePublish(struct MqttReconnect *rc, struct MqttBuffer *buf)
+{
+    struct MqttBuffer pkt;
+    int err;
+
+    if(!buf->first_ext) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    if(buf->buffered_bytes > rc->max_queued_bytes) {
+        return MQTTERR_PKT_TOO_LARGE;
+    }
+
+    if(rc->queued_pkts == rc->capacity) {
+        err = MqttReconnect_Grow(rc);
+        if(MQTTERR_NOERROR != err) {
+            return err;
+        }
+    }
+
+    // the packet may wait through many reconnects, extents in the caller's storage are copied
+    err = MqttBuffer_Move(&pkt, buf);
+    if(MQTTERR_NOERROR != err) {
+        return err;
+    }
+
+    while(rc->queued_pkts && (rc->queued_bytes + pkt.buffered_bytes > rc->max_queued_bytes)) {
+        MqttReconnect_DropOldest(rc);
+        ++rc->dropped_pkts;
+    }
+
+    rc->pkts[(rc->head + rc->queued_pkts) % rc->capacity] = pkt;
+    ++rc->queued_pkts;
+    rc->queued_bytes += pkt.buffered_bytes;
+
+    return MQTTERR_NOERROR;
+}
+
+int MqttReconnect_Begin(struct MqttReconnect *rc, struct MqttSendQueue *queue, int64_t now)
+{
+    struct MqttBuffer buf[1];
+    int err;
+
+    if(!rc->pack_connect) {
+        return MQTTERR_EMPTY_CALLBACK;
+    }
+
+    ++rc->attempts;
+    rc->state = MQTT_RECONNECT_CONNECTING;
+    rc->subscribes_sent = 0;
+    rc->replaying = 0;
+
+    MqttBuffer_Init(buf);
+    err = rc->pack_connect(rc->pack_connect_arg, buf);
+    if(err >= 0) {
+        err = MqttSendQueue_Push(queue, buf, now);
+    }
+    MqttBuffer_Destroy(buf);
+    if(MQTTERR_NOERROR != err) {
+        return err;
+    }
+
+    // a server that kept the session last time most likely keeps it again, the
+    // subscriptions then only follow when the CONNACK says it was lost after all
+    if(rc->topic_count && (rc->clean_session || !rc->session_present)) {
+        err = MqttReconnect_PushSubscribes(rc, queue, now);
+        if(MQTTERR_NOERROR != err) {
+            return err;
+        }
+    }
+
+    // the server handles the packets in order, nothing needs to wait for the CONNACK
+    if(rc->queued_pkts) {
+        err = MqttReconnect_PushQueued(rc, queue, now);
+        if(MQTTERR_NOERROR != err) {
+            return err;
+        }
+    }
+
+    return MQTTERR_NOERROR;
+}
+
+int MqttReconnect_HandleConnAck(struct MqttReconnect *rc, char flags, char ret_code,
+                                struct MqttSendQueue *queue, int64_t now)
+{
+    if(MQTT_CONNACK_ACCEPTED != ret_code) {
+        MqttReconnect_HandleDisconnect(rc, now);
+        return MQTTERR_NOERROR;
+    }
+
+    rc->state = MQTT_RECONNECT_CONNECTED;
+    rc->failures = 0;
+
+    // the copies sent with the CONNECT reached a server that took the connection
+    rc->replayed_pkts += rc->replaying;
+    while(rc->replaying) {
+        MqttReconnect_DropOldest(rc);
+    }
+
+    // without clean session the server holds a session from now on, the next connection
+    // leaves the subscriptions out and relies on the session present flag
+    rc->session_present = !rc->clean_session;
+
+    if(rc->subscribes_sent || !rc->topic_count) {
+        return MQTTERR_NOERROR;
+    }
+
+    if(flags & MQTT_CONNACK_SP) {
+        ++rc->sessions_resumed;
+        return MQTTERR_NOERROR;
+    }
+
+    return MqttReconnect_PushSubscribes(rc, queue, now);
+}
+
+void MqttReconnect_HandleDisconnect(struct MqttReconnect *rc, int64_t now)
+{
+    uint32_t cap = rc->min_backoff_ms;
+    uint32_t i;
+
+    // a refused CONNACK already scheduled the attempt, closing the socket must not do it twice
+    if(MQTT_RECONNECT_WAITING == rc->state) {
+        return;
+    }
+
+    ++rc->failures;
+    for(i = 1; (i < rc->failures) && (cap < rc->max_backoff_ms); ++i) {
+        cap = cap > rc->max_backoff_ms / 2 ? rc->max_backoff_ms : cap * 2;
+    }
+    if(cap > rc->max_backoff_ms) {
+        cap = rc->max_backoff_ms;
+    }
+
+    // full jitter: devices dropped by the same outage come back spread over the window
+    rc->next_attempt = now + (int64_t)(MqttReconnect_Random(rc) % ((uint64_t)cap + 1));
+    rc->state = MQTT_RECONNECT_WAITING;
+}
+
+int64_t MqttReconnect_Deadline(const struct MqttReconnect *rc)
+{
+    return MQTT_RECONNECT_WAITING == rc->state ? rc->next_attempt : -1;
+}
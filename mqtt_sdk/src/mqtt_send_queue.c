@@ -0,0 +1,180 @@
+#include "mqtt/mqtt_send_queue.h"
+#include "mqtt/mqtt_trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// extents handed to writev_func at once, larger backlogs take several calls
+#define MQTT_SEND_QUEUE_MAX_IOV 256
+
+static int MqttSendQueue_WouldBlock(void)
+{
+#ifdef EWOULDBLOCK
+    if(EWOULDBLOCK == errno) {
+        return 1;
+    }
+#endif
+    return (EAGAIN == errno) || (EINTR == errno);
+}
+
+static int MqttSendQueue_Grow(struct MqttSendQueue *queue)
+{
+    const uint32_t capacity = queue->capacity ? queue->capacity * 2 : 8;
+    struct MqttBuffer *pkts;
+    uint32_t i;
+
+    pkts = (struct MqttBuffer*)malloc(capacity * sizeof(struct MqttBuffer));
+    if(!pkts) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    for(i = 0; i < queue->queued_pkts; ++i) {
+        pkts[i] = queue->pkts[(queue->head + i) % queue->capacity];
+    }
+
+    free(queue->pkts);
+    queue->pkts = pkts;
+    queue->head = 0;
+    queue->capacity = capacity;
+    return MQTTERR_NOERROR;
+}
+
+// releases the packets the last write finished, the partly sent one stays at the head
+static void MqttSendQueue_Consume(struct MqttSendQueue *queue, uint32_t bytes)
+{
+    queue->queued_bytes -= bytes;
+    bytes += queue->sended_bytes;
+
+    while(queue->queued_pkts) {
+        struct MqttBuffer *pkt = queue->pkts + queue->head;
+        if(bytes < pkt->buffered_bytes) {
+            break;
+        }
+
+        bytes -= pkt->buffered_bytes;
+        MqttBuffer_Destroy(pkt);
+        queue->head = (queue->head + 1) % queue->capacity;
+        --queue->queued_pkts;
+        ++queue->sended_pkts;
+    }
+
+    queue->sended_bytes = bytes;
+}
+
+void MqttSendQueue_Init(struct MqttSendQueue *queue)
+{
+    memset(queue, 0, sizeof(*queue));
+}
+
+void MqttSendQueue_Destroy(struct MqttSendQueue *queue)
+{
+    uint32_t i;
+
+    for(i = 0; i < queue->queued_pkts; ++i) {
+        MqttBuffer_Destroy(queue->pkts + (queue->head + i) % queue->capacity);
+    }
+
+    free(queue->pkts);
+    MqttSendQueue_Init(queue);
+}
+
+int MqttSendQueue_Push(struct MqttSendQueue *queue, struct MqttBuffer *buf, int64_t now)
+{
+    struct MqttBuffer *pkt;
+    int err;
+
+    if(!buf->first_ext) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    if(queue->queued_pkts == queue->capacity) {
+        err = MqttSendQueue_Grow(queue);
+        if(MQTTERR_NOERROR != err) {
+            return err;
+        }
+    }
+
+    // only the header moves unless the extents sit in the caller's storage
+    pkt = queue->pkts + (queue->head + queue->queued_pkts) % queue->capacity;
+    err = MqttBuffer_Move(pkt, buf);
+    if(MQTTERR_NOERROR != err) {
+        return err;
+    }
+
+    if(0 == queue->queued_pkts) {
+        queue->first_queued = now;
+    }
+
+    ++queue->queued_pkts;
+    queue->queued_bytes += pkt->buffered_bytes;
+
+    return MQTTERR_NOERROR;
+}
+
+int MqttSendQueue_Flush(struct MqttSendQueue *queue, struct MqttContext *ctx,
+                        int64_t now, int force)
+{
+    struct iovec iov[MQTT_SEND_QUEUE_MAX_IOV];
+
+    if(!force && (now < MqttSendQueue_Deadline(queue))) {
+        return MQTTERR_NOERROR;
+    }
+
+    while(queue->queued_bytes > 0) {
+        const struct MqttExtent *cursor = queue->pkts[queue->head].first_ext;
+        uint32_t skip = queue->sended_bytes;
+        uint32_t i, total = 0;
+        int count = 0;
+        int bytes;
+
+        while(cursor && (skip >= cursor->len)) {
+            skip -= cursor->len;
+            cursor = cursor->next;
+        }
+
+        // one iovec array runs across as many packets as it can hold
+        for(i = 0; (i < queue->queued_pkts) && (count < MQTT_SEND_QUEUE_MAX_IOV); ++i) {
+            if(i > 0) {
+                cursor = queue->pkts[(queue->head + i) % queue->capacity].first_ext;
+            }
+
+            for(; cursor && (count < MQTT_SEND_QUEUE_MAX_IOV); cursor = cursor->next) {
+                iov[count].iov_base = cursor->payload + skip;
+                iov[count].iov_len = cursor->len - skip;
+                total += cursor->len - skip;
+                skip = 0;
+                ++count;
+            }
+        }
+
+        ++queue->writev_calls;
+        // one writev may carry many packets, the span names the type of the first
+        MQTT_TRACE_BEGIN(MQTT_TRACE_WRITEV, ((uint8_t)queue->pkts[queue->head].first_ext->payload[0]) >> 4, 0);
+        bytes = ctx->writev_func(ctx->writev_func_arg, iov, count);
+        MQTT_TRACE_END(MQTT_TRACE_WRITEV, ((uint8_t)queue->pkts[queue->head].first_ext->payload[0]) >> 4, 0);
+        if(bytes < 0) {
+            return MqttSendQueue_WouldBlock() ? MQTTERR_NOERROR : MQTTERR_IO;
+        }
+
+        MqttSendQueue_Consume(queue, (uint32_t)bytes);
+        if((uint32_t)bytes < total) {
+            break; // the transport is full
+        }
+    }
+
+    return MQTTERR_NOERROR;
+}
+
+int64_t MqttSendQueue_Deadline(const struct MqttSendQueue *queue)
+{
+    if(0 == queue->queued_bytes) {
+        return -1;
+    }
+
+    if((0 == queue->cork_ms) || (0 == queue->cork_bytes) ||
+       (queue->queued_bytes >= queue->cork_bytes)) {
+        return queue->first_queued;
+    }
+
+    return queue->first_queued + queue->cork_ms;
+}
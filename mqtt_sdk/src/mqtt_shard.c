@@ -0,0 +1,256 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
+
+#include "mqtt/mqtt_shard.h"
+
+#include <sched.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void MqttShard_FreeTasks(struct MqttShardTask *task)
+{
+    while(task) {
+        struct MqttShardTask *next = task->next;
+        MqttBuffer_Destroy(task->buf);
+        free(task);
+        task = next;
+    }
+}
+
+static void MqttShard_RunTasks(void *arg, struct MqttEngine *engine)
+{
+    struct MqttShard *shard = (struct MqttShard*)arg;
+    struct MqttShardTask *task, *fifo = NULL;
+
+    task = __atomic_exchange_n(&shard->tasks, NULL, __ATOMIC_ACQUIRE);
+
+    // the producers push onto a stack, restore the submission order
+    while(task) {
+        struct MqttShardTask *next = task->next;
+        task->next = fifo;
+        fifo = task;
+        task = next;
+    }
+
+    for(task = fifo; task; task = task->next) {
+        if(task->func) {
+            task->func(task->func_arg, engine);
+        }
+        else {
+            struct MqttConnection *conn = MqttEngine_FindConnection(engine, task->conn_id);
+            // queued packets of one batch leave in as few writes as possible
+            if(!conn || (MqttEngine_QueuePkt(conn, task->buf) != MQTTERR_NOERROR)) {
+                ++shard->dropped_pkts;
+            }
+        }
+    }
+
+    MqttShard_FreeTasks(fifo);
+}
+
+static void MqttShard_Push(struct MqttShard *shard, struct MqttShardTask *task)
+{
+    struct MqttShardTask *head = __atomic_load_n(&shard->tasks, __ATOMIC_RELAXED);
+
+    do {
+        task->next = head;
+    } while(!__atomic_compare_exchange_n(&shard->tasks, &head, task, 1,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // only the push onto an empty queue has to wake the shard up
+    if(!task->next) {
+        MqttEngine_Wakeup(shard->engine);
+    }
+}
+
+static void *MqttShard_Thread(void *arg)
+{
+    struct MqttShard *shard = (struct MqttShard*)arg;
+
+    if(shard->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(shard->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    while(shard->engine->running) {
+        if(MqttEngine_RunOnce(shard->engine, -1) < 0) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static int MqttShard_NthCpu(uint32_t n)
+{
+    cpu_set_t set;
+    int cpu, count;
+
+    if(sched_getaffinity(0, sizeof(set), &set) < 0 || 0 == (count = CPU_COUNT(&set))) {
+        return -1;
+    }
+
+    n %= (uint32_t)count;
+    for(cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if(CPU_ISSET(cpu, &set) && (0 == n--)) {
+            return cpu;
+        }
+    }
+
+    return -1;
+}
+
+int MqttShardedEngine_Init(struct MqttShardedEngine *se, uint32_t shard_count,
+                           uint32_t max_conns, int pin_cpu)
+{
+    uint32_t i;
+    int err;
+
+    memset(se, 0, sizeof(*se));
+
+    if(0 == shard_count) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        shard_count = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+
+    se->shards = (struct MqttShard*)calloc(shard_count, sizeof(struct MqttShard));
+    if(!se->shards) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    for(i = 0; i < shard_count; ++i) {
+        struct MqttShard *shard = se->shards + i;
+
+        err = MqttEngine_Init(shard->engine, max_conns);
+        if(MQTTERR_NOERROR != err) {
+            MqttShardedEngine_Destroy(se);
+            return err;
+        }
+
+        ++se->shard_count;
+        shard->owner = se;
+        shard->index = i;
+        shard->cpu = pin_cpu ? MqttShard_NthCpu(i) : -1;
+        shard->engine->handle_wakeup = MqttShard_RunTasks;
+        shard->engine->handle_wakeup_arg = shard;
+    }
+
+    return MQTTERR_NOERROR;
+}
+
+void MqttShardedEngine_Destroy(struct MqttShardedEngine *se)
+{
+    uint32_t i;
+
+    MqttShardedEngine_Stop(se);
+
+    for(i = 0; i < se->shard_count; ++i) {
+        MqttShard_FreeTasks(se->shards[i].tasks);
+        MqttEngine_Destroy(se->shards[i].engine);
+    }
+
+    free(se->shards);
+    memset(se, 0, sizeof(*se));
+}
+
+int MqttShardedEngine_Start(struct MqttShardedEngine *se)
+{
+    uint32_t i;
+
+    for(i = 0; i < se->shard_count; ++i) {
+        struct MqttShard *shard = se->shards + i;
+
+        // set before the thread starts, so a quick Stop is never overwritten
+        shard->engine->running = 1;
+        if(0 != pthread_create(&shard->thread, NULL, MqttShard_Thread, shard)) {
+            shard->engine->running = 0;
+            MqttShardedEngine_Stop(se);
+            return MQTTERR_INTERNAL;
+        }
+        shard->started = 1;
+    }
+
+    return MQTTERR_NOERROR;
+}
+
+void MqttShardedEngine_Stop(struct MqttShardedEngine *se)
+{
+    uint32_t i;
+
+    for(i = 0; i < se->shard_count; ++i) {
+        struct MqttShard *shard = se->shards + i;
+        if(shard->started) {
+            MqttEngine_Stop(shard->engine);
+            MqttEngine_Wakeup(shard->engine);
+        }
+    }
+
+    for(i = 0; i < se->shard_count; ++i) {
+        struct MqttShard *shard = se->shards + i;
+        if(shard->started) {
+            pthread_join(shard->thread, NULL);
+            shard->started = 0;
+        }
+    }
+}
+
+struct MqttShard *MqttShardedEngine_GetShard(struct MqttShardedEngine *se, uint64_t key)
+{
+    return se->shards + (key % se->shard_count);
+}
+
+int MqttShard_Post(struct MqttShard *shard,
+                   void (*func)(void *arg, struct MqttEngine *engine), void *arg)
+{
+    struct MqttShardTask *task;
+
+    if(!func) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    task = (struct MqttShardTask*)malloc(sizeof(*task));
+    if(!task) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    task->conn_id = 0;
+    task->func = func;
+    task->func_arg = arg;
+    MqttBuffer_Init(task->buf);
+
+    MqttShard_Push(shard, task);
+    return MQTTERR_NOERROR;
+}
+
+int MqttShard_SubmitPkt(struct MqttShard *shard, uint64_t conn_id, struct MqttBuffer *buf)
+{
+    struct MqttShardTask *task;
+    int err;
+
+    if(!buf->first_ext) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    task = (struct MqttShardTask*)malloc(sizeof(*task));
+    if(!task) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    // the shard thread sends it later, extents in the caller's storage are copied
+    err = MqttBuffer_Move(task->buf, buf);
+    if(MQTTERR_NOERROR != err) {
+        free(task);
+        return err;
+    }
+
+    task->conn_id = conn_id;
+    task->func = NULL;
+    task->func_arg = NULL;
+
+    MqttShard_Push(shard, task);
+    return MQTTERR_NOERROR;
+}
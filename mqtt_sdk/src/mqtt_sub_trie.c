@@ -0,0 +1,491 @@
+#include "mqtt/mqtt_sub_trie.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MQTT_SUB_TRIE_MIN_BUCKETS 64
+
+struct MqttSubNode {
+    struct MqttSubNode *parent;
+    struct MqttSubNode *next;  /* 散列表中的下一个节点 */
+    struct MqttSubNode *plus;  /* '+'子节点，不在散列表中 */
+    struct MqttSubNode *hash;  /* '#'子节点，不在散列表中，总是叶子节点 */
+    MqttSubHandler handler;
+    void *arg;
+    uint32_t hash_value;
+    uint32_t children;
+    uint32_t level_len;
+    char level[1];
+};
+
+// FNV-1a over the level name, the parent is mixed in per lookup
+static uint32_t MqttSubTrie_HashLevel(const char *level, uint32_t len)
+{
+    uint32_t hash = 2166136261u;
+    uint32_t i;
+
+    for(i = 0; i < len; ++i) {
+        hash ^= (uint8_t)level[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static uint32_t MqttSubTrie_HashChild(const struct MqttSubNode *parent, uint32_t level_hash)
+{
+    uint32_t hash = level_hash ^ ((uint32_t)((uintptr_t)parent >> 4) * 0x9E3779B1u);
+    return hash ^ (hash >> 16);
+}
+
+static struct MqttSubNode *MqttSubTrie_NewNode(struct MqttSubNode *parent,
+                                               const char *level, uint32_t len)
+{
+    struct MqttSubNode *node;
+
+    node = (struct MqttSubNode*)malloc(sizeof(struct MqttSubNode) + len);
+    if(!node) {
+        return NULL;
+    }
+
+    memset(node, 0, offsetof(struct MqttSubNode, level));
+    node->parent = parent;
+    node->level_len = len;
+    memcpy(node->level, level, len);
+    node->level[len] = '\0';
+    return node;
+}
+
+static struct MqttSubNode *MqttSubTrie_Find(const struct MqttSubTrie *trie,
+                                            const struct MqttSubNode *parent,
+                                            const char *level, uint32_t len,
+                                            uint32_t hash)
+{
+    struct MqttSubNode *node = trie->buckets[hash & (trie->bucket_count - 1)];
+
+    for(; node; node = node->next) {
+        if((node->hash_value == hash) && (node->parent == parent) &&
+           (node->level_len == len) && (0 == memcmp(node->level, level, len))) {
+            return node;
+        }
+    }
+
+    return NULL;
+}
+
+static int MqttSubTrie_Grow(struct MqttSubTrie *trie)
+{
+    const uint32_t count = trie->bucket_count * 2;
+    struct MqttSubNode **buckets, *node, *next;
+    uint32_t i;
+
+    buckets = (struct MqttSubNode**)calloc(count, sizeof(struct MqttSubNode*));
+    if(!buckets) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    for(i = 0; i < trie->bucket_count; ++i) {
+        for(node = trie->buckets[i]; node; node = next) {
+            next = node->next;
+            node->next = buckets[node->hash_value & (count - 1)];
+            buckets[node->hash_value & (count - 1)] = node;
+        }
+    }
+
+    free(trie->buckets);
+    trie->buckets = buckets;
+    trie->bucket_count = count;
+    return MQTTERR_NOERROR;
+}
+
+static void MqttSubTrie_Unlink(struct MqttSubTrie *trie, struct MqttSubNode *node)
+{
+    struct MqttSubNode *parent = node->parent;
+    struct MqttSubNode **link;
+
+    if(parent->plus == node) {
+        parent->plus = NULL;
+    }
+    else if(parent->hash == node) {
+        parent->hash = NULL;
+    }
+    else {
+        link = trie->buckets + (node->hash_value & (trie->bucket_count - 1));
+        while(*link != node) {
+            link = &(*link)->next;
+        }
+        *link = node->next;
+    }
+
+    --parent->children;
+    --trie->nodes;
+}
+
+// frees the nodes from node upwards which have neither a handler nor children
+static void MqttSubTrie_Prune(struct MqttSubTrie *trie, struct MqttSubNode *node)
+{
+    struct MqttSubNode *parent;
+
+    while((node != trie->root) && !node->handler && !node->children) {
+        parent = node->parent;
+        MqttSubTrie_Unlink(trie, node);
+        free(node);
+        node = parent;
+    }
+}
+
+static int MqttSubTrie_CheckFilter(const char *filter)
+{
+    const char *cursor;
+
+    if(!filter) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    for(cursor = filter; '\0' != *cursor; ++cursor) {
+        if(('+' != *cursor) && ('#' != *cursor)) {
+            continue;
+        }
+
+        if((cursor != filter) && ('/' != cursor[-1])) {
+            return MQTTERR_INVALID_PARAMETER;
+        }
+
+        if('+' == *cursor) {
+            if(('\0' != cursor[1]) && ('/' != cursor[1])) {
+                return MQTTERR_INVALID_PARAMETER;
+            }
+        }
+        else if('\0' != cursor[1]) {
+            return MQTTERR_INVALID_PARAMETER;
+        }
+    }
+
+    return MQTTERR_NOERROR;
+}
+
+// the length of the level starting at level, *next is NULL after the last level
+static uint32_t MqttSubTrie_NextLevel(const char *level, const char **next)
+{
+    const char *slash = strchr(level, '/');
+
+    if(slash) {
+        *next = slash + 1;
+        return (uint32_t)(slash - level);
+    }
+
+    *next = NULL;
+    return (uint32_t)strlen(level);
+}
+
+// walks down the levels of filter, creating the missing nodes when create is set
+static struct MqttSubNode *MqttSubTrie_Walk(struct MqttSubTrie *trie, const char *filter,
+                                            int create, int *err)
+{
+    struct MqttSubNode *node = trie->root, *child;
+    const char *level = filter, *next;
+    uint32_t len, hash;
+
+    *err = MQTTERR_NOERROR;
+    while(level) {
+        len = MqttSubTrie_NextLevel(level, &next);
+        hash = 0;
+
+        if((1 == len) && ('+' == *level)) {
+            child = node->plus;
+        }
+        else if((1 == len) && ('#' == *level)) {
+            child = node->hash;
+        }
+        else {
+            hash = MqttSubTrie_HashChild(node, MqttSubTrie_HashLevel(level, len));
+            child = MqttSubTrie_Find(trie, node, level, len, hash);
+        }
+
+        if(!child) {
+            if(!create) {
+                return NULL;
+            }
+
+            if((trie->nodes >= trie->bucket_count) && (MqttSubTrie_Grow(trie) < 0)) {
+                *err = MQTTERR_OUTOFMEMORY;
+                MqttSubTrie_Prune(trie, node);
+                return NULL;
+            }
+
+            child = MqttSubTrie_NewNode(node, level, len);
+            if(!child) {
+                *err = MQTTERR_OUTOFMEMORY;
+                MqttSubTrie_Prune(trie, node);
+                return NULL;
+            }
+
+            if((1 == len) && ('+' == *level)) {
+                node->plus = child;
+            }
+            else if((1 == len) && ('#' == *level)) {
+                node->hash = child;
+            }
+            else {
+                child->hash_value = hash;
+                child->next = trie->buckets[hash & (trie->bucket_count - 1)];
+                trie->buckets[hash & (trie->bucket_count - 1)] = child;
+            }
+
+            ++node->children;
+            ++trie->nodes;
+        }
+
+        node = child;
+        level = next;
+    }
+
+    return node;
+}
+
+int MqttSubTrie_Init(struct MqttSubTrie *trie)
+{
+    memset(trie, 0, sizeof(*trie));
+
+    trie->root = MqttSubTrie_NewNode(NULL, "", 0);
+    trie->buckets = (struct MqttSubNode**)calloc(MQTT_SUB_TRIE_MIN_BUCKETS,
+                                                 sizeof(struct MqttSubNode*));
+    if(!trie->root || !trie->buckets) {
+        free(trie->root);
+        free(trie->buckets);
+        memset(trie, 0, sizeof(*trie));
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    trie->bucket_count = MQTT_SUB_TRIE_MIN_BUCKETS;
+    return MQTTERR_NOERROR;
+}
+
+static void MqttSubTrie_FreeWildcards(struct MqttSubNode *node)
+{
+    if(node->plus) {
+        MqttSubTrie_FreeWildcards(node->plus);
+        free(node->plus);
+    }
+
+    free(node->hash);
+}
+
+void MqttSubTrie_Destroy(struct MqttSubTrie *trie)
+{
+    struct MqttSubNode *node, *next;
+    uint32_t i;
+
+    // every named node sits in the table, the wildcard ones hang off a node
+    for(i = 0; i < trie->bucket_count; ++i) {
+        for(node = trie->buckets[i]; node; node = node->next) {
+            MqttSubTrie_FreeWildcards(node);
+        }
+    }
+
+    for(i = 0; i < trie->bucket_count; ++i) {
+        for(node = trie->buckets[i]; node; node = next) {
+            next = node->next;
+            free(node);
+        }
+    }
+
+    if(trie->root) {
+        MqttSubTrie_FreeWildcards(trie->root);
+        free(trie->root);
+    }
+
+    free(trie->buckets);
+    memset(trie, 0, sizeof(*trie));
+}
+
+int MqttSubTrie_Add(struct MqttSubTrie *trie, const char *filter,
+                    MqttSubHandler handler, void *arg)
+{
+    struct MqttSubNode *node;
+    int err;
+
+    if(!handler) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    err = MqttSubTrie_CheckFilter(filter);
+    if(err < 0) {
+        return err;
+    }
+
+    node = MqttSubTrie_Walk(trie, filter, 1, &err);
+    if(!node) {
+        return err;
+    }
+
+    if(!node->handler) {
+        ++trie->filters;
+    }
+
+    node->handler = handler;
+    node->arg = arg;
+    return MQTTERR_NOERROR;
+}
+
+int MqttSubTrie_Remove(struct MqttSubTrie *trie, const char *filter)
+{
+    struct MqttSubNode *node;
+    int err;
+
+    if(!filter) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    node = MqttSubTrie_Walk(trie, filter, 0, &err);
+    if(!node || !node->handler) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    node->handler = NULL;
+    node->arg = NULL;
+    --trie->filters;
+    MqttSubTrie_Prune(trie, node);
+    return MQTTERR_NOERROR;
+}
+
+struct MqttSubMessage {
+    uint16_t pkt_id;
+    const char *topic;
+    const char *payload;
+    uint32_t payloadsize;
+    int dup;
+    enum MqttQosLevel qos;
+};
+
+static int MqttSubTrie_Call(const struct MqttSubNode *node, const struct MqttSubMessage *msg)
+{
+    return node->handler(node->arg, msg->pkt_id, msg->topic, msg->payload,
+                         msg->payloadsize, msg->dup, msg->qos);
+}
+
+// level is NULL once every level of the topic has been consumed
+static int MqttSubTrie_Match(const struct MqttSubTrie *trie, const struct MqttSubNode *node,
+                             const char *level, const struct MqttSubMessage *msg)
+{
+    const struct MqttSubNode *child;
+    const char *next;
+    int matched = 0, err;
+    uint32_t len;
+
+    // wildcards at the first level never match the $ system topics
+    const int wildcards = (node != trie->root) || ('$' != *msg->topic);
+
+    // "a/#" also matches "a" itself
+    if(node->hash && wildcards) {
+        err = MqttSubTrie_Call(node->hash, msg);
+        if(err < 0) {
+            return err;
+        }
+        ++matched;
+    }
+
+    if(!level) {
+        if(node->handler) {
+            err = MqttSubTrie_Call(node, msg);
+            if(err < 0) {
+                return err;
+            }
+            ++matched;
+        }
+        return matched;
+    }
+
+    if(!node->children) {
+        return matched;
+    }
+
+    len = MqttSubTrie_NextLevel(level, &next);
+    child = MqttSubTrie_Find(trie, node, level, len,
+                             MqttSubTrie_HashChild(node, MqttSubTrie_HashLevel(level, len)));
+    if(child) {
+        err = MqttSubTrie_Match(trie, child, next, msg);
+        if(err < 0) {
+            return err;
+        }
+        matched += err;
+    }
+
+    if(node->plus && wildcards) {
+        err = MqttSubTrie_Match(trie, node->plus, next, msg);
+        if(err < 0) {
+            return err;
+        }
+        matched += err;
+    }
+
+    return matched;
+}
+
+int MqttSubTrie_Dispatch(const struct MqttSubTrie *trie, uint16_t pkt_id, const char *topic,
+                         const char *payload, uint32_t payloadsize,
+                         int dup, enum MqttQosLevel qos)
+{
+    struct MqttSubMessage msg;
+
+    msg.pkt_id = pkt_id;
+    msg.topic = topic;
+    msg.payload = payload;
+    msg.payloadsize = payloadsize;
+    msg.dup = dup;
+    msg.qos = qos;
+
+    return MqttSubTrie_Match(trie, trie->root, topic, &msg);
+}
+
+int MqttSubTrie_PackSubscribePkt(struct MqttSubTrie *trie, struct MqttBuffer *buf,
+                                 uint16_t pkt_id, enum MqttQosLevel qos,
+                                 const char *topics[], int topics_len,
+                                 MqttSubHandler handler, void *arg)
+{
+    int i, err;
+
+    if(!handler) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    // reject a bad filter before anything is packed or registered
+    for(i = 0; i < topics_len; ++i) {
+        err = MqttSubTrie_CheckFilter(topics[i]);
+        if(err < 0) {
+            return err;
+        }
+    }
+
+    err = Mqtt_PackSubscribePkt(buf, pkt_id, qos, topics, topics_len);
+    if(err < 0) {
+        return err;
+    }
+
+    for(i = 0; i < topics_len; ++i) {
+        err = MqttSubTrie_Add(trie, topics[i], handler, arg);
+        if(err < 0) {
+            return err;
+        }
+    }
+
+    return MQTTERR_NOERROR;
+}
+
+int MqttSubTrie_PackUnsubscribePkt(struct MqttSubTrie *trie, struct MqttBuffer *buf,
+                                   uint16_t pkt_id, const char *topics[], int topics_len)
+{
+    int i, err;
+
+    err = Mqtt_PackUnsubscribePkt(buf, pkt_id, topics, topics_len);
+    if(err < 0) {
+        return err;
+    }
+
+    for(i = 0; i < topics_len; ++i) {
+        MqttSubTrie_Remove(trie, topics[i]);
+    }
+
+    return MQTTERR_NOERROR;
+}
@@ -0,0 +1,228 @@
+#include "mqtt/mqtt_timer.h"
+
+#include <stddef.h>
+
+#define MQTT_TIMER_WHEEL_MASK (MQTT_TIMER_WHEEL_SLOTS - 1)
+// the farthest the top level can reach, later timers are parked there and placed again
+#define MQTT_TIMER_WHEEL_SPAN (((int64_t)1 << (MQTT_TIMER_WHEEL_BITS * MQTT_TIMER_WHEEL_LEVELS)) - 1)
+
+static void MqttTimerLink_Init(struct MqttTimerLink *head)
+{
+    head->prev = head;
+    head->next = head;
+}
+
+static void MqttTimerLink_Append(struct MqttTimerLink *head, struct MqttTimerLink *link)
+{
+    link->prev = head->prev;
+    link->next = head;
+    head->prev->next = link;
+    head->prev = link;
+}
+
+static void MqttTimerLink_Remove(struct MqttTimerLink *link)
+{
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link->prev = NULL;
+    link->next = NULL;
+}
+
+// moves every entry of src to the empty list dst
+static void MqttTimerLink_Take(struct MqttTimerLink *dst, struct MqttTimerLink *src)
+{
+    if(src->next == src) {
+        MqttTimerLink_Init(dst);
+        return;
+    }
+
+    dst->next = src->next;
+    dst->prev = src->prev;
+    dst->next->prev = dst;
+    dst->prev->next = dst;
+    MqttTimerLink_Init(src);
+}
+
+static void MqttTimerWheel_Place(struct MqttTimerWheel *wheel, struct MqttTimer *timer)
+{
+    int64_t expire = timer->expire;
+    int64_t delta;
+    int level;
+
+    // overdue timers go to the slot of the tick being processed
+    if(expire < wheel->now) {
+        expire = wheel->now;
+    }
+    else if(expire - wheel->now > MQTT_TIMER_WHEEL_SPAN) {
+        expire = wheel->now + MQTT_TIMER_WHEEL_SPAN;
+    }
+
+    delta = expire - wheel->now;
+    for(level = 0; level < MQTT_TIMER_WHEEL_LEVELS - 1; ++level) {
+        if(delta < ((int64_t)1 << ((level + 1) * MQTT_TIMER_WHEEL_BITS))) {
+            break;
+        }
+    }
+
+    timer->level = level;
+    ++wheel->level_count[level];
+    MqttTimerLink_Append(&wheel->slots[level][(expire >> (level * MQTT_TIMER_WHEEL_BITS)) &
+                                              MQTT_TIMER_WHEEL_MASK], &timer->link);
+}
+
+static void MqttTimerWheel_Unlink(struct MqttTimerWheel *wheel, struct MqttTimer *timer)
+{
+    --wheel->level_count[timer->level];
+    MqttTimerLink_Remove(&timer->link);
+}
+
+// the lowest level holding a timer, the top level when all are empty
+static int MqttTimerWheel_LowestLevel(const struct MqttTimerWheel *wheel)
+{
+    int level;
+
+    for(level = 0; level < MQTT_TIMER_WHEEL_LEVELS - 1; ++level) {
+        if(wheel->level_count[level]) {
+            break;
+        }
+    }
+
+    return level;
+}
+
+// spreads the current slot of a level over the levels below, returns the slot index
+static uint32_t MqttTimerWheel_Cascade(struct MqttTimerWheel *wheel, int level)
+{
+    const uint32_t idx = (uint32_t)(wheel->now >> (level * MQTT_TIMER_WHEEL_BITS)) &
+        MQTT_TIMER_WHEEL_MASK;
+    struct MqttTimerLink list;
+
+    MqttTimerLink_Take(&list, &wheel->slots[level][idx]);
+    while(list.next != &list) {
+        struct MqttTimer *timer = (struct MqttTimer*)list.next;
+        MqttTimerWheel_Unlink(wheel, timer);
+        MqttTimerWheel_Place(wheel, timer);
+    }
+
+    return idx;
+}
+
+void MqttTimerWheel_Init(struct MqttTimerWheel *wheel, int64_t now)
+{
+    int level, slot;
+
+    wheel->now = now;
+    wheel->count = 0;
+
+    for(level = 0; level < MQTT_TIMER_WHEEL_LEVELS; ++level) {
+        wheel->level_count[level] = 0;
+        for(slot = 0; slot < MQTT_TIMER_WHEEL_SLOTS; ++slot) {
+            MqttTimerLink_Init(&wheel->slots[level][slot]);
+        }
+    }
+}
+
+uint32_t MqttTimerWheel_Advance(struct MqttTimerWheel *wheel, int64_t now)
+{
+    struct MqttTimerLink list;
+    uint32_t fired = 0;
+    int level;
+
+    while(wheel->now < now) {
+        if(0 == wheel->count) {
+            wheel->now = now;
+            break;
+        }
+
+        // nothing below this level, no tick before its next cascade can fire
+        level = MqttTimerWheel_LowestLevel(wheel);
+        if(level > 0) {
+            const int64_t last = wheel->now | (((int64_t)1 << (level * MQTT_TIMER_WHEEL_BITS)) - 1);
+            if(last >= now) {
+                wheel->now = now;
+                break;
+            }
+            wheel->now = last;
+        }
+
+        ++wheel->now;
+        for(level = 1; level < MQTT_TIMER_WHEEL_LEVELS; ++level) {
+            if((wheel->now & (((int64_t)1 << (level * MQTT_TIMER_WHEEL_BITS)) - 1)) ||
+               MqttTimerWheel_Cascade(wheel, level)) {
+                break;
+            }
+        }
+
+        // the callbacks may start or stop any timer, including the ones fired with them
+        MqttTimerLink_Take(&list, &wheel->slots[0][wheel->now & MQTT_TIMER_WHEEL_MASK]);
+        while(list.next != &list) {
+            struct MqttTimer *timer = (struct MqttTimer*)list.next;
+
+            MqttTimerWheel_Unlink(wheel, timer);
+            --wheel->count;
+            ++fired;
+
+            timer->func(timer->func_arg, timer);
+        }
+    }
+
+    return fired;
+}
+
+int64_t MqttTimerWheel_NextTimeout(const struct MqttTimerWheel *wheel)
+{
+    int level, shift;
+    int64_t idx;
+
+    if(0 == wheel->count) {
+        return -1;
+    }
+
+    // the nearest busy slot of the lowest busy level, or its wrap which cascades the level above
+    level = MqttTimerWheel_LowestLevel(wheel);
+    shift = level * MQTT_TIMER_WHEEL_BITS;
+    for(idx = (wheel->now >> shift) + 1; ; ++idx) {
+        const struct MqttTimerLink *head = &wheel->slots[level][idx & MQTT_TIMER_WHEEL_MASK];
+        if((head->next != head) || (0 == (idx & MQTT_TIMER_WHEEL_MASK))) {
+            return (idx << shift) - wheel->now;
+        }
+    }
+}
+
+void MqttTimer_Init(struct MqttTimer *timer,
+                    void (*func)(void *arg, struct MqttTimer *timer), void *arg)
+{
+    timer->link.prev = NULL;
+    timer->link.next = NULL;
+    timer->expire = 0;
+    timer->level = 0;
+    timer->func = func;
+    timer->func_arg = arg;
+}
+
+void MqttTimer_Start(struct MqttTimerWheel *wheel, struct MqttTimer *timer, int64_t expire)
+{
+    if(MqttTimer_IsActive(timer)) {
+        MqttTimerWheel_Unlink(wheel, timer);
+    }
+    else {
+        ++wheel->count;
+    }
+
+    // the slot of the current tick has already fired
+    timer->expire = expire > wheel->now ? expire : wheel->now + 1;
+    MqttTimerWheel_Place(wheel, timer);
+}
+
+void MqttTimer_Stop(struct MqttTimerWheel *wheel, struct MqttTimer *timer)
+{
+    if(MqttTimer_IsActive(timer)) {
+        MqttTimerWheel_Unlink(wheel, timer);
+        --wheel->count;
+    }
+}
+
+int MqttTimer_IsActive(const struct MqttTimer *timer)
+{
+    return NULL != timer->link.next;
+}
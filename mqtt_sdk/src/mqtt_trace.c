@@ -0,0 +1,139 @@
+#include "mqtt/mqtt_trace.h"
+#include "mqtt/mqtt_metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <windows.h>
+#define MQTT_TRACE_THREAD_LOCAL __declspec(thread)
+#else
+#define MQTT_TRACE_THREAD_LOCAL __thread
+#endif
+
+struct MqttTraceHooks MqttTrace_Hooks;
+
+static const char *const MqttTrace_SpanNames[MQTT_TRACE_SPAN_COUNT] = {
+    "dispatch", "callback", "writev", "pack"
+};
+
+static MQTT_TRACE_THREAD_LOCAL uint32_t MqttTrace_ThreadId;
+static uint32_t MqttTrace_LastThreadId;
+
+static uint32_t MqttTrace_FetchAdd(uint32_t *value)
+{
+#ifdef WIN32
+    return (uint32_t)InterlockedIncrement((volatile LONG*)value) - 1;
+#else
+    return __atomic_fetch_add(value, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+void MqttTrace_SetHooks(const struct MqttTraceHooks *hooks)
+{
+    if(hooks) {
+        MqttTrace_Hooks = *hooks;
+    }
+    else {
+        memset(&MqttTrace_Hooks, 0, sizeof(MqttTrace_Hooks));
+    }
+}
+
+const char *MqttTrace_SpanName(enum MqttTraceSpan span)
+{
+    if(((int)span < 0) || (span >= MQTT_TRACE_SPAN_COUNT)) {
+        return "unknown";
+    }
+
+    return MqttTrace_SpanNames[span];
+}
+
+int MqttTraceChrome_Init(struct MqttTraceChrome *chrome, uint32_t capacity)
+{
+    memset(chrome, 0, sizeof(*chrome));
+
+    chrome->events = (struct MqttTraceEvent*)malloc(sizeof(struct MqttTraceEvent) * capacity);
+    if(!chrome->events && capacity) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    chrome->capacity = capacity;
+    chrome->start = MqttMetrics_Now();
+    return MQTTERR_NOERROR;
+}
+
+void MqttTraceChrome_Destroy(struct MqttTraceChrome *chrome)
+{
+    free(chrome->events);
+    memset(chrome, 0, sizeof(*chrome));
+}
+
+static void MqttTraceChrome_Record(struct MqttTraceChrome *chrome, uint8_t phase,
+                                   enum MqttTraceSpan span, int pkt_type, uint16_t pkt_id)
+{
+    struct MqttTraceEvent *event;
+    const uint32_t index = MqttTrace_FetchAdd(&chrome->count);
+
+    if(index >= chrome->capacity) {
+        return;
+    }
+
+    // chrome://tracing wants small thread ids, hand them out on first use
+    if(0 == MqttTrace_ThreadId) {
+        MqttTrace_ThreadId = MqttTrace_FetchAdd(&MqttTrace_LastThreadId) + 1;
+    }
+
+    event = chrome->events + index;
+    event->ts = MqttMetrics_Now() - chrome->start;
+    event->tid = MqttTrace_ThreadId;
+    event->pkt_id = pkt_id;
+    event->span = (uint8_t)span;
+    event->pkt_type = (uint8_t)pkt_type;
+    event->phase = phase;
+}
+
+static void MqttTraceChrome_Begin(void *arg, enum MqttTraceSpan span, int pkt_type, uint16_t pkt_id)
+{
+    MqttTraceChrome_Record((struct MqttTraceChrome*)arg, 'B', span, pkt_type, pkt_id);
+}
+
+static void MqttTraceChrome_End(void *arg, enum MqttTraceSpan span, int pkt_type, uint16_t pkt_id)
+{
+    MqttTraceChrome_Record((struct MqttTraceChrome*)arg, 'E', span, pkt_type, pkt_id);
+}
+
+void MqttTraceChrome_GetHooks(struct MqttTraceChrome *chrome, struct MqttTraceHooks *hooks)
+{
+    hooks->arg = chrome;
+    hooks->begin = MqttTraceChrome_Begin;
+    hooks->end = MqttTraceChrome_End;
+}
+
+int MqttTraceChrome_Write(const struct MqttTraceChrome *chrome, FILE *fp)
+{
+    const uint32_t count = chrome->count < chrome->capacity ? chrome->count : chrome->capacity;
+    const struct MqttTraceEvent *event;
+    uint32_t i;
+
+    if(fprintf(fp, "{\"traceEvents\":[") < 0) {
+        return MQTTERR_IO;
+    }
+
+    for(i = 0; i < count; ++i) {
+        event = chrome->events + i;
+        // timestamps are in microseconds, keep the nanoseconds as decimals
+        if(fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"mqtt\",\"ph\":\"%c\",\"ts\":%.3f,"
+                   "\"pid\":1,\"tid\":%u,\"args\":{\"pkt_type\":%u,\"pkt_id\":%u}}",
+                   i ? "," : "", MqttTrace_SpanName((enum MqttTraceSpan)event->span),
+                   event->phase, event->ts / 1000.0, event->tid,
+                   event->pkt_type, event->pkt_id) < 0) {
+            return MQTTERR_IO;
+        }
+    }
+
+    if(fprintf(fp, "\n]}\n") < 0) {
+        return MQTTERR_IO;
+    }
+
+    return (int)count;
+}
@@ -0,0 +1,752 @@
+#include "mqtt/mqtt_uring.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MQTT_URING_BUF_GROUP 0
+// sendmsg requests linked into one chain and the extents carried by each of them
+#define MQTT_URING_MAX_LINKS 8
+#define MQTT_URING_LINK_IOVS 64
+// connections are at least pointer aligned, the low bit tells sends from receives
+#define MQTT_URING_SEND_TAG 1
+// rounds of completions Destroy waits for before it gives up on the kernel
+#define MQTT_URING_DRAIN_ROUNDS 50
+
+static int MqttUring_Enter(struct MqttUring *ring, unsigned to_submit, unsigned min_complete,
+                           unsigned flags, void *arg, size_t argsz)
+{
+    ++ring->enter_calls;
+    return (int)syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, min_complete,
+                        flags, arg, argsz);
+}
+
+static int MqttUring_Submit(struct MqttUring *ring, unsigned wait_nr, int timeout_ms)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = 0;
+    int ret;
+
+    if(!ring->to_submit && !wait_nr) {
+        return 0;
+    }
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    memset(&arg, 0, sizeof(arg));
+    if(wait_nr) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if(timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+        }
+    }
+
+    ret = MqttUring_Enter(ring, ring->to_submit, wait_nr, flags,
+                          (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL,
+                          (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0);
+
+    // a timed out wait still consumes the submissions, trust the kernel's head
+    ring->to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if((ret < 0) && (ETIME != errno) && (EINTR != errno) && (EBUSY != errno)) {
+        return MQTTERR_IO;
+    }
+
+    return MQTTERR_NOERROR;
+}
+
+// makes sure count entries fit in the submission queue, so a linked chain is never split
+static int MqttUring_Reserve(struct MqttUring *ring, unsigned count)
+{
+    if(ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) + count <=
+       ring->sq_entries) {
+        return MQTTERR_NOERROR;
+    }
+
+    if(MqttUring_Submit(ring, 0, 0) != MQTTERR_NOERROR) {
+        return MQTTERR_IO;
+    }
+
+    return ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) + count <=
+        ring->sq_entries ? MQTTERR_NOERROR : MQTTERR_IO;
+}
+
+static struct io_uring_sqe *MqttUring_GetSqe(struct MqttUring *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    if(MqttUring_Reserve(ring, 1) != MQTTERR_NOERROR) {
+        return NULL;
+    }
+
+    idx = ring->sq_local_tail & ring->sq_mask;
+    sqe = (struct io_uring_sqe*)ring->sqes + idx;
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+
+    ++ring->sq_local_tail;
+    ++ring->to_submit;
+    return sqe;
+}
+
+static void MqttUring_ProvideBuf(struct MqttUring *ring, int bid)
+{
+    struct io_uring_buf_ring *br = (struct io_uring_buf_ring*)ring->buf_ring;
+    struct io_uring_buf *buf = br->bufs + (ring->buf_tail & (ring->buf_count - 1));
+
+    buf->addr = (uint64_t)(uintptr_t)(ring->bufs + (size_t)bid * ring->buf_size);
+    buf->len = ring->buf_size;
+    buf->bid = (uint16_t)bid;
+
+    ++ring->buf_tail;
+    __atomic_store_n(&br->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void MqttUring_ReleaseRx(struct MqttUringConn *conn)
+{
+    while(conn->rx_head >= 0) {
+        const int bid = conn->rx_head;
+        conn->rx_head = conn->ring->buf_next[bid];
+        MqttUring_ProvideBuf(conn->ring, bid);
+    }
+
+    conn->rx_tail = -1;
+    conn->rx_offset = 0;
+}
+
+static int MqttUring_ArmRecv(struct MqttUringConn *conn)
+{
+    struct io_uring_sqe *sqe = MqttUring_GetSqe(conn->ring);
+
+    if(!sqe) {
+        return MQTTERR_IO;
+    }
+
+    // one request keeps delivering data, the kernel picks a buffer from the group each time
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = MQTT_URING_BUF_GROUP;
+    sqe->user_data = (uint64_t)(uintptr_t)conn;
+
+    conn->recv_armed = 1;
+    ++conn->refs;
+    return MQTTERR_NOERROR;
+}
+
+static int MqttUring_Read(void *arg, void *buf, uint32_t count)
+{
+    struct MqttUringConn *conn = (struct MqttUringConn*)arg;
+    struct MqttUring *ring = conn->ring;
+    uint32_t copied = 0;
+
+    while((copied < count) && (conn->rx_head >= 0)) {
+        const int bid = conn->rx_head;
+        uint32_t bytes = ring->buf_len[bid] - conn->rx_offset;
+
+        if(bytes > count - copied) {
+            bytes = count - copied;
+        }
+
+        memcpy((char*)buf + copied,
+               ring->bufs + (size_t)bid * ring->buf_size + conn->rx_offset, bytes);
+        copied += bytes;
+        conn->rx_offset += bytes;
+
+        // the buffer goes straight back to the kernel once it is drained
+        if(conn->rx_offset == ring->buf_len[bid]) {
+            conn->rx_head = ring->buf_next[bid];
+            if(conn->rx_head < 0) {
+                conn->rx_tail = -1;
+            }
+            conn->rx_offset = 0;
+            MqttUring_ProvideBuf(ring, bid);
+        }
+    }
+
+    if(copied > 0) {
+        return (int)copied;
+    }
+
+    if(conn->rx_error) {
+        errno = conn->rx_error;
+        return -1;
+    }
+
+    if(conn->rx_eof) {
+        return 0;
+    }
+
+    conn->read_blocked = 1;
+    errno = EAGAIN;
+    return -1;
+}
+
+static int MqttUring_Writev(void *arg, const struct iovec *iov, int iovcnt)
+{
+    struct MqttUringConn *conn = (struct MqttUringConn*)arg;
+    struct MqttUring *ring = conn->ring;
+    uint32_t total = 0;
+    int i;
+
+    if(conn->closed) {
+        return -1;
+    }
+
+    // the kernel reads the data after this call returns, it has to be copied
+    for(i = 0; i < iovcnt; ++i) {
+        if(MqttBuffer_Append(conn->pending, (char*)iov[i].iov_base,
+                             (uint32_t)iov[i].iov_len, 1) != MQTTERR_NOERROR) {
+            return -1;
+        }
+        total += (uint32_t)iov[i].iov_len;
+    }
+
+    if(!conn->dirty) {
+        conn->dirty = 1;
+        conn->next_dirty = ring->dirty;
+        ring->dirty = conn;
+    }
+
+    return (int)total;
+}
+
+static int MqttUring_SubmitSend(struct MqttUringConn *conn)
+{
+    struct MqttUring *ring = conn->ring;
+    struct msghdr *msgs = (struct msghdr*)conn->send_msgs;
+    const struct MqttExtent *cursor;
+    uint32_t skip = conn->sended_bytes;
+    int links, count, i;
+
+    for(cursor = conn->sending->first_ext; cursor && skip >= cursor->len;
+        cursor = cursor->next) {
+        skip -= cursor->len;
+    }
+
+    for(links = 0; cursor && (links < MQTT_URING_MAX_LINKS); ++links) {
+        struct iovec *iov = conn->send_iov + links * MQTT_URING_LINK_IOVS;
+
+        for(count = 0; cursor && (count < MQTT_URING_LINK_IOVS); cursor = cursor->next, ++count) {
+            iov[count].iov_base = cursor->payload + skip;
+            iov[count].iov_len = cursor->len - skip;
+            skip = 0;
+        }
+
+        memset(msgs + links, 0, sizeof(struct msghdr));
+        msgs[links].msg_iov = iov;
+        msgs[links].msg_iovlen = count;
+    }
+
+    if(MqttUring_Reserve(ring, (unsigned)links) != MQTTERR_NOERROR) {
+        return MQTTERR_IO;
+    }
+
+    // a short or failed send cancels the rest of the chain, so the bytes never reorder
+    for(i = 0; i < links; ++i) {
+        struct io_uring_sqe *sqe = MqttUring_GetSqe(ring);
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn->fd;
+        sqe->addr = (uint64_t)(uintptr_t)(msgs + i);
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->flags = (i + 1 < links) ? IOSQE_IO_LINK : 0;
+        sqe->user_data = (uint64_t)(uintptr_t)conn | MQTT_URING_SEND_TAG;
+    }
+
+    conn->send_inflight = (uint32_t)links;
+    conn->refs += (uint32_t)links;
+    ring->send_submissions += (uint64_t)links;
+    return MQTTERR_NOERROR;
+}
+
+static int MqttUring_StartSend(struct MqttUringConn *conn)
+{
+    if(conn->send_inflight || (0 == conn->pending->buffered_bytes)) {
+        return MQTTERR_NOERROR;
+    }
+
+    // the chain points into the extents, new packets keep going to pending meanwhile
+    MqttBuffer_Reset(conn->sending);
+    *conn->sending = *conn->pending;
+    MqttBuffer_Init(conn->pending);
+    conn->sended_bytes = 0;
+
+    return MqttUring_SubmitSend(conn);
+}
+
+static void MqttUring_FlushDirty(struct MqttUring *ring)
+{
+    while(ring->dirty) {
+        struct MqttUringConn *conn = ring->dirty;
+        ring->dirty = conn->next_dirty;
+        conn->dirty = 0;
+
+        if(!conn->closed && (MqttUring_StartSend(conn) != MQTTERR_NOERROR)) {
+            MqttUring_CloseConnection(conn, MQTTERR_IO);
+        }
+    }
+}
+
+static void MqttUring_Unref(struct MqttUringConn *conn)
+{
+    struct MqttUring *ring = conn->ring;
+
+    if((0 == --conn->refs) && conn->closed) {
+        conn->next_closed = ring->closed;
+        ring->closed = conn;
+    }
+}
+
+static void MqttUring_HandleInput(struct MqttUringConn *conn)
+{
+    struct MqttContext *ctx = conn->ctx;
+    int err;
+
+    // everything to read is already in memory, parse until it runs out
+    while(!conn->closed) {
+        if(ctx->pos == ctx->end) {
+            MqttUring_CloseConnection(conn, MQTTERR_BUF_OVERFLOW);
+            return;
+        }
+
+        conn->read_blocked = 0;
+        err = Mqtt_RecvPkt(ctx);
+        if(MQTTERR_NOERROR == err) {
+            continue;
+        }
+
+        if((MQTTERR_IO == err) && conn->read_blocked) {
+            return;
+        }
+
+        MqttUring_CloseConnection(conn, err);
+        return;
+    }
+}
+
+static void MqttUring_HandleRecv(struct MqttUringConn *conn, int res, uint32_t flags)
+{
+    struct MqttUring *ring = conn->ring;
+
+    if(res > 0) {
+        const int bid = (int)(flags >> IORING_CQE_BUFFER_SHIFT);
+
+        ++ring->recv_completions;
+        if(conn->closed) {
+            MqttUring_ProvideBuf(ring, bid);
+        }
+        else {
+            ring->buf_len[bid] = (uint32_t)res;
+            ring->buf_next[bid] = -1;
+            if(conn->rx_tail >= 0) {
+                ring->buf_next[conn->rx_tail] = bid;
+            }
+            else {
+                conn->rx_head = bid;
+            }
+            conn->rx_tail = bid;
+        }
+    }
+    else if(0 == res) {
+        conn->rx_eof = 1;
+    }
+    else if((-ENOBUFS != res) && (-ECANCELED != res)) {
+        conn->rx_error = -res;
+    }
+
+    // a multishot receive ends without IORING_CQE_F_MORE, e.g. when the buffers ran out
+    if(!(flags & IORING_CQE_F_MORE)) {
+        conn->recv_armed = 0;
+        MqttUring_Unref(conn);
+    }
+
+    if(conn->closed) {
+        return;
+    }
+
+    MqttUring_HandleInput(conn);
+
+    if(!conn->closed && !conn->recv_armed && !conn->rx_eof && !conn->rx_error &&
+       (MqttUring_ArmRecv(conn) != MQTTERR_NOERROR)) {
+        MqttUring_CloseConnection(conn, MQTTERR_IO);
+    }
+}
+
+static void MqttUring_HandleSend(struct MqttUringConn *conn, int res)
+{
+    --conn->send_inflight;
+
+    if(res > 0) {
+        conn->sended_bytes += (uint32_t)res;
+    }
+    else if((-ECANCELED != res) && !conn->send_err) {
+        conn->send_err = res < 0 ? -res : EPIPE;
+    }
+
+    if(!conn->send_inflight && !conn->closed) {
+        int err = MQTTERR_IO;
+
+        if(conn->send_err) {
+            // keep MQTTERR_IO
+        }
+        else if(conn->sended_bytes < conn->sending->buffered_bytes) {
+            err = MqttUring_SubmitSend(conn);
+        }
+        else {
+            MqttBuffer_Reset(conn->sending);
+            conn->sended_bytes = 0;
+            err = MqttUring_StartSend(conn);
+        }
+
+        if(MQTTERR_NOERROR != err) {
+            MqttUring_CloseConnection(conn, err);
+        }
+    }
+
+    MqttUring_Unref(conn);
+}
+
+static void MqttUring_FreeConnection(struct MqttUringConn *conn)
+{
+    struct MqttUring *ring = conn->ring;
+
+    if(conn->prev) {
+        conn->prev->next = conn->next;
+    }
+    else {
+        ring->conns = conn->next;
+    }
+
+    if(conn->next) {
+        conn->next->prev = conn->prev;
+    }
+
+    if(conn->fd >= 0) {
+        close(conn->fd);
+    }
+
+    Mqtt_DestroyContext(conn->ctx);
+    MqttBuffer_Destroy(conn->pending);
+    MqttBuffer_Destroy(conn->sending);
+    free(conn->send_iov);
+    free(conn->send_msgs);
+    free(conn);
+}
+
+static void MqttUring_ReapClosed(struct MqttUring *ring)
+{
+    while(ring->closed) {
+        struct MqttUringConn *conn = ring->closed;
+        ring->closed = conn->next_closed;
+
+        if(conn->handle_close && !ring->destroying) {
+            conn->handle_close(conn->handle_close_arg, conn, conn->close_err);
+        }
+        MqttUring_FreeConnection(conn);
+    }
+}
+
+int MqttUring_Init(struct MqttUring *ring, uint32_t entries, uint16_t buf_count,
+                   uint32_t buf_size)
+{
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    size_t sq_len, cq_len;
+    uint32_t i;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->ring_fd = -1;
+
+    if(!entries || !buf_count || (buf_count & (buf_count - 1)) || !buf_size) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    memset(&params, 0, sizeof(params));
+    ring->ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->ring_fd < 0) {
+        return MQTTERR_IO;
+    }
+
+    // multishot receive needs newer kernels than both of these, they are just sanity checks
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        MqttUring_Destroy(ring);
+        return MQTTERR_IO;
+    }
+
+    sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    ring->ring_ptr = mmap(NULL, ring->ring_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    if(MAP_FAILED == ring->ring_ptr) {
+        ring->ring_ptr = NULL;
+        MqttUring_Destroy(ring);
+        return MQTTERR_IO;
+    }
+
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if(MAP_FAILED == ring->sqes) {
+        ring->sqes = NULL;
+        MqttUring_Destroy(ring);
+        return MQTTERR_IO;
+    }
+
+    ring->sq_head = (unsigned*)((char*)ring->ring_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned*)((char*)ring->ring_ptr + params.sq_off.tail);
+    ring->sq_array = (unsigned*)((char*)ring->ring_ptr + params.sq_off.array);
+    ring->sq_mask = *(unsigned*)((char*)ring->ring_ptr + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned*)((char*)ring->ring_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned*)((char*)ring->ring_ptr + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)((char*)ring->ring_ptr + params.cq_off.ring_mask);
+    ring->cqes = (char*)ring->ring_ptr + params.cq_off.cqes;
+
+    // the provided buffer ring is shared by every connection of the loop
+    ring->buf_ring_len = (size_t)buf_count * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_len, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(MAP_FAILED == ring->buf_ring) {
+        ring->buf_ring = NULL;
+        MqttUring_Destroy(ring);
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    ring->buf_size = buf_size;
+    ring->buf_count = buf_count;
+    ring->bufs = (char*)malloc((size_t)buf_count * buf_size);
+    ring->buf_len = (uint32_t*)malloc(buf_count * sizeof(uint32_t));
+    ring->buf_next = (int*)malloc(buf_count * sizeof(int));
+    if(!ring->bufs || !ring->buf_len || !ring->buf_next) {
+        MqttUring_Destroy(ring);
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = buf_count;
+    reg.bgid = MQTT_URING_BUF_GROUP;
+    if(syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        MqttUring_Destroy(ring);
+        return MQTTERR_IO;
+    }
+
+    for(i = 0; i < buf_count; ++i) {
+        MqttUring_ProvideBuf(ring, (int)i);
+    }
+
+    return MQTTERR_NOERROR;
+}
+
+void MqttUring_Destroy(struct MqttUring *ring)
+{
+    struct MqttUringConn *conn;
+    int round;
+
+    // the kernel may still point into the connections, wait for their requests to finish
+    ring->destroying = 1;
+    for(conn = ring->conns; conn; conn = conn->next) {
+        MqttUring_CloseConnection(conn, MQTTERR_NOERROR);
+    }
+    MqttUring_FlushDirty(ring);
+
+    for(round = 0; ring->conns && (round < MQTT_URING_DRAIN_ROUNDS); ++round) {
+        MqttUring_ReapClosed(ring);
+        if(ring->conns && (MqttUring_RunOnce(ring, 100) < 0)) {
+            break;
+        }
+    }
+    MqttUring_ReapClosed(ring);
+
+    if(ring->ring_ptr) {
+        munmap(ring->ring_ptr, ring->ring_len);
+    }
+
+    if(ring->sqes) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+
+    if(ring->ring_fd >= 0) {
+        close(ring->ring_fd);
+    }
+
+    // connections the kernel never let go of are freed only after the ring is gone
+    while(ring->conns) {
+        MqttUring_FreeConnection(ring->conns);
+    }
+
+    if(ring->buf_ring) {
+        munmap(ring->buf_ring, ring->buf_ring_len);
+    }
+
+    free(ring->bufs);
+    free(ring->buf_len);
+    free(ring->buf_next);
+    memset(ring, 0, sizeof(*ring));
+    ring->ring_fd = -1;
+}
+
+int MqttUring_AddConnection(struct MqttUring *ring, int fd, uint32_t buf_size,
+                            struct MqttUringConn **conn)
+{
+    struct MqttUringConn *c;
+    int flags, err;
+
+    if((fd < 0) || !conn) {
+        return MQTTERR_INVALID_PARAMETER;
+    }
+
+    // io_uring waits for readiness itself, a nonblocking socket would only return EAGAIN
+    flags = fcntl(fd, F_GETFL, 0);
+    if((flags < 0) || (fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0)) {
+        return MQTTERR_IO;
+    }
+
+    c = (struct MqttUringConn*)calloc(1, sizeof(*c));
+    if(!c) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    err = Mqtt_InitContext(c->ctx, buf_size);
+    if(MQTTERR_NOERROR != err) {
+        free(c);
+        return err;
+    }
+
+    c->fd = fd;
+    c->ring = ring;
+    c->rx_head = c->rx_tail = -1;
+    c->ctx->read_func = MqttUring_Read;
+    c->ctx->read_func_arg = c;
+    c->ctx->writev_func = MqttUring_Writev;
+    c->ctx->writev_func_arg = c;
+    MqttBuffer_Init(c->pending);
+    MqttBuffer_Init(c->sending);
+
+    c->send_iov = (struct iovec*)malloc(sizeof(struct iovec) *
+                                        MQTT_URING_MAX_LINKS * MQTT_URING_LINK_IOVS);
+    c->send_msgs = malloc(sizeof(struct msghdr) * MQTT_URING_MAX_LINKS);
+
+    c->next = ring->conns;
+    if(ring->conns) {
+        ring->conns->prev = c;
+    }
+    ring->conns = c;
+
+    if(!c->send_iov || !c->send_msgs) {
+        c->fd = -1; // still owned by the caller
+        MqttUring_FreeConnection(c);
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    err = MqttUring_ArmRecv(c);
+    if(MQTTERR_NOERROR != err) {
+        c->fd = -1;
+        MqttUring_FreeConnection(c);
+        return err;
+    }
+
+    ++ring->conn_count;
+    *conn = c;
+    return MQTTERR_NOERROR;
+}
+
+void MqttUring_CloseConnection(struct MqttUringConn *conn, int err)
+{
+    struct MqttUring *ring = conn->ring;
+
+    if(conn->closed) {
+        return;
+    }
+
+    conn->closed = 1;
+    conn->close_err = err;
+    --ring->conn_count;
+
+    // completes the outstanding receive and sends, the connection is freed after the last one
+    shutdown(conn->fd, SHUT_RDWR);
+    MqttUring_ReleaseRx(conn);
+
+    if(0 == conn->refs) {
+        conn->next_closed = ring->closed;
+        ring->closed = conn;
+    }
+}
+
+int MqttUring_SendPkt(struct MqttUringConn *conn, const struct MqttBuffer *buf)
+{
+    int bytes;
+
+    if(conn->closed) {
+        return MQTTERR_IO;
+    }
+
+    bytes = Mqtt_SendPkt(conn->ctx, buf, 0);
+    if(bytes < 0) {
+        return (MQTTERR_OUTOFMEMORY == bytes) ? bytes : MQTTERR_IO;
+    }
+
+    return MQTTERR_NOERROR;
+}
+
+int MqttUring_RunOnce(struct MqttUring *ring, int timeout_ms)
+{
+    struct io_uring_cqe *cqes = (struct io_uring_cqe*)ring->cqes;
+    unsigned head, tail;
+    int count = 0;
+
+    MqttUring_FlushDirty(ring);
+    MqttUring_ReapClosed(ring);
+
+    // the submission and the wait share one system call
+    head = *ring->cq_head;
+    if(MqttUring_Submit(ring, head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE),
+                        timeout_ms) != MQTTERR_NOERROR) {
+        return MQTTERR_IO;
+    }
+
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while(head != tail) {
+        const struct io_uring_cqe *cqe = cqes + (head & ring->cq_mask);
+        const uint64_t user_data = cqe->user_data;
+        const int res = cqe->res;
+        const uint32_t flags = cqe->flags;
+        struct MqttUringConn *conn =
+            (struct MqttUringConn*)(uintptr_t)(user_data & ~(uint64_t)MQTT_URING_SEND_TAG);
+
+        // hand the entry back before the handlers queue new requests
+        __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+        ++count;
+
+        if(user_data & MQTT_URING_SEND_TAG) {
+            MqttUring_HandleSend(conn, res);
+        }
+        else {
+            MqttUring_HandleRecv(conn, res, flags);
+        }
+
+        if(head == tail) {
+            tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    MqttUring_FlushDirty(ring);
+    MqttUring_ReapClosed(ring);
+    return count;
+}
@@ -0,0 +1,462 @@
+#include "mqtt/mqtt_v5.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MQTT_V5_DEFAULT_TOPIC_ALIAS_MAXIMUM 16
+#define MQTT_V5_DEFAULT_RECEIVE_MAXIMUM 65535
+// bytes of receive buffer per unacknowledged publish we let the server send
+#define MQTT_V5_RECEIVE_SLOT_SIZE 1024
+
+struct MqttV5OutAlias {
+    char *topic;
+    uint32_t len;
+    uint32_t hash;
+    uint16_t next;      /* 同一散列桶中的下一个别名，0为没有 */
+    uint64_t last_used;
+};
+
+struct MqttV5InAlias {
+    char *topic;
+    uint16_t len;
+    uint32_t capacity;
+};
+
+enum MqttV5PropType {
+    MQTT_V5_TYPE_UNKNOWN = 0,
+    MQTT_V5_TYPE_BYTE,
+    MQTT_V5_TYPE_U16,
+    MQTT_V5_TYPE_U32,
+    MQTT_V5_TYPE_VARINT,
+    MQTT_V5_TYPE_BINARY, /* 字符串和二进制数据的编码相同 */
+    MQTT_V5_TYPE_PAIR
+};
+
+static enum MqttV5PropType MqttV5_PropType(uint8_t id)
+{
+    switch(id) {
+    case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+        return MQTT_V5_TYPE_BYTE;
+    case 0x13: case 0x21: case 0x22: case 0x23:
+        return MQTT_V5_TYPE_U16;
+    case 0x02: case 0x11: case 0x18: case 0x27:
+        return MQTT_V5_TYPE_U32;
+    case 0x0B:
+        return MQTT_V5_TYPE_VARINT;
+    case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C:
+    case 0x1F:
+        return MQTT_V5_TYPE_BINARY;
+    case 0x26:
+        return MQTT_V5_TYPE_PAIR;
+    default:
+        return MQTT_V5_TYPE_UNKNOWN;
+    }
+}
+
+int MqttV5_ReadVarInt(const char *data, uint32_t size, uint32_t *value)
+{
+    uint32_t i, multiplier = 1;
+
+    *value = 0;
+    for(i = 0; (i < 4) && (i < size); ++i) {
+        *value += ((uint8_t)data[i] & 0x7F) * multiplier;
+        if(!(data[i] & 0x80)) {
+            return (int)i + 1;
+        }
+        multiplier *= 128;
+    }
+
+    return -1;
+}
+
+static int MqttV5_SkipBinary(const char **cursor, const char *end)
+{
+    uint32_t len;
+
+    if(end - *cursor < 2) {
+        return MQTTERR_ILLEGAL_PKT;
+    }
+
+    len = ((uint32_t)(uint8_t)(*cursor)[0] << 8) | (uint8_t)(*cursor)[1];
+    if((uint32_t)(end - *cursor) - 2 < len) {
+        return MQTTERR_ILLEGAL_PKT;
+    }
+
+    *cursor += 2 + len;
+    return MQTTERR_NOERROR;
+}
+
+int MqttV5_ReadProperty(const char **cursor, const char *end, uint8_t *id, uint32_t *value)
+{
+    const uint8_t *p;
+    int bytes;
+
+    if(*cursor >= end) {
+        return 0;
+    }
+
+    *id = (uint8_t)*((*cursor)++);
+    *value = 0;
+    p = (const uint8_t*)*cursor;
+
+    switch(MqttV5_PropType(*id)) {
+    case MQTT_V5_TYPE_BYTE:
+        if(end - *cursor < 1) {
+            return MQTTERR_ILLEGAL_PKT;
+        }
+        *value = p[0];
+        *cursor += 1;
+        break;
+
+    case MQTT_V5_TYPE_U16:
+        if(end - *cursor < 2) {
+            return MQTTERR_ILLEGAL_PKT;
+        }
+        *value = ((uint32_t)p[0] << 8) | p[1];
+        *cursor += 2;
+        break;
+
+    case MQTT_V5_TYPE_U32:
+        if(end - *cursor < 4) {
+            return MQTTERR_ILLEGAL_PKT;
+        }
+        *value = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+        *cursor += 4;
+        break;
+
+    case MQTT_V5_TYPE_VARINT:
+        bytes = MqttV5_ReadVarInt(*cursor, (uint32_t)(end - *cursor), value);
+        if(bytes < 0) {
+            return MQTTERR_ILLEGAL_PKT;
+        }
+        *cursor += bytes;
+        break;
+
+    case MQTT_V5_TYPE_BINARY:
+        if(MqttV5_SkipBinary(cursor, end) < 0) {
+            return MQTTERR_ILLEGAL_PKT;
+        }
+        break;
+
+    case MQTT_V5_TYPE_PAIR:
+        if((MqttV5_SkipBinary(cursor, end) < 0) || (MqttV5_SkipBinary(cursor, end) < 0)) {
+            return MQTTERR_ILLEGAL_PKT;
+        }
+        break;
+
+    default:
+        return MQTTERR_ILLEGAL_PKT;
+    }
+
+    return 1;
+}
+
+void MqttV5Session_Init(struct MqttV5Session *session)
+{
+    memset(session, 0, sizeof(*session));
+    session->topic_alias_maximum = MQTT_V5_DEFAULT_TOPIC_ALIAS_MAXIMUM;
+    session->server_receive_maximum = MQTT_V5_DEFAULT_RECEIVE_MAXIMUM;
+}
+
+void MqttV5Session_Attach(struct MqttV5Session *session, struct MqttContext *ctx)
+{
+    const uint32_t buf_size = (uint32_t)(ctx->end - ctx->bgn);
+    uint32_t slots = buf_size / MQTT_V5_RECEIVE_SLOT_SIZE;
+
+    if(slots < 1) {
+        slots = 1;
+    }
+    else if(slots > 65535) {
+        slots = 65535;
+    }
+
+    session->receive_maximum = (uint16_t)slots;
+    session->maximum_packet_size = buf_size;
+    ctx->v5 = session;
+}
+
+void MqttV5Session_Reset(struct MqttV5Session *session)
+{
+    uint32_t i;
+
+    for(i = 0; i < session->out_count; ++i) {
+        free(session->out_aliases[i].topic);
+    }
+    for(i = 0; i < session->in_capacity; ++i) {
+        free(session->in_aliases[i].topic);
+    }
+
+    free(session->out_aliases);
+    free(session->out_buckets);
+    free(session->in_aliases);
+
+    session->out_aliases = NULL;
+    session->out_buckets = NULL;
+    session->out_bucket_count = 0;
+    session->out_capacity = 0;
+    session->out_count = 0;
+    session->out_clock = 0;
+    session->in_aliases = NULL;
+    session->in_capacity = 0;
+    session->server_topic_alias_maximum = 0;
+    session->server_receive_maximum = MQTT_V5_DEFAULT_RECEIVE_MAXIMUM;
+    session->server_maximum_packet_size = 0;
+    session->inflight = 0;
+}
+
+void MqttV5Session_Destroy(struct MqttV5Session *session)
+{
+    MqttV5Session_Reset(session);
+    memset(session, 0, sizeof(*session));
+}
+
+int MqttV5Session_HandleConnAckProps(struct MqttV5Session *session, const char *props,
+                                     uint32_t size)
+{
+    const char *cursor, *end;
+    uint32_t props_len, value;
+    uint8_t id;
+    int bytes, ret;
+
+    MqttV5Session_Reset(session);
+
+    bytes = MqttV5_ReadVarInt(props, size, &props_len);
+    if((bytes < 0) || (props_len != size - (uint32_t)bytes)) {
+        return MQTTERR_ILLEGAL_PKT;
+    }
+
+    cursor = props + bytes;
+    end = cursor + props_len;
+    while((ret = MqttV5_ReadProperty(&cursor, end, &id, &value)) > 0) {
+        switch(id) {
+        case MQTT_V5_PROP_TOPIC_ALIAS_MAXIMUM:
+            session->server_topic_alias_maximum = (uint16_t)value;
+            break;
+        case MQTT_V5_PROP_RECEIVE_MAXIMUM:
+            if(0 == value) {
+                return MQTTERR_ILLEGAL_PKT;
+            }
+            session->server_receive_maximum = (uint16_t)value;
+            break;
+        case MQTT_V5_PROP_MAXIMUM_PACKET_SIZE:
+            if(0 == value) {
+                return MQTTERR_ILLEGAL_PKT;
+            }
+            session->server_maximum_packet_size = value;
+            break;
+        default:
+            break;
+        }
+    }
+    if(ret < 0) {
+        return ret;
+    }
+
+    session->out_capacity = session->server_topic_alias_maximum < session->topic_alias_maximum ?
+        session->server_topic_alias_maximum : session->topic_alias_maximum;
+    return MQTTERR_NOERROR;
+}
+
+uint32_t MqttV5Session_SendQuota(const struct MqttV5Session *session)
+{
+    return session->inflight < session->server_receive_maximum ?
+        (uint32_t)(session->server_receive_maximum - session->inflight) : 0;
+}
+
+void MqttV5Session_ReleaseQuota(struct MqttV5Session *session)
+{
+    if(session->inflight > 0) {
+        --session->inflight;
+    }
+}
+
+static uint32_t MqttV5_HashTopic(const char *topic, uint32_t len)
+{
+    uint32_t hash = 2166136261u;
+    uint32_t i;
+
+    for(i = 0; i < len; ++i) {
+        hash ^= (uint8_t)topic[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static int MqttV5Session_AllocOutbound(struct MqttV5Session *session)
+{
+    uint32_t buckets = 16;
+
+    while(buckets < 2u * session->out_capacity) {
+        buckets *= 2;
+    }
+
+    session->out_aliases = (struct MqttV5OutAlias*)calloc(session->out_capacity,
+                                                          sizeof(struct MqttV5OutAlias));
+    session->out_buckets = (uint16_t*)calloc(buckets, sizeof(uint16_t));
+    if(!session->out_aliases || !session->out_buckets) {
+        free(session->out_aliases);
+        free(session->out_buckets);
+        session->out_aliases = NULL;
+        session->out_buckets = NULL;
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    session->out_bucket_count = buckets;
+    return MQTTERR_NOERROR;
+}
+
+static void MqttV5Session_Unlink(struct MqttV5Session *session, uint16_t alias)
+{
+    struct MqttV5OutAlias *entry = session->out_aliases + alias - 1;
+    uint16_t *link = session->out_buckets + (entry->hash & (session->out_bucket_count - 1));
+
+    // a slot whose topic copy failed is in no chain
+    while(*link && (*link != alias)) {
+        link = &session->out_aliases[*link - 1].next;
+    }
+    if(*link) {
+        *link = entry->next;
+    }
+    entry->next = 0;
+}
+
+// the least recently used alias leaves its bucket chain so it can take a new topic
+static uint16_t MqttV5Session_EvictOutbound(struct MqttV5Session *session)
+{
+    uint32_t i;
+    uint16_t victim = 1;
+
+    for(i = 2; i <= session->out_count; ++i) {
+        if(session->out_aliases[i - 1].last_used < session->out_aliases[victim - 1].last_used) {
+            victim = i;
+        }
+    }
+
+    MqttV5Session_Unlink(session, victim);
+    return victim;
+}
+
+int MqttV5Session_OutboundAlias(struct MqttV5Session *session, const char *topic, uint32_t len,
+                                uint16_t *alias)
+{
+    struct MqttV5OutAlias *entry;
+    uint32_t hash, bucket;
+    uint16_t index;
+    char *copy;
+
+    if((0 == session->out_capacity) || (0 == len)) {
+        return 0;
+    }
+
+    if(!session->out_aliases && (MqttV5Session_AllocOutbound(session) < 0)) {
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    hash = MqttV5_HashTopic(topic, len);
+    bucket = hash & (session->out_bucket_count - 1);
+    for(index = session->out_buckets[bucket]; index; index = entry->next) {
+        entry = session->out_aliases + index - 1;
+        if((entry->hash == hash) && (entry->len == len) && (0 == memcmp(entry->topic, topic, len))) {
+            entry->last_used = ++session->out_clock;
+            *alias = index;
+            ++session->alias_hits;
+            session->topic_bytes_saved += len;
+            return 2;
+        }
+    }
+
+    if(session->out_count < session->out_capacity) {
+        index = ++session->out_count;
+    }
+    else {
+        index = MqttV5Session_EvictOutbound(session);
+    }
+
+    entry = session->out_aliases + index - 1;
+    copy = (char*)realloc(entry->topic, len);
+    if(!copy) {
+        // the slot stays unlinked and is the first to be taken again
+        entry->len = 0;
+        entry->last_used = 0;
+        return MQTTERR_OUTOFMEMORY;
+    }
+
+    memcpy(copy, topic, len);
+    entry->topic = copy;
+    entry->len = len;
+    entry->hash = hash;
+    entry->last_used = ++session->out_clock;
+    entry->next = session->out_buckets[bucket];
+    session->out_buckets[bucket] = index;
+
+    *alias = index;
+    ++session->alias_assigns;
+    return 1;
+}
+
+void MqttV5Session_DropOutboundAlias(struct MqttV5Session *session, uint16_t alias)
+{
+    struct MqttV5OutAlias *entry;
+
+    if((0 == alias) || (alias > session->out_count)) {
+        return;
+    }
+
+    // unlinked with the oldest use, the next miss takes the slot again
+    MqttV5Session_Unlink(session, alias);
+    entry = session->out_aliases + alias - 1;
+    entry->len = 0;
+    entry->last_used = 0;
+    --session->alias_assigns;
+}
+
+int MqttV5Session_InboundAlias(struct MqttV5Session *session, uint16_t alias,
+                               const char *topic, uint16_t len,
+                               const char **resolved, uint16_t *resolved_len)
+{
+    struct MqttV5InAlias *entry;
+    char *copy;
+
+    if((0 == alias) || (alias > session->topic_alias_maximum)) {
+        return MQTTERR_ILLEGAL_PKT;
+    }
+
+    if(!session->in_aliases) {
+        session->in_aliases = (struct MqttV5InAlias*)calloc(session->topic_alias_maximum,
+                                                            sizeof(struct MqttV5InAlias));
+        if(!session->in_aliases) {
+            return MQTTERR_OUTOFMEMORY;
+        }
+        session->in_capacity = session->topic_alias_maximum;
+    }
+
+    if(alias > session->in_capacity) {
+        return MQTTERR_ILLEGAL_PKT;
+    }
+
+    entry = session->in_aliases + alias - 1;
+    if(len > 0) {
+        if(len + 1u > entry->capacity) {
+            copy = (char*)realloc(entry->topic, len + 1);
+            if(!copy) {
+                return MQTTERR_OUTOFMEMORY;
+            }
+            entry->topic = copy;
+            entry->capacity = len + 1u;
+        }
+        memcpy(entry->topic, topic, len);
+        entry->topic[len] = '\0';
+        entry->len = len;
+    }
+    else if(!entry->topic) {
+        return MQTTERR_ILLEGAL_PKT;
+    }
+    else {
+        ++session->inbound_aliases;
+    }
+
+    *resolved = entry->topic;
+    *resolved_len = entry->len;
+    return MQTTERR_NOERROR;
+}